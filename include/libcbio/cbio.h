@@ -38,6 +38,25 @@ extern "C" {
     LIBCBIO_API
     void cbio_close_handle(libcbio_t handle);
 
+    /**
+     * cbio_refresh_handle moves a read only handle to the most recent
+     * header in the file. This is a lot cheaper than closing and
+     * reopening the handle, because it will only search for a new
+     * header if the file changed since the last time.
+     *
+     * Note that when there is a new header the file is opened again
+     * from scratch (couchstore can't move an open Db to another
+     * header), so nothing couchstore has read or cached through the
+     * old handle is carried over to the new one.
+     *
+     * @param handle the handle to refresh (must be opened with
+     *               CBIO_OPEN_RDONLY or CBIO_OPEN_SHARED_RDONLY)
+     * @return CBIO_SUCCESS if the handle is positioned at the most
+     *         recent header
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_refresh_handle(libcbio_t handle);
+
     LIBCBIO_API
     off_t cbio_get_header_position(libcbio_t handle);
 
@@ -49,10 +68,9 @@ extern "C" {
     /**
      * This is a helper function to avoid having to call
      * cbio_document_release() followed by
-     * cbio_create_empty_document(). Please note that you can
-     * <b>not</b> call cbio_document_reinitialize() on a document
-     * returned from cbio_get_document() (that have undefined behaviour,
-     * but will most likely crash your process)
+     * cbio_create_empty_document(). The document may come from any
+     * of the functions returning documents, and the buffers it owns
+     * are kept for reuse by cbio_get_document_into().
      */
     LIBCBIO_API
     void cbio_document_reinitialize(libcbio_document_t doc);
@@ -88,6 +106,41 @@ extern "C" {
                                                 uint8_t content_type);
 
 
+    /**
+     * Validate the value of the document and set the content type to
+     * CBIO_DOC_IS_JSON, CBIO_DOC_INVALID_JSON or
+     * CBIO_DOC_INVALID_JSON_KEY. This is the same check as
+     * cbio_set_json_mode() performs, but lets the caller run it on
+     * its own threads before the documents are stored.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_document_classify(libcbio_document_t doc);
+
+    /**
+     * Replace the value of the document with a JSON object holding
+     * only the given fields of it, keyed by the path used to look
+     * them up. A path is a list of keys separated by dots, with [n]
+     * selecting element n of an array (e.g. "address.city" or
+     * "tags[0]"). Keys containing dots, brackets, quotes, backslashes
+     * or escape sequences can't be selected. Fields which don't exist
+     * are left out. The value is scanned without building a
+     * representation of it, and only as far as needed to find all of
+     * the paths. The memory used by the original value is released
+     * if it was read by libcbio. Use it on documents returned by
+     * cbio_get_document() or (after cbio_document_fetch_value()) the
+     * ones passed to the cbio_changes_since() callback.
+     *
+     * @param doc the document (must have a value)
+     * @param paths the fields to keep
+     * @param npaths the number of entries in paths
+     * @return CBIO_SUCCESS upon success, CBIO_ERROR_EINVAL if a path
+     *         is malformed or the value isn't JSON
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_document_project(libcbio_document_t doc,
+                                       const char *const *paths,
+                                       size_t npaths);
+
     LIBCBIO_API
     cbio_error_t cbio_document_get_id(libcbio_document_t doc,
                                       const void **id,
@@ -116,12 +169,134 @@ extern "C" {
     cbio_error_t cbio_document_get_content_type(libcbio_document_t doc,
                                                 uint8_t *content_type);
 
+    /**
+     * Get the sequence number the document was stored with. Only
+     * available for documents returned from libcbio.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_document_get_seqno(libcbio_document_t doc,
+                                         uint64_t *seqno);
+
     LIBCBIO_API
     cbio_error_t cbio_get_document(libcbio_t handle,
                                    const void *id,
                                    size_t nid,
                                    libcbio_document_t *doc);
 
+    /**
+     * Read a document into an existing document instead of allocating
+     * a new one. The document is reinitialized first, and the id,
+     * metadata and value are copied into a buffer owned by it, which
+     * is reused by the next call (and grown when needed). A loop
+     * reading into the same document doesn't allocate any memory
+     * through libcbio once the buffer is big enough.
+     *
+     * @param handle libcbio handle
+     * @param id the id of the document to read
+     * @param nid the number of bytes in id
+     * @param doc the document to read into (from any of the functions
+     *            returning a document)
+     * @return CBIO_SUCCESS upon success, CBIO_ERROR_ENOENT if the
+     *         document doesn't exist (doc is left empty)
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_get_document_into(libcbio_t handle,
+                                        const void *id,
+                                        size_t nid,
+                                        libcbio_document_t doc);
+
+    /**
+     * Get a document with only the given fields of its (JSON) value.
+     * This is cbio_get_document() followed by cbio_document_project().
+     *
+     * @param handle libcbio handle
+     * @param id the id of the document
+     * @param nid the number of bytes in id
+     * @param paths the fields to return
+     * @param npaths the number of entries in paths
+     * @param doc where to store the document
+     * @return CBIO_SUCCESS upon success
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_get_document_projected(libcbio_t handle,
+                                             const void *id,
+                                             size_t nid,
+                                             const char *const *paths,
+                                             size_t npaths,
+                                             libcbio_document_t *doc);
+
+    /**
+     * The callback function used by cbio_get_document_async() to
+     * notify the caller that the read completed. It is called from
+     * one of libcbio's worker threads.
+     *
+     * @param handle the libcbio handle
+     * @param id the id of the document requested
+     * @param nid the number of bytes in the id
+     * @param err the result of the operation
+     * @param doc the document if err is CBIO_SUCCESS (owned by the
+     *            callback, and should be freed with
+     *            cbio_document_release()), NULL otherwise
+     * @param ctx user context
+     */
+    typedef void (*cbio_get_callback_fn)(libcbio_t handle,
+                                         const void *id,
+                                         size_t nid,
+                                         cbio_error_t err,
+                                         libcbio_document_t doc,
+                                         void *ctx);
+
+    /**
+     * Schedule a read of the document with the given id. The read is
+     * served by a pool of worker threads, so the caller may keep a
+     * large number of reads in flight at the same time. The handle
+     * must be opened with CBIO_OPEN_SHARED_RDONLY.
+     *
+     * @param handle libcbio handle
+     * @param id the document id (copied by libcbio)
+     * @param nid the number of bytes in the id
+     * @param callback the function to call when the read completes
+     * @param ctx client context (passed to the callback)
+     * @return CBIO_SUCCESS if the read was scheduled,
+     *         CBIO_ERROR_EBUSY if the maximum number of reads are
+     *         pending already (see cbio_set_async_options())
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_get_document_async(libcbio_t handle,
+                                         const void *id,
+                                         size_t nid,
+                                         cbio_get_callback_fn callback,
+                                         void *ctx);
+
+    /**
+     * Wait for all reads scheduled with cbio_get_document_async() to
+     * complete.
+     */
+    LIBCBIO_API
+    void cbio_wait_async(libcbio_t handle);
+
+    /**
+     * Initialize the async options with the defaults (32 threads and
+     * at most 16384 pending reads).
+     */
+    LIBCBIO_API
+    void cbio_async_options_init(cbio_async_options_t *opts);
+
+    /**
+     * Set the size of the thread pool and the queue used by
+     * cbio_get_document_async(). The pool is started by the first
+     * read scheduled, so this must be called before that.
+     *
+     * @param handle libcbio handle
+     * @param opts the options to use (copied), or NULL for the
+     *             defaults
+     * @return CBIO_SUCCESS upon success, CBIO_ERROR_EINVAL if the pool
+     *         is already running or nthreads is 0
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_set_async_options(libcbio_t handle,
+                                        const cbio_async_options_t *opts);
+
     LIBCBIO_API
     cbio_error_t cbio_store_document(libcbio_t handle,
                                      libcbio_document_t doc);
@@ -131,6 +306,94 @@ extern "C" {
                                       libcbio_document_t *doc,
                                       size_t ndocs);
 
+    /**
+     * Enable (or disable) validation of the document bodies when they
+     * are stored. When enabled the content type of all documents
+     * passed to cbio_store_documents() is set to CBIO_DOC_IS_JSON,
+     * CBIO_DOC_INVALID_JSON or CBIO_DOC_INVALID_JSON_KEY (for JSON
+     * with reserved top-level keys starting with '_'). Compressed
+     * documents and deleted documents are left untouched.
+     *
+     * @param handle libcbio handle opened for writing
+     * @param enable non-zero to enable validation
+     * @return CBIO_SUCCESS upon success
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_set_json_mode(libcbio_t handle, int enable);
+
+    /**
+     * Buffer the documents stored with cbio_store_documents() in
+     * memory, and write them to the file in batches when one of the
+     * limits in the policy is hit. The documents are copied, so the
+     * caller may release them right away. If the documents of a call
+     * can't all be copied, none of them are buffered.
+     * cbio_get_document() reads
+     * through the buffer, and the buffer is flushed by cbio_commit()
+     * and before any operation which reads or writes the file
+     * directly (the changes feed, conditional stores, deletes etc).
+     *
+     * @param handle libcbio handle opened for writing
+     * @param policy when to flush the buffer (copied), or NULL to
+     *               flush and disable the buffer
+     * @return CBIO_SUCCESS upon success
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_set_write_buffer(libcbio_t handle,
+                                       const cbio_write_buffer_t *policy);
+
+    /**
+     * Write the documents in the write buffer to the file (without
+     * committing).
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_flush(libcbio_t handle);
+
+    /**
+     * Store a batch of documents only if the current revision of each
+     * of them is as expected. The current revisions are looked up in
+     * one pass over the by-id index as part of the same batch, and
+     * only the documents passing the check are stored. If the same id
+     * is in the batch more than once, only the first one is checked
+     * and the others fail with CBIO_ERROR_EEXISTS.
+     *
+     * @param handle libcbio handle opened for writing
+     * @param doc the documents to store (no local documents)
+     * @param expected the revision each document must currently
+     *                 have, or CBIO_REV_MUST_NOT_EXIST if it must not
+     *                 exist (or be deleted)
+     * @param result where to store the outcome for each document:
+     *               CBIO_SUCCESS if it was stored, CBIO_ERROR_EEXISTS
+     *               if it exists with another revision (or exists at
+     *               all for CBIO_REV_MUST_NOT_EXIST), or
+     *               CBIO_ERROR_ENOENT if it doesn't exist
+     * @param ndocs the number of documents
+     * @return CBIO_SUCCESS if the batch was processed (check result
+     *         for the individual documents)
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_store_documents_conditional(libcbio_t handle,
+                                                  libcbio_document_t *doc,
+                                                  const uint64_t *expected,
+                                                  cbio_error_t *result,
+                                                  size_t ndocs);
+
+    /**
+     * Delete a batch of documents by id. This is equivalent to storing
+     * a deleted document for each id with cbio_store_documents(), but
+     * without creating the documents.
+     *
+     * @param handle libcbio handle opened for writing
+     * @param ids the ids of the documents to delete
+     * @param nids the number of bytes in each id
+     * @param nitems the number of ids
+     * @return CBIO_SUCCESS upon success
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_delete_documents(libcbio_t handle,
+                                       const void *const *ids,
+                                       const size_t *nids,
+                                       size_t nitems);
+
     LIBCBIO_API
     void cbio_document_release(libcbio_document_t doc);
 
@@ -140,6 +403,21 @@ extern "C" {
     LIBCBIO_API
     const char *cbio_strerror(cbio_error_t err);
 
+    /**
+     * Route the memory libcbio allocates itself (handles, documents
+     * and copies of their data, and temporary arrays) through the
+     * given functions. The allocator is global (documents may be
+     * released without a handle), and it must be installed before
+     * libcbio is used and not changed while there are open handles
+     * or documents. Memory allocated by couchstore is not affected.
+     *
+     * @param allocator the functions to use (NULL for the standard
+     *                  malloc, calloc, realloc and free)
+     * @return CBIO_SUCCESS upon success
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_set_allocator(const cbio_allocator_t *allocator);
+
 
 
 
@@ -150,17 +428,51 @@ extern "C" {
      * The document automatically released if the callback
      * returns 0. A non-zero return value will preserve the document
      * for future use (should be freed with cbio_document_release() by the
-     * caller)
+     * caller). A negative return value releases the document and stops
+     * the iteration (cbio_changes_since() still returns CBIO_SUCCESS).
      *
      * @param habdle the libcbio handle
      * @param doc the current document
      * @param ctx user context
-     * @return 0 or 1. See description above
+     * @return 0, 1 or -1. See description above
      */
     typedef int (*cbio_changes_callback_fn)(libcbio_t handle,
                                             libcbio_document_t doc,
                                             void *ctx);
 
+    /**
+     * Read the value for a document returned by cbio_changes_since().
+     * Those documents only carry the metadata, and this reads the
+     * exact revision reported (without looking up the id again). It
+     * is safe to call from another thread than the one running
+     * cbio_changes_since() if the handle is opened with
+     * CBIO_OPEN_SHARED_RDONLY.
+     *
+     * @param handle the handle the document was returned from
+     * @param doc the document to read the value for
+     * @return CBIO_SUCCESS upon success, CBIO_ERROR_ENOENT for
+     *         deleted documents
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_document_fetch_value(libcbio_t handle,
+                                           libcbio_document_t doc);
+
+    /**
+     * Read the value for a document returned by cbio_changes_since()
+     * like cbio_document_fetch_value(), but decompress it if it is
+     * stored compressed (and clear CBIO_DOC_IS_COMPRESSED in the
+     * content type of the document).
+     *
+     * @param handle the handle the document was returned from
+     * @param doc the document to read the value for
+     * @return CBIO_SUCCESS upon success, CBIO_ERROR_ENOENT for
+     *         deleted documents, CBIO_ERROR_EINVAL if the compressed
+     *         value is already read
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_document_fetch_decompressed_value(libcbio_t handle,
+                                                        libcbio_document_t doc);
+
     /**
      * Iterate through the changes since sequence number `since`.
      *
@@ -176,6 +488,493 @@ extern "C" {
                                     cbio_changes_callback_fn callback,
                                     void *ctx);
 
+    /**
+     * Initialize follow options with the defaults (check the file
+     * every second, look for a new header at most every 50ms when
+     * inotify reports writes, and follow until stopped).
+     */
+    LIBCBIO_API
+    void cbio_follow_options_init(cbio_follow_options_t *opts);
+
+    /**
+     * Iterate through the changes since sequence number `since`, and
+     * keep following the file: when the end is reached, wait for a
+     * new commit, refresh the handle and continue with the documents
+     * it added. Commits through cbio_commit() in the same process are
+     * seen right away. Where the file can be watched with inotify,
+     * commits by other processes are seen within the minimum refresh
+     * interval (inotify can't tell a commit from the writes before
+     * it, so the refreshes it causes are rate limited). Otherwise the
+     * file is checked every poll interval.
+     *
+     * @param handle libcbio handle opened with CBIO_OPEN_RDONLY or
+     *               CBIO_OPEN_SHARED_RDONLY
+     * @param since the sequence number to start iterating from
+     * @param opts the options to use (NULL for the defaults)
+     * @param callback the callback function used to iterate over all
+     *                 changes (like for cbio_changes_since(), so a
+     *                 negative return stops following)
+     * @param ctx client context (passed to the callback)
+     * @return CBIO_SUCCESS when stopped by the callback,
+     *         cbio_stop_following() or the timeout
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_follow_changes(libcbio_t handle,
+                                     uint64_t since,
+                                     const cbio_follow_options_t *opts,
+                                     cbio_changes_callback_fn callback,
+                                     void *ctx);
+
+    /**
+     * Make the cbio_follow_changes() calls in progress on the handle
+     * return once they have delivered the changes they have already
+     * found. May be called from any thread, including from the
+     * callback.
+     *
+     * @param handle libcbio handle
+     */
+    LIBCBIO_API
+    void cbio_stop_following(libcbio_t handle);
+
+    /**
+     * Fill a batch with the id, sequence number and deleted flag of
+     * the documents changed since sequence number `since`
+     * (inclusive), in sequence number order. The documents and their
+     * bodies are never read. To get the next batch, call this again
+     * with the last sequence number in the batch plus one.
+     *
+     * @param handle libcbio handle
+     * @param since the sequence number to start at
+     * @param batch where to store the keys (nentries is 0 when there
+     *              are no more changes)
+     * @return CBIO_SUCCESS upon success, CBIO_ERROR_ENOMEM if the next
+     *         id is bigger than the id buffer
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_changes_since_keys(libcbio_t handle,
+                                         uint64_t since,
+                                         cbio_key_batch_t *batch);
+
+    /**
+     * Fill a batch with the id, sequence number and deleted flag of
+     * the documents in id order, starting with the first id after
+     * `after`. To get the next batch, call this again with the last
+     * id in the batch (it may point into the batch).
+     *
+     * @param handle libcbio handle
+     * @param after the id to start after (NULL to start with the
+     *              first document)
+     * @param nafter the number of bytes in after
+     * @param batch where to store the keys (nentries is 0 when there
+     *              are no more documents)
+     * @return CBIO_SUCCESS upon success, CBIO_ERROR_ENOMEM if the next
+     *         id is bigger than the id buffer
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_all_keys(libcbio_t handle,
+                               const void *after,
+                               size_t nafter,
+                               cbio_key_batch_t *batch);
+
+    /**
+     * Initialize a filter to report all documents.
+     */
+    LIBCBIO_API
+    void cbio_changes_filter_init(cbio_changes_filter_t *filter);
+
+    /**
+     * Iterate through the changes since sequence number `since` which
+     * matches the filter. The callback is only invoked for the
+     * matching documents.
+     *
+     * @param handle libcbio handle
+     * @param since the sequence number to start iterating from
+     * @param filter the filter to apply (NULL matches everything)
+     * @param callback the callback function used to iterate over all changes
+     * @param ctx client context (passed to the callback)
+     * @return CBIO_SUCCESS upon success
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_changes_since_filtered(libcbio_t handle,
+                                             uint64_t since,
+                                             const cbio_changes_filter_t *filter,
+                                             cbio_changes_callback_fn callback,
+                                             void *ctx);
+
+    /**
+     * Write a copy of the database to `target` without the deleted
+     * documents with a sequence number lower than `before`. All other
+     * documents are copied with their revision, metadata, content type
+     * and deleted flag.
+     *
+     * The documents are assigned new sequence numbers (in the same
+     * order) in the new file, and the new file contains a
+     * "_local/purge" document with the purge seqno (see
+     * cbio_get_purge_seqno()), the cutoff and the last sequence
+     * number of the source so that consumers of the changes feed can
+     * detect that they need to start over. Local documents can't be
+     * enumerated, so the ones to carry over must be listed in
+     * `local_ids`.
+     *
+     * @param handle the database to purge
+     * @param target the name of the new file (must not exist)
+     * @param before purge tombstones with sequence number below this
+     * @param local_ids the ids of local documents to copy
+     * @param nlocal the number of entries in local_ids
+     * @return CBIO_SUCCESS upon success
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_purge_tombstones(libcbio_t handle,
+                                       const char *target,
+                                       uint64_t before,
+                                       const char *const *local_ids,
+                                       size_t nlocal);
+
+    /**
+     * Get the purge seqno of the last purge that produced this
+     * database (0 if it was never purged). This is the cutoff passed
+     * to cbio_purge_tombstones() translated to this file's sequence
+     * numbers: tombstones may have been dropped from the changes
+     * before it, so a consumer that has not seen all changes up to
+     * it must start over from 0. The cutoff in the source file's
+     * numbering is only kept for reference, as "source_cutoff" in
+     * the "_local/purge" document.
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_get_purge_seqno(libcbio_t handle, uint64_t *seqno);
+
+    /**
+     * The function passed to the extractor to add a key for the
+     * document to the secondary index. The key is copied, may not be
+     * empty and may not contain NUL bytes (such keys are ignored).
+     */
+    typedef void (*cbio_index_emit_fn)(void *emitctx,
+                                       const void *key,
+                                       size_t nkey);
+
+    /**
+     * The function used to extract the secondary index keys from a
+     * document. It is called for every (non-deleted) document stored
+     * through the handle, and should call emit for each key the
+     * document should be found under (zero or more times).
+     *
+     * @param handle the libcbio handle
+     * @param doc the document being stored (owned by libcbio)
+     * @param emit the function to call for each key
+     * @param emitctx the context to pass to emit
+     * @param cookie the cookie passed to cbio_open_index()
+     */
+    typedef void (*cbio_index_extract_fn)(libcbio_t handle,
+                                          libcbio_document_t doc,
+                                          cbio_index_emit_fn emit,
+                                          void *emitctx,
+                                          void *cookie);
+
+    /**
+     * The callback function used by cbio_index_query() to report the
+     * matching entries in key order.
+     *
+     * @param handle the libcbio handle
+     * @param key the secondary key
+     * @param nkey the number of bytes in the key
+     * @param id the id of the document
+     * @param nid the number of bytes in the id
+     * @param ctx user context
+     * @return 0 to continue, non-zero to stop the iteration
+     */
+    typedef int (*cbio_index_callback_fn)(libcbio_t handle,
+                                          const void *key,
+                                          size_t nkey,
+                                          const void *id,
+                                          size_t nid,
+                                          void *ctx);
+
+    /**
+     * Maintain a secondary index for the handle in the file
+     * `filename`. The extractor is run for every document stored or
+     * deleted through the handle, and the index file is committed
+     * right after the main file in cbio_commit(). When the index is
+     * opened on a handle opened for writing, the documents changed
+     * since the last time the index was committed are indexed before
+     * this function returns. If updating the index fails, the same
+     * catch-up runs at the next cbio_commit(). Read-only handles (but not
+     * CBIO_OPEN_SHARED_RDONLY) may open the index for queries only.
+     *
+     * @param handle libcbio handle
+     * @param filename the name of the index file
+     * @param extract the key extractor (may be NULL for read-only
+     *                handles)
+     * @param cookie passed to the extractor
+     * @return CBIO_SUCCESS upon success
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_open_index(libcbio_t handle,
+                                 const char *filename,
+                                 cbio_index_extract_fn extract,
+                                 void *cookie);
+
+    /**
+     * Look up the documents with secondary keys in the range
+     * [start, end] (keys are compared with memcmp, and a shorter key
+     * sorts before the longer keys it is a prefix of).
+     *
+     * @param handle libcbio handle with an index opened
+     * @param start the first key in the range (NULL for the first key
+     *              in the index)
+     * @param nstart the number of bytes in start
+     * @param end the last key in the range (NULL for no upper limit)
+     * @param nend the number of bytes in end
+     * @param callback the function to call for each entry
+     * @param ctx client context (passed to the callback)
+     * @return CBIO_SUCCESS upon success
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_index_query(libcbio_t handle,
+                                  const void *start,
+                                  size_t nstart,
+                                  const void *end,
+                                  size_t nend,
+                                  cbio_index_callback_fn callback,
+                                  void *ctx);
+
+    /**
+     * Count the documents with ids in the range [start, end] and sum
+     * up the size of the live ones. Only the document metadata is
+     * visited (local documents are not included).
+     *
+     * Note that this walks the leaves of the by-id tree in the range,
+     * so it takes time proportional to the number of documents in it.
+     * couchstore doesn't give access to the reduce values of the
+     * inner nodes, which is what it would take to count in
+     * logarithmic time.
+     *
+     * @param handle libcbio handle
+     * @param start the first id in the range (NULL for the first
+     *              document in the database)
+     * @param nstart the number of bytes in start
+     * @param end the last id in the range (NULL for no upper limit)
+     * @param nend the number of bytes in end
+     * @param stats where to store the result
+     * @return CBIO_SUCCESS upon success
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_count_range(libcbio_t handle,
+                                  const void *start,
+                                  size_t nstart,
+                                  const void *end,
+                                  size_t nend,
+                                  cbio_range_stats_t *stats);
+
+    /**
+     * Write the documents changed since sequence number `since`
+     * (inclusive) to a new delta file. Local documents aren't part of
+     * the changes feed, so the ones to include must be listed in
+     * `local_ids` (they are always included, and are recorded as
+     * deleted if they don't exist). The file is only complete once
+     * this function returns successfully.
+     *
+     * To build a chain of deltas, pass the last sequence number
+     * returned by the previous backup plus one as `since`.
+     *
+     * @param handle the database to back up
+     * @param since the first sequence number to include
+     * @param path the name of the delta file (must not exist)
+     * @param local_ids the ids of the local documents to include
+     * @param nlocal the number of entries in local_ids
+     * @param last_seqno where to store the last sequence number
+     *                   covered by the delta (may be NULL)
+     * @return CBIO_SUCCESS upon success
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_backup_since(libcbio_t handle,
+                                   uint64_t since,
+                                   const char *path,
+                                   const char *const *local_ids,
+                                   size_t nlocal,
+                                   uint64_t *last_seqno);
+
+    /**
+     * Apply a chain of delta files created by cbio_backup_since() (in
+     * the order they were created) and commit once at the end. The
+     * documents keep their revision, metadata, content type and
+     * deleted flag, but get new sequence numbers. All of the files
+     * are validated before anything is stored, and
+     * CBIO_ERROR_EINVAL is returned if there is a gap in the chain.
+     * A damaged record found while storing the documents makes it
+     * return CBIO_ERROR_CORRUPT. If it fails after it started storing
+     * documents, the ones stored so far are written but not
+     * committed, so close the handle without calling cbio_commit() to
+     * leave the file as it was.
+     *
+     * @param handle libcbio handle opened for writing
+     * @param paths the delta files
+     * @param npaths the number of entries in paths
+     * @return CBIO_SUCCESS upon success
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_restore_delta(libcbio_t handle,
+                                    const char *const *paths,
+                                    size_t npaths);
+
+    /**
+     * Initialize replication options with the defaults (batches of
+     * 1000 documents, commit every 100000 documents, 4 threads and
+     * the checkpoint stored in "_local/cbio_replicate").
+     */
+    LIBCBIO_API
+    void cbio_replicate_options_init(cbio_replicate_options_t *opts);
+
+    /**
+     * Copy the documents changed since sequence number `since`
+     * (inclusive) from one database to another. The changes are
+     * scanned ahead while the bodies are read (in parallel if `src`
+     * is opened with CBIO_OPEN_SHARED_RDONLY) and stored in batches.
+     * The documents keep their revision, metadata, content type and
+     * deleted flag, but get new sequence numbers in `dst`.
+     *
+     * The last sequence number copied is stored as `{"seqno":N}` in
+     * the checkpoint document right before every commit, so an
+     * interrupted replication can be continued by setting `resume`.
+     * Local documents are not copied.
+     *
+     * @param src the database to copy from
+     * @param dst the database to copy to (opened for writing)
+     * @param since the first sequence number to copy
+     * @param opts the options to use (NULL for the defaults)
+     * @return CBIO_SUCCESS upon success
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_replicate(libcbio_t src,
+                                libcbio_t dst,
+                                uint64_t since,
+                                const cbio_replicate_options_t *opts);
+
+    /**
+     * Initialize verify options with the defaults (4 threads, no
+     * throttle, 100000 sequence numbers per task, progress every
+     * second and no callbacks).
+     */
+    LIBCBIO_API
+    void cbio_verify_options_init(cbio_verify_options_t *opts);
+
+    /**
+     * Verify the checksums of the B-tree nodes and document bodies in
+     * a set of database files. The files are split into tasks which
+     * are verified in parallel, and the reads may be throttled to
+     * leave room for other users of the disks. The verification
+     * continues past the problems found, and each of them is reported
+     * through the problem callback.
+     *
+     * @param paths the files to verify
+     * @param npaths the number of entries in paths
+     * @param opts the options to use (NULL for the defaults)
+     * @return CBIO_SUCCESS if no problems were found, otherwise the
+     *         error of the first problem reported
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_verify(const char *const *paths,
+                             size_t npaths,
+                             const cbio_verify_options_t *opts);
+
+    /**
+     * Record a sample of the ids of the documents read from the
+     * handle (through cbio_get_document(), cbio_get_document_async()
+     * and cbio_get_document_into()) for use by cbio_warmup(). Every
+     * sample_rate'th read is recorded, and the last max_ids samples
+     * are kept. The sorted and unique ids are written to `path` by
+     * cbio_save_access_log(), when the log is replaced or disabled and
+     * when the handle is closed. Set the log up before the handle is
+     * used by multiple threads.
+     *
+     * @param handle libcbio handle
+     * @param path the file to save the log in (NULL to disable the
+     *             log)
+     * @param sample_rate record one out of this many reads
+     * @param max_ids the number of samples to keep
+     * @return CBIO_SUCCESS upon success
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_set_access_log(libcbio_t handle,
+                                     const char *path,
+                                     uint32_t sample_rate,
+                                     size_t max_ids);
+
+    /**
+     * Save the access log now (the file is replaced atomically), so
+     * it survives a crash.
+     *
+     * @param handle libcbio handle with an access log
+     * @return CBIO_SUCCESS upon success
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_save_access_log(libcbio_t handle);
+
+    /**
+     * Bring the documents in an access log (see cbio_set_access_log())
+     * into the page cache, typically right after the handle is opened
+     * and before it serves any traffic. The B-tree paths to all of the
+     * documents are read in one pass, and the bodies are read in file
+     * offset order by `nthreads` threads. Ids which no longer exist
+     * are ignored.
+     *
+     * @param handle libcbio handle
+     * @param path the access log to replay
+     * @param nthreads the number of threads reading bodies
+     * @param nread where to store the number of bodies read (may be
+     *              NULL)
+     * @return CBIO_SUCCESS upon success
+     */
+    LIBCBIO_API
+    cbio_error_t cbio_warmup(libcbio_t handle,
+                             const char *path,
+                             int nthreads,
+                             uint64_t *nread);
+
+    /**
+     * Set the size of the process-wide lookup cache. The cache keeps
+     * the result of looking up a document id in the B-tree (where the
+     * document is, or that it doesn't exist) so repeated reads of the
+     * same documents only have to read the bodies. It is shared by all
+     * of the handles opened with CBIO_OPEN_RDONLY or
+     * CBIO_OPEN_SHARED_RDONLY, and needs no invalidation since a
+     * lookup from a given header never changes. The cache is disabled
+     * by default.
+     *
+     * @param max_bytes the memory the cache may use (0 disables the
+     *                  cache and releases its memory)
+     */
+    LIBCBIO_API
+    void cbio_set_lookup_cache(size_t max_bytes);
+
+    /**
+     * Get the statistics of the lookup cache. The hits and misses are
+     * counted since the process started (only for the lookups made
+     * while the cache is enabled).
+     *
+     * @param stats where to store the result
+     */
+    LIBCBIO_API
+    void cbio_get_lookup_cache_stats(cbio_lookup_cache_stats_t *stats);
+
+    /**
+     * Install a callback called when cbio_get_document(),
+     * cbio_store_documents(), cbio_commit() and cbio_changes_since()
+     * start and finish, and around every call to the callback of
+     * cbio_changes_since(). The same events are available as USDT
+     * probes (libcbio:get_document_entry, get_document_return,
+     * store_documents_*, commit_*, changes_since_* and
+     * changes_callback_*) when libcbio is built with them. Like the
+     * allocator the callback is global, and it must be installed
+     * before libcbio is used. It may be called from multiple threads
+     * at the same time.
+     *
+     * @param callback the function to call (NULL to stop tracing)
+     * @param cookie passed to the callback
+     */
+    LIBCBIO_API
+    void cbio_set_trace_callback(cbio_trace_callback_t callback,
+                                 void *cookie);
+
 #ifdef __cplusplus
 }
 #endif
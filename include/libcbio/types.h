@@ -46,6 +46,14 @@ extern "C" {
     /**< Document was not checked (DB running in non-JSON mode) */
 #define CBIO_DOC_NON_JSON_MODE 3
 
+    /**< Expected revision for a conditional store of a document which
+       must not exist (or be deleted) */
+#define CBIO_REV_MUST_NOT_EXIST UINT64_MAX
+
+    /**< Set in the flags reported in a cbio_key_batch_t for deleted
+       documents */
+#define CBIO_KEY_DELETED 0x01
+
     struct libcbio_st;
     typedef struct libcbio_st *libcbio_t;
 
@@ -55,9 +63,172 @@ extern "C" {
     typedef enum {
         CBIO_OPEN_RDONLY,
         CBIO_OPEN_RW,
-        CBIO_OPEN_CREATE
+        CBIO_OPEN_CREATE,
+        /**
+         * Read only handle that may be used from multiple threads at
+         * the same time (cbio_get_document(), cbio_changes_since(),
+         * cbio_refresh_handle() and cbio_get_header_position())
+         */
+        CBIO_OPEN_SHARED_RDONLY
     } libcbio_open_mode_t;
 
+    typedef enum {
+        /** Report both deleted and live documents */
+        CBIO_FILTER_DELETED_ANY,
+        /** Only report live documents */
+        CBIO_FILTER_DELETED_EXCLUDE,
+        /** Only report deleted documents */
+        CBIO_FILTER_DELETED_ONLY
+    } cbio_filter_deleted_t;
+
+    /**
+     * A filter used by cbio_changes_since_filtered() to select the
+     * documents to report. The filter is evaluated against the
+     * document metadata before any memory is allocated for the
+     * document. Initialize it with cbio_changes_filter_init() (which
+     * matches everything) and narrow down the fields you care about.
+     */
+    typedef struct {
+        /** Only report documents with ids starting with this prefix */
+        const void *id_prefix;
+        size_t nid_prefix;
+        cbio_filter_deleted_t deleted;
+        /** Only report documents with this content type (-1 for all),
+            whether or not the value is compressed */
+        int content_type;
+        /** Only report documents with revision in this range */
+        uint64_t min_revision;
+        uint64_t max_revision;
+        /** Only report documents with value size in this range */
+        size_t min_size;
+        size_t max_size;
+    } cbio_changes_filter_t;
+
+    /**
+     * The aggregates reported by cbio_count_range()
+     */
+    typedef struct {
+        /** The number of live documents */
+        uint64_t live;
+        /** The number of deleted documents */
+        uint64_t deleted;
+        /** The total size of the live document bodies (as stored) */
+        uint64_t live_bytes;
+    } cbio_range_stats_t;
+
+    /**
+     * The statistics reported by cbio_get_lookup_cache_stats()
+     */
+    typedef struct {
+        /** The number of lookups answered by the cache */
+        uint64_t hits;
+        /** The number of lookups that had to walk the B-tree */
+        uint64_t misses;
+        /** The number of lookups in the cache */
+        uint64_t entries;
+        /** The memory used by them */
+        uint64_t bytes;
+    } cbio_lookup_cache_stats_t;
+
+    /**
+     * The flush policy for the write buffer (see
+     * cbio_set_write_buffer()). A limit of 0 means no limit.
+     */
+    typedef struct {
+        /** Flush when this many documents are buffered */
+        size_t max_documents;
+        /** Flush when the buffered ids, metadata and values use this
+            many bytes */
+        size_t max_bytes;
+        /** Flush when the oldest buffered document is this old (only
+            checked when documents are stored) */
+        uint32_t max_age_ms;
+        /** Commit the database every time a limit is hit */
+        int commit_on_flush;
+    } cbio_write_buffer_t;
+
+    /**
+     * The options for cbio_replicate() (see
+     * cbio_replicate_options_init() for the defaults)
+     */
+    typedef struct {
+        /** The number of documents stored in each batch */
+        size_t batch_size;
+        /** Commit the destination (and store the checkpoint) every
+            time this many documents are stored */
+        uint64_t commit_interval;
+        /** The number of threads reading document bodies (only used
+            if the source is opened with CBIO_OPEN_SHARED_RDONLY) */
+        int nthreads;
+        /** The id of the local document in the destination holding
+            the checkpoint */
+        const char *checkpoint_id;
+        /** Continue after the sequence number in the checkpoint if it
+            is higher than `since` */
+        int resume;
+    } cbio_replicate_options_t;
+
+    /**
+     * What an allocation made by libcbio is used for (so an allocator
+     * can pick a size class or pool)
+     */
+    typedef enum {
+        /** Handles and the per handle state */
+        CBIO_ALLOC_HANDLE,
+        /** The document object returned to the caller */
+        CBIO_ALLOC_DOCUMENT,
+        /** The couchstore Doc and DocInfo structs of a document */
+        CBIO_ALLOC_DOCINFO,
+        /** Copies of ids, metadata and values */
+        CBIO_ALLOC_DATA,
+        /** Arrays used for the duration of a single call */
+        CBIO_ALLOC_BATCH,
+        /** Everything else */
+        CBIO_ALLOC_OTHER
+    } cbio_alloc_class_t;
+
+    /**
+     * The functions libcbio use to allocate memory (see
+     * cbio_set_allocator()). They work like the standard functions,
+     * with the class of the allocation and the cookie as extra
+     * arguments. free_fn is called with the class used when the
+     * memory was allocated, and is never called with NULL.
+     */
+    typedef struct {
+        void *(*malloc_fn)(size_t size, cbio_alloc_class_t cls,
+                           void *cookie);
+        void *(*calloc_fn)(size_t nmemb, size_t size,
+                           cbio_alloc_class_t cls, void *cookie);
+        void *(*realloc_fn)(void *ptr, size_t size,
+                            cbio_alloc_class_t cls, void *cookie);
+        void (*free_fn)(void *ptr, cbio_alloc_class_t cls, void *cookie);
+        void *cookie;
+    } cbio_allocator_t;
+
+    /**
+     * The columns filled by cbio_changes_since_keys() and
+     * cbio_all_keys(). The caller allocates the arrays and sets
+     * capacity and ids_size, and the ids are packed back to back in
+     * `ids` (entry ii is stored from id_offsets[ii] up to
+     * id_offsets[ii + 1]).
+     */
+    typedef struct {
+        /** The number of entries in seqnos and flags */
+        size_t capacity;
+        /** The number of entries filled in */
+        size_t nentries;
+        /** The sequence numbers */
+        uint64_t *seqnos;
+        /** CBIO_KEY_DELETED (or 0) */
+        uint8_t *flags;
+        /** The offset of each id in ids (capacity + 1 entries) */
+        size_t *id_offsets;
+        /** The buffer the ids are packed into */
+        char *ids;
+        /** The number of bytes in ids */
+        size_t ids_size;
+    } cbio_key_batch_t;
+
     typedef enum {
         CBIO_SUCCESS = 0x00,
         CBIO_ERROR_ENOMEM,
@@ -69,9 +240,159 @@ extern "C" {
         CBIO_ERROR_ENOENT,
         CBIO_ERROR_NO_HEADER,
         CBIO_ERROR_HEADER_VERSION,
-        CBIO_ERROR_CHECKSUM_FAIL
+        CBIO_ERROR_CHECKSUM_FAIL,
+        CBIO_ERROR_EEXISTS,
+        CBIO_ERROR_EBUSY
     } cbio_error_t;
 
+    /**
+     * The part of a file a problem reported by cbio_verify() was
+     * found in
+     */
+    typedef enum {
+        /** The file could not be opened (or its header could not be
+            read) */
+        CBIO_VERIFY_FILE,
+        /** The by-sequence tree (first_seqno and last_seqno holds the
+            sequence numbers we could not read) */
+        CBIO_VERIFY_BY_SEQNO,
+        /** The by-id tree (nothing after id could be read) */
+        CBIO_VERIFY_BY_ID,
+        /** The body of the document id with sequence number
+            first_seqno */
+        CBIO_VERIFY_BODY
+    } cbio_verify_area_t;
+
+    /**
+     * A problem found by cbio_verify()
+     */
+    typedef struct {
+        /** The file the problem was found in */
+        const char *path;
+        cbio_verify_area_t area;
+        uint64_t first_seqno;
+        uint64_t last_seqno;
+        /** The document id (if any) */
+        const void *id;
+        size_t nid;
+        /** The error returned when reading */
+        cbio_error_t error;
+    } cbio_verify_problem_t;
+
+    /**
+     * The progress reported by cbio_verify()
+     */
+    typedef struct {
+        /** The number of files to verify */
+        size_t nfiles;
+        /** The number of files completely verified */
+        size_t files_done;
+        /** The number of documents verified */
+        uint64_t documents;
+        /** The number of bytes read */
+        uint64_t bytes;
+        /** The number of problems found */
+        uint64_t problems;
+    } cbio_verify_progress_t;
+
+    typedef void (*cbio_verify_problem_fn)(const cbio_verify_problem_t *p,
+                                           void *ctx);
+    typedef void (*cbio_verify_progress_fn)(const cbio_verify_progress_t *p,
+                                            void *ctx);
+
+    /**
+     * The options for cbio_verify() (see cbio_verify_options_init()
+     * for the defaults). The callbacks are never called concurrently.
+     */
+    typedef struct {
+        /** The number of threads reading the files */
+        int nthreads;
+        /** Sleep to keep the reads below this many bytes per second
+            (0 for no limit) */
+        uint64_t max_bytes_per_sec;
+        /** The number of sequence numbers verified by each task */
+        uint64_t seqnos_per_task;
+        /** How often to call the progress callback */
+        uint32_t progress_interval_ms;
+        /** Called for every problem found (may be NULL) */
+        cbio_verify_problem_fn problem;
+        /** Called with the progress (may be NULL) */
+        cbio_verify_progress_fn progress;
+        /** Passed to the callbacks */
+        void *cookie;
+    } cbio_verify_options_t;
+
+    /**
+     * The operations reported to the trace callback (see
+     * cbio_set_trace_callback())
+     */
+    typedef enum {
+        /** cbio_get_document() and cbio_get_document_into() */
+        CBIO_TRACE_GET_DOCUMENT,
+        /** cbio_store_document() and cbio_store_documents() */
+        CBIO_TRACE_STORE_DOCUMENTS,
+        CBIO_TRACE_COMMIT,
+        /** cbio_changes_since() and cbio_changes_since_filtered() */
+        CBIO_TRACE_CHANGES_SINCE,
+        /** A call to the callback of cbio_changes_since() */
+        CBIO_TRACE_CHANGES_CALLBACK
+    } cbio_trace_op_t;
+
+    /**
+     * An event reported to the trace callback. Every operation is
+     * reported when it starts and when it is done.
+     */
+    typedef struct {
+        cbio_trace_op_t op;
+        /** 0 when the operation starts and 1 when it is done */
+        int done;
+        /** The number of documents */
+        uint64_t ndocs;
+        /** The total size of the ids */
+        uint64_t nkey;
+        /** The total size of the values (as far as they are known) */
+        uint64_t nbytes;
+        /** The cbio_error_t returned (the value returned by the
+            callback for CBIO_TRACE_CHANGES_CALLBACK). Only set when
+            the operation is done */
+        int result;
+    } cbio_trace_event_t;
+
+    /**
+     * The options for cbio_follow_changes() (see
+     * cbio_follow_options_init() for the defaults)
+     */
+    typedef struct {
+        /** Check the file for new commits this often (in ms) even if
+            nothing tells us about them (0 to never check) */
+        uint32_t poll_interval_ms;
+        /** Return if no changes arrive for this long (in ms, 0 to
+            follow until cbio_stop_following() is called) */
+        uint32_t timeout_ms;
+        /** inotify reports every write to the file, not just the
+            commits. Don't look for a new header more often than this
+            (in ms) because of it */
+        uint32_t min_refresh_interval_ms;
+    } cbio_follow_options_t;
+
+    /**
+     * How the reads scheduled with cbio_get_document_async() on a
+     * handle are served
+     */
+    typedef struct {
+        /** The number of worker threads, which is the number of reads
+            in flight at the same time */
+        uint32_t nthreads;
+        /** The number of reads which may be scheduled but not yet
+            complete before cbio_get_document_async() fails with
+            CBIO_ERROR_EBUSY (0 for no limit) */
+        size_t max_pending;
+    } cbio_async_options_t;
+
+    typedef void (*cbio_trace_callback_t)(libcbio_t handle,
+                                          const cbio_trace_event_t *event,
+                                          void *cookie);
+
 #ifdef __cplusplus
 }
 #endif
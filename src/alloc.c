@@ -0,0 +1,82 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The allocator is only changed before libcbio is used (there is
+ * nothing to free memory with the right allocator otherwise), so it
+ * isn't protected by a lock.
+ */
+static cbio_allocator_t allocator;
+static int custom_allocator;
+
+LIBCBIO_API
+cbio_error_t cbio_set_allocator(const cbio_allocator_t *alloc)
+{
+    if (alloc == NULL) {
+        custom_allocator = 0;
+        memset(&allocator, 0, sizeof(allocator));
+        return CBIO_SUCCESS;
+    }
+
+    if (alloc->malloc_fn == NULL || alloc->calloc_fn == NULL ||
+        alloc->realloc_fn == NULL || alloc->free_fn == NULL) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    allocator = *alloc;
+    custom_allocator = 1;
+    return CBIO_SUCCESS;
+}
+
+void *cbio_malloc(size_t size, cbio_alloc_class_t cls)
+{
+    if (custom_allocator) {
+        return allocator.malloc_fn(size, cls, allocator.cookie);
+    }
+    return malloc(size);
+}
+
+void *cbio_calloc(size_t nmemb, size_t size, cbio_alloc_class_t cls)
+{
+    if (custom_allocator) {
+        return allocator.calloc_fn(nmemb, size, cls, allocator.cookie);
+    }
+    return calloc(nmemb, size);
+}
+
+void *cbio_realloc(void *ptr, size_t size, cbio_alloc_class_t cls)
+{
+    if (custom_allocator) {
+        return allocator.realloc_fn(ptr, size, cls, allocator.cookie);
+    }
+    return realloc(ptr, size);
+}
+
+void cbio_free(void *ptr, cbio_alloc_class_t cls)
+{
+    if (custom_allocator) {
+        if (ptr != NULL) {
+            allocator.free_fn(ptr, cls, allocator.cookie);
+        }
+    } else {
+        free(ptr);
+    }
+}
@@ -0,0 +1,238 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "internal.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct cbio_async_req {
+    struct cbio_async_req *next;
+    cbio_get_callback_fn callback;
+    void *ctx;
+    size_t nid;
+    char id[1];
+};
+
+struct cbio_async_st {
+    pthread_mutex_t mutex;
+    /* Signalled when there is new work (or we're shutting down) */
+    pthread_cond_t cond;
+    /* Signalled when pending drops to zero */
+    pthread_cond_t idle;
+    struct cbio_async_req *head;
+    struct cbio_async_req *tail;
+    size_t pending;
+    size_t max_pending;
+    int shutdown;
+    int nthreads;
+    pthread_t *threads;
+    libcbio_t handle;
+};
+
+static void *cbio_async_worker(void *arg)
+{
+    struct cbio_async_st *async = arg;
+
+    pthread_mutex_lock(&async->mutex);
+    while (1) {
+        struct cbio_async_req *req;
+        libcbio_document_t doc = NULL;
+        cbio_error_t err;
+
+        while (async->head == NULL && !async->shutdown) {
+            pthread_cond_wait(&async->cond, &async->mutex);
+        }
+
+        if ((req = async->head) == NULL) {
+            /* shutdown and there is no more work */
+            break;
+        }
+
+        if ((async->head = req->next) == NULL) {
+            async->tail = NULL;
+        }
+        pthread_mutex_unlock(&async->mutex);
+
+        err = cbio_get_document(async->handle, req->id, req->nid, &doc);
+        req->callback(async->handle, req->id, req->nid, err,
+                      err == CBIO_SUCCESS ? doc : NULL, req->ctx);
+        cbio_free(req, CBIO_ALLOC_OTHER);
+
+        pthread_mutex_lock(&async->mutex);
+        if (--async->pending == 0) {
+            pthread_cond_broadcast(&async->idle);
+        }
+    }
+    pthread_mutex_unlock(&async->mutex);
+
+    return NULL;
+}
+
+static struct cbio_async_st *cbio_async_create(libcbio_t handle)
+{
+    struct cbio_async_st *async = cbio_calloc(1, sizeof(*async),
+                                              CBIO_ALLOC_HANDLE);
+    if (async == NULL) {
+        return NULL;
+    }
+
+    async->handle = handle;
+    async->max_pending = handle->async_options.max_pending;
+    async->threads = cbio_calloc(handle->async_options.nthreads,
+                                 sizeof(pthread_t), CBIO_ALLOC_HANDLE);
+    pthread_mutex_init(&async->mutex, NULL);
+    pthread_cond_init(&async->cond, NULL);
+    pthread_cond_init(&async->idle, NULL);
+
+    while (async->threads != NULL &&
+           (uint32_t)async->nthreads < handle->async_options.nthreads &&
+           pthread_create(async->threads + async->nthreads, NULL,
+                          cbio_async_worker, async) == 0) {
+        ++async->nthreads;
+    }
+
+    if (async->nthreads == 0) {
+        pthread_cond_destroy(&async->idle);
+        pthread_cond_destroy(&async->cond);
+        pthread_mutex_destroy(&async->mutex);
+        cbio_free(async->threads, CBIO_ALLOC_HANDLE);
+        cbio_free(async, CBIO_ALLOC_HANDLE);
+        return NULL;
+    }
+
+    return async;
+}
+
+static void cbio_async_shutdown(struct cbio_async_st *async)
+{
+    pthread_mutex_lock(&async->mutex);
+    async->shutdown = 1;
+    pthread_cond_broadcast(&async->cond);
+    pthread_mutex_unlock(&async->mutex);
+
+    for (int ii = 0; ii < async->nthreads; ++ii) {
+        pthread_join(async->threads[ii], NULL);
+    }
+
+    pthread_cond_destroy(&async->idle);
+    pthread_cond_destroy(&async->cond);
+    pthread_mutex_destroy(&async->mutex);
+    cbio_free(async->threads, CBIO_ALLOC_HANDLE);
+    cbio_free(async, CBIO_ALLOC_HANDLE);
+}
+
+void cbio_async_destroy(libcbio_t handle)
+{
+    if (handle->async != NULL) {
+        cbio_async_shutdown(handle->async);
+        handle->async = NULL;
+    }
+}
+
+LIBCBIO_API
+cbio_error_t cbio_get_document_async(libcbio_t handle,
+                                     const void *id,
+                                     size_t nid,
+                                     cbio_get_callback_fn callback,
+                                     void *ctx)
+{
+    struct cbio_async_st *async;
+    struct cbio_async_req *req;
+
+    if (handle->mode != CBIO_OPEN_SHARED_RDONLY || callback == NULL) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if ((async = handle->async) == NULL) {
+        if ((async = cbio_async_create(handle)) == NULL) {
+            return CBIO_ERROR_ENOMEM;
+        }
+        if (!__sync_bool_compare_and_swap(&handle->async, NULL, async)) {
+            /* Someone else beat us to it */
+            cbio_async_shutdown(async);
+            async = handle->async;
+        }
+    }
+
+    if ((req = cbio_malloc(sizeof(*req) + nid, CBIO_ALLOC_OTHER)) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+    req->next = NULL;
+    req->callback = callback;
+    req->ctx = ctx;
+    req->nid = nid;
+    memcpy(req->id, id, nid);
+
+    pthread_mutex_lock(&async->mutex);
+    if (async->max_pending != 0 && async->pending >= async->max_pending) {
+        pthread_mutex_unlock(&async->mutex);
+        cbio_free(req, CBIO_ALLOC_OTHER);
+        return CBIO_ERROR_EBUSY;
+    }
+    if (async->tail == NULL) {
+        async->head = async->tail = req;
+    } else {
+        async->tail->next = req;
+        async->tail = req;
+    }
+    ++async->pending;
+    pthread_cond_signal(&async->cond);
+    pthread_mutex_unlock(&async->mutex);
+
+    return CBIO_SUCCESS;
+}
+
+LIBCBIO_API
+void cbio_async_options_init(cbio_async_options_t *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->nthreads = CBIO_ASYNC_THREADS;
+    opts->max_pending = CBIO_ASYNC_MAX_PENDING;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_set_async_options(libcbio_t handle,
+                                    const cbio_async_options_t *opts)
+{
+    if (handle->async != NULL || (opts != NULL && opts->nthreads == 0)) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if (opts == NULL) {
+        cbio_async_options_init(&handle->async_options);
+    } else {
+        handle->async_options = *opts;
+    }
+
+    return CBIO_SUCCESS;
+}
+
+LIBCBIO_API
+void cbio_wait_async(libcbio_t handle)
+{
+    struct cbio_async_st *async = handle->async;
+    if (async == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&async->mutex);
+    while (async->pending != 0) {
+        pthread_cond_wait(&async->idle, &async->mutex);
+    }
+    pthread_mutex_unlock(&async->mutex);
+}
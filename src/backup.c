@@ -0,0 +1,510 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * A delta file contains the documents changed since a sequence
+ * number. All integers are stored in network byte order:
+ *
+ *   "CBIODLT1" uint64_t since
+ *
+ * followed by one record per document:
+ *
+ *   'D' uint64_t seq, uint64_t rev, uint8_t deleted, uint8_t content_type,
+ *       uint32_t nid, uint32_t nmeta, uint32_t nvalue, id, meta, value
+ *   'L' uint8_t deleted, uint32_t nid, uint32_t nvalue, id, value
+ *
+ * and terminated by:
+ *
+ *   'E' uint64_t last_seqno
+ *
+ * A file without the terminating record is incomplete and is refused
+ * by cbio_restore_delta().
+ */
+#include "internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CBIO_DELTA_MAGIC "CBIODLT1"
+#define CBIO_DELTA_HEADER_SIZE 16
+#define CBIO_DELTA_TRAILER_SIZE 9
+
+/* Number of documents stored in each batch when restoring */
+#define CBIO_RESTORE_BATCH 1000
+
+static void cbio_encode_uint(unsigned char *dest, uint64_t val, int nbytes)
+{
+    for (int ii = nbytes - 1; ii >= 0; --ii) {
+        dest[ii] = (unsigned char)(val & 0xff);
+        val >>= 8;
+    }
+}
+
+static uint64_t cbio_decode_uint(const unsigned char *src, int nbytes)
+{
+    uint64_t ret = 0;
+    for (int ii = 0; ii < nbytes; ++ii) {
+        ret = (ret << 8) | src[ii];
+    }
+    return ret;
+}
+
+static cbio_error_t cbio_delta_write(FILE *fp, const void *data, size_t size)
+{
+    if (size > 0 && fwrite(data, 1, size, fp) != size) {
+        return CBIO_ERROR_EIO;
+    }
+    return CBIO_SUCCESS;
+}
+
+static cbio_error_t cbio_delta_read(FILE *fp, void *data, size_t size)
+{
+    if (size > 0 && fread(data, 1, size, fp) != size) {
+        return ferror(fp) ? CBIO_ERROR_EIO : CBIO_ERROR_CORRUPT;
+    }
+    return CBIO_SUCCESS;
+}
+
+struct cbio_backup_ctx {
+    FILE *fp;
+    uint64_t last;
+    cbio_error_t error;
+};
+
+static int cbio_backup_callback(libcbio_t handle,
+                                libcbio_document_t doc,
+                                void *arg)
+{
+    struct cbio_backup_ctx *ctx = arg;
+    const DocInfo *info = doc->info;
+    unsigned char header[31];
+    sized_buf value = { NULL, 0 };
+
+    if (ctx->error != CBIO_SUCCESS) {
+        return 0;
+    }
+
+    if (!info->deleted) {
+        ctx->error = cbio_document_fetch_value(handle, doc);
+        if (ctx->error != CBIO_SUCCESS) {
+            return 0;
+        }
+        value = doc->doc->data;
+    }
+
+    header[0] = 'D';
+    cbio_encode_uint(header + 1, info->db_seq, 8);
+    cbio_encode_uint(header + 9, info->rev_seq, 8);
+    header[17] = info->deleted ? 1 : 0;
+    header[18] = info->content_meta;
+    cbio_encode_uint(header + 19, info->id.size, 4);
+    cbio_encode_uint(header + 23, info->rev_meta.size, 4);
+    cbio_encode_uint(header + 27, value.size, 4);
+
+    if ((ctx->error = cbio_delta_write(ctx->fp, header, 31)) != CBIO_SUCCESS ||
+        (ctx->error = cbio_delta_write(ctx->fp, info->id.buf,
+                                       info->id.size)) != CBIO_SUCCESS ||
+        (ctx->error = cbio_delta_write(ctx->fp, info->rev_meta.buf,
+                                       info->rev_meta.size)) != CBIO_SUCCESS ||
+        (ctx->error = cbio_delta_write(ctx->fp, value.buf,
+                                       value.size)) != CBIO_SUCCESS) {
+        return 0;
+    }
+
+    if (info->db_seq > ctx->last) {
+        ctx->last = info->db_seq;
+    }
+
+    return 0;
+}
+
+static cbio_error_t cbio_backup_local(libcbio_t handle,
+                                      FILE *fp,
+                                      const char *id)
+{
+    libcbio_document_t doc;
+    unsigned char header[10];
+    const void *value = NULL;
+    size_t nvalue = 0;
+    cbio_error_t err;
+
+    err = cbio_get_document(handle, id, strlen(id), &doc);
+    if (err == CBIO_SUCCESS) {
+        cbio_document_get_value(doc, &value, &nvalue);
+    } else if (err != CBIO_ERROR_ENOENT) {
+        return err;
+    }
+
+    /* A missing local document is restored as a deletion */
+    header[0] = 'L';
+    header[1] = err == CBIO_ERROR_ENOENT ? 1 : 0;
+    cbio_encode_uint(header + 2, strlen(id), 4);
+    cbio_encode_uint(header + 6, nvalue, 4);
+
+    if ((err = cbio_delta_write(fp, header, sizeof(header))) == CBIO_SUCCESS &&
+        (err = cbio_delta_write(fp, id, strlen(id))) == CBIO_SUCCESS) {
+        err = cbio_delta_write(fp, value, nvalue);
+    }
+
+    if (header[1] == 0) {
+        cbio_document_release(doc);
+    }
+
+    return err;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_backup_since(libcbio_t handle,
+                               uint64_t since,
+                               const char *path,
+                               const char *const *local_ids,
+                               size_t nlocal,
+                               uint64_t *last_seqno)
+{
+    struct cbio_backup_ctx ctx;
+    struct cbio_db_ref *ref;
+    unsigned char header[CBIO_DELTA_HEADER_SIZE];
+    unsigned char trailer[CBIO_DELTA_TRAILER_SIZE];
+    DbInfo info;
+    cbio_error_t err;
+    int fd;
+
+    if (path == NULL) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if ((err = cbio_buffer_flush(handle)) != CBIO_SUCCESS ||
+        (err = cbio_acquire_db(handle, &ref)) != CBIO_SUCCESS) {
+        return err;
+    }
+    err = cbio_remap_error(couchstore_db_info(ref->db, &info));
+    cbio_release_db(handle, ref);
+    if (err != CBIO_SUCCESS) {
+        return err;
+    }
+
+    /* Never overwrite an existing delta */
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644)) == -1) {
+        return errno == EEXIST ? CBIO_ERROR_EINVAL : CBIO_ERROR_OPEN_FILE;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.last = info.last_sequence;
+    if ((ctx.fp = fdopen(fd, "wb")) == NULL) {
+        close(fd);
+        (void)remove(path);
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    memcpy(header, CBIO_DELTA_MAGIC, 8);
+    cbio_encode_uint(header + 8, since, 8);
+    ctx.error = cbio_delta_write(ctx.fp, header, sizeof(header));
+
+    if (ctx.error == CBIO_SUCCESS) {
+        err = cbio_changes_since(handle, since, cbio_backup_callback, &ctx);
+        if (err != CBIO_SUCCESS) {
+            ctx.error = err;
+        }
+    }
+
+    for (size_t ii = 0; ii < nlocal && ctx.error == CBIO_SUCCESS; ++ii) {
+        ctx.error = cbio_backup_local(handle, ctx.fp, local_ids[ii]);
+    }
+
+    if (ctx.error == CBIO_SUCCESS) {
+        trailer[0] = 'E';
+        cbio_encode_uint(trailer + 1, ctx.last, 8);
+        ctx.error = cbio_delta_write(ctx.fp, trailer, sizeof(trailer));
+    }
+
+    if (ctx.error == CBIO_SUCCESS &&
+        (fflush(ctx.fp) != 0 || fsync(fd) != 0)) {
+        ctx.error = CBIO_ERROR_EIO;
+    }
+
+    if (fclose(ctx.fp) != 0 && ctx.error == CBIO_SUCCESS) {
+        ctx.error = CBIO_ERROR_EIO;
+    }
+
+    if (ctx.error != CBIO_SUCCESS) {
+        (void)remove(path);
+    } else if (last_seqno != NULL) {
+        *last_seqno = ctx.last;
+    }
+
+    return ctx.error;
+}
+
+/* Validate the header and trailer of a delta */
+/*
+ * Check the header and the trailer of a delta file, and leave it
+ * positioned at the first record. end is set to the offset of the
+ * trailer.
+ */
+static cbio_error_t cbio_delta_check(FILE *fp, uint64_t *since, uint64_t *last,
+                                     long *end)
+{
+    unsigned char header[CBIO_DELTA_HEADER_SIZE];
+    unsigned char trailer[CBIO_DELTA_TRAILER_SIZE];
+    cbio_error_t err;
+
+    if ((err = cbio_delta_read(fp, header, sizeof(header))) != CBIO_SUCCESS) {
+        return err;
+    }
+
+    if (memcmp(header, CBIO_DELTA_MAGIC, 8) != 0) {
+        return CBIO_ERROR_CORRUPT;
+    }
+
+    if (fseek(fp, -CBIO_DELTA_TRAILER_SIZE, SEEK_END) != 0 ||
+        (*end = ftell(fp)) < CBIO_DELTA_HEADER_SIZE) {
+        return CBIO_ERROR_CORRUPT;
+    }
+
+    if ((err = cbio_delta_read(fp, trailer, sizeof(trailer))) != CBIO_SUCCESS) {
+        return err;
+    }
+
+    if (trailer[0] != 'E') {
+        return CBIO_ERROR_CORRUPT;
+    }
+
+    *since = cbio_decode_uint(header + 8, 8);
+    *last = cbio_decode_uint(trailer + 1, 8);
+
+    if (fseek(fp, CBIO_DELTA_HEADER_SIZE, SEEK_SET) != 0) {
+        return CBIO_ERROR_EIO;
+    }
+
+    return CBIO_SUCCESS;
+}
+
+struct cbio_restore_ctx {
+    libcbio_t handle;
+    size_t ndocs;
+    libcbio_document_t docs[CBIO_RESTORE_BATCH];
+};
+
+static cbio_error_t cbio_restore_flush(struct cbio_restore_ctx *ctx)
+{
+    cbio_error_t err = CBIO_SUCCESS;
+
+    if (ctx->ndocs > 0) {
+        err = cbio_store_documents(ctx->handle, ctx->docs, ctx->ndocs);
+    }
+
+    for (size_t ii = 0; ii < ctx->ndocs; ++ii) {
+        cbio_document_release(ctx->docs[ii]);
+    }
+    ctx->ndocs = 0;
+
+    return err;
+}
+
+/*
+ * Read id, meta and value into a single allocation owned by a new
+ * document. The lengths come from the file, so check that they don't
+ * reach past the trailer (at offset end) before trusting them.
+ */
+static cbio_error_t cbio_restore_read_document(FILE *fp,
+                                               long end,
+                                               size_t nid,
+                                               size_t nmeta,
+                                               size_t nvalue,
+                                               libcbio_document_t *doc)
+{
+    libcbio_document_t ret;
+    cbio_error_t err;
+    long pos = ftell(fp);
+    size_t left;
+    char *data;
+
+    if (pos < 0) {
+        return CBIO_ERROR_EIO;
+    }
+    left = pos < end ? (size_t)(end - pos) : 0;
+    if (nid > left || nmeta > left - nid || nvalue > left - nid - nmeta) {
+        return CBIO_ERROR_CORRUPT;
+    }
+
+    if ((err = cbio_create_empty_document(NULL, &ret)) != CBIO_SUCCESS) {
+        return err;
+    }
+
+    if ((data = cbio_malloc(nid + nmeta + nvalue + 1,
+                            CBIO_ALLOC_DATA)) == NULL) {
+        cbio_document_release(ret);
+        return CBIO_ERROR_ENOMEM;
+    }
+    ret->tmp_alloc_bp = data;
+
+    if ((err = cbio_delta_read(fp, data,
+                               nid + nmeta + nvalue)) != CBIO_SUCCESS ||
+        (err = cbio_document_set_id(ret, data, nid, 0)) != CBIO_SUCCESS ||
+        (err = cbio_document_set_meta(ret, data + nid, nmeta,
+                                      0)) != CBIO_SUCCESS ||
+        (err = cbio_document_set_value(ret, data + nid + nmeta, nvalue,
+                                       0)) != CBIO_SUCCESS) {
+        cbio_document_release(ret);
+        return err;
+    }
+
+    *doc = ret;
+    return CBIO_SUCCESS;
+}
+
+static cbio_error_t cbio_restore_file(struct cbio_restore_ctx *ctx, FILE *fp,
+                                      long end)
+{
+    cbio_error_t err = CBIO_SUCCESS;
+    unsigned char header[31];
+    libcbio_document_t doc;
+    size_t nid, nmeta, nvalue;
+
+    while (err == CBIO_SUCCESS) {
+        if ((err = cbio_delta_read(fp, header, 1)) != CBIO_SUCCESS) {
+            break;
+        }
+
+        if (header[0] == 'E') {
+            break;
+        } else if (header[0] == 'D') {
+            if ((err = cbio_delta_read(fp, header + 1, 30)) != CBIO_SUCCESS) {
+                break;
+            }
+            nid = (size_t)cbio_decode_uint(header + 19, 4);
+            nmeta = (size_t)cbio_decode_uint(header + 23, 4);
+            nvalue = (size_t)cbio_decode_uint(header + 27, 4);
+            err = cbio_restore_read_document(fp, end, nid, nmeta, nvalue,
+                                             &doc);
+            if (err != CBIO_SUCCESS) {
+                break;
+            }
+
+            cbio_document_set_revision(doc, cbio_decode_uint(header + 9, 8));
+            cbio_document_set_deleted(doc, header[17]);
+            doc->info->content_meta = header[18];
+
+            ctx->docs[ctx->ndocs++] = doc;
+            if (ctx->ndocs == CBIO_RESTORE_BATCH) {
+                err = cbio_restore_flush(ctx);
+            }
+        } else if (header[0] == 'L') {
+            /* Local documents can't be mixed with others in a batch */
+            if ((err = cbio_restore_flush(ctx)) != CBIO_SUCCESS ||
+                (err = cbio_delta_read(fp, header + 1, 9)) != CBIO_SUCCESS) {
+                break;
+            }
+            nid = (size_t)cbio_decode_uint(header + 2, 4);
+            nvalue = (size_t)cbio_decode_uint(header + 6, 4);
+            err = cbio_restore_read_document(fp, end, nid, 0, nvalue, &doc);
+            if (err != CBIO_SUCCESS) {
+                break;
+            }
+
+            cbio_document_set_deleted(doc, header[1]);
+            err = cbio_store_document(ctx->handle, doc);
+            cbio_document_release(doc);
+        } else {
+            err = CBIO_ERROR_CORRUPT;
+        }
+    }
+
+    /* A document may be in several deltas, and a batch can't contain
+       the same document twice */
+    if (err == CBIO_SUCCESS) {
+        err = cbio_restore_flush(ctx);
+    }
+
+    return err;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_restore_delta(libcbio_t handle,
+                                const char *const *paths,
+                                size_t npaths)
+{
+    struct cbio_restore_ctx *ctx;
+    cbio_error_t err = CBIO_SUCCESS;
+    FILE **files;
+    long *ends;
+    uint64_t previous = 0;
+
+    if (npaths == 0 || handle->mode == CBIO_OPEN_RDONLY ||
+        handle->mode == CBIO_OPEN_SHARED_RDONLY) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if ((files = cbio_calloc(npaths, sizeof(FILE *),
+                             CBIO_ALLOC_BATCH)) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+    if ((ends = cbio_calloc(npaths, sizeof(long),
+                            CBIO_ALLOC_BATCH)) == NULL) {
+        cbio_free(files, CBIO_ALLOC_BATCH);
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    /* Verify that the chain is complete before we change anything */
+    for (size_t ii = 0; ii < npaths && err == CBIO_SUCCESS; ++ii) {
+        uint64_t since = 0;
+        uint64_t last = 0;
+
+        if ((files[ii] = fopen(paths[ii], "rb")) == NULL) {
+            err = CBIO_ERROR_OPEN_FILE;
+        } else if ((err = cbio_delta_check(files[ii], &since, &last,
+                                           ends + ii)) == CBIO_SUCCESS &&
+                   ii > 0 && since > previous + 1) {
+            /* There is a gap between this delta and the previous */
+            err = CBIO_ERROR_EINVAL;
+        }
+        previous = last;
+    }
+
+    if (err == CBIO_SUCCESS) {
+        if ((ctx = cbio_calloc(1, sizeof(*ctx), CBIO_ALLOC_BATCH)) == NULL) {
+            err = CBIO_ERROR_ENOMEM;
+        } else {
+            ctx->handle = handle;
+            for (size_t ii = 0; ii < npaths && err == CBIO_SUCCESS; ++ii) {
+                err = cbio_restore_file(ctx, files[ii], ends[ii]);
+            }
+            for (size_t ii = 0; ii < ctx->ndocs; ++ii) {
+                cbio_document_release(ctx->docs[ii]);
+            }
+            cbio_free(ctx, CBIO_ALLOC_BATCH);
+        }
+    }
+
+    for (size_t ii = 0; ii < npaths; ++ii) {
+        if (files[ii] != NULL) {
+            fclose(files[ii]);
+        }
+    }
+    cbio_free(files, CBIO_ALLOC_BATCH);
+    cbio_free(ends, CBIO_ALLOC_BATCH);
+
+    if (err == CBIO_SUCCESS) {
+        err = cbio_commit(handle);
+    }
+
+    return err;
+}
@@ -0,0 +1,343 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * The write buffer keeps copies of the stored documents in an array
+ * sorted by id, so that a document stored multiple times before the
+ * buffer is flushed is only written once, and the buffer can be
+ * searched by cbio_get_document(). There is no background thread, so
+ * the age limit is checked when documents are stored.
+ */
+#include "internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct cbio_buffer_st {
+    cbio_write_buffer_t policy;
+    libcbio_document_t *docs;
+    size_t ndocs;
+    size_t allocated;
+    size_t nbytes;
+    /* When the oldest document in the buffer was stored (in ms) */
+    uint64_t oldest;
+};
+
+static uint64_t cbio_buffer_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static size_t cbio_buffer_docsize(libcbio_document_t doc)
+{
+    size_t ret = doc->info->id.size + doc->info->rev_meta.size;
+    if (doc->doc != NULL) {
+        ret += doc->doc->data.size;
+    }
+    return ret;
+}
+
+/* Copy the document into a single allocation owned by the buffer */
+static cbio_error_t cbio_buffer_copy(libcbio_document_t src,
+                                     libcbio_document_t *dest)
+{
+    const DocInfo *info = src->info;
+    size_t nvalue = src->doc != NULL ? src->doc->data.size : 0;
+    libcbio_document_t ret;
+    char *ptr;
+
+    if ((ret = cbio_calloc(1, sizeof(*ret), CBIO_ALLOC_DOCUMENT)) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+    ret->scratch = 1;
+
+    ret->info = cbio_calloc(1, sizeof(*ret->info), CBIO_ALLOC_DOCINFO);
+    ret->tmp_alloc_bp = ptr = cbio_malloc(cbio_buffer_docsize(src) + 1,
+                                          CBIO_ALLOC_DATA);
+    if (ret->info == NULL || ptr == NULL ||
+        (src->doc != NULL &&
+         (ret->doc = cbio_calloc(1, sizeof(*ret->doc),
+                                 CBIO_ALLOC_DOCINFO)) == NULL)) {
+        cbio_document_release(ret);
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    *ret->info = *info;
+    ret->info->id.buf = ptr;
+    memcpy(ptr, info->id.buf, info->id.size);
+    ptr += info->id.size;
+
+    ret->info->rev_meta.buf = ptr;
+    if (info->rev_meta.size > 0) {
+        memcpy(ptr, info->rev_meta.buf, info->rev_meta.size);
+        ptr += info->rev_meta.size;
+    }
+
+    if (ret->doc != NULL) {
+        ret->doc->id = ret->info->id;
+        ret->doc->data.buf = ptr;
+        ret->doc->data.size = nvalue;
+        if (nvalue > 0) {
+            memcpy(ptr, src->doc->data.buf, nvalue);
+        }
+    }
+
+    *dest = ret;
+    return CBIO_SUCCESS;
+}
+
+/* Binary search for id. Returns the index it is (or should be) at */
+static size_t cbio_buffer_find(struct cbio_buffer_st *buffer,
+                               const void *id, size_t nid, int *found)
+{
+    size_t lo = 0;
+    size_t hi = buffer->ndocs;
+
+    *found = 0;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const sized_buf *key = &buffer->docs[mid]->info->id;
+        size_t size = key->size < nid ? key->size : nid;
+        int cmp = memcmp(key->buf, id, size);
+        if (cmp == 0) {
+            cmp = key->size < nid ? -1 : (key->size > nid ? 1 : 0);
+        }
+
+        if (cmp == 0) {
+            *found = 1;
+            return mid;
+        } else if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/* Make room for n more documents in the buffer */
+static cbio_error_t cbio_buffer_reserve(struct cbio_buffer_st *buffer,
+                                        size_t n)
+{
+    size_t allocated = buffer->allocated ? buffer->allocated : 64;
+    libcbio_document_t *docs;
+
+    if (buffer->ndocs + n <= buffer->allocated) {
+        return CBIO_SUCCESS;
+    }
+
+    while (allocated < buffer->ndocs + n) {
+        allocated *= 2;
+    }
+    docs = cbio_realloc(buffer->docs, allocated * sizeof(*docs),
+                        CBIO_ALLOC_HANDLE);
+    if (docs == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+    buffer->docs = docs;
+    buffer->allocated = allocated;
+
+    return CBIO_SUCCESS;
+}
+
+/* Insert a copy made by cbio_buffer_copy(). There must be room for it */
+static void cbio_buffer_insert(struct cbio_buffer_st *buffer,
+                               libcbio_document_t copy)
+{
+    size_t idx;
+    int found;
+
+    idx = cbio_buffer_find(buffer, copy->info->id.buf, copy->info->id.size,
+                           &found);
+    if (found) {
+        buffer->nbytes -= cbio_buffer_docsize(buffer->docs[idx]);
+        cbio_document_release(buffer->docs[idx]);
+    } else {
+        memmove(buffer->docs + idx + 1, buffer->docs + idx,
+                (buffer->ndocs - idx) * sizeof(*buffer->docs));
+        ++buffer->ndocs;
+    }
+
+    if (buffer->ndocs == 1) {
+        buffer->oldest = cbio_buffer_now();
+    }
+    buffer->docs[idx] = copy;
+    buffer->nbytes += cbio_buffer_docsize(copy);
+}
+
+static int cbio_buffer_full(const struct cbio_buffer_st *buffer)
+{
+    const cbio_write_buffer_t *policy = &buffer->policy;
+
+    if (buffer->ndocs == 0) {
+        return 0;
+    }
+
+    return (policy->max_documents != 0 &&
+            buffer->ndocs >= policy->max_documents) ||
+           (policy->max_bytes != 0 && buffer->nbytes >= policy->max_bytes) ||
+           (policy->max_age_ms != 0 &&
+            cbio_buffer_now() - buffer->oldest >= policy->max_age_ms);
+}
+
+cbio_error_t cbio_buffer_store(libcbio_t handle,
+                               libcbio_document_t *doc,
+                               size_t ndocs)
+{
+    struct cbio_buffer_st *buffer = handle->buffer;
+    libcbio_document_t *copies;
+    cbio_error_t ret;
+    size_t ncopies = 0;
+
+    /* Do everything which may fail before the buffer is touched, so a
+       failure leaves none of the documents in it */
+    if ((ret = cbio_buffer_reserve(buffer, ndocs)) != CBIO_SUCCESS) {
+        return ret;
+    }
+    if ((copies = cbio_malloc(ndocs * sizeof(*copies) + 1,
+                              CBIO_ALLOC_HANDLE)) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+    while (ncopies < ndocs && ret == CBIO_SUCCESS) {
+        ret = cbio_buffer_copy(doc[ncopies], copies + ncopies);
+        if (ret == CBIO_SUCCESS) {
+            ++ncopies;
+        }
+    }
+
+    for (size_t ii = 0; ii < ncopies; ++ii) {
+        if (ret == CBIO_SUCCESS) {
+            cbio_buffer_insert(buffer, copies[ii]);
+        } else {
+            cbio_document_release(copies[ii]);
+        }
+    }
+    cbio_free(copies, CBIO_ALLOC_HANDLE);
+
+    if (ret == CBIO_SUCCESS && cbio_buffer_full(buffer)) {
+        if (buffer->policy.commit_on_flush) {
+            ret = cbio_commit(handle);
+        } else {
+            ret = cbio_buffer_flush(handle);
+        }
+    }
+
+    return ret;
+}
+
+cbio_error_t cbio_buffer_flush(libcbio_t handle)
+{
+    struct cbio_buffer_st *buffer = handle->buffer;
+    cbio_error_t ret;
+
+    if (buffer == NULL || buffer->ndocs == 0) {
+        return CBIO_SUCCESS;
+    }
+
+    /* Keep the documents around so that we may retry if we fail */
+    ret = cbio_write_documents(handle, buffer->docs, buffer->ndocs);
+    if (ret == CBIO_SUCCESS) {
+        for (size_t ii = 0; ii < buffer->ndocs; ++ii) {
+            cbio_document_release(buffer->docs[ii]);
+        }
+        buffer->ndocs = 0;
+        buffer->nbytes = 0;
+    }
+
+    return ret;
+}
+
+int cbio_buffer_lookup(libcbio_t handle,
+                       const void *id,
+                       size_t nid,
+                       cbio_error_t *err,
+                       libcbio_document_t *doc)
+{
+    struct cbio_buffer_st *buffer = handle->buffer;
+    size_t idx;
+    int found;
+
+    if (buffer == NULL) {
+        return 0;
+    }
+
+    idx = cbio_buffer_find(buffer, id, nid, &found);
+    if (found) {
+        libcbio_document_t entry = buffer->docs[idx];
+        if (entry->info->deleted || entry->doc == NULL) {
+            *err = CBIO_ERROR_ENOENT;
+        } else {
+            *err = cbio_buffer_copy(entry, doc);
+        }
+    }
+
+    return found;
+}
+
+void cbio_buffer_destroy(libcbio_t handle)
+{
+    struct cbio_buffer_st *buffer = handle->buffer;
+
+    if (buffer != NULL) {
+        for (size_t ii = 0; ii < buffer->ndocs; ++ii) {
+            cbio_document_release(buffer->docs[ii]);
+        }
+        cbio_free(buffer->docs, CBIO_ALLOC_HANDLE);
+        cbio_free(buffer, CBIO_ALLOC_HANDLE);
+        handle->buffer = NULL;
+    }
+}
+
+LIBCBIO_API
+cbio_error_t cbio_set_write_buffer(libcbio_t handle,
+                                   const cbio_write_buffer_t *policy)
+{
+    cbio_error_t ret;
+
+    if (handle->mode == CBIO_OPEN_RDONLY ||
+        handle->mode == CBIO_OPEN_SHARED_RDONLY) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if (policy == NULL) {
+        if ((ret = cbio_buffer_flush(handle)) == CBIO_SUCCESS) {
+            cbio_buffer_destroy(handle);
+        }
+        return ret;
+    }
+
+    if (handle->buffer == NULL) {
+        handle->buffer = cbio_calloc(1, sizeof(*handle->buffer),
+                                     CBIO_ALLOC_HANDLE);
+        if (handle->buffer == NULL) {
+            return CBIO_ERROR_ENOMEM;
+        }
+    }
+    handle->buffer->policy = *policy;
+
+    return CBIO_SUCCESS;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_flush(libcbio_t handle)
+{
+    return cbio_buffer_flush(handle);
+}
@@ -0,0 +1,503 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * The lookup cache remembers the result of walking the by-id B-tree
+ * (the DocInfo, or the fact that there is no such document) for the
+ * read only handles in the process. couchstore decodes the tree nodes
+ * internally, so this is the closest we get to caching them.
+ *
+ * The file is append-only, so what a lookup finds from a given header
+ * never changes. The entries are keyed by the file and the header
+ * position, and are never invalidated; the ones belonging to old
+ * headers just age out of the LRU lists. Handles that may write to the
+ * file don't use the cache since they see documents that aren't
+ * committed yet.
+ *
+ * Compaction replaces the file, and once the old one is gone its inode
+ * may be reused (and the new file may have a header at the same
+ * position). So the files are identified by a number handed out when
+ * a file is opened by the first handle in the process. While a handle
+ * is open the inode can't be reused, and once the last one is closed
+ * the number is retired with it.
+ *
+ * The cache is split in stripes, each with its own lock, hash table,
+ * LRU list and share of the budget, so threads looking up different
+ * documents rarely contend.
+ */
+#include "internal.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CBIO_CACHE_STRIPES 64
+#define CBIO_CACHE_MIN_BUCKETS 64
+
+struct cbio_cache_entry {
+    /* The next entry in the hash bucket */
+    struct cbio_cache_entry *next;
+    struct cbio_cache_entry *older;
+    struct cbio_cache_entry *newer;
+    uint32_t hash;
+    struct cbio_file_id file;
+    uint64_t header;
+    /* The number of bytes charged to the budget */
+    size_t size;
+    /* Zero if the document doesn't exist */
+    int found;
+    /* The id and revision metadata point into data */
+    DocInfo info;
+    char data[];
+};
+
+struct cbio_cache_stripe {
+    pthread_mutex_t mutex;
+    struct cbio_cache_entry **buckets;
+    size_t nbuckets;
+    size_t nentries;
+    size_t used;
+    struct cbio_cache_entry *oldest;
+    struct cbio_cache_entry *newest;
+    uint64_t hits;
+    uint64_t misses;
+};
+
+/* A file opened with cbio_open_db() */
+struct cbio_open_file {
+    struct cbio_open_file *next;
+    dev_t dev;
+    ino_t ino;
+    uint64_t id;
+    /* The number of handles open on it */
+    size_t refcount;
+};
+
+static pthread_mutex_t files_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct cbio_open_file *open_files;
+static uint64_t next_file_id;
+
+static struct cbio_cache_stripe stripes[CBIO_CACHE_STRIPES];
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+/* The budget of each stripe. Zero when the cache is disabled */
+static volatile size_t stripe_budget;
+
+static void cbio_cache_init(void)
+{
+    for (int ii = 0; ii < CBIO_CACHE_STRIPES; ++ii) {
+        pthread_mutex_init(&stripes[ii].mutex, NULL);
+    }
+}
+
+static uint32_t cbio_cache_hash(const struct cbio_file_id *file,
+                                uint64_t header,
+                                const void *id,
+                                size_t nid)
+{
+    const unsigned char *ptr = id;
+    uint64_t words[2];
+    uint32_t hash = 2166136261U;
+
+    /* FNV-1a */
+    for (size_t ii = 0; ii < nid; ++ii) {
+        hash = (hash ^ ptr[ii]) * 16777619U;
+    }
+
+    words[0] = file->id;
+    words[1] = header;
+    ptr = (const unsigned char *)words;
+    for (size_t ii = 0; ii < sizeof(words); ++ii) {
+        hash = (hash ^ ptr[ii]) * 16777619U;
+    }
+
+    return hash;
+}
+
+static struct cbio_cache_stripe *cbio_cache_stripe(uint32_t hash)
+{
+    return stripes + (hash % CBIO_CACHE_STRIPES);
+}
+
+static size_t cbio_cache_bucket(const struct cbio_cache_stripe *stripe,
+                                uint32_t hash)
+{
+    return (hash / CBIO_CACHE_STRIPES) & (stripe->nbuckets - 1);
+}
+
+static int cbio_cache_match(const struct cbio_cache_entry *entry,
+                            uint32_t hash,
+                            const struct cbio_file_id *file,
+                            uint64_t header,
+                            const void *id,
+                            size_t nid)
+{
+    return entry->hash == hash && entry->header == header &&
+           entry->file.id == file->id &&
+           entry->info.id.size == nid &&
+           memcmp(entry->info.id.buf, id, nid) == 0;
+}
+
+static void cbio_cache_lru_unlink(struct cbio_cache_stripe *stripe,
+                                  struct cbio_cache_entry *entry)
+{
+    if (entry->older != NULL) {
+        entry->older->newer = entry->newer;
+    } else {
+        stripe->oldest = entry->newer;
+    }
+    if (entry->newer != NULL) {
+        entry->newer->older = entry->older;
+    } else {
+        stripe->newest = entry->older;
+    }
+}
+
+static void cbio_cache_lru_append(struct cbio_cache_stripe *stripe,
+                                  struct cbio_cache_entry *entry)
+{
+    entry->older = stripe->newest;
+    entry->newer = NULL;
+    if (stripe->newest != NULL) {
+        stripe->newest->newer = entry;
+    } else {
+        stripe->oldest = entry;
+    }
+    stripe->newest = entry;
+}
+
+static void cbio_cache_remove(struct cbio_cache_stripe *stripe,
+                              struct cbio_cache_entry *entry)
+{
+    struct cbio_cache_entry **pp;
+
+    pp = stripe->buckets + cbio_cache_bucket(stripe, entry->hash);
+    while (*pp != entry) {
+        pp = &(*pp)->next;
+    }
+    *pp = entry->next;
+
+    cbio_cache_lru_unlink(stripe, entry);
+    stripe->used -= entry->size;
+    --stripe->nentries;
+    cbio_free(entry, CBIO_ALLOC_OTHER);
+}
+
+static void cbio_cache_evict(struct cbio_cache_stripe *stripe, size_t budget)
+{
+    while (stripe->used > budget) {
+        cbio_cache_remove(stripe, stripe->oldest);
+    }
+
+    if (stripe->nentries == 0) {
+        cbio_free(stripe->buckets, CBIO_ALLOC_OTHER);
+        stripe->buckets = NULL;
+        stripe->nbuckets = 0;
+    }
+}
+
+/*
+ * Resize the hash table of the stripe. If we can't allocate a new
+ * one we'll just keep using the one we've got (with longer chains)
+ */
+static void cbio_cache_rehash(struct cbio_cache_stripe *stripe,
+                              size_t nbuckets)
+{
+    struct cbio_cache_entry **buckets;
+
+    buckets = cbio_calloc(nbuckets, sizeof(*buckets), CBIO_ALLOC_OTHER);
+    if (buckets == NULL) {
+        return;
+    }
+
+    for (size_t ii = 0; ii < stripe->nbuckets; ++ii) {
+        struct cbio_cache_entry *entry = stripe->buckets[ii];
+        while (entry != NULL) {
+            struct cbio_cache_entry *next = entry->next;
+            size_t idx = (entry->hash / CBIO_CACHE_STRIPES) & (nbuckets - 1);
+            entry->next = buckets[idx];
+            buckets[idx] = entry;
+            entry = next;
+        }
+    }
+
+    cbio_free(stripe->buckets, CBIO_ALLOC_OTHER);
+    stripe->buckets = buckets;
+    stripe->nbuckets = nbuckets;
+}
+
+static struct cbio_cache_entry *cbio_cache_find(
+    struct cbio_cache_stripe *stripe,
+    uint32_t hash,
+    const struct cbio_file_id *file,
+    uint64_t header,
+    const void *id,
+    size_t nid)
+{
+    struct cbio_cache_entry *entry;
+
+    if (stripe->nbuckets == 0) {
+        return NULL;
+    }
+
+    entry = stripe->buckets[cbio_cache_bucket(stripe, hash)];
+    while (entry != NULL &&
+           !cbio_cache_match(entry, hash, file, header, id, nid)) {
+        entry = entry->next;
+    }
+
+    return entry;
+}
+
+static DocInfo *cbio_cache_copy(const DocInfo *info)
+{
+    DocInfo *ret = cbio_malloc(sizeof(*ret) + info->id.size +
+                               info->rev_meta.size, CBIO_ALLOC_DOCINFO);
+    if (ret != NULL) {
+        char *ptr = (char *)(ret + 1);
+        *ret = *info;
+        ret->id.buf = ptr;
+        memcpy(ptr, info->id.buf, info->id.size);
+        ret->rev_meta.buf = ptr + info->id.size;
+        if (info->rev_meta.size > 0) {
+            memcpy(ret->rev_meta.buf, info->rev_meta.buf,
+                   info->rev_meta.size);
+        }
+    }
+    return ret;
+}
+
+LIBCBIO_API
+void cbio_set_lookup_cache(size_t max_bytes)
+{
+    size_t budget = max_bytes / CBIO_CACHE_STRIPES;
+
+    pthread_once(&cache_once, cbio_cache_init);
+    (void)__sync_lock_test_and_set(&stripe_budget, budget);
+
+    for (int ii = 0; ii < CBIO_CACHE_STRIPES; ++ii) {
+        pthread_mutex_lock(&stripes[ii].mutex);
+        cbio_cache_evict(stripes + ii, budget);
+        pthread_mutex_unlock(&stripes[ii].mutex);
+    }
+}
+
+LIBCBIO_API
+void cbio_get_lookup_cache_stats(cbio_lookup_cache_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    pthread_once(&cache_once, cbio_cache_init);
+
+    for (int ii = 0; ii < CBIO_CACHE_STRIPES; ++ii) {
+        pthread_mutex_lock(&stripes[ii].mutex);
+        stats->hits += stripes[ii].hits;
+        stats->misses += stripes[ii].misses;
+        stats->entries += stripes[ii].nentries;
+        stats->bytes += stripes[ii].used;
+        pthread_mutex_unlock(&stripes[ii].mutex);
+    }
+}
+
+couchstore_error_t cbio_open_db(const char *name,
+                                couchstore_open_flags flags,
+                                Db **db,
+                                struct cbio_file_id *file)
+{
+    struct stat before, after;
+    couchstore_error_t err;
+    int known;
+
+    memset(file, 0, sizeof(*file));
+    known = (flags & COUCHSTORE_OPEN_FLAG_RDONLY) && stat(name, &before) == 0;
+
+    err = couchstore_open_db(name, flags, db);
+
+    /* If the file was replaced while we opened it we don't know which
+       one we've got */
+    if (err == COUCHSTORE_SUCCESS && known && stat(name, &after) == 0 &&
+        after.st_dev == before.st_dev && after.st_ino == before.st_ino) {
+        struct cbio_open_file *curr;
+
+        file->dev = after.st_dev;
+        file->ino = after.st_ino;
+
+        /* Without an id the handle just won't use the cache */
+        pthread_mutex_lock(&files_mutex);
+        for (curr = open_files; curr != NULL; curr = curr->next) {
+            if (curr->dev == after.st_dev && curr->ino == after.st_ino) {
+                break;
+            }
+        }
+        if (curr == NULL &&
+            (curr = cbio_calloc(1, sizeof(*curr), CBIO_ALLOC_OTHER)) != NULL) {
+            curr->dev = after.st_dev;
+            curr->ino = after.st_ino;
+            curr->id = ++next_file_id;
+            curr->next = open_files;
+            open_files = curr;
+        }
+        if (curr != NULL) {
+            ++curr->refcount;
+            file->id = curr->id;
+        }
+        pthread_mutex_unlock(&files_mutex);
+    }
+
+    return err;
+}
+
+void cbio_close_db(Db *db, const struct cbio_file_id *file)
+{
+    couchstore_close_db(db);
+
+    if (file->id != 0) {
+        struct cbio_open_file **pp;
+
+        pthread_mutex_lock(&files_mutex);
+        for (pp = &open_files; (*pp)->id != file->id; pp = &(*pp)->next) {
+            /* Find the pointer to the file */
+        }
+        if (--(*pp)->refcount == 0) {
+            struct cbio_open_file *curr = *pp;
+            *pp = curr->next;
+            cbio_free(curr, CBIO_ALLOC_OTHER);
+        }
+        pthread_mutex_unlock(&files_mutex);
+    }
+}
+
+int cbio_cache_lookup(struct cbio_db_ref *ref,
+                      const void *id,
+                      size_t nid,
+                      cbio_error_t *err,
+                      DocInfo **info)
+{
+    struct cbio_cache_stripe *stripe;
+    struct cbio_cache_entry *entry;
+    uint64_t header;
+    uint32_t hash;
+
+    if (ref->file.id == 0 || __sync_fetch_and_add(&stripe_budget, 0) == 0) {
+        return 0;
+    }
+
+    header = couchstore_get_header_position(ref->db);
+    hash = cbio_cache_hash(&ref->file, header, id, nid);
+    stripe = cbio_cache_stripe(hash);
+
+    pthread_mutex_lock(&stripe->mutex);
+    entry = cbio_cache_find(stripe, hash, &ref->file, header, id, nid);
+    if (entry == NULL) {
+        ++stripe->misses;
+    } else {
+        ++stripe->hits;
+        cbio_cache_lru_unlink(stripe, entry);
+        cbio_cache_lru_append(stripe, entry);
+        if (!entry->found) {
+            *info = NULL;
+            *err = CBIO_ERROR_ENOENT;
+        } else if ((*info = cbio_cache_copy(&entry->info)) == NULL) {
+            *err = CBIO_ERROR_ENOMEM;
+        } else {
+            *err = CBIO_SUCCESS;
+        }
+    }
+    pthread_mutex_unlock(&stripe->mutex);
+
+    return entry != NULL;
+}
+
+void cbio_cache_store(struct cbio_db_ref *ref,
+                      const void *id,
+                      size_t nid,
+                      couchstore_error_t err,
+                      const DocInfo *info)
+{
+    struct cbio_cache_stripe *stripe;
+    struct cbio_cache_entry *entry;
+    size_t nmeta = 0;
+    size_t size, budget;
+
+    if (ref->file.id == 0 ||
+        (err != COUCHSTORE_SUCCESS && err != COUCHSTORE_ERROR_DOC_NOT_FOUND)) {
+        return;
+    }
+
+    if (err == COUCHSTORE_SUCCESS) {
+        nmeta = info->rev_meta.size;
+    }
+
+    size = sizeof(*entry) + nid + nmeta;
+    budget = __sync_fetch_and_add(&stripe_budget, 0);
+    if (size > budget ||
+        (entry = cbio_malloc(size, CBIO_ALLOC_OTHER)) == NULL) {
+        return;
+    }
+
+    if (err == COUCHSTORE_SUCCESS) {
+        entry->info = *info;
+        entry->found = 1;
+    } else {
+        memset(&entry->info, 0, sizeof(entry->info));
+        entry->found = 0;
+    }
+    entry->info.id.buf = entry->data;
+    entry->info.id.size = nid;
+    memcpy(entry->data, id, nid);
+    entry->info.rev_meta.buf = entry->data + nid;
+    entry->info.rev_meta.size = nmeta;
+    if (nmeta > 0) {
+        memcpy(entry->info.rev_meta.buf, info->rev_meta.buf, nmeta);
+    }
+    entry->file = ref->file;
+    entry->header = couchstore_get_header_position(ref->db);
+    entry->hash = cbio_cache_hash(&entry->file, entry->header, id, nid);
+    entry->size = size;
+
+    stripe = cbio_cache_stripe(entry->hash);
+    pthread_mutex_lock(&stripe->mutex);
+
+    /* The budget may have changed (or another thread may have cached
+       the same lookup) while we didn't hold the lock */
+    budget = __sync_fetch_and_add(&stripe_budget, 0);
+    if (size <= budget &&
+        cbio_cache_find(stripe, entry->hash, &entry->file, entry->header,
+                        id, nid) == NULL) {
+        if (stripe->nentries >= stripe->nbuckets * 2) {
+            size_t nbuckets = stripe->nbuckets * 2;
+            if (nbuckets < CBIO_CACHE_MIN_BUCKETS) {
+                nbuckets = CBIO_CACHE_MIN_BUCKETS;
+            }
+            cbio_cache_rehash(stripe, nbuckets);
+        }
+    } else {
+        budget = 0;
+    }
+
+    if (budget == 0 || stripe->nbuckets == 0) {
+        cbio_free(entry, CBIO_ALLOC_OTHER);
+    } else {
+        size_t idx = cbio_cache_bucket(stripe, entry->hash);
+        entry->next = stripe->buckets[idx];
+        stripe->buckets[idx] = entry;
+        cbio_cache_lru_append(stripe, entry);
+        stripe->used += size;
+        ++stripe->nentries;
+        cbio_cache_evict(stripe, budget);
+    }
+
+    pthread_mutex_unlock(&stripe->mutex);
+}
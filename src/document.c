@@ -24,14 +24,17 @@ LIBCBIO_API
 void cbio_document_release(libcbio_document_t doc)
 {
     cbio_document_reinitialize(doc);
-    free(doc);
+    cbio_free(doc->spare_doc, CBIO_ALLOC_DOCINFO);
+    cbio_free(doc->spare_info, CBIO_ALLOC_DOCINFO);
+    cbio_free(doc->read_buffer, CBIO_ALLOC_DATA);
+    cbio_free(doc, CBIO_ALLOC_DOCUMENT);
 }
 
 LIBCBIO_API
 cbio_error_t cbio_create_empty_document(libcbio_t handle,
                                         libcbio_document_t *doc)
 {
-    libcbio_document_t ret = calloc(1, sizeof(*ret));
+    libcbio_document_t ret = cbio_calloc(1, sizeof(*ret), CBIO_ALLOC_DOCUMENT);
     (void)handle;
     *doc = ret;
     if (*doc != NULL) {
@@ -46,23 +49,105 @@ LIBCBIO_API
 void cbio_document_reinitialize(libcbio_document_t doc)
 {
     if (doc->scratch == 1) {
-        free(doc->info);
-        free(doc->doc);
+        /* Keep the structs around for cbio_get_document_into() */
+        if (doc->spare_info == NULL) {
+            doc->spare_info = doc->info;
+        } else {
+            cbio_free(doc->info, CBIO_ALLOC_DOCINFO);
+        }
+        if (doc->spare_doc == NULL) {
+            doc->spare_doc = doc->doc;
+        } else {
+            cbio_free(doc->doc, CBIO_ALLOC_DOCINFO);
+        }
     } else {
-        if (doc->info != NULL) {
+        if (doc->own_info) {
+            cbio_free(doc->info, CBIO_ALLOC_DOCINFO);
+        } else if (doc->info != NULL) {
             couchstore_free_docinfo(doc->info);
         }
-        if (doc->doc) {
+        if (doc->own_doc) {
+            cbio_free(doc->doc, CBIO_ALLOC_DOCINFO);
+        } else if (doc->doc) {
             couchstore_free_document(doc->doc);
         }
     }
-    free(doc->tmp_alloc_id);
-    free(doc->tmp_alloc_meta);
-    free(doc->tmp_alloc_bp);
+    cbio_free(doc->tmp_alloc_id, CBIO_ALLOC_DATA);
+    cbio_free(doc->tmp_alloc_meta, CBIO_ALLOC_DATA);
+    cbio_free(doc->tmp_alloc_bp, CBIO_ALLOC_DATA);
 
     doc->info = NULL;
     doc->doc = NULL;
-    doc->tmp_alloc_id = doc->tmp_alloc_meta = doc->tmp_alloc_bp;
+    doc->tmp_alloc_id = doc->tmp_alloc_meta = doc->tmp_alloc_bp = NULL;
+    doc->scratch = 1;
+    doc->own_doc = 0;
+    doc->own_info = 0;
+}
+
+cbio_error_t cbio_document_fill(libcbio_document_t doc,
+                                const DocInfo *info,
+                                const Doc *body)
+{
+    size_t needed = info->id.size + info->rev_meta.size;
+    char *ptr;
+
+    if (body != NULL) {
+        needed += body->data.size;
+    }
+
+    if (needed > doc->read_size) {
+        /* Grow geometrically so a read loop settles quickly */
+        size_t size = doc->read_size * 2;
+        if (size < needed) {
+            size = needed;
+        }
+        cbio_free(doc->read_buffer, CBIO_ALLOC_DATA);
+        doc->read_size = 0;
+        if ((doc->read_buffer = cbio_malloc(size, CBIO_ALLOC_DATA)) == NULL) {
+            return CBIO_ERROR_ENOMEM;
+        }
+        doc->read_size = size;
+    }
+
+    if (doc->spare_info != NULL) {
+        doc->info = doc->spare_info;
+        doc->spare_info = NULL;
+    } else if ((doc->info = cbio_malloc(sizeof(DocInfo),
+                                        CBIO_ALLOC_DOCINFO)) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    if (body != NULL) {
+        if (doc->spare_doc != NULL) {
+            doc->doc = doc->spare_doc;
+            doc->spare_doc = NULL;
+        } else if ((doc->doc = cbio_malloc(sizeof(Doc),
+                                           CBIO_ALLOC_DOCINFO)) == NULL) {
+            return CBIO_ERROR_ENOMEM;
+        }
+    }
+
+    ptr = doc->read_buffer;
+    *doc->info = *info;
+    doc->info->id.buf = ptr;
+    memcpy(ptr, info->id.buf, info->id.size);
+    ptr += info->id.size;
+    doc->info->rev_meta.buf = ptr;
+    if (info->rev_meta.size > 0) {
+        memcpy(ptr, info->rev_meta.buf, info->rev_meta.size);
+        ptr += info->rev_meta.size;
+    }
+
+    if (body != NULL) {
+        doc->doc->id = doc->info->id;
+        doc->doc->data.buf = ptr;
+        doc->doc->data.size = body->data.size;
+        if (body->data.size > 0) {
+            memcpy(ptr, body->data.buf, body->data.size);
+        }
+    }
+
+    return CBIO_SUCCESS;
 }
 
 LIBCBIO_API
@@ -76,20 +161,23 @@ cbio_error_t cbio_document_set_id(libcbio_document_t doc,
     assert(doc);
 
     if (doc->doc == NULL) {
-        if ((doc->doc = calloc(1, sizeof(*doc->doc))) == NULL) {
+        if ((doc->doc = cbio_calloc(1, sizeof(*doc->doc),
+                                    CBIO_ALLOC_DOCINFO)) == NULL) {
             return CBIO_ERROR_ENOMEM;
         }
     }
 
     if (doc->info == NULL) {
-        if ((doc->info = calloc(1, sizeof(*doc->info))) == NULL) {
+        if ((doc->info = cbio_calloc(1, sizeof(*doc->info),
+                                     CBIO_ALLOC_DOCINFO)) == NULL) {
             return CBIO_ERROR_ENOMEM;
         }
     }
 
     if (allocate) {
-        free(doc->tmp_alloc_id);
-        if ((doc->tmp_alloc_id = ptr = malloc(nid)) == NULL) {
+        cbio_free(doc->tmp_alloc_id, CBIO_ALLOC_DATA);
+        ptr = cbio_malloc(nid, CBIO_ALLOC_DATA);
+        if ((doc->tmp_alloc_id = ptr) == NULL) {
             return CBIO_ERROR_ENOMEM;
         }
         memcpy(ptr, id, nid);
@@ -112,14 +200,16 @@ cbio_error_t cbio_document_set_meta(libcbio_document_t doc,
     assert(doc);
 
     if (doc->info == NULL) {
-        if ((doc->info = calloc(1, sizeof(*doc->info))) == NULL) {
+        if ((doc->info = cbio_calloc(1, sizeof(*doc->info),
+                                     CBIO_ALLOC_DOCINFO)) == NULL) {
             return CBIO_ERROR_ENOMEM;
         }
     }
 
     if (allocate) {
-        free(doc->tmp_alloc_meta);
-        if ((doc->tmp_alloc_meta = ptr = malloc(nmeta)) == NULL) {
+        cbio_free(doc->tmp_alloc_meta, CBIO_ALLOC_DATA);
+        ptr = cbio_malloc(nmeta, CBIO_ALLOC_DATA);
+        if ((doc->tmp_alloc_meta = ptr) == NULL) {
             return CBIO_ERROR_ENOMEM;
         }
         memcpy(ptr, meta, nmeta);
@@ -137,7 +227,8 @@ cbio_error_t cbio_document_set_revision(libcbio_document_t doc, uint64_t revno)
     assert(doc);
 
     if (doc->info == NULL) {
-        if ((doc->info = calloc(1, sizeof(*doc->info))) == NULL) {
+        if ((doc->info = cbio_calloc(1, sizeof(*doc->info),
+                                     CBIO_ALLOC_DOCINFO)) == NULL) {
             return CBIO_ERROR_ENOMEM;
         }
     }
@@ -152,7 +243,8 @@ cbio_error_t cbio_document_set_deleted(libcbio_document_t doc, int deleted)
     assert(doc);
 
     if (doc->info == NULL) {
-        if ((doc->info = calloc(1, sizeof(*doc->info))) == NULL) {
+        if ((doc->info = cbio_calloc(1, sizeof(*doc->info),
+                                     CBIO_ALLOC_DOCINFO)) == NULL) {
             return CBIO_ERROR_ENOMEM;
         }
     }
@@ -172,20 +264,23 @@ cbio_error_t cbio_document_set_value(libcbio_document_t doc,
     assert(doc);
 
     if (doc->doc == NULL) {
-        if ((doc->doc = calloc(1, sizeof(*doc->doc))) == NULL) {
+        if ((doc->doc = cbio_calloc(1, sizeof(*doc->doc),
+                                    CBIO_ALLOC_DOCINFO)) == NULL) {
             return CBIO_ERROR_ENOMEM;
         }
     }
 
     if (doc->info == NULL) {
-        if ((doc->info = calloc(1, sizeof(*doc->info))) == NULL) {
+        if ((doc->info = cbio_calloc(1, sizeof(*doc->info),
+                                     CBIO_ALLOC_DOCINFO)) == NULL) {
             return CBIO_ERROR_ENOMEM;
         }
     }
 
     if (allocate) {
-        free(doc->tmp_alloc_bp);
-        if ((doc->tmp_alloc_bp = ptr = malloc(nvalue)) == NULL) {
+        cbio_free(doc->tmp_alloc_bp, CBIO_ALLOC_DATA);
+        ptr = cbio_malloc(nvalue, CBIO_ALLOC_DATA);
+        if ((doc->tmp_alloc_bp = ptr) == NULL) {
             return CBIO_ERROR_ENOMEM;
         }
         memcpy(ptr, value, nvalue);
@@ -204,16 +299,84 @@ cbio_error_t cbio_document_set_content_type(libcbio_document_t doc,
     assert(doc);
 
     if (doc->info == NULL) {
-        if ((doc->info = calloc(1, sizeof(*doc->info))) == NULL) {
+        if ((doc->info = cbio_calloc(1, sizeof(*doc->info),
+                                     CBIO_ALLOC_DOCINFO)) == NULL) {
             return CBIO_ERROR_ENOMEM;
         }
     }
 
-    /* @todo verify the content type */
+    if ((content_type & ~CBIO_DOC_IS_COMPRESSED) > CBIO_DOC_NON_JSON_MODE) {
+        return CBIO_ERROR_EINVAL;
+    }
+
     doc->info->content_meta = content_type;
     return CBIO_SUCCESS;
 }
 
+LIBCBIO_API
+cbio_error_t cbio_document_classify(libcbio_document_t doc)
+{
+    if (doc == NULL || doc->doc == NULL || doc->info == NULL) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if (doc->info->content_meta & CBIO_DOC_IS_COMPRESSED) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    doc->info->content_meta = cbio_json_classify(doc->doc->data.buf,
+                                                 doc->doc->data.size);
+    return CBIO_SUCCESS;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_document_project(libcbio_document_t doc,
+                                   const char *const *paths,
+                                   size_t npaths)
+{
+    cbio_error_t ret;
+    size_t nvalue;
+    char *value;
+
+    if (doc == NULL || doc->doc == NULL || (paths == NULL && npaths > 0)) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if (doc->info != NULL &&
+        (doc->info->content_meta & CBIO_DOC_IS_COMPRESSED)) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    ret = cbio_json_project(doc->doc->data.buf, doc->doc->data.size,
+                            paths, npaths, &value, &nvalue);
+    if (ret != CBIO_SUCCESS) {
+        return ret;
+    }
+
+    if (!doc->scratch && !doc->own_doc) {
+        /* Release the body read by couchstore right away. The id in
+           it lives in the same allocation, so use the one in info */
+        Doc *body = cbio_malloc(sizeof(*body), CBIO_ALLOC_DOCINFO);
+        if (body == NULL) {
+            cbio_free(value, CBIO_ALLOC_DATA);
+            return CBIO_ERROR_ENOMEM;
+        }
+        body->id = doc->info->id;
+        couchstore_free_document(doc->doc);
+        doc->doc = body;
+        doc->own_doc = 1;
+    } else if (doc->scratch && doc->info != NULL) {
+        doc->info->size = nvalue;
+    }
+
+    cbio_free(doc->tmp_alloc_bp, CBIO_ALLOC_DATA);
+    doc->tmp_alloc_bp = value;
+    doc->doc->data.buf = value;
+    doc->doc->data.size = nvalue;
+
+    return CBIO_SUCCESS;
+}
+
 LIBCBIO_API
 cbio_error_t cbio_document_get_id(libcbio_document_t doc,
                                   const void **id,
@@ -297,3 +460,14 @@ cbio_error_t cbio_document_get_content_type(libcbio_document_t doc,
     *content_type = doc->info->content_meta;
     return CBIO_SUCCESS;
 }
+
+LIBCBIO_API
+cbio_error_t cbio_document_get_seqno(libcbio_document_t doc, uint64_t *seqno)
+{
+    if (doc == NULL || doc->info == NULL) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    *seqno = doc->info->db_seq;
+    return CBIO_SUCCESS;
+}
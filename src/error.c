@@ -77,6 +77,10 @@ const char *cbio_strerror(cbio_error_t err)
         return "illegal header version";
     case CBIO_ERROR_CHECKSUM_FAIL:
         return "checksum fail";
+    case CBIO_ERROR_EEXISTS:
+        return "document exists or revision mismatch";
+    case CBIO_ERROR_EBUSY:
+        return "too many pending requests";
     case CBIO_ERROR_INTERNAL:
     default:
         return "Internal error";
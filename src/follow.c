@@ -0,0 +1,390 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * cbio_follow_changes() runs the changes feed, and then sleeps until
+ * the file may have a new header before it refreshes the handle and
+ * continues from where it left off. Every follower owns a pipe, which
+ * is written to by cbio_commit() on a writer in the same process (the
+ * followers are registered in a process-wide list keyed by the file)
+ * and by cbio_stop_following(). Commits by other processes are picked
+ * up by watching the file with inotify (where available), and as a
+ * last resort by checking the file every poll interval.
+ *
+ * inotify can't tell a commit from any other write, and a writer in
+ * another process keeps the file open, so we have to watch every
+ * modification. Most of them aren't commits, and a refresh that sees
+ * the file grow has to open it to find out. So the refreshes caused
+ * by inotify are rate limited to one per min_refresh_interval_ms.
+ */
+#include "internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef CBIO_INOTIFY
+#include <sys/inotify.h>
+#endif
+
+/* What woke up cbio_follow_wait() */
+#define CBIO_FOLLOW_PIPE 1
+#define CBIO_FOLLOW_INOTIFY 2
+
+struct cbio_follower {
+    struct cbio_follower *next;
+    libcbio_t handle;
+    struct cbio_file_id file;
+    /* Written to by committers and cbio_stop_following() */
+    int pipe[2];
+    /* inotify descriptor and watch (-1 if not used) */
+    int inotify;
+    int watch;
+    volatile int stop;
+    /* Set when the callback returned a negative value */
+    int cancelled;
+
+    cbio_changes_callback_fn callback;
+    void *ctx;
+    /* The sequence number to continue from */
+    uint64_t next_seqno;
+    uint64_t ndocs;
+};
+
+static pthread_mutex_t followers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct cbio_follower *followers;
+/* Lets cbio_commit() skip the lock when nobody is following */
+static volatile int nfollowers;
+
+static uint64_t cbio_follow_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* Write a byte to the pipe of the follower (unless one is pending) */
+static void cbio_follow_wake(struct cbio_follower *follower)
+{
+    char c = 0;
+    ssize_t nw;
+
+    do {
+        nw = write(follower->pipe[1], &c, 1);
+    } while (nw == -1 && errno == EINTR);
+}
+
+static int cbio_follow_identify(libcbio_t handle, struct cbio_file_id *file)
+{
+    struct stat st;
+
+    memset(file, 0, sizeof(*file));
+    if (stat(handle->name, &st) == -1) {
+        return -1;
+    }
+    file->dev = st.st_dev;
+    file->ino = st.st_ino;
+    return 0;
+}
+
+/*
+ * (Re)start watching the file. Compaction replaces the file, so the
+ * watch has to follow the name
+ */
+static void cbio_follow_watch(struct cbio_follower *follower)
+{
+#ifdef CBIO_INOTIFY
+    if (follower->inotify != -1) {
+        if (follower->watch != -1) {
+            (void)inotify_rm_watch(follower->inotify, follower->watch);
+        }
+        follower->watch = inotify_add_watch(follower->inotify,
+                                            follower->handle->name,
+                                            IN_MODIFY | IN_ATTRIB |
+                                            IN_MOVE_SELF | IN_DELETE_SELF);
+    }
+#else
+    (void)follower;
+#endif
+}
+
+static cbio_error_t cbio_follow_register(struct cbio_follower *follower)
+{
+    follower->inotify = follower->watch = -1;
+    if (pipe(follower->pipe) == -1) {
+        return CBIO_ERROR_INTERNAL;
+    }
+    (void)fcntl(follower->pipe[0], F_SETFL, O_NONBLOCK);
+    (void)fcntl(follower->pipe[1], F_SETFL, O_NONBLOCK);
+
+#ifdef CBIO_INOTIFY
+    follower->inotify = inotify_init();
+    if (follower->inotify != -1) {
+        (void)fcntl(follower->inotify, F_SETFL, O_NONBLOCK);
+    }
+#endif
+    cbio_follow_watch(follower);
+
+    pthread_mutex_lock(&followers_mutex);
+    (void)cbio_follow_identify(follower->handle, &follower->file);
+    follower->next = followers;
+    followers = follower;
+    __sync_add_and_fetch(&nfollowers, 1);
+    pthread_mutex_unlock(&followers_mutex);
+
+    return CBIO_SUCCESS;
+}
+
+static void cbio_follow_unregister(struct cbio_follower *follower)
+{
+    struct cbio_follower **pp;
+
+    pthread_mutex_lock(&followers_mutex);
+    for (pp = &followers; *pp != follower; pp = &(*pp)->next) {
+        /* Find the pointer to the follower */
+    }
+    *pp = follower->next;
+    __sync_sub_and_fetch(&nfollowers, 1);
+    pthread_mutex_unlock(&followers_mutex);
+
+    close(follower->pipe[0]);
+    close(follower->pipe[1]);
+    if (follower->inotify != -1) {
+        close(follower->inotify);
+    }
+}
+
+/*
+ * Wait until the pipe or inotify wakes us up (or the timeout expires),
+ * and drain them so the next wait blocks again. Returns which of them
+ * (CBIO_FOLLOW_PIPE and/or CBIO_FOLLOW_INOTIFY) were readable, and
+ * (uint32_t)-1 waits forever
+ */
+static int cbio_follow_wait(struct cbio_follower *follower,
+                            uint32_t timeout_ms)
+{
+    struct pollfd fds[2];
+    nfds_t nfds = 1;
+    char buffer[4096];
+    int timeout = -1;
+    int ret = 0;
+
+    if (timeout_ms != (uint32_t)-1) {
+        timeout = timeout_ms > INT_MAX ? INT_MAX : (int)timeout_ms;
+    }
+
+    fds[0].fd = follower->pipe[0];
+    fds[0].events = POLLIN;
+    if (follower->inotify != -1) {
+        fds[1].fd = follower->inotify;
+        fds[1].events = POLLIN;
+        nfds = 2;
+    }
+
+    if (poll(fds, nfds, timeout) > 0) {
+        for (nfds_t ii = 0; ii < nfds; ++ii) {
+            if (fds[ii].revents != 0) {
+                ret |= ii == 0 ? CBIO_FOLLOW_PIPE : CBIO_FOLLOW_INOTIFY;
+            }
+            while (read(fds[ii].fd, buffer, sizeof(buffer)) > 0) {
+                /* Drain */
+            }
+        }
+    }
+
+    return ret;
+}
+
+static int cbio_follow_callback(libcbio_t handle,
+                                libcbio_document_t doc,
+                                void *ctx)
+{
+    struct cbio_follower *follower = ctx;
+    uint64_t seqno;
+    int ret;
+
+    /* Look at the document before the callback may release it */
+    if (cbio_document_get_seqno(doc, &seqno) == CBIO_SUCCESS &&
+        seqno >= follower->next_seqno) {
+        follower->next_seqno = seqno + 1;
+    }
+    ++follower->ndocs;
+
+    if ((ret = follower->callback(handle, doc, follower->ctx)) < 0) {
+        follower->cancelled = 1;
+    }
+    return ret;
+}
+
+/*
+ * Refresh the handle. If the file was replaced we need to know about
+ * commits to the new one instead
+ */
+static cbio_error_t cbio_follow_refresh(struct cbio_follower *follower)
+{
+    struct cbio_file_id file;
+    cbio_error_t ret;
+
+    if ((ret = cbio_refresh_handle(follower->handle)) != CBIO_SUCCESS) {
+        return ret;
+    }
+
+    if (cbio_follow_identify(follower->handle, &file) == 0 &&
+        (file.dev != follower->file.dev || file.ino != follower->file.ino)) {
+        pthread_mutex_lock(&followers_mutex);
+        follower->file = file;
+        pthread_mutex_unlock(&followers_mutex);
+        cbio_follow_watch(follower);
+    }
+
+    return CBIO_SUCCESS;
+}
+
+LIBCBIO_API
+void cbio_follow_options_init(cbio_follow_options_t *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->poll_interval_ms = 1000;
+    opts->min_refresh_interval_ms = 50;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_follow_changes(libcbio_t handle,
+                                 uint64_t since,
+                                 const cbio_follow_options_t *opts,
+                                 cbio_changes_callback_fn callback,
+                                 void *ctx)
+{
+    struct cbio_follower follower;
+    cbio_follow_options_t defaults;
+    uint64_t idle_since, last_refresh;
+    uint64_t header = 0;
+    cbio_error_t ret;
+    int scan = 1;
+
+    if (handle->mode != CBIO_OPEN_RDONLY &&
+        handle->mode != CBIO_OPEN_SHARED_RDONLY) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if (opts == NULL) {
+        cbio_follow_options_init(&defaults);
+        opts = &defaults;
+    }
+
+    memset(&follower, 0, sizeof(follower));
+    follower.handle = handle;
+    follower.callback = callback;
+    follower.ctx = ctx;
+    follower.next_seqno = since;
+
+    /* Register before the first scan so no commit goes unnoticed */
+    if ((ret = cbio_follow_register(&follower)) != CBIO_SUCCESS) {
+        return ret;
+    }
+
+    idle_since = last_refresh = cbio_follow_now();
+    while (!follower.stop) {
+        uint32_t wait = opts->poll_interval_ms;
+
+        if (scan) {
+            uint64_t ndocs = follower.ndocs;
+
+            header = (uint64_t)cbio_get_header_position(handle);
+            ret = cbio_changes_since(handle, follower.next_seqno,
+                                     cbio_follow_callback, &follower);
+            if (ret != CBIO_SUCCESS || follower.cancelled) {
+                break;
+            }
+            if (follower.ndocs != ndocs) {
+                idle_since = cbio_follow_now();
+            }
+        }
+
+        if (opts->timeout_ms != 0) {
+            uint64_t idle = cbio_follow_now() - idle_since;
+            if (idle >= opts->timeout_ms) {
+                break;
+            }
+            if (wait == 0 || opts->timeout_ms - idle < wait) {
+                wait = (uint32_t)(opts->timeout_ms - idle);
+            }
+        }
+
+        if (cbio_follow_wait(&follower, wait == 0 ? (uint32_t)-1 : wait) ==
+            CBIO_FOLLOW_INOTIFY) {
+            /* Probably just a write. Let a few more of them pass before
+               we look for a new header (a commit in this process or
+               cbio_stop_following() still wakes us up right away) */
+            uint64_t elapsed = cbio_follow_now() - last_refresh;
+            if (elapsed < opts->min_refresh_interval_ms) {
+                wait = opts->min_refresh_interval_ms - (uint32_t)elapsed;
+                (void)cbio_follow_wait(&follower, wait);
+            }
+        }
+        if (follower.stop) {
+            break;
+        }
+
+        last_refresh = cbio_follow_now();
+        if ((ret = cbio_follow_refresh(&follower)) != CBIO_SUCCESS) {
+            break;
+        }
+        /* Don't rescan unless there is a new header */
+        scan = (uint64_t)cbio_get_header_position(handle) != header;
+    }
+
+    cbio_follow_unregister(&follower);
+    return ret;
+}
+
+LIBCBIO_API
+void cbio_stop_following(libcbio_t handle)
+{
+    struct cbio_follower *follower;
+
+    pthread_mutex_lock(&followers_mutex);
+    for (follower = followers; follower != NULL; follower = follower->next) {
+        if (follower->handle == handle) {
+            follower->stop = 1;
+            cbio_follow_wake(follower);
+        }
+    }
+    pthread_mutex_unlock(&followers_mutex);
+}
+
+void cbio_follow_notify(libcbio_t handle)
+{
+    struct cbio_follower *follower;
+
+    if (__sync_fetch_and_add(&nfollowers, 0) == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&followers_mutex);
+    for (follower = followers; follower != NULL; follower = follower->next) {
+        if (follower->file.dev == handle->file.dev &&
+            follower->file.ino == handle->file.ino) {
+            cbio_follow_wake(follower);
+        }
+    }
+    pthread_mutex_unlock(&followers_mutex);
+}
@@ -0,0 +1,739 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * The secondary index lives in a couchstore file of its own. Every
+ * (key, id) pair is a document with the id "key\0id" and no body, so
+ * the by-id tree of the index file keeps the entries sorted by key.
+ * To be able to remove the old entries when a document changes, the
+ * keys emitted for each document are kept in the local document
+ * "_local/cbio_index/<id>" as a list of NUL-terminated keys.
+ *
+ * The entries for a batch of documents are collected and written
+ * with a single couchstore_save_documents() call.
+ *
+ * The main file is committed before the index file, and the index
+ * file records the last sequence number of the main file it covers.
+ * If we crash in between, the changes since that sequence number are
+ * indexed again the next time the index is opened. The same catch-up
+ * runs at the next commit if updating the index failed.
+ */
+#include "internal.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Number of entries the catch-up collects before writing them */
+#define CBIO_INDEX_BATCH 1000
+
+struct cbio_index_st {
+    Db *db;
+    cbio_index_extract_fn extract;
+    void *cookie;
+    /* Set if we failed to update the index, so that we don't record
+       that the index is up to date until it has caught up again */
+    int failed;
+};
+
+struct cbio_index_entry {
+    /* "key\0id" */
+    sized_buf id;
+    int deleted;
+    /* The order the entry was added in. A later entry for the same
+       key and document replaces an earlier one */
+    size_t order;
+};
+
+/* The changes to write to the index file */
+struct cbio_index_batch {
+    struct cbio_index_entry *entries;
+    size_t nentries;
+    size_t allocated;
+    /* The new lists of keys ("_local/cbio_index/<id>") */
+    LocalDoc *reverse;
+    size_t nreverse;
+    size_t rallocated;
+};
+
+struct cbio_index_keys {
+    char *data;
+    size_t size;
+    size_t allocated;
+    cbio_error_t err;
+};
+
+static int cbio_index_has_key(const char *keys, size_t nkeys,
+                              const void *key, size_t nkey)
+{
+    size_t offset = 0;
+    while (offset < nkeys) {
+        size_t len = strlen(keys + offset);
+        if (len == nkey && memcmp(keys + offset, key, nkey) == 0) {
+            return 1;
+        }
+        offset += len + 1;
+    }
+    return 0;
+}
+
+static void cbio_index_emit(void *emitctx, const void *key, size_t nkey)
+{
+    struct cbio_index_keys *keys = emitctx;
+
+    /* Keys containing NUL can't be represented in the index */
+    if (keys->err != CBIO_SUCCESS || nkey == 0 ||
+        memchr(key, '\0', nkey) != NULL ||
+        cbio_index_has_key(keys->data, keys->size, key, nkey)) {
+        return;
+    }
+
+    if (keys->size + nkey + 1 > keys->allocated) {
+        size_t allocated = (keys->size + nkey + 1) * 2;
+        char *ptr = cbio_realloc(keys->data, allocated, CBIO_ALLOC_BATCH);
+        if (ptr == NULL) {
+            keys->err = CBIO_ERROR_ENOMEM;
+            return;
+        }
+        keys->data = ptr;
+        keys->allocated = allocated;
+    }
+
+    memcpy(keys->data + keys->size, key, nkey);
+    keys->data[keys->size + nkey] = '\0';
+    keys->size += nkey + 1;
+}
+
+static char *cbio_index_reverse_id(const sized_buf *id, size_t *nid)
+{
+    size_t nprefix = sizeof(CBIO_INDEX_REVERSE_PREFIX) - 1;
+    char *ret = cbio_malloc(nprefix + id->size, CBIO_ALLOC_BATCH);
+    if (ret != NULL) {
+        memcpy(ret, CBIO_INDEX_REVERSE_PREFIX, nprefix);
+        memcpy(ret + nprefix, id->buf, id->size);
+        *nid = nprefix + id->size;
+    }
+    return ret;
+}
+
+static void cbio_index_batch_reset(struct cbio_index_batch *batch)
+{
+    for (size_t ii = 0; ii < batch->nentries; ++ii) {
+        cbio_free(batch->entries[ii].id.buf, CBIO_ALLOC_BATCH);
+    }
+    batch->nentries = 0;
+
+    for (size_t ii = 0; ii < batch->nreverse; ++ii) {
+        cbio_free(batch->reverse[ii].id.buf, CBIO_ALLOC_BATCH);
+        cbio_free(batch->reverse[ii].json.buf, CBIO_ALLOC_BATCH);
+    }
+    batch->nreverse = 0;
+}
+
+static void cbio_index_batch_destroy(struct cbio_index_batch *batch)
+{
+    cbio_index_batch_reset(batch);
+    cbio_free(batch->entries, CBIO_ALLOC_BATCH);
+    cbio_free(batch->reverse, CBIO_ALLOC_BATCH);
+    memset(batch, 0, sizeof(*batch));
+}
+
+/* Same ordering as couchstore use for the by-id tree */
+static int cbio_index_compare_ids(const sized_buf *a, const sized_buf *b)
+{
+    size_t size = a->size < b->size ? a->size : b->size;
+    int ret = memcmp(a->buf, b->buf, size);
+    if (ret == 0 && a->size != b->size) {
+        ret = a->size < b->size ? -1 : 1;
+    }
+    return ret;
+}
+
+static int cbio_index_compare_entries(const void *a, const void *b)
+{
+    const struct cbio_index_entry *ea = a;
+    const struct cbio_index_entry *eb = b;
+    int ret = cbio_index_compare_ids(&ea->id, &eb->id);
+    if (ret == 0) {
+        ret = ea->order < eb->order ? -1 : 1;
+    }
+    return ret;
+}
+
+/*
+ * Write the batch to the index file: the entries with a single call to
+ * couchstore_save_documents(), and then the lists of keys per document.
+ * The lists go last so that if we fail half way, the next catch-up
+ * still sees the old list and writes the missing entries again.
+ */
+static couchstore_error_t cbio_index_batch_flush(Db *db,
+                                                 struct cbio_index_batch *batch)
+{
+    couchstore_error_t err = COUCHSTORE_SUCCESS;
+    struct cbio_index_entry *entries = batch->entries;
+    size_t nentries = batch->nentries;
+    size_t nsave = 0;
+
+    if (nentries > 0) {
+        DocInfo *info, **infos;
+        Doc *docs, **pdocs;
+        void *block;
+
+        block = cbio_calloc(nentries, sizeof(DocInfo) + sizeof(Doc) +
+                            sizeof(DocInfo *) + sizeof(Doc *),
+                            CBIO_ALLOC_BATCH);
+        if (block == NULL) {
+            cbio_index_batch_reset(batch);
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        info = block;
+        docs = (Doc *)(info + nentries);
+        infos = (DocInfo **)(docs + nentries);
+        pdocs = (Doc **)(infos + nentries);
+
+        qsort(entries, nentries, sizeof(*entries),
+              cbio_index_compare_entries);
+        for (size_t ii = 0; ii < nentries; ++ii) {
+            if (ii + 1 < nentries &&
+                cbio_index_compare_ids(&entries[ii].id,
+                                       &entries[ii + 1].id) == 0) {
+                /* Replaced by the next one */
+                continue;
+            }
+            info[nsave].id = entries[ii].id;
+            info[nsave].deleted = entries[ii].deleted;
+            docs[nsave].id = entries[ii].id;
+            infos[nsave] = info + nsave;
+            pdocs[nsave] = docs + nsave;
+            ++nsave;
+        }
+
+        err = couchstore_save_documents(db, pdocs, infos, (unsigned)nsave, 0);
+        cbio_free(block, CBIO_ALLOC_BATCH);
+    }
+
+    for (size_t ii = 0; ii < batch->nreverse && err == COUCHSTORE_SUCCESS;
+         ++ii) {
+        err = couchstore_save_local_document(db, batch->reverse + ii);
+    }
+    cbio_index_batch_reset(batch);
+
+    return err;
+}
+
+/*
+ * Add a tombstone (deleted != 0) or an entry to the batch for each key
+ * in `keys` which isn't in `other`.
+ */
+static cbio_error_t cbio_index_save_entries(struct cbio_index_batch *batch,
+                                            const sized_buf *id,
+                                            const char *keys,
+                                            size_t nkeys,
+                                            const char *other,
+                                            size_t nother,
+                                            int deleted)
+{
+    size_t offset = 0;
+
+    while (offset < nkeys) {
+        size_t len = strlen(keys + offset);
+        if (!cbio_index_has_key(other, nother, keys + offset, len)) {
+            struct cbio_index_entry *entry;
+            char *ptr;
+
+            if (batch->nentries == batch->allocated) {
+                size_t allocated = batch->allocated == 0 ?
+                                   64 : batch->allocated * 2;
+                entry = cbio_realloc(batch->entries,
+                                     allocated * sizeof(*entry),
+                                     CBIO_ALLOC_BATCH);
+                if (entry == NULL) {
+                    return CBIO_ERROR_ENOMEM;
+                }
+                batch->entries = entry;
+                batch->allocated = allocated;
+            }
+
+            ptr = cbio_malloc(len + 1 + id->size, CBIO_ALLOC_BATCH);
+            if (ptr == NULL) {
+                return CBIO_ERROR_ENOMEM;
+            }
+            memcpy(ptr, keys + offset, len + 1);
+            memcpy(ptr + len + 1, id->buf, id->size);
+
+            entry = batch->entries + batch->nentries;
+            entry->id.buf = ptr;
+            entry->id.size = len + 1 + id->size;
+            entry->deleted = deleted;
+            entry->order = batch->nentries++;
+        }
+        offset += len + 1;
+    }
+
+    return CBIO_SUCCESS;
+}
+
+/* Queue the new list of keys for a document (the batch takes over the
+   buffers) */
+static cbio_error_t cbio_index_save_reverse(struct cbio_index_batch *batch,
+                                            char *rid,
+                                            size_t nrid,
+                                            char *keys,
+                                            size_t nkeys)
+{
+    LocalDoc *ldoc;
+
+    if (batch->nreverse == batch->rallocated) {
+        size_t allocated = batch->rallocated == 0 ?
+                           64 : batch->rallocated * 2;
+        ldoc = cbio_realloc(batch->reverse, allocated * sizeof(*ldoc),
+                            CBIO_ALLOC_BATCH);
+        if (ldoc == NULL) {
+            return CBIO_ERROR_ENOMEM;
+        }
+        batch->reverse = ldoc;
+        batch->rallocated = allocated;
+    }
+
+    ldoc = batch->reverse + batch->nreverse++;
+    ldoc->id.buf = rid;
+    ldoc->id.size = nrid;
+    ldoc->json.buf = keys;
+    ldoc->json.size = nkeys;
+    ldoc->deleted = nkeys == 0 ? 1 : 0;
+
+    return CBIO_SUCCESS;
+}
+
+static cbio_error_t cbio_index_update_one(libcbio_t handle,
+                                          struct cbio_index_batch *batch,
+                                          DocInfo *info,
+                                          Doc *doc)
+{
+    struct cbio_index_st *idx = handle->secondary;
+    struct cbio_index_keys keys;
+    couchstore_error_t err;
+    LocalDoc *old = NULL;
+    size_t nrid;
+    char *rid;
+    sized_buf prev = { NULL, 0 };
+
+    if ((rid = cbio_index_reverse_id(&info->id, &nrid)) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    err = couchstore_open_local_document(idx->db, rid, nrid, &old);
+    if (err == COUCHSTORE_SUCCESS) {
+        if (!old->deleted) {
+            prev = old->json;
+        }
+    } else if (err != COUCHSTORE_ERROR_DOC_NOT_FOUND) {
+        cbio_free(rid, CBIO_ALLOC_BATCH);
+        return cbio_remap_error(err);
+    }
+
+    memset(&keys, 0, sizeof(keys));
+    if (!info->deleted && doc != NULL) {
+        struct libcbio_document_st document;
+        memset(&document, 0, sizeof(document));
+        document.doc = doc;
+        document.info = info;
+        idx->extract(handle, &document, cbio_index_emit, &keys, idx->cookie);
+    }
+
+    if (keys.err == CBIO_SUCCESS) {
+        keys.err = cbio_index_save_entries(batch, &info->id,
+                                           prev.buf, prev.size,
+                                           keys.data, keys.size, 1);
+    }
+    if (keys.err == CBIO_SUCCESS) {
+        keys.err = cbio_index_save_entries(batch, &info->id,
+                                           keys.data, keys.size,
+                                           prev.buf, prev.size, 0);
+    }
+    if (keys.err == CBIO_SUCCESS &&
+        (prev.size != keys.size ||
+         (keys.size > 0 && memcmp(prev.buf, keys.data, keys.size) != 0))) {
+        keys.err = cbio_index_save_reverse(batch, rid, nrid,
+                                           keys.data, keys.size);
+        if (keys.err == CBIO_SUCCESS) {
+            rid = keys.data = NULL;
+        }
+    }
+
+    if (old != NULL) {
+        couchstore_free_local_document(old);
+    }
+    cbio_free(keys.data, CBIO_ALLOC_BATCH);
+    cbio_free(rid, CBIO_ALLOC_BATCH);
+
+    return keys.err;
+}
+
+struct cbio_index_order {
+    const sized_buf *id;
+    size_t index;
+};
+
+static int cbio_index_compare_order(const void *a, const void *b)
+{
+    const struct cbio_index_order *oa = a;
+    const struct cbio_index_order *ob = b;
+    int ret = cbio_index_compare_ids(oa->id, ob->id);
+    if (ret == 0) {
+        ret = oa->index < ob->index ? -1 : 1;
+    }
+    return ret;
+}
+
+/*
+ * A document has to see the keys of the ones before it with the same
+ * id, so the batch must be written before it. Set *repeat to flags for
+ * the documents where that is the case (or NULL if there are none).
+ */
+static cbio_error_t cbio_index_find_repeats(DocInfo **info,
+                                            size_t ndocs,
+                                            unsigned char **repeat)
+{
+    struct cbio_index_order *order;
+    cbio_error_t ret = CBIO_SUCCESS;
+
+    *repeat = NULL;
+    if (ndocs < 2) {
+        return CBIO_SUCCESS;
+    }
+
+    order = cbio_malloc(ndocs * sizeof(*order), CBIO_ALLOC_BATCH);
+    if (order == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+    for (size_t ii = 0; ii < ndocs; ++ii) {
+        order[ii].id = &info[ii]->id;
+        order[ii].index = ii;
+    }
+    qsort(order, ndocs, sizeof(*order), cbio_index_compare_order);
+
+    for (size_t ii = 1; ii < ndocs && ret == CBIO_SUCCESS; ++ii) {
+        if (cbio_index_compare_ids(order[ii - 1].id, order[ii].id) == 0) {
+            if (*repeat == NULL &&
+                (*repeat = cbio_calloc(ndocs, 1, CBIO_ALLOC_BATCH)) == NULL) {
+                ret = CBIO_ERROR_ENOMEM;
+            } else {
+                (*repeat)[order[ii].index] = 1;
+            }
+        }
+    }
+    cbio_free(order, CBIO_ALLOC_BATCH);
+
+    return ret;
+}
+
+cbio_error_t cbio_index_update(libcbio_t handle,
+                               DocInfo **info,
+                               Doc **docs,
+                               size_t ndocs)
+{
+    struct cbio_index_st *idx = handle->secondary;
+    struct cbio_index_batch batch;
+    unsigned char *repeat;
+    cbio_error_t ret;
+
+    if (idx == NULL) {
+        return CBIO_SUCCESS;
+    }
+
+    memset(&batch, 0, sizeof(batch));
+    ret = cbio_index_find_repeats(info, ndocs, &repeat);
+    for (size_t ii = 0; ii < ndocs && ret == CBIO_SUCCESS; ++ii) {
+        if (repeat != NULL && repeat[ii]) {
+            ret = cbio_remap_error(cbio_index_batch_flush(idx->db, &batch));
+        }
+        if (ret == CBIO_SUCCESS) {
+            ret = cbio_index_update_one(handle, &batch, info[ii], docs[ii]);
+        }
+    }
+
+    /* If we failed, nothing more is written, and the next commit
+       indexes the documents again from the old lists of keys */
+    if (ret == CBIO_SUCCESS) {
+        ret = cbio_remap_error(cbio_index_batch_flush(idx->db, &batch));
+    }
+    cbio_index_batch_destroy(&batch);
+    cbio_free(repeat, CBIO_ALLOC_BATCH);
+
+    if (ret != CBIO_SUCCESS) {
+        idx->failed = 1;
+    }
+
+    return ret;
+}
+
+void cbio_index_destroy(libcbio_t handle)
+{
+    if (handle->secondary != NULL) {
+        couchstore_close_db(handle->secondary->db);
+        cbio_free(handle->secondary, CBIO_ALLOC_HANDLE);
+        handle->secondary = NULL;
+    }
+}
+
+static uint64_t cbio_index_get_seqno(Db *db)
+{
+    uint64_t ret = 0;
+    LocalDoc *ldoc;
+
+    if (couchstore_open_local_document(db, CBIO_INDEX_SEQNO_DOCUMENT,
+                                       sizeof(CBIO_INDEX_SEQNO_DOCUMENT) - 1,
+                                       &ldoc) == COUCHSTORE_SUCCESS) {
+        char json[64];
+        char *ptr;
+
+        if (!ldoc->deleted && ldoc->json.size < sizeof(json)) {
+            memcpy(json, ldoc->json.buf, ldoc->json.size);
+            json[ldoc->json.size] = '\0';
+            if ((ptr = strstr(json, "\"seqno\":")) != NULL) {
+                ret = strtoull(ptr + strlen("\"seqno\":"), NULL, 10);
+            }
+        }
+        couchstore_free_local_document(ldoc);
+    }
+
+    return ret;
+}
+
+struct cbio_index_catchup_ctx {
+    libcbio_t handle;
+    struct cbio_index_batch batch;
+    cbio_error_t err;
+};
+
+static int cbio_index_catchup_callback(Db *db, DocInfo *docinfo, void *arg)
+{
+    struct cbio_index_catchup_ctx *ctx = arg;
+    couchstore_error_t err = COUCHSTORE_SUCCESS;
+    Doc *doc = NULL;
+
+    if (!docinfo->deleted) {
+        err = couchstore_open_doc_with_docinfo(db, docinfo, &doc, 0);
+    }
+
+    if (err == COUCHSTORE_SUCCESS) {
+        ctx->err = cbio_index_update_one(ctx->handle, &ctx->batch,
+                                         docinfo, doc);
+        couchstore_free_document(doc);
+        if (ctx->err == CBIO_SUCCESS &&
+            ctx->batch.nentries + ctx->batch.nreverse >= CBIO_INDEX_BATCH) {
+            err = cbio_index_batch_flush(ctx->handle->secondary->db,
+                                         &ctx->batch);
+            ctx->err = cbio_remap_error(err);
+        }
+    } else {
+        ctx->err = cbio_remap_error(err);
+    }
+
+    if (ctx->err != CBIO_SUCCESS) {
+        /* couchstore only releases the docinfo if we return 0 */
+        couchstore_free_docinfo(docinfo);
+        return COUCHSTORE_ERROR_CANCEL;
+    }
+
+    return 0;
+}
+
+/*
+ * Index the changes in the main file since the sequence number the
+ * index file records
+ */
+static cbio_error_t cbio_index_catchup(libcbio_t handle)
+{
+    struct cbio_index_st *idx = handle->secondary;
+    struct cbio_index_catchup_ctx ctx;
+    couchstore_error_t err;
+    uint64_t seqno = cbio_index_get_seqno(idx->db);
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.handle = handle;
+    ctx.err = CBIO_SUCCESS;
+    err = couchstore_changes_since(handle->couchstore_handle, seqno + 1,
+                                   0, cbio_index_catchup_callback, &ctx);
+    if (ctx.err == CBIO_SUCCESS && err == COUCHSTORE_SUCCESS) {
+        err = cbio_index_batch_flush(idx->db, &ctx.batch);
+    }
+    cbio_index_batch_destroy(&ctx.batch);
+
+    return ctx.err != CBIO_SUCCESS ? ctx.err : cbio_remap_error(err);
+}
+
+cbio_error_t cbio_index_commit(libcbio_t handle)
+{
+    struct cbio_index_st *idx = handle->secondary;
+    couchstore_error_t err;
+
+    if (idx == NULL) {
+        return CBIO_SUCCESS;
+    }
+
+    /* Index what we missed again (updating the index is idempotent) */
+    if (idx->failed && cbio_index_catchup(handle) == CBIO_SUCCESS) {
+        idx->failed = 0;
+    }
+
+    if (!idx->failed) {
+        DbInfo info;
+        LocalDoc ldoc;
+        char json[64];
+        int len;
+
+        err = couchstore_db_info(handle->couchstore_handle, &info);
+        if (err != COUCHSTORE_SUCCESS) {
+            return cbio_remap_error(err);
+        }
+
+        len = snprintf(json, sizeof(json), "{\"seqno\":%" PRIu64 "}",
+                       info.last_sequence);
+        ldoc.id.buf = (char *)CBIO_INDEX_SEQNO_DOCUMENT;
+        ldoc.id.size = sizeof(CBIO_INDEX_SEQNO_DOCUMENT) - 1;
+        ldoc.json.buf = json;
+        ldoc.json.size = (size_t)len;
+        ldoc.deleted = 0;
+        err = couchstore_save_local_document(idx->db, &ldoc);
+        if (err != COUCHSTORE_SUCCESS) {
+            return cbio_remap_error(err);
+        }
+    }
+
+    return cbio_remap_error(couchstore_commit(idx->db));
+}
+
+LIBCBIO_API
+cbio_error_t cbio_open_index(libcbio_t handle,
+                             const char *filename,
+                             cbio_index_extract_fn extract,
+                             void *cookie)
+{
+    struct cbio_index_st *idx;
+    couchstore_error_t err;
+    int rdonly = handle->mode == CBIO_OPEN_RDONLY;
+
+    if (handle->secondary != NULL || handle->shared != NULL ||
+        filename == NULL || (!rdonly && extract == NULL)) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if ((idx = cbio_calloc(1, sizeof(*idx), CBIO_ALLOC_HANDLE)) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+    idx->extract = extract;
+    idx->cookie = cookie;
+
+    err = couchstore_open_db(filename,
+                             rdonly ? COUCHSTORE_OPEN_FLAG_RDONLY :
+                             COUCHSTORE_OPEN_FLAG_CREATE, &idx->db);
+    if (err != COUCHSTORE_SUCCESS) {
+        cbio_free(idx, CBIO_ALLOC_HANDLE);
+        return cbio_remap_error(err);
+    }
+    handle->secondary = idx;
+
+    if (!rdonly) {
+        /* Documents still in the write buffer are indexed when they
+           are flushed */
+        cbio_error_t ret = cbio_index_catchup(handle);
+        if (ret != CBIO_SUCCESS) {
+            cbio_index_destroy(handle);
+            return ret;
+        }
+    }
+
+    return CBIO_SUCCESS;
+}
+
+struct cbio_index_query_ctx {
+    libcbio_t handle;
+    const void *end;
+    size_t nend;
+    cbio_index_callback_fn callback;
+    void *ctx;
+};
+
+static int cbio_index_query_callback(Db *db, DocInfo *docinfo, void *arg)
+{
+    struct cbio_index_query_ctx *ctx = arg;
+    const char *key = docinfo->id.buf;
+    const char *sep = memchr(key, '\0', docinfo->id.size);
+    size_t nkey;
+    (void)db;
+
+    if (sep == NULL) {
+        /* Not written by us */
+        return 0;
+    }
+    nkey = (size_t)(sep - key);
+
+    if (ctx->end != NULL) {
+        size_t size = nkey < ctx->nend ? nkey : ctx->nend;
+        int cmp = memcmp(key, ctx->end, size);
+        if (cmp > 0 || (cmp == 0 && nkey > ctx->nend)) {
+            couchstore_free_docinfo(docinfo);
+            return COUCHSTORE_ERROR_CANCEL;
+        }
+    }
+
+    if (ctx->callback(ctx->handle, key, nkey, sep + 1,
+                      docinfo->id.size - nkey - 1, ctx->ctx) != 0) {
+        couchstore_free_docinfo(docinfo);
+        return COUCHSTORE_ERROR_CANCEL;
+    }
+
+    return 0;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_index_query(libcbio_t handle,
+                              const void *start,
+                              size_t nstart,
+                              const void *end,
+                              size_t nend,
+                              cbio_index_callback_fn callback,
+                              void *ctx)
+{
+    struct cbio_index_query_ctx qctx;
+    couchstore_error_t err;
+    sized_buf startkey;
+
+    if (handle->secondary == NULL || callback == NULL) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    qctx.handle = handle;
+    qctx.end = end;
+    qctx.nend = nend;
+    qctx.callback = callback;
+    qctx.ctx = ctx;
+
+    startkey.buf = (char *)start;
+    startkey.size = start != NULL ? nstart : 0;
+    err = couchstore_all_docs(handle->secondary->db, &startkey,
+                              COUCHSTORE_NO_DELETES,
+                              cbio_index_query_callback, &qctx);
+    if (err == COUCHSTORE_ERROR_CANCEL) {
+        err = COUCHSTORE_SUCCESS;
+    }
+
+    return cbio_remap_error(err);
+}
@@ -16,8 +16,10 @@
  */
 #include "internal.h"
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 static int cbio_is_local_id(const void *data, size_t nb)
 {
@@ -29,6 +31,24 @@ static int cbio_is_local_document(DocInfo *info)
     return cbio_is_local_id(info->id.buf, info->id.size);
 }
 
+static int cbio_is_rdonly(libcbio_t handle)
+{
+    return (handle->mode == CBIO_OPEN_RDONLY ||
+            handle->mode == CBIO_OPEN_SHARED_RDONLY) ? 1 : 0;
+}
+
+static void cbio_snapshot_file(libcbio_t handle)
+{
+    struct stat st;
+    if (stat(handle->name, &st) == 0) {
+        handle->file.dev = st.st_dev;
+        handle->file.ino = st.st_ino;
+        handle->file.size = st.st_size;
+    } else {
+        memset(&handle->file, 0, sizeof(handle->file));
+    }
+}
+
 LIBCBIO_API
 cbio_error_t cbio_open_handle(const char *name,
                               libcbio_open_mode_t mode,
@@ -38,13 +58,21 @@ cbio_error_t cbio_open_handle(const char *name,
     uint64_t flags;
     libcbio_t ret;
 
-    ret = calloc(1, sizeof(*ret));
+    ret = cbio_calloc(1, sizeof(*ret), CBIO_ALLOC_HANDLE);
     if (ret == NULL) {
         return CBIO_ERROR_ENOMEM;
     }
 
     ret->mode = mode;
-    if (mode == CBIO_OPEN_RDONLY) {
+    cbio_async_options_init(&ret->async_options);
+    if ((ret->name = cbio_malloc(strlen(name) + 1,
+                                 CBIO_ALLOC_HANDLE)) == NULL) {
+        cbio_free(ret, CBIO_ALLOC_HANDLE);
+        return CBIO_ERROR_ENOMEM;
+    }
+    strcpy(ret->name, name);
+
+    if (cbio_is_rdonly(ret)) {
         flags = COUCHSTORE_OPEN_FLAG_RDONLY;
     } else if (CBIO_OPEN_CREATE) {
         flags = COUCHSTORE_OPEN_FLAG_CREATE;
@@ -52,12 +80,27 @@ cbio_error_t cbio_open_handle(const char *name,
         flags = 0;
     }
 
-    err = couchstore_open_db(name, flags, &ret->couchstore_handle);
+    err = cbio_open_db(name, flags, &ret->couchstore_handle,
+                       &ret->exclusive.file);
     if (err != COUCHSTORE_SUCCESS) {
-        free(ret);
+        cbio_free(ret->name, CBIO_ALLOC_HANDLE);
+        cbio_free(ret, CBIO_ALLOC_HANDLE);
         return cbio_remap_error(err);
     }
 
+    if (mode == CBIO_OPEN_SHARED_RDONLY) {
+        cbio_error_t e = cbio_shared_create(ret, ret->couchstore_handle);
+        if (e != CBIO_SUCCESS) {
+            cbio_close_db(ret->couchstore_handle, &ret->exclusive.file);
+            cbio_free(ret->name, CBIO_ALLOC_HANDLE);
+            cbio_free(ret, CBIO_ALLOC_HANDLE);
+            return e;
+        }
+        /* The handle is owned by the pool now */
+        ret->couchstore_handle = NULL;
+    }
+
+    cbio_snapshot_file(ret);
     *handle = ret;
     return CBIO_SUCCESS;
 }
@@ -65,18 +108,100 @@ cbio_error_t cbio_open_handle(const char *name,
 LIBCBIO_API
 void cbio_close_handle(libcbio_t handle)
 {
-    if (handle->mode != CBIO_OPEN_RDONLY) {
+    if (!cbio_is_rdonly(handle)) {
         (void)cbio_commit(handle);
     }
 
-    couchstore_close_db(handle->couchstore_handle);
-    free(handle);
+    cbio_async_destroy(handle);
+    (void)cbio_access_log_destroy(handle);
+    cbio_buffer_destroy(handle);
+    cbio_index_destroy(handle);
+    if (handle->shared != NULL) {
+        cbio_shared_destroy(handle);
+    } else {
+        cbio_close_db(handle->couchstore_handle, &handle->exclusive.file);
+    }
+    cbio_free(handle->name, CBIO_ALLOC_HANDLE);
+    cbio_free(handle, CBIO_ALLOC_HANDLE);
+}
+
+static uint64_t cbio_current_header(libcbio_t handle)
+{
+    if (handle->shared != NULL) {
+        return __sync_fetch_and_add(&handle->shared->header_position, 0);
+    }
+    return couchstore_get_header_position(handle->couchstore_handle);
+}
+
+static cbio_error_t cbio_do_refresh(libcbio_t handle)
+{
+    struct cbio_file_id file;
+    struct stat st;
+    couchstore_error_t err;
+    Db *db;
+
+    if (stat(handle->name, &st) == -1) {
+        return CBIO_ERROR_ENOENT;
+    }
+
+    /* The file is append-only, so if it didn't grow (and wasn't
+       replaced by compaction) there can't be a newer header */
+    if (st.st_dev == handle->file.dev && st.st_ino == handle->file.ino &&
+        st.st_size == handle->file.size) {
+        return CBIO_SUCCESS;
+    }
+
+    err = cbio_open_db(handle->name, COUCHSTORE_OPEN_FLAG_RDONLY, &db, &file);
+    if (err != COUCHSTORE_SUCCESS) {
+        return cbio_remap_error(err);
+    }
+
+    if (couchstore_get_header_position(db) == cbio_current_header(handle) &&
+        st.st_ino == handle->file.ino && st.st_dev == handle->file.dev) {
+        /* Someone is in the middle of writing a batch, but haven't
+           committed yet. Keep the handle we've got. */
+        cbio_close_db(db, &file);
+    } else if (handle->shared != NULL) {
+        cbio_shared_publish(handle, db, &file);
+    } else {
+        cbio_close_db(handle->couchstore_handle, &handle->exclusive.file);
+        handle->couchstore_handle = db;
+        handle->exclusive.file = file;
+    }
+
+    handle->file.dev = st.st_dev;
+    handle->file.ino = st.st_ino;
+    handle->file.size = st.st_size;
+
+    return CBIO_SUCCESS;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_refresh_handle(libcbio_t handle)
+{
+    cbio_error_t ret;
+
+    if (handle->mode == CBIO_OPEN_RDONLY) {
+        return cbio_do_refresh(handle);
+    }
+
+    if (handle->mode != CBIO_OPEN_SHARED_RDONLY) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    /* If another thread is already moving the handle forward we wait
+       for it, so that a header it hasn't published yet isn't missed */
+    pthread_mutex_lock(&handle->shared->mutex);
+    ret = cbio_do_refresh(handle);
+    pthread_mutex_unlock(&handle->shared->mutex);
+
+    return ret;
 }
 
 LIBCBIO_API
 off_t cbio_get_header_position(libcbio_t handle)
 {
-    return (off_t)couchstore_get_header_position(handle->couchstore_handle);
+    return (off_t)cbio_current_header(handle);
 }
 
 static cbio_error_t cbio_ldoc2doc(libcbio_t handle, const LocalDoc *ldoc, libcbio_document_t *doc)
@@ -94,6 +219,7 @@ static cbio_error_t cbio_ldoc2doc(libcbio_t handle, const LocalDoc *ldoc, libcbi
 }
 
 static cbio_error_t cbio_get_local_document(libcbio_t handle,
+                                            Db *db,
                                             const void *id,
                                             size_t nid,
                                             libcbio_document_t *doc)
@@ -101,8 +227,7 @@ static cbio_error_t cbio_get_local_document(libcbio_t handle,
     couchstore_error_t err;
     LocalDoc *ldoc;
 
-    err = couchstore_open_local_document(handle->couchstore_handle, id,
-                                         nid, &ldoc);
+    err = couchstore_open_local_document(db, id, nid, &ldoc);
     if (err == COUCHSTORE_SUCCESS) {
         cbio_error_t ret;
         if (ldoc->deleted) {
@@ -117,44 +242,225 @@ static cbio_error_t cbio_get_local_document(libcbio_t handle,
     return cbio_remap_error(err);
 }
 
+/*
+ * Look up the DocInfo for id, through the lookup cache if the handle
+ * may use it. *cached tells if info must be released with cbio_free()
+ * rather than couchstore_free_docinfo()
+ */
+static cbio_error_t cbio_docinfo_by_id(struct cbio_db_ref *ref,
+                                       const void *id,
+                                       size_t nid,
+                                       DocInfo **info,
+                                       int *cached)
+{
+    couchstore_error_t err;
+    cbio_error_t ret;
+
+    if ((*cached = cbio_cache_lookup(ref, id, nid, &ret, info)) != 0) {
+        return ret;
+    }
+
+    err = couchstore_docinfo_by_id(ref->db, id, nid, info);
+    cbio_cache_store(ref, id, nid, err, *info);
+    return cbio_remap_error(err);
+}
+
+static void cbio_free_docinfo(DocInfo *info, int cached)
+{
+    if (cached) {
+        cbio_free(info, CBIO_ALLOC_DOCINFO);
+    } else {
+        couchstore_free_docinfo(info);
+    }
+}
+
+static cbio_error_t cbio_lookup_document(struct cbio_db_ref *ref,
+                                         const void *id,
+                                         size_t nid,
+                                         libcbio_document_t *doc)
+{
+    libcbio_document_t ret;
+    couchstore_error_t err;
+    cbio_error_t e;
+    DocInfo *info;
+    int cached;
+
+    e = cbio_docinfo_by_id(ref, id, nid, &info, &cached);
+    if (e != CBIO_SUCCESS) {
+        return e;
+    }
+
+    if (info->deleted) {
+        cbio_free_docinfo(info, cached);
+        return CBIO_ERROR_ENOENT;
+    }
+
+    if ((ret = cbio_calloc(1, sizeof(*ret), CBIO_ALLOC_DOCUMENT)) == NULL) {
+        cbio_free_docinfo(info, cached);
+        return CBIO_ERROR_ENOMEM;
+    }
+    ret->info = info;
+    ret->own_info = cached;
+
+    err = couchstore_open_doc_with_docinfo(ref->db, ret->info, &ret->doc, 0);
+    if (err != COUCHSTORE_SUCCESS) {
+        cbio_document_release(ret);
+        return cbio_remap_error(err);
+    }
+
+    *doc = ret;
+    return CBIO_SUCCESS;
+}
+
+static cbio_error_t cbio_do_get_document(libcbio_t handle,
+                                         const void *id,
+                                         size_t nid,
+                                         libcbio_document_t *doc)
+{
+    struct cbio_db_ref *ref;
+    cbio_error_t ret;
+
+    if (cbio_buffer_lookup(handle, id, nid, &ret, doc)) {
+        return ret;
+    }
+
+    if ((ret = cbio_acquire_db(handle, &ref)) != CBIO_SUCCESS) {
+        return ret;
+    }
+
+    if (cbio_is_local_id(id, nid)) {
+        ret = cbio_get_local_document(handle, ref->db, id, nid, doc);
+    } else {
+        ret = cbio_lookup_document(ref, id, nid, doc);
+        if (ret == CBIO_SUCCESS && handle->access_log != NULL) {
+            cbio_access_log_record(handle, id, nid);
+        }
+    }
+
+    cbio_release_db(handle, ref);
+    return ret;
+}
+
+static uint64_t cbio_value_size(libcbio_document_t doc)
+{
+    return doc->doc != NULL ? doc->doc->data.size : 0;
+}
+
 LIBCBIO_API
 cbio_error_t cbio_get_document(libcbio_t handle,
                                const void *id,
                                size_t nid,
                                libcbio_document_t *doc)
 {
-    if (cbio_is_local_id(id, nid)) {
-        return cbio_get_local_document(handle, id, nid, doc);
-    }
+    cbio_error_t ret;
+
+    CBIO_TRACE_ENTRY(get_document, CBIO_TRACE_GET_DOCUMENT,
+                     handle, 1, nid, 0);
+    ret = cbio_do_get_document(handle, id, nid, doc);
+    CBIO_TRACE_RETURN(get_document, CBIO_TRACE_GET_DOCUMENT, handle, 1, nid,
+                      ret == CBIO_SUCCESS ? cbio_value_size(*doc) : 0, ret);
+
+    return ret;
+}
 
-    libcbio_document_t ret = calloc(1, sizeof(*ret));
+static cbio_error_t cbio_do_get_document_into(libcbio_t handle,
+                                              const void *id,
+                                              size_t nid,
+                                              libcbio_document_t doc)
+{
+    struct cbio_db_ref *ref;
+    libcbio_document_t tmp;
     couchstore_error_t err;
+    cbio_error_t ret;
+    DocInfo *info;
+    Doc *body;
+    int cached;
+    int copy;
 
-    if (ret == NULL) {
-        return CBIO_ERROR_ENOMEM;
+    if (doc == NULL) {
+        return CBIO_ERROR_EINVAL;
     }
+    cbio_document_reinitialize(doc);
 
+    /* Buffered and local documents are rare enough to not bother
+       avoiding the extra copy */
+    copy = cbio_buffer_lookup(handle, id, nid, &ret, &tmp);
+    if (!copy && cbio_is_local_id(id, nid)) {
+        ret = cbio_do_get_document(handle, id, nid, &tmp);
+        copy = 1;
+    }
+    if (copy) {
+        if (ret == CBIO_SUCCESS) {
+            ret = cbio_document_fill(doc, tmp->info, tmp->doc);
+            cbio_document_release(tmp);
+        }
+        return ret;
+    }
 
-    err = couchstore_docinfo_by_id(handle->couchstore_handle, id,
-                                   nid, &ret->info);
-    if (err != COUCHSTORE_SUCCESS) {
-        cbio_document_release(ret);
-        return cbio_remap_error(err);
+    if ((ret = cbio_acquire_db(handle, &ref)) != CBIO_SUCCESS) {
+        return ret;
     }
 
-    err = couchstore_open_doc_with_docinfo(handle->couchstore_handle,
-                                           ret->info,
-                                           &ret->doc, 0);
-    if (err != COUCHSTORE_SUCCESS || ret->info->deleted) {
-        cbio_document_release(ret);
-        if (err == COUCHSTORE_SUCCESS) {
-            return CBIO_ERROR_ENOENT;
+    /* These are released as soon as they are copied into doc */
+    ret = cbio_docinfo_by_id(ref, id, nid, &info, &cached);
+    if (ret == CBIO_SUCCESS) {
+        if (info->deleted) {
+            ret = CBIO_ERROR_ENOENT;
+        } else {
+            err = couchstore_open_doc_with_docinfo(ref->db, info, &body, 0);
+            if (err == COUCHSTORE_SUCCESS) {
+                ret = cbio_document_fill(doc, info, body);
+                couchstore_free_document(body);
+                if (ret == CBIO_SUCCESS && handle->access_log != NULL) {
+                    cbio_access_log_record(handle, id, nid);
+                }
+            } else {
+                ret = cbio_remap_error(err);
+            }
         }
-        return cbio_remap_error(err);
+        cbio_free_docinfo(info, cached);
     }
+    cbio_release_db(handle, ref);
 
-    *doc = ret;
-    return CBIO_SUCCESS;
+    return ret;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_get_document_into(libcbio_t handle,
+                                    const void *id,
+                                    size_t nid,
+                                    libcbio_document_t doc)
+{
+    cbio_error_t ret;
+
+    CBIO_TRACE_ENTRY(get_document, CBIO_TRACE_GET_DOCUMENT,
+                     handle, 1, nid, 0);
+    ret = cbio_do_get_document_into(handle, id, nid, doc);
+    CBIO_TRACE_RETURN(get_document, CBIO_TRACE_GET_DOCUMENT, handle, 1, nid,
+                      ret == CBIO_SUCCESS ? cbio_value_size(doc) : 0, ret);
+
+    return ret;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_get_document_projected(libcbio_t handle,
+                                         const void *id,
+                                         size_t nid,
+                                         const char *const *paths,
+                                         size_t npaths,
+                                         libcbio_document_t *doc)
+{
+    cbio_error_t ret;
+
+    if ((ret = cbio_get_document(handle, id, nid, doc)) != CBIO_SUCCESS) {
+        return ret;
+    }
+
+    if ((ret = cbio_document_project(*doc, paths, npaths)) != CBIO_SUCCESS) {
+        cbio_document_release(*doc);
+    }
+
+    return ret;
 }
 
 LIBCBIO_API
@@ -184,8 +490,30 @@ static cbio_error_t cbio_store_local_documents(libcbio_t handle,
     return CBIO_SUCCESS;
 }
 
+static void cbio_classify_documents(DocInfo **info, Doc **docs, size_t ndocs)
+{
+    for (size_t ii = 0; ii < ndocs; ++ii) {
+        /* We can't look inside compressed bodies */
+        if (!info[ii]->deleted && docs[ii] != NULL &&
+            (info[ii]->content_meta & CBIO_DOC_IS_COMPRESSED) == 0) {
+            info[ii]->content_meta = cbio_json_classify(docs[ii]->data.buf,
+                                                        docs[ii]->data.size);
+        }
+    }
+}
+
 LIBCBIO_API
-cbio_error_t cbio_store_documents(libcbio_t handle,
+cbio_error_t cbio_set_json_mode(libcbio_t handle, int enable)
+{
+    if (cbio_is_rdonly(handle)) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    handle->json_mode = enable ? 1 : 0;
+    return CBIO_SUCCESS;
+}
+
+cbio_error_t cbio_write_documents(libcbio_t handle,
                                   libcbio_document_t *doc,
                                   size_t ndocs)
 {
@@ -193,8 +521,43 @@ cbio_error_t cbio_store_documents(libcbio_t handle,
     DocInfo **info;
     size_t ii;
     couchstore_error_t err;
+    cbio_error_t ret;
 
-    if (handle->mode == CBIO_OPEN_RDONLY || ndocs == 0) {
+    docs = cbio_calloc(ndocs, sizeof(Doc *), CBIO_ALLOC_BATCH);
+    info = cbio_calloc(ndocs, sizeof(DocInfo *), CBIO_ALLOC_BATCH);
+    if (docs == NULL || info == NULL) {
+        cbio_free(docs, CBIO_ALLOC_BATCH);
+        cbio_free(info, CBIO_ALLOC_BATCH);
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    for (ii = 0; ii < ndocs; ++ii) {
+        docs[ii] = doc[ii]->doc;
+        info[ii] = doc[ii]->info;
+    }
+
+    if (handle->json_mode) {
+        cbio_classify_documents(info, docs, ndocs);
+    }
+
+    err = couchstore_save_documents(handle->couchstore_handle, docs, info,
+                                    ndocs, 0);
+    if (err == COUCHSTORE_SUCCESS) {
+        ret = cbio_index_update(handle, info, docs, ndocs);
+    } else {
+        ret = cbio_remap_error(err);
+    }
+    cbio_free(docs, CBIO_ALLOC_BATCH);
+    cbio_free(info, CBIO_ALLOC_BATCH);
+
+    return ret;
+}
+
+static cbio_error_t cbio_do_store_documents(libcbio_t handle,
+                                            libcbio_document_t *doc,
+                                            size_t ndocs)
+{
+    if (cbio_is_rdonly(handle) || ndocs == 0) {
         return CBIO_ERROR_EINVAL;
     }
 
@@ -202,75 +565,523 @@ cbio_error_t cbio_store_documents(libcbio_t handle,
         return cbio_store_local_documents(handle, doc, ndocs);
     }
 
-    docs = calloc(ndocs, sizeof(Doc *));
-    info = calloc(ndocs, sizeof(DocInfo *));
-    if (docs == NULL || info == NULL) {
-        free(docs);
-        free(info);
+    if (handle->buffer != NULL) {
+        return cbio_buffer_store(handle, doc, ndocs);
+    }
+
+    return cbio_write_documents(handle, doc, ndocs);
+}
+
+LIBCBIO_API
+cbio_error_t cbio_store_documents(libcbio_t handle,
+                                  libcbio_document_t *doc,
+                                  size_t ndocs)
+{
+    uint64_t nkey = 0;
+    uint64_t nbytes = 0;
+    cbio_error_t ret;
+
+    if (CBIO_TRACING(store_documents)) {
+        for (size_t ii = 0; ii < ndocs; ++ii) {
+            if (doc[ii]->info != NULL) {
+                nkey += doc[ii]->info->id.size;
+            }
+            nbytes += cbio_value_size(doc[ii]);
+        }
+    }
+
+    CBIO_TRACE_ENTRY(store_documents, CBIO_TRACE_STORE_DOCUMENTS,
+                     handle, ndocs, nkey, nbytes);
+    ret = cbio_do_store_documents(handle, doc, ndocs);
+    CBIO_TRACE_RETURN(store_documents, CBIO_TRACE_STORE_DOCUMENTS,
+                      handle, ndocs, nkey, nbytes, ret);
+
+    return ret;
+}
+
+struct cbio_cas_key {
+    sized_buf id;
+    size_t index;
+};
+
+struct cbio_cas_state {
+    int found;
+    int deleted;
+    /* The id is earlier in the batch as well */
+    int duplicate;
+    uint64_t revision;
+};
+
+struct cbio_cas_ctx {
+    struct cbio_cas_key *keys;
+    struct cbio_cas_state *state;
+    size_t nkeys;
+    size_t cursor;
+};
+
+/* Same ordering as couchstore use for the by-id tree */
+static int cbio_compare_ids(const sized_buf *a, const sized_buf *b)
+{
+    size_t size = a->size < b->size ? a->size : b->size;
+    int ret = memcmp(a->buf, b->buf, size);
+    if (ret == 0) {
+        if (a->size < b->size) {
+            ret = -1;
+        } else if (a->size > b->size) {
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+/* Equal ids are ordered by their position in the batch */
+static int cbio_compare_cas_keys(const void *a, const void *b)
+{
+    const struct cbio_cas_key *ka = a;
+    const struct cbio_cas_key *kb = b;
+    int ret = cbio_compare_ids(&ka->id, &kb->id);
+    if (ret == 0) {
+        ret = ka->index < kb->index ? -1 : 1;
+    }
+    return ret;
+}
+
+static int cbio_cas_callback(Db *db, DocInfo *docinfo, void *arg)
+{
+    struct cbio_cas_ctx *ctx = arg;
+    (void)db;
+
+    while (ctx->cursor < ctx->nkeys &&
+           cbio_compare_ids(&ctx->keys[ctx->cursor].id, &docinfo->id) < 0) {
+        ++ctx->cursor;
+    }
+
+    /* The same id may be in the batch multiple times */
+    for (size_t ii = ctx->cursor; ii < ctx->nkeys &&
+         cbio_compare_ids(&ctx->keys[ii].id, &docinfo->id) == 0; ++ii) {
+        struct cbio_cas_state *state = ctx->state + ctx->keys[ii].index;
+        state->found = 1;
+        state->deleted = docinfo->deleted;
+        state->revision = docinfo->rev_seq;
+    }
+
+    return 0;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_store_documents_conditional(libcbio_t handle,
+                                              libcbio_document_t *doc,
+                                              const uint64_t *expected,
+                                              cbio_error_t *result,
+                                              size_t ndocs)
+{
+    struct cbio_cas_ctx ctx;
+    sized_buf *ids;
+    Doc **docs;
+    DocInfo **info;
+    size_t nstore = 0;
+    couchstore_error_t err;
+    cbio_error_t ret = CBIO_SUCCESS;
+    void *block;
+
+    if (cbio_is_rdonly(handle) || ndocs == 0) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    for (size_t ii = 0; ii < ndocs; ++ii) {
+        if (doc[ii]->info == NULL || cbio_is_local_document(doc[ii]->info)) {
+            return CBIO_ERROR_EINVAL;
+        }
+    }
+
+    /* The lookups below must see the buffered documents */
+    if ((ret = cbio_buffer_flush(handle)) != CBIO_SUCCESS) {
+        return ret;
+    }
+
+    block = cbio_calloc(ndocs, sizeof(struct cbio_cas_key) +
+                        sizeof(sized_buf) + sizeof(struct cbio_cas_state) +
+                        sizeof(Doc *) + sizeof(DocInfo *), CBIO_ALLOC_BATCH);
+    if (block == NULL) {
         return CBIO_ERROR_ENOMEM;
     }
 
-    for (ii = 0; ii < ndocs; ++ii) {
-        docs[ii] = doc[ii]->doc;
-        info[ii] = doc[ii]->info;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.keys = block;
+    ctx.state = (struct cbio_cas_state *)(ctx.keys + ndocs);
+    ctx.nkeys = ndocs;
+    ids = (sized_buf *)(ctx.state + ndocs);
+    docs = (Doc **)(ids + ndocs);
+    info = (DocInfo **)(docs + ndocs);
+
+    /* couchstore wants the ids in sorted order */
+    for (size_t ii = 0; ii < ndocs; ++ii) {
+        ctx.keys[ii].id = doc[ii]->info->id;
+        ctx.keys[ii].index = ii;
+    }
+    qsort(ctx.keys, ndocs, sizeof(struct cbio_cas_key),
+          cbio_compare_cas_keys);
+    for (size_t ii = 0; ii < ndocs; ++ii) {
+        ids[ii] = ctx.keys[ii].id;
+        /* Only the first one may be stored, since the others would be
+           checked against the revision it replaces */
+        if (ii > 0 && cbio_compare_ids(&ids[ii - 1], &ids[ii]) == 0) {
+            ctx.state[ctx.keys[ii].index].duplicate = 1;
+        }
     }
 
-    err = couchstore_save_documents(handle->couchstore_handle, docs, info,
-                                    ndocs, 0);
-    free(docs);
-    free(info);
+    err = couchstore_docinfos_by_id(handle->couchstore_handle, ids,
+                                    (unsigned)ndocs, 0,
+                                    cbio_cas_callback, &ctx);
+    if (err != COUCHSTORE_SUCCESS) {
+        cbio_free(block, CBIO_ALLOC_BATCH);
+        return cbio_remap_error(err);
+    }
 
-    return cbio_remap_error(err);
+    for (size_t ii = 0; ii < ndocs; ++ii) {
+        int exists = ctx.state[ii].found && !ctx.state[ii].deleted;
+        if (ctx.state[ii].duplicate) {
+            result[ii] = CBIO_ERROR_EEXISTS;
+        } else if (expected[ii] == CBIO_REV_MUST_NOT_EXIST) {
+            result[ii] = exists ? CBIO_ERROR_EEXISTS : CBIO_SUCCESS;
+        } else if (!exists) {
+            result[ii] = CBIO_ERROR_ENOENT;
+        } else if (ctx.state[ii].revision != expected[ii]) {
+            result[ii] = CBIO_ERROR_EEXISTS;
+        } else {
+            result[ii] = CBIO_SUCCESS;
+        }
+
+        if (result[ii] == CBIO_SUCCESS) {
+            docs[nstore] = doc[ii]->doc;
+            info[nstore] = doc[ii]->info;
+            ++nstore;
+        }
+    }
+
+    if (nstore > 0) {
+        if (handle->json_mode) {
+            cbio_classify_documents(info, docs, nstore);
+        }
+        err = couchstore_save_documents(handle->couchstore_handle, docs, info,
+                                        (unsigned)nstore, 0);
+        if (err == COUCHSTORE_SUCCESS) {
+            ret = cbio_index_update(handle, info, docs, nstore);
+        } else {
+            ret = cbio_remap_error(err);
+            for (size_t ii = 0; ii < ndocs; ++ii) {
+                if (result[ii] == CBIO_SUCCESS) {
+                    result[ii] = ret;
+                }
+            }
+        }
+    }
+    cbio_free(block, CBIO_ALLOC_BATCH);
+
+    return ret;
 }
 
 LIBCBIO_API
-cbio_error_t cbio_commit(libcbio_t handle)
+cbio_error_t cbio_delete_documents(libcbio_t handle,
+                                   const void *const *ids,
+                                   const size_t *nids,
+                                   size_t nitems)
 {
-    if (handle->mode == CBIO_OPEN_RDONLY) {
+    couchstore_error_t err = COUCHSTORE_SUCCESS;
+    cbio_error_t ret = CBIO_SUCCESS;
+    DocInfo *tombstones;
+    DocInfo **info;
+    Doc **docs;
+    size_t ndocs = 0;
+
+    if (cbio_is_rdonly(handle) || nitems == 0) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    /* Buffered stores of these ids must not be written after us */
+    if ((ret = cbio_buffer_flush(handle)) != CBIO_SUCCESS) {
+        return ret;
+    }
+
+    /* All of the tombstones and the arrays couchstore wants in one go */
+    tombstones = cbio_calloc(nitems, sizeof(DocInfo) + sizeof(DocInfo *) +
+                             sizeof(Doc *), CBIO_ALLOC_BATCH);
+    if (tombstones == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+    info = (DocInfo **)(tombstones + nitems);
+    docs = (Doc **)(info + nitems);
+
+    for (size_t ii = 0; ii < nitems && err == COUCHSTORE_SUCCESS; ++ii) {
+        if (cbio_is_local_id(ids[ii], nids[ii])) {
+            LocalDoc ldoc;
+            memset(&ldoc, 0, sizeof(ldoc));
+            ldoc.id.buf = (void *)ids[ii];
+            ldoc.id.size = nids[ii];
+            ldoc.deleted = 1;
+            err = couchstore_save_local_document(handle->couchstore_handle,
+                                                 &ldoc);
+        } else {
+            /* The couchstore API got the const wrong here.. */
+            tombstones[ndocs].id.buf = (void *)ids[ii];
+            tombstones[ndocs].id.size = nids[ii];
+            tombstones[ndocs].deleted = 1;
+            info[ndocs] = tombstones + ndocs;
+            ++ndocs;
+        }
+    }
+
+    if (err == COUCHSTORE_SUCCESS && ndocs > 0) {
+        err = couchstore_save_documents(handle->couchstore_handle, docs, info,
+                                        (unsigned)ndocs, 0);
+        if (err == COUCHSTORE_SUCCESS) {
+            ret = cbio_index_update(handle, info, docs, ndocs);
+        }
+    }
+    cbio_free(tombstones, CBIO_ALLOC_BATCH);
+
+    return err == COUCHSTORE_SUCCESS ? ret : cbio_remap_error(err);
+}
+
+static cbio_error_t cbio_do_commit(libcbio_t handle)
+{
+    couchstore_error_t err;
+    cbio_error_t ret;
+
+    if (cbio_is_rdonly(handle)) {
         return CBIO_ERROR_EINVAL;
     }
-    return cbio_remap_error(couchstore_commit(handle->couchstore_handle));
+
+    if ((ret = cbio_buffer_flush(handle)) != CBIO_SUCCESS) {
+        return ret;
+    }
+
+    err = couchstore_commit(handle->couchstore_handle);
+    if (err != COUCHSTORE_SUCCESS) {
+        return cbio_remap_error(err);
+    }
+    if ((ret = cbio_index_commit(handle)) == CBIO_SUCCESS) {
+        /* Wake up the followers of the file in this process */
+        cbio_follow_notify(handle);
+    }
+    return ret;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_commit(libcbio_t handle)
+{
+    cbio_error_t ret;
+
+    CBIO_TRACE_ENTRY(commit, CBIO_TRACE_COMMIT, handle, 0, 0, 0);
+    ret = cbio_do_commit(handle);
+    CBIO_TRACE_RETURN(commit, CBIO_TRACE_COMMIT, handle, 0, 0, 0, ret);
+
+    return ret;
 }
 
 struct cbio_wrap_ctx {
     cbio_changes_callback_fn callback;
     libcbio_t handle;
+    const cbio_changes_filter_t *filter;
     void *ctx;
+    /* The number of documents passed to the callback */
+    uint64_t ndocs;
 };
 
+static int cbio_filter_match(const cbio_changes_filter_t *filter,
+                             const DocInfo *info)
+{
+    if (filter->nid_prefix > 0 &&
+        (info->id.size < filter->nid_prefix ||
+         memcmp(info->id.buf, filter->id_prefix, filter->nid_prefix) != 0)) {
+        return 0;
+    }
+
+    if ((filter->deleted == CBIO_FILTER_DELETED_EXCLUDE && info->deleted) ||
+        (filter->deleted == CBIO_FILTER_DELETED_ONLY && !info->deleted)) {
+        return 0;
+    }
+
+    /* The compressed flag isn't part of the content type */
+    if (filter->content_type != -1 &&
+        filter->content_type !=
+        (int)(info->content_meta & ~CBIO_DOC_IS_COMPRESSED)) {
+        return 0;
+    }
+
+    return info->rev_seq >= filter->min_revision &&
+           info->rev_seq <= filter->max_revision &&
+           info->size >= filter->min_size &&
+           info->size <= filter->max_size;
+}
+
 static int couchstore_changes_callback(Db *db, DocInfo *docinfo, void *ctx)
 {
     (void)db;
     int ret = 0;
-    libcbio_document_t doc = calloc(1, sizeof(*doc));
-    if (doc) {
-        struct cbio_wrap_ctx *uctx = ctx;
+    struct cbio_wrap_ctx *uctx = ctx;
+    libcbio_document_t doc;
+    /* The callback may release the document when it keeps it */
+    uint64_t nkey = docinfo->id.size;
+    uint64_t nbytes = docinfo->size;
+
+    if (uctx->filter != NULL && !cbio_filter_match(uctx->filter, docinfo)) {
+        return 0;
+    }
+
+    if ((doc = cbio_calloc(1, sizeof(*doc), CBIO_ALLOC_DOCUMENT)) != NULL) {
         doc->info = docinfo;
 
+        ++uctx->ndocs;
+        CBIO_TRACE_ENTRY(changes_callback, CBIO_TRACE_CHANGES_CALLBACK,
+                         uctx->handle, 1, nkey, nbytes);
         ret = uctx->callback(uctx->handle, doc, uctx->ctx);
+        CBIO_TRACE_RETURN(changes_callback, CBIO_TRACE_CHANGES_CALLBACK,
+                          uctx->handle, 1, nkey, nbytes, ret);
         if (ret == 0) {
-            free(doc);
+            /* couchstore owns the docinfo, but not a value fetched
+               with cbio_document_fetch_value() */
+            doc->info = NULL;
+            cbio_document_release(doc);
+        } else if (ret < 0) {
+            /* couchstore only releases the docinfo if we return 0 */
+            cbio_document_release(doc);
+            ret = COUCHSTORE_ERROR_CANCEL;
         }
     }
 
     return ret;
 }
 
+static cbio_error_t cbio_fetch_value(libcbio_t handle,
+                                     libcbio_document_t doc,
+                                     couchstore_open_options options)
+{
+    struct cbio_db_ref *ref;
+    couchstore_error_t err;
+    cbio_error_t ret;
+
+    if (doc == NULL || doc->info == NULL || doc->scratch) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if (doc->doc != NULL) {
+        /* We can't decompress a value which is already read */
+        if ((options & DECOMPRESS_DOC_BODIES) &&
+            (doc->info->content_meta & CBIO_DOC_IS_COMPRESSED)) {
+            return CBIO_ERROR_EINVAL;
+        }
+        return CBIO_SUCCESS;
+    }
+
+    if (doc->info->deleted) {
+        return CBIO_ERROR_ENOENT;
+    }
+
+    if ((ret = cbio_acquire_db(handle, &ref)) != CBIO_SUCCESS) {
+        return ret;
+    }
+
+    err = couchstore_open_doc_with_docinfo(ref->db, doc->info, &doc->doc,
+                                           options);
+    cbio_release_db(handle, ref);
+
+    if (err == COUCHSTORE_SUCCESS && (options & DECOMPRESS_DOC_BODIES)) {
+        doc->info->content_meta &= ~CBIO_DOC_IS_COMPRESSED;
+    }
+
+    return cbio_remap_error(err);
+}
+
+LIBCBIO_API
+cbio_error_t cbio_document_fetch_value(libcbio_t handle,
+                                       libcbio_document_t doc)
+{
+    return cbio_fetch_value(handle, doc, 0);
+}
+
+LIBCBIO_API
+cbio_error_t cbio_document_fetch_decompressed_value(libcbio_t handle,
+                                                    libcbio_document_t doc)
+{
+    return cbio_fetch_value(handle, doc, DECOMPRESS_DOC_BODIES);
+}
+
+LIBCBIO_API
+void cbio_changes_filter_init(cbio_changes_filter_t *filter)
+{
+    memset(filter, 0, sizeof(*filter));
+    filter->deleted = CBIO_FILTER_DELETED_ANY;
+    filter->content_type = -1;
+    filter->max_revision = UINT64_MAX;
+    filter->max_size = SIZE_MAX;
+}
+
 LIBCBIO_API
 cbio_error_t cbio_changes_since(libcbio_t handle,
                                 uint64_t since,
                                 cbio_changes_callback_fn callback,
                                 void *ctx)
+{
+    return cbio_changes_since_filtered(handle, since, NULL, callback, ctx);
+}
+
+static cbio_error_t cbio_do_changes_since(libcbio_t handle,
+                                          uint64_t since,
+                                          const cbio_changes_filter_t *filter,
+                                          cbio_changes_callback_fn callback,
+                                          void *ctx,
+                                          uint64_t *ndocs)
 {
     struct cbio_wrap_ctx uctx = { .callback = callback,
         .handle = handle,
-         .ctx = ctx
+        .filter = filter,
+        .ctx = ctx
     };
+    couchstore_docinfos_options options = 0;
+    struct cbio_db_ref *ref;
     couchstore_error_t err;
-    err = couchstore_changes_since(handle->couchstore_handle,
-                                   since, 0,
+    cbio_error_t ret;
+
+    if ((ret = cbio_buffer_flush(handle)) != CBIO_SUCCESS ||
+        (ret = cbio_acquire_db(handle, &ref)) != CBIO_SUCCESS) {
+        return ret;
+    }
+
+    if (filter != NULL && filter->deleted == CBIO_FILTER_DELETED_EXCLUDE) {
+        /* Let couchstore skip them */
+        options |= COUCHSTORE_NO_DELETES;
+    }
+
+    err = couchstore_changes_since(ref->db,
+                                   since, options,
                                    couchstore_changes_callback,
                                    &uctx);
+    cbio_release_db(handle, ref);
+    *ndocs = uctx.ndocs;
+    if (err == COUCHSTORE_ERROR_CANCEL) {
+        /* The callback asked us to stop */
+        err = COUCHSTORE_SUCCESS;
+    }
 
     return cbio_remap_error(err);
 }
+
+LIBCBIO_API
+cbio_error_t cbio_changes_since_filtered(libcbio_t handle,
+                                         uint64_t since,
+                                         const cbio_changes_filter_t *filter,
+                                         cbio_changes_callback_fn callback,
+                                         void *ctx)
+{
+    uint64_t ndocs = 0;
+    cbio_error_t ret;
+
+    CBIO_TRACE_ENTRY(changes_since, CBIO_TRACE_CHANGES_SINCE,
+                     handle, 0, 0, 0);
+    ret = cbio_do_changes_since(handle, since, filter, callback, ctx, &ndocs);
+    CBIO_TRACE_RETURN(changes_since, CBIO_TRACE_CHANGES_SINCE,
+                      handle, ndocs, 0, 0, ret);
+
+    return ret;
+}
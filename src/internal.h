@@ -20,17 +20,124 @@
 
 #include <libcbio/cbio.h>
 #include <libcouchstore/couch_db.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #ifndef INTERNAL_H
 #define INTERNAL_H 1
 
+#ifdef CBIO_PROBES
+/* Every probe has a semaphore (defined in trace.c) */
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#endif
+
 #ifdef __cplusplus
 #error "What are you thinking?? this is a C project"
 #endif
 
+/*
+ * Number of idle couchstore handles a shared handle keeps around for
+ * reuse. Threads beyond this will open (and close) their own
+ * couchstore handle for the duration of the operation.
+ */
+#define CBIO_SHARED_POOL_SIZE 64
+
+/*
+ * How long (in ms) a thread needing a couchstore handle for a shared
+ * handle waits for one at the published header to be released, when
+ * the idle list is empty and a newer header was written to the file
+ */
+#define CBIO_SHARED_WAIT_MS 100
+
+/* The local document recording the last tombstone purge */
+#define CBIO_PURGE_DOCUMENT "_local/purge"
+
+/* The local documents used by the secondary index file */
+#define CBIO_INDEX_SEQNO_DOCUMENT "_local/cbio_index_seqno"
+#define CBIO_INDEX_REVERSE_PREFIX "_local/cbio_index/"
+
+/* The default checkpoint document used by cbio_replicate() */
+#define CBIO_REPLICATE_DOCUMENT "_local/cbio_replicate"
+
+/*
+ * Default number of threads serving cbio_get_document_async() (the
+ * number of reads a handle may have in flight at the same time), and
+ * of reads which may be pending before it fails with CBIO_ERROR_EBUSY
+ */
+#define CBIO_ASYNC_THREADS 32
+#define CBIO_ASYNC_MAX_PENDING 16384
+
+struct cbio_async_st;
+struct cbio_index_st;
+struct cbio_buffer_st;
+struct cbio_access_log_st;
+
+/*
+ * The file a couchstore handle was opened on. All zero if it isn't
+ * known (or the handle may write to the file), which keeps the handle
+ * from using the lookup cache.
+ */
+struct cbio_file_id {
+    dev_t dev;
+    ino_t ino;
+    /* Unlike the inode this is never reused. All the handles open on
+       the same file share it, and the next time the file is opened
+       after they are all closed it gets a new one */
+    uint64_t id;
+};
+
+struct cbio_db_ref {
+    Db *db;
+    /* The generation of the shared handle when db was opened */
+    uint64_t generation;
+    struct cbio_file_id file;
+};
+
+/*
+ * The state for a handle opened with CBIO_OPEN_SHARED_RDONLY. The
+ * couchstore Db isn't thread safe, so every operation checks out a
+ * Db from the idle list (or opens a new one). The idle list, the
+ * generation and the header position are accessed with atomic
+ * operations only, and are only moved forward with the mutex held.
+ */
+struct cbio_shared_st {
+    struct cbio_db_ref *volatile idle[CBIO_SHARED_POOL_SIZE];
+    /* Bumped every time a new header is published */
+    volatile uint64_t generation;
+    volatile uint64_t header_position;
+    /* Serializes refreshes and publishing a new header */
+    pthread_mutex_t mutex;
+    /* The file the published header is in (protected by the mutex) */
+    struct cbio_file_id file;
+    /* Signalled when a Db is put on the idle list while there are
+       threads waiting for one */
+    pthread_cond_t released;
+    volatile int waiters;
+};
+
 struct libcbio_st {
     Db *couchstore_handle;
+    struct cbio_db_ref exclusive;
+    struct cbio_shared_st *shared;
+    struct cbio_async_st *volatile async;
+    cbio_async_options_t async_options;
+    struct cbio_index_st *secondary;
+    struct cbio_buffer_st *buffer;
+    struct cbio_access_log_st *access_log;
+    /* Classify the content type of documents as they are stored */
+    int json_mode;
     libcbio_open_mode_t mode;
+    char *name;
+
+    /* The file we saw the last time we located the header. Used by
+       cbio_refresh_handle() to avoid touching couchstore when nothing
+       has been appended to the file */
+    struct {
+        dev_t dev;
+        ino_t ino;
+        off_t size;
+    } file;
 };
 
 struct libcbio_document_st {
@@ -41,8 +148,213 @@ struct libcbio_document_st {
     void *tmp_alloc_meta;
     void *tmp_alloc_bp;
     int scratch;
+    /* doc was allocated by libcbio even if the document isn't scratch */
+    int own_doc;
+    /* info was allocated by libcbio (copied from the lookup cache) even
+       if the document isn't scratch */
+    int own_info;
+
+    /*
+     * Kept by cbio_document_reinitialize() so cbio_get_document_into()
+     * may reuse them. The id, metadata and value read are copied into
+     * read_buffer.
+     */
+    Doc *spare_doc;
+    DocInfo *spare_info;
+    char *read_buffer;
+    size_t read_size;
 };
 
 cbio_error_t cbio_remap_error(couchstore_error_t in);
 
+/*
+ * Copy a document (and its value, unless body is NULL) into the
+ * buffers of doc, which must be empty (just reinitialized)
+ */
+cbio_error_t cbio_document_fill(libcbio_document_t doc,
+                                const DocInfo *info,
+                                const Doc *body);
+
+/*
+ * Allocate and release memory through the allocator installed with
+ * cbio_set_allocator(). Memory allocated by couchstore must still be
+ * released with the couchstore functions.
+ */
+void *cbio_malloc(size_t size, cbio_alloc_class_t cls);
+void *cbio_calloc(size_t nmemb, size_t size, cbio_alloc_class_t cls);
+void *cbio_realloc(void *ptr, size_t size, cbio_alloc_class_t cls);
+void cbio_free(void *ptr, cbio_alloc_class_t cls);
+
+/*
+ * Validate that data is UTF-8 encoded JSON and return the
+ * corresponding content type (CBIO_DOC_IS_JSON, CBIO_DOC_INVALID_JSON
+ * or CBIO_DOC_INVALID_JSON_KEY if it has reserved top level keys)
+ */
+uint8_t cbio_json_classify(const void *data, size_t ndata);
+
+/*
+ * Build a JSON object with the values of the given paths in the JSON
+ * document in data (see cbio_document_project()). out is allocated
+ * with cbio_malloc() (CBIO_ALLOC_DATA).
+ */
+cbio_error_t cbio_json_project(const void *data,
+                               size_t ndata,
+                               const char *const *paths,
+                               size_t npaths,
+                               char **out,
+                               size_t *nout);
+
+cbio_error_t cbio_shared_create(libcbio_t handle, Db *db);
+void cbio_shared_destroy(libcbio_t handle);
+/*
+ * Move the shared handle to the header db is positioned at, and hand
+ * db over to the idle list. Must be called with the mutex held.
+ */
+void cbio_shared_publish(libcbio_t handle,
+                         Db *db,
+                         const struct cbio_file_id *file);
+
+void cbio_async_destroy(libcbio_t handle);
+
+/*
+ * Update the secondary index (if any) with the documents just stored
+ * in the main file, and commit it after the main file is committed.
+ */
+cbio_error_t cbio_index_update(libcbio_t handle,
+                               DocInfo **info,
+                               Doc **docs,
+                               size_t ndocs);
+cbio_error_t cbio_index_commit(libcbio_t handle);
+void cbio_index_destroy(libcbio_t handle);
+
+/* Write (non-local) documents to the file, bypassing the buffer */
+cbio_error_t cbio_write_documents(libcbio_t handle,
+                                  libcbio_document_t *doc,
+                                  size_t ndocs);
+
+/*
+ * The write buffer. cbio_buffer_lookup() returns non-zero (and sets
+ * err and doc) if the buffer holds the document.
+ */
+cbio_error_t cbio_buffer_store(libcbio_t handle,
+                               libcbio_document_t *doc,
+                               size_t ndocs);
+cbio_error_t cbio_buffer_flush(libcbio_t handle);
+int cbio_buffer_lookup(libcbio_t handle,
+                       const void *id,
+                       size_t nid,
+                       cbio_error_t *err,
+                       libcbio_document_t *doc);
+void cbio_buffer_destroy(libcbio_t handle);
+
+/*
+ * Open a couchstore handle and identify the file it was opened on
+ * (only for read only handles).
+ */
+couchstore_error_t cbio_open_db(const char *name,
+                                couchstore_open_flags flags,
+                                Db **db,
+                                struct cbio_file_id *file);
+
+/*
+ * Close a couchstore handle opened with cbio_open_db()
+ */
+void cbio_close_db(Db *db, const struct cbio_file_id *file);
+
+/*
+ * The lookup cache. cbio_cache_lookup() returns non-zero (and sets err
+ * and info) if the cache holds the result of looking up id through
+ * ref. info is then allocated with cbio_malloc() (CBIO_ALLOC_DOCINFO)
+ * and isn't set for missing documents. cbio_cache_store() records the
+ * result of a couchstore_docinfo_by_id() call.
+ */
+int cbio_cache_lookup(struct cbio_db_ref *ref,
+                      const void *id,
+                      size_t nid,
+                      cbio_error_t *err,
+                      DocInfo **info);
+void cbio_cache_store(struct cbio_db_ref *ref,
+                      const void *id,
+                      size_t nid,
+                      couchstore_error_t err,
+                      const DocInfo *info);
+
+/*
+ * The access log. cbio_access_log_record() must only be called when
+ * handle->access_log is set, and cbio_access_log_destroy() saves the
+ * log before releasing it.
+ */
+void cbio_access_log_record(libcbio_t handle, const void *id, size_t nid);
+cbio_error_t cbio_access_log_destroy(libcbio_t handle);
+
+/* Tell the cbio_follow_changes() callers following the file about a
+   new header */
+void cbio_follow_notify(libcbio_t handle);
+
+/*
+ * Tracing. A traced operation fires the USDT probes
+ * libcbio:<name>_entry and libcbio:<name>_return (if libcbio is built
+ * with probes) and calls the trace callback (if one is installed).
+ * The probe arguments are the handle, the number of documents, the
+ * size of the ids, the size of the values and the result (zero on
+ * entry). Without probes this is just a test of cbio_trace_callback.
+ *
+ * CBIO_TRACING(name) tells if it is worth computing the arguments:
+ * a tracer attaching to a probe bumps its semaphore, so when nobody
+ * listens it is just as cheap as without probes.
+ */
+extern cbio_trace_callback_t cbio_trace_callback;
+void cbio_trace(libcbio_t handle,
+                cbio_trace_op_t op,
+                int done,
+                uint64_t ndocs,
+                uint64_t nkey,
+                uint64_t nbytes,
+                int result);
+
+#ifdef CBIO_PROBES
+#define CBIO_PROBE_SEMAPHORES(name) \
+    extern volatile unsigned short libcbio_##name##_entry_semaphore; \
+    extern volatile unsigned short libcbio_##name##_return_semaphore
+CBIO_PROBE_SEMAPHORES(get_document);
+CBIO_PROBE_SEMAPHORES(store_documents);
+CBIO_PROBE_SEMAPHORES(commit);
+CBIO_PROBE_SEMAPHORES(changes_since);
+CBIO_PROBE_SEMAPHORES(changes_callback);
+
+#define CBIO_PROBE(name, handle, ndocs, nkey, nbytes, result) \
+    DTRACE_PROBE5(libcbio, name, handle, ndocs, nkey, nbytes, result)
+#define CBIO_TRACING(name) \
+    (cbio_trace_callback != NULL || \
+     __builtin_expect(libcbio_##name##_entry_semaphore != 0 || \
+                      libcbio_##name##_return_semaphore != 0, 0))
+#else
+#define CBIO_PROBE(name, handle, ndocs, nkey, nbytes, result)
+#define CBIO_TRACING(name) (cbio_trace_callback != NULL)
+#endif
+
+#define CBIO_TRACE_ENTRY(name, op, handle, ndocs, nkey, nbytes) \
+    do { \
+        CBIO_PROBE(name##_entry, handle, ndocs, nkey, nbytes, 0); \
+        if (cbio_trace_callback != NULL) { \
+            cbio_trace(handle, op, 0, ndocs, nkey, nbytes, 0); \
+        } \
+    } while (0)
+
+#define CBIO_TRACE_RETURN(name, op, handle, ndocs, nkey, nbytes, result) \
+    do { \
+        CBIO_PROBE(name##_return, handle, ndocs, nkey, nbytes, result); \
+        if (cbio_trace_callback != NULL) { \
+            cbio_trace(handle, op, 1, ndocs, nkey, nbytes, result); \
+        } \
+    } while (0)
+
+/*
+ * Get a couchstore handle to perform read operations on. Every call
+ * to cbio_acquire_db() must be paired with a call to
+ * cbio_release_db().
+ */
+cbio_error_t cbio_acquire_db(libcbio_t handle, struct cbio_db_ref **ref);
+void cbio_release_db(libcbio_t handle, struct cbio_db_ref *ref);
+
 #endif
@@ -0,0 +1,706 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * A validating JSON scanner used to classify document bodies. It
+ * doesn't build any representation of the document, it only walks the
+ * structure once. The string contents (which is where most of the
+ * bytes in a typical document live) are skipped 16 bytes at the time
+ * with SSE2 when available.
+ */
+#include "internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Nesting deeper than this is treated as invalid */
+#define CBIO_JSON_MAX_DEPTH 512
+
+struct json_scanner {
+    const unsigned char *ptr;
+    const unsigned char *end;
+    int reserved_key;
+};
+
+static void json_skip_ws(struct json_scanner *s)
+{
+    while (s->ptr < s->end && (*s->ptr == ' ' || *s->ptr == '\t' ||
+                               *s->ptr == '\n' || *s->ptr == '\r')) {
+        ++s->ptr;
+    }
+}
+
+/* Validate a multibyte UTF-8 sequence starting at s->ptr */
+static int json_utf8(struct json_scanner *s)
+{
+    const unsigned char *p = s->ptr;
+    size_t avail = (size_t)(s->end - p);
+    unsigned int c = p[0];
+
+    if (c >= 0xC2 && c <= 0xDF) {
+        if (avail < 2 || (p[1] & 0xC0) != 0x80) {
+            return -1;
+        }
+        s->ptr += 2;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        if (avail < 3 || (p[1] & 0xC0) != 0x80 || (p[2] & 0xC0) != 0x80 ||
+            (c == 0xE0 && p[1] < 0xA0) || (c == 0xED && p[1] > 0x9F)) {
+            return -1;
+        }
+        s->ptr += 3;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        if (avail < 4 || (p[1] & 0xC0) != 0x80 || (p[2] & 0xC0) != 0x80 ||
+            (p[3] & 0xC0) != 0x80 || (c == 0xF0 && p[1] < 0x90) ||
+            (c == 0xF4 && p[1] > 0x8F)) {
+            return -1;
+        }
+        s->ptr += 4;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int json_hex(unsigned char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') ||
+           (c >= 'A' && c <= 'F');
+}
+
+/* s->ptr points just past the opening quote */
+static int json_string(struct json_scanner *s)
+{
+    while (1) {
+#ifdef __SSE2__
+        /* Skip runs of plain printable ascii without quote/backslash */
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i bslash = _mm_set1_epi8('\\');
+        const __m128i space = _mm_set1_epi8(0x20);
+        while (s->end - s->ptr >= 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)s->ptr);
+            /* The signed compare catches both control characters and
+               bytes >= 0x80 (which needs to be UTF-8 validated) */
+            __m128i special = _mm_cmplt_epi8(v, space);
+            special = _mm_or_si128(special, _mm_cmpeq_epi8(v, quote));
+            special = _mm_or_si128(special, _mm_cmpeq_epi8(v, bslash));
+            int mask = _mm_movemask_epi8(special);
+            if (mask != 0) {
+                s->ptr += __builtin_ctz(mask);
+                break;
+            }
+            s->ptr += 16;
+        }
+#endif
+        if (s->ptr >= s->end) {
+            return -1;
+        }
+
+        unsigned char c = *s->ptr;
+        if (c == '"') {
+            ++s->ptr;
+            return 0;
+        } else if (c == '\\') {
+            if (s->end - s->ptr < 2) {
+                return -1;
+            }
+            c = s->ptr[1];
+            if (c == 'u') {
+                if (s->end - s->ptr < 6 || !json_hex(s->ptr[2]) ||
+                    !json_hex(s->ptr[3]) || !json_hex(s->ptr[4]) ||
+                    !json_hex(s->ptr[5])) {
+                    return -1;
+                }
+                s->ptr += 6;
+            } else if (c != '\0' && strchr("\"\\/bfnrt", c) != NULL) {
+                s->ptr += 2;
+            } else {
+                return -1;
+            }
+        } else if (c < 0x20) {
+            return -1;
+        } else if (c < 0x80) {
+            ++s->ptr;
+        } else if (json_utf8(s) != 0) {
+            return -1;
+        }
+    }
+}
+
+static int json_number(struct json_scanner *s)
+{
+    const unsigned char *start;
+
+    if (s->ptr < s->end && *s->ptr == '-') {
+        ++s->ptr;
+    }
+    if (s->ptr >= s->end) {
+        return -1;
+    }
+    if (*s->ptr == '0') {
+        ++s->ptr;
+    } else {
+        start = s->ptr;
+        while (s->ptr < s->end && *s->ptr >= '0' && *s->ptr <= '9') {
+            ++s->ptr;
+        }
+        if (start == s->ptr) {
+            return -1;
+        }
+    }
+
+    if (s->ptr < s->end && *s->ptr == '.') {
+        start = ++s->ptr;
+        while (s->ptr < s->end && *s->ptr >= '0' && *s->ptr <= '9') {
+            ++s->ptr;
+        }
+        if (start == s->ptr) {
+            return -1;
+        }
+    }
+
+    if (s->ptr < s->end && (*s->ptr == 'e' || *s->ptr == 'E')) {
+        ++s->ptr;
+        if (s->ptr < s->end && (*s->ptr == '+' || *s->ptr == '-')) {
+            ++s->ptr;
+        }
+        start = s->ptr;
+        while (s->ptr < s->end && *s->ptr >= '0' && *s->ptr <= '9') {
+            ++s->ptr;
+        }
+        if (start == s->ptr) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int json_literal(struct json_scanner *s, const char *lit, size_t n)
+{
+    if ((size_t)(s->end - s->ptr) < n || memcmp(s->ptr, lit, n) != 0) {
+        return -1;
+    }
+    s->ptr += n;
+    return 0;
+}
+
+static int json_value(struct json_scanner *s, int depth)
+{
+    json_skip_ws(s);
+    if (s->ptr >= s->end || depth > CBIO_JSON_MAX_DEPTH) {
+        return -1;
+    }
+
+    switch (*s->ptr) {
+    case '{':
+        ++s->ptr;
+        json_skip_ws(s);
+        if (s->ptr < s->end && *s->ptr == '}') {
+            ++s->ptr;
+            return 0;
+        }
+        while (1) {
+            json_skip_ws(s);
+            if (s->ptr >= s->end || *s->ptr != '"') {
+                return -1;
+            }
+            ++s->ptr;
+            if (depth == 0 && s->ptr < s->end && *s->ptr == '_') {
+                s->reserved_key = 1;
+            }
+            if (json_string(s) != 0) {
+                return -1;
+            }
+            json_skip_ws(s);
+            if (s->ptr >= s->end || *s->ptr != ':') {
+                return -1;
+            }
+            ++s->ptr;
+            if (json_value(s, depth + 1) != 0) {
+                return -1;
+            }
+            json_skip_ws(s);
+            if (s->ptr >= s->end) {
+                return -1;
+            }
+            if (*s->ptr == '}') {
+                ++s->ptr;
+                return 0;
+            }
+            if (*s->ptr != ',') {
+                return -1;
+            }
+            ++s->ptr;
+        }
+    case '[':
+        ++s->ptr;
+        json_skip_ws(s);
+        if (s->ptr < s->end && *s->ptr == ']') {
+            ++s->ptr;
+            return 0;
+        }
+        while (1) {
+            if (json_value(s, depth + 1) != 0) {
+                return -1;
+            }
+            json_skip_ws(s);
+            if (s->ptr >= s->end) {
+                return -1;
+            }
+            if (*s->ptr == ']') {
+                ++s->ptr;
+                return 0;
+            }
+            if (*s->ptr != ',') {
+                return -1;
+            }
+            ++s->ptr;
+        }
+    case '"':
+        ++s->ptr;
+        return json_string(s);
+    case 't':
+        return json_literal(s, "true", 4);
+    case 'f':
+        return json_literal(s, "false", 5);
+    case 'n':
+        return json_literal(s, "null", 4);
+    default:
+        return json_number(s);
+    }
+}
+
+uint8_t cbio_json_classify(const void *data, size_t ndata)
+{
+    struct json_scanner s;
+    s.ptr = data;
+    s.end = s.ptr + ndata;
+    s.reserved_key = 0;
+
+    if (json_value(&s, 0) != 0) {
+        return CBIO_DOC_INVALID_JSON;
+    }
+
+    json_skip_ws(&s);
+    if (s.ptr != s.end) {
+        return CBIO_DOC_INVALID_JSON;
+    }
+
+    return s.reserved_key ? CBIO_DOC_INVALID_JSON_KEY : CBIO_DOC_IS_JSON;
+}
+
+/*
+ * Projection walks the document with the same scanner, but descends
+ * only into the members and elements on the way to one of the paths,
+ * and stops as soon as all of them are found. The paths are dot
+ * separated keys with [n] for array elements (e.g. "a.b[2].c").
+ */
+struct json_path_state {
+    /* The offset of the next segment of the path */
+    size_t cursor;
+    const unsigned char *start;
+    const unsigned char *end;
+};
+
+struct json_projection {
+    const char *const *paths;
+    size_t npaths;
+    size_t nfound;
+    struct json_path_state *state;
+    /*
+     * Two arrays of npaths entries for every level of the walk: the
+     * paths active on that level, and the cursors of the paths
+     * selected for the next level (before they were moved).
+     */
+    size_t *active;
+};
+
+/*
+ * Validate a path and count its segments. Paths containing characters
+ * which would need escaping in the result are rejected
+ */
+static int json_path_segments(const char *path)
+{
+    int nsegments = 0;
+    const char *ptr = path;
+
+    while (1) {
+        if (*ptr == '[') {
+            const char *digits = ++ptr;
+            while (*ptr >= '0' && *ptr <= '9') {
+                ++ptr;
+            }
+            if (ptr == digits || *ptr != ']') {
+                return -1;
+            }
+            ++ptr;
+        } else {
+            const char *key = ptr;
+            while (*ptr != '\0' && *ptr != '.' && *ptr != '[') {
+                if (*ptr == '"' || *ptr == '\\' ||
+                    (unsigned char)*ptr < 0x20) {
+                    return -1;
+                }
+                ++ptr;
+            }
+            if (ptr == key) {
+                return -1;
+            }
+        }
+        ++nsegments;
+
+        if (*ptr == '\0') {
+            return nsegments;
+        }
+        if (*ptr == '.' && *++ptr == '\0') {
+            return -1;
+        }
+    }
+}
+
+/* Get the key (or NULL for an index) of the next segment of a path */
+static const char *json_path_key(const char *path, size_t cursor,
+                                 size_t *nkey, size_t *index,
+                                 size_t *next)
+{
+    const char *ptr = path + cursor;
+    const char *key = NULL;
+
+    if (*ptr == '[') {
+        *index = (size_t)strtoul(ptr + 1, (char **)&ptr, 10);
+        ++ptr;
+    } else {
+        key = ptr;
+        while (*ptr != '\0' && *ptr != '.' && *ptr != '[') {
+            ++ptr;
+        }
+        *nkey = (size_t)(ptr - key);
+    }
+
+    if (*ptr == '.') {
+        ++ptr;
+    }
+    *next = (size_t)(ptr - path);
+
+    return key;
+}
+
+/*
+ * Select the paths among the nactive in active whose next segment is
+ * the given key (or index if key is NULL), and move them past it.
+ */
+static size_t json_path_select(struct json_projection *p,
+                               const size_t *active,
+                               size_t nactive,
+                               size_t *selected,
+                               const unsigned char *key,
+                               size_t nkey,
+                               size_t index)
+{
+    size_t nselected = 0;
+
+    for (size_t ii = 0; ii < nactive; ++ii) {
+        struct json_path_state *state = p->state + active[ii];
+        const char *segment;
+        size_t nsegment = 0, idx = 0, next;
+
+        if (state->start != NULL) {
+            /* Found already (under an earlier duplicate key) */
+            continue;
+        }
+
+        segment = json_path_key(p->paths[active[ii]], state->cursor,
+                                &nsegment, &idx, &next);
+        if (key != NULL ? (segment != NULL && nsegment == nkey &&
+                           memcmp(segment, key, nkey) == 0) :
+            (segment == NULL && idx == index)) {
+            state->cursor = next;
+            selected[nselected++] = active[ii];
+        }
+    }
+
+    return nselected;
+}
+
+static int json_project_value(struct json_scanner *s,
+                              struct json_projection *p,
+                              size_t *active,
+                              size_t nactive,
+                              int depth);
+
+/*
+ * Walk into a member or element reached by the selected paths. The
+ * paths not found in it are moved back, in case a later duplicate
+ * key matches
+ */
+static int json_project_child(struct json_scanner *s,
+                              struct json_projection *p,
+                              size_t *selected,
+                              size_t nselected,
+                              const size_t *cursors,
+                              int depth)
+{
+    int ret;
+
+    if (nselected == 0) {
+        return json_value(s, depth);
+    }
+
+    ret = json_project_value(s, p, selected, nselected, depth);
+    for (size_t ii = 0; ii < nselected; ++ii) {
+        if (p->state[selected[ii]].start == NULL) {
+            p->state[selected[ii]].cursor = cursors[selected[ii]];
+        }
+    }
+
+    return ret;
+}
+
+static int json_project_value(struct json_scanner *s,
+                              struct json_projection *p,
+                              size_t *active,
+                              size_t nactive,
+                              int depth)
+{
+    size_t *cursors = active + p->npaths;
+    size_t *selected = active + 2 * p->npaths;
+    const unsigned char *start;
+    size_t nrest = 0;
+    size_t ndone = 0;
+    size_t index = 0;
+    int ret;
+
+    json_skip_ws(s);
+    if (s->ptr >= s->end || depth > CBIO_JSON_MAX_DEPTH) {
+        return -1;
+    }
+    start = s->ptr;
+
+    /* Paths ending here are moved to the end of the list, the rest
+       stay in front */
+    for (size_t ii = nactive; ii > nrest;) {
+        size_t idx = active[nrest];
+        if (p->paths[idx][p->state[idx].cursor] == '\0') {
+            p->state[idx].start = start;
+            active[nrest] = active[--ii];
+            active[ii] = idx;
+            ++ndone;
+        } else {
+            ++nrest;
+        }
+    }
+
+    for (size_t ii = 0; ii < nrest; ++ii) {
+        cursors[active[ii]] = p->state[active[ii]].cursor;
+    }
+
+    if (nrest == 0 || (*s->ptr != '{' && *s->ptr != '[')) {
+        ret = json_value(s, depth);
+    } else if (*s->ptr == '{') {
+        ++s->ptr;
+        json_skip_ws(s);
+        ret = 0;
+        if (s->ptr < s->end && *s->ptr == '}') {
+            ++s->ptr;
+        } else {
+            ret = -1;
+            while (1) {
+                const unsigned char *key;
+                size_t nselected;
+
+                json_skip_ws(s);
+                if (s->ptr >= s->end || *s->ptr != '"') {
+                    break;
+                }
+                key = ++s->ptr;
+                if (json_string(s) != 0) {
+                    break;
+                }
+                nselected = json_path_select(p, active, nrest, selected, key,
+                                             (size_t)(s->ptr - key - 1), 0);
+                json_skip_ws(s);
+                if (s->ptr >= s->end || *s->ptr != ':') {
+                    break;
+                }
+                ++s->ptr;
+                if ((ret = json_project_child(s, p, selected, nselected,
+                                              cursors, depth + 1)) != 0) {
+                    break;
+                }
+                ret = -1;
+                json_skip_ws(s);
+                if (s->ptr >= s->end) {
+                    break;
+                }
+                if (*s->ptr == '}') {
+                    ++s->ptr;
+                    ret = 0;
+                    break;
+                }
+                if (*s->ptr != ',') {
+                    break;
+                }
+                ++s->ptr;
+            }
+        }
+    } else {
+        ++s->ptr;
+        json_skip_ws(s);
+        ret = 0;
+        if (s->ptr < s->end && *s->ptr == ']') {
+            ++s->ptr;
+        } else {
+            ret = -1;
+            while (1) {
+                size_t nselected = json_path_select(p, active, nrest,
+                                                    selected, NULL, 0,
+                                                    index++);
+                if ((ret = json_project_child(s, p, selected, nselected,
+                                              cursors, depth + 1)) != 0) {
+                    break;
+                }
+                ret = -1;
+                json_skip_ws(s);
+                if (s->ptr >= s->end) {
+                    break;
+                }
+                if (*s->ptr == ']') {
+                    ++s->ptr;
+                    ret = 0;
+                    break;
+                }
+                if (*s->ptr != ',') {
+                    break;
+                }
+                ++s->ptr;
+            }
+        }
+    }
+
+    if (ret == 0) {
+        for (size_t ii = nrest; ii < nactive; ++ii) {
+            p->state[active[ii]].end = s->ptr;
+        }
+        p->nfound += ndone;
+        if (p->nfound == p->npaths) {
+            /* No need to look at the rest of the document */
+            ret = 1;
+        }
+    }
+
+    return ret;
+}
+
+cbio_error_t cbio_json_project(const void *data,
+                               size_t ndata,
+                               const char *const *paths,
+                               size_t npaths,
+                               char **out,
+                               size_t *nout)
+{
+    struct json_projection p;
+    struct json_scanner s;
+    size_t maxsegments = 0;
+    size_t size = 2;
+    char *ptr;
+    int ret;
+
+    for (size_t ii = 0; ii < npaths; ++ii) {
+        int nsegments;
+        if (paths[ii] == NULL ||
+            (nsegments = json_path_segments(paths[ii])) < 0) {
+            return CBIO_ERROR_EINVAL;
+        }
+        if ((size_t)nsegments > maxsegments) {
+            maxsegments = (size_t)nsegments;
+        }
+    }
+
+    p.paths = paths;
+    p.npaths = npaths;
+    p.nfound = 0;
+    p.state = cbio_calloc(npaths + 1, sizeof(*p.state), CBIO_ALLOC_BATCH);
+    p.active = cbio_malloc((maxsegments + 2) * 2 * (npaths + 1) *
+                           sizeof(size_t), CBIO_ALLOC_BATCH);
+    if (p.state == NULL || p.active == NULL) {
+        cbio_free(p.state, CBIO_ALLOC_BATCH);
+        cbio_free(p.active, CBIO_ALLOC_BATCH);
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    for (size_t ii = 0; ii < npaths; ++ii) {
+        p.active[ii] = ii;
+    }
+
+    s.ptr = data;
+    s.end = s.ptr + ndata;
+    s.reserved_key = 0;
+    ret = npaths == 0 ? json_value(&s, 0) :
+          json_project_value(&s, &p, p.active, npaths, 0);
+    if (ret == 0) {
+        json_skip_ws(&s);
+        ret = s.ptr == s.end ? 0 : -1;
+    }
+
+    if (ret < 0) {
+        cbio_free(p.state, CBIO_ALLOC_BATCH);
+        cbio_free(p.active, CBIO_ALLOC_BATCH);
+        return CBIO_ERROR_EINVAL;
+    }
+
+    for (size_t ii = 0; ii < npaths; ++ii) {
+        if (p.state[ii].start != NULL) {
+            size += strlen(paths[ii]) + 4 +
+                    (size_t)(p.state[ii].end - p.state[ii].start);
+        }
+    }
+
+    if ((*out = ptr = cbio_malloc(size, CBIO_ALLOC_DATA)) == NULL) {
+        cbio_free(p.state, CBIO_ALLOC_BATCH);
+        cbio_free(p.active, CBIO_ALLOC_BATCH);
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    *ptr++ = '{';
+    for (size_t ii = 0; ii < npaths; ++ii) {
+        if (p.state[ii].start != NULL) {
+            size_t npath = strlen(paths[ii]);
+            size_t nvalue = (size_t)(p.state[ii].end - p.state[ii].start);
+            if (ptr != *out + 1) {
+                *ptr++ = ',';
+            }
+            *ptr++ = '"';
+            memcpy(ptr, paths[ii], npath);
+            ptr += npath;
+            *ptr++ = '"';
+            *ptr++ = ':';
+            memcpy(ptr, p.state[ii].start, nvalue);
+            ptr += nvalue;
+        }
+    }
+    *ptr++ = '}';
+    *nout = (size_t)(ptr - *out);
+
+    cbio_free(p.state, CBIO_ALLOC_BATCH);
+    cbio_free(p.active, CBIO_ALLOC_BATCH);
+    return CBIO_SUCCESS;
+}
@@ -0,0 +1,165 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct cbio_keys_ctx {
+    cbio_key_batch_t *batch;
+    /* The number of bytes used in batch->ids */
+    size_t used;
+    /* Skip this id (all_docs includes the start key) */
+    const void *skip;
+    size_t nskip;
+};
+
+static int cbio_keys_callback(Db *db, DocInfo *docinfo, void *arg)
+{
+    struct cbio_keys_ctx *ctx = arg;
+    cbio_key_batch_t *batch = ctx->batch;
+    size_t ii = batch->nentries;
+    (void)db;
+
+    if (ctx->skip != NULL) {
+        int match = docinfo->id.size == ctx->nskip &&
+                    memcmp(docinfo->id.buf, ctx->skip, ctx->nskip) == 0;
+        ctx->skip = NULL;
+        if (match) {
+            return 0;
+        }
+    }
+
+    if (ii == batch->capacity ||
+        docinfo->id.size > batch->ids_size - ctx->used) {
+        /* couchstore only releases the docinfo if we return 0 */
+        couchstore_free_docinfo(docinfo);
+        return COUCHSTORE_ERROR_CANCEL;
+    }
+
+    memcpy(batch->ids + ctx->used, docinfo->id.buf, docinfo->id.size);
+    ctx->used += docinfo->id.size;
+    batch->id_offsets[ii + 1] = ctx->used;
+    batch->seqnos[ii] = docinfo->db_seq;
+    batch->flags[ii] = docinfo->deleted ? CBIO_KEY_DELETED : 0;
+    batch->nentries = ii + 1;
+
+    return 0;
+}
+
+static cbio_error_t cbio_keys_prepare(libcbio_t handle,
+                                      cbio_key_batch_t *batch,
+                                      struct cbio_db_ref **ref)
+{
+    cbio_error_t err;
+
+    if (batch == NULL || batch->capacity == 0 || batch->seqnos == NULL ||
+        batch->flags == NULL || batch->id_offsets == NULL ||
+        batch->ids == NULL) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    batch->nentries = 0;
+    batch->id_offsets[0] = 0;
+
+    if ((err = cbio_buffer_flush(handle)) != CBIO_SUCCESS) {
+        return err;
+    }
+
+    return cbio_acquire_db(handle, ref);
+}
+
+static cbio_error_t cbio_keys_done(struct cbio_keys_ctx *ctx,
+                                   couchstore_error_t err)
+{
+    if (err == COUCHSTORE_ERROR_CANCEL) {
+        /* The id following the last one didn't fit */
+        if (ctx->batch->nentries == 0) {
+            return CBIO_ERROR_ENOMEM;
+        }
+        err = COUCHSTORE_SUCCESS;
+    }
+
+    return cbio_remap_error(err);
+}
+
+LIBCBIO_API
+cbio_error_t cbio_changes_since_keys(libcbio_t handle,
+                                     uint64_t since,
+                                     cbio_key_batch_t *batch)
+{
+    struct cbio_keys_ctx ctx;
+    struct cbio_db_ref *ref;
+    couchstore_error_t err;
+    cbio_error_t ret;
+
+    if ((ret = cbio_keys_prepare(handle, batch, &ref)) != CBIO_SUCCESS) {
+        return ret;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.batch = batch;
+    err = couchstore_changes_since(ref->db, since, 0, cbio_keys_callback,
+                                   &ctx);
+    cbio_release_db(handle, ref);
+
+    return cbio_keys_done(&ctx, err);
+}
+
+LIBCBIO_API
+cbio_error_t cbio_all_keys(libcbio_t handle,
+                           const void *after,
+                           size_t nafter,
+                           cbio_key_batch_t *batch)
+{
+    struct cbio_keys_ctx ctx;
+    struct cbio_db_ref *ref;
+    couchstore_error_t err;
+    cbio_error_t ret;
+    sized_buf startkey;
+    void *copy = NULL;
+
+    if ((ret = cbio_keys_prepare(handle, batch, &ref)) != CBIO_SUCCESS) {
+        return ret;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.batch = batch;
+    startkey.buf = NULL;
+    startkey.size = 0;
+
+    if (after != NULL) {
+        /* The key may point into the ids we're about to overwrite */
+        if ((copy = cbio_malloc(nafter > 0 ? nafter : 1,
+                                CBIO_ALLOC_BATCH)) == NULL) {
+            cbio_release_db(handle, ref);
+            return CBIO_ERROR_ENOMEM;
+        }
+        memcpy(copy, after, nafter);
+        startkey.buf = copy;
+        startkey.size = nafter;
+        ctx.skip = copy;
+        ctx.nskip = nafter;
+    }
+
+    err = couchstore_all_docs(ref->db, &startkey, 0, cbio_keys_callback,
+                              &ctx);
+    cbio_release_db(handle, ref);
+    cbio_free(copy, CBIO_ALLOC_BATCH);
+
+    return cbio_keys_done(&ctx, err);
+}
@@ -0,0 +1,261 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Number of documents written to the new file in each batch */
+#define CBIO_PURGE_BATCH 1000
+
+struct cbio_purge_ctx {
+    libcbio_t target;
+    uint64_t before;
+    uint64_t purged;
+    /* Documents copied from below the cutoff. The copies get sequence
+       numbers 1 to kept in the new file */
+    uint64_t kept;
+    cbio_error_t error;
+    size_t ndocs;
+    libcbio_document_t docs[CBIO_PURGE_BATCH];
+};
+
+static void cbio_purge_flush(struct cbio_purge_ctx *ctx)
+{
+    if (ctx->ndocs > 0 && ctx->error == CBIO_SUCCESS) {
+        ctx->error = cbio_store_documents(ctx->target, ctx->docs, ctx->ndocs);
+    }
+
+    for (size_t ii = 0; ii < ctx->ndocs; ++ii) {
+        cbio_document_release(ctx->docs[ii]);
+    }
+    ctx->ndocs = 0;
+}
+
+static int cbio_purge_callback(libcbio_t handle,
+                               libcbio_document_t doc,
+                               void *arg)
+{
+    struct cbio_purge_ctx *ctx = arg;
+
+    if (ctx->error != CBIO_SUCCESS) {
+        return 0;
+    }
+
+    if (doc->info->deleted) {
+        if (doc->info->db_seq < ctx->before) {
+            ++ctx->purged;
+            return 0;
+        }
+    } else if ((ctx->error = cbio_document_fetch_value(handle,
+                                                        doc)) != CBIO_SUCCESS) {
+        return 0;
+    }
+
+    if (doc->info->db_seq < ctx->before) {
+        ++ctx->kept;
+    }
+    ctx->docs[ctx->ndocs++] = doc;
+    if (ctx->ndocs == CBIO_PURGE_BATCH) {
+        cbio_purge_flush(ctx);
+    }
+
+    return 1;
+}
+
+static cbio_error_t cbio_copy_local_documents(libcbio_t source,
+                                              libcbio_t target,
+                                              const char *const *local_ids,
+                                              size_t nlocal)
+{
+    for (size_t ii = 0; ii < nlocal; ++ii) {
+        libcbio_document_t doc;
+        cbio_error_t err;
+
+        err = cbio_get_document(source, local_ids[ii], strlen(local_ids[ii]),
+                                &doc);
+        if (err == CBIO_ERROR_ENOENT) {
+            continue;
+        } else if (err != CBIO_SUCCESS) {
+            return err;
+        }
+
+        err = cbio_store_document(target, doc);
+        cbio_document_release(doc);
+        if (err != CBIO_SUCCESS) {
+            return err;
+        }
+    }
+
+    return CBIO_SUCCESS;
+}
+
+/*
+ * The purge seqno is the cutoff translated to the new file: the
+ * documents are copied in sequence order, so the first sequence number
+ * in the new file past the tombstones we dropped is one more than the
+ * number of documents kept from below the cutoff
+ */
+static cbio_error_t cbio_store_purge_record(libcbio_t handle,
+                                            const struct cbio_purge_ctx *ctx,
+                                            uint64_t source_seqno)
+{
+    libcbio_document_t doc;
+    cbio_error_t err;
+    char json[160];
+    int len;
+
+    len = snprintf(json, sizeof(json),
+                   "{\"purge_seqno\":%" PRIu64 ",\"purged\":%" PRIu64
+                   ",\"source_cutoff\":%" PRIu64
+                   ",\"source_seqno\":%" PRIu64 "}",
+                   ctx->kept + 1, ctx->purged, ctx->before, source_seqno);
+
+    if ((err = cbio_create_empty_document(handle, &doc)) != CBIO_SUCCESS) {
+        return err;
+    }
+
+    if ((err = cbio_document_set_id(doc, CBIO_PURGE_DOCUMENT,
+                                    sizeof(CBIO_PURGE_DOCUMENT) - 1,
+                                    0)) == CBIO_SUCCESS &&
+        (err = cbio_document_set_value(doc, json, (size_t)len,
+                                       0)) == CBIO_SUCCESS) {
+        err = cbio_store_document(handle, doc);
+    }
+    cbio_document_release(doc);
+
+    return err;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_purge_tombstones(libcbio_t handle,
+                                   const char *target,
+                                   uint64_t before,
+                                   const char *const *local_ids,
+                                   size_t nlocal)
+{
+    struct cbio_purge_ctx *ctx;
+    struct cbio_db_ref *ref;
+    DbInfo info;
+    cbio_error_t err;
+    int fd;
+
+    if (target == NULL) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if ((err = cbio_buffer_flush(handle)) != CBIO_SUCCESS ||
+        (err = cbio_acquire_db(handle, &ref)) != CBIO_SUCCESS) {
+        return err;
+    }
+    err = cbio_remap_error(couchstore_db_info(ref->db, &info));
+    cbio_release_db(handle, ref);
+    if (err != CBIO_SUCCESS) {
+        return err;
+    }
+
+    /* Claim the name so we never write into someone else's file.
+       couchstore initializes the empty file when we open it */
+    if ((fd = open(target, O_WRONLY | O_CREAT | O_EXCL, 0644)) == -1) {
+        return errno == EEXIST ? CBIO_ERROR_EINVAL : CBIO_ERROR_OPEN_FILE;
+    }
+    close(fd);
+
+    if ((ctx = cbio_calloc(1, sizeof(*ctx), CBIO_ALLOC_BATCH)) == NULL) {
+        (void)remove(target);
+        return CBIO_ERROR_ENOMEM;
+    }
+    ctx->before = before;
+
+    if ((err = cbio_open_handle(target, CBIO_OPEN_CREATE,
+                                &ctx->target)) != CBIO_SUCCESS) {
+        cbio_free(ctx, CBIO_ALLOC_BATCH);
+        (void)remove(target);
+        return err;
+    }
+
+    err = cbio_changes_since(handle, 0, cbio_purge_callback, ctx);
+    cbio_purge_flush(ctx);
+    if (err == CBIO_SUCCESS) {
+        err = ctx->error;
+    }
+
+    if (err == CBIO_SUCCESS) {
+        err = cbio_copy_local_documents(handle, ctx->target,
+                                        local_ids, nlocal);
+    }
+
+    if (err == CBIO_SUCCESS) {
+        err = cbio_store_purge_record(ctx->target, ctx, info.last_sequence);
+    }
+
+    if (err == CBIO_SUCCESS) {
+        err = cbio_commit(ctx->target);
+    }
+
+    cbio_close_handle(ctx->target);
+    cbio_free(ctx, CBIO_ALLOC_BATCH);
+
+    if (err != CBIO_SUCCESS) {
+        (void)remove(target);
+    }
+
+    return err;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_get_purge_seqno(libcbio_t handle, uint64_t *seqno)
+{
+    libcbio_document_t doc;
+    const void *value;
+    size_t nvalue;
+    cbio_error_t err;
+    char json[128];
+    char *ptr;
+
+    err = cbio_get_document(handle, CBIO_PURGE_DOCUMENT,
+                            sizeof(CBIO_PURGE_DOCUMENT) - 1, &doc);
+    if (err == CBIO_ERROR_ENOENT) {
+        *seqno = 0;
+        return CBIO_SUCCESS;
+    } else if (err != CBIO_SUCCESS) {
+        return err;
+    }
+
+    err = cbio_document_get_value(doc, &value, &nvalue);
+    if (err == CBIO_SUCCESS) {
+        if (nvalue >= sizeof(json)) {
+            err = CBIO_ERROR_CORRUPT;
+        } else {
+            memcpy(json, value, nvalue);
+            json[nvalue] = '\0';
+            if ((ptr = strstr(json, "\"purge_seqno\":")) == NULL) {
+                err = CBIO_ERROR_CORRUPT;
+            } else {
+                *seqno = strtoull(ptr + strlen("\"purge_seqno\":"), NULL, 10);
+            }
+        }
+    }
+    cbio_document_release(doc);
+
+    return err;
+}
@@ -0,0 +1,95 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct cbio_range_ctx {
+    const void *end;
+    size_t nend;
+    cbio_range_stats_t *stats;
+};
+
+static int cbio_range_callback(Db *db, DocInfo *docinfo, void *arg)
+{
+    struct cbio_range_ctx *ctx = arg;
+    (void)db;
+
+    if (ctx->end != NULL) {
+        size_t size = docinfo->id.size < ctx->nend ?
+                      docinfo->id.size : ctx->nend;
+        int cmp = memcmp(docinfo->id.buf, ctx->end, size);
+        if (cmp > 0 || (cmp == 0 && docinfo->id.size > ctx->nend)) {
+            /* couchstore only releases the docinfo if we return 0 */
+            couchstore_free_docinfo(docinfo);
+            return COUCHSTORE_ERROR_CANCEL;
+        }
+    }
+
+    if (docinfo->deleted) {
+        ctx->stats->deleted++;
+    } else {
+        ctx->stats->live++;
+        ctx->stats->live_bytes += docinfo->size;
+    }
+
+    return 0;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_count_range(libcbio_t handle,
+                              const void *start,
+                              size_t nstart,
+                              const void *end,
+                              size_t nend,
+                              cbio_range_stats_t *stats)
+{
+    struct cbio_range_ctx ctx;
+    struct cbio_db_ref *ref;
+    couchstore_error_t err;
+    cbio_error_t ret;
+    sized_buf startkey;
+
+    if (stats == NULL) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    ctx.end = end;
+    ctx.nend = nend;
+    ctx.stats = stats;
+
+    startkey.buf = (char *)start;
+    startkey.size = start != NULL ? nstart : 0;
+
+    if ((ret = cbio_buffer_flush(handle)) != CBIO_SUCCESS ||
+        (ret = cbio_acquire_db(handle, &ref)) != CBIO_SUCCESS) {
+        return ret;
+    }
+
+    /* Only the leaf entries are visited, no document bodies are read */
+    err = couchstore_all_docs(ref->db, &startkey, 0,
+                              cbio_range_callback, &ctx);
+    cbio_release_db(handle, ref);
+
+    if (err == COUCHSTORE_ERROR_CANCEL) {
+        err = COUCHSTORE_SUCCESS;
+    }
+
+    return cbio_remap_error(err);
+}
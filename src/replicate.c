@@ -0,0 +1,407 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * cbio_replicate() is a three stage pipeline. The calling thread walks
+ * the changes feed of the source (which only reads the metadata) and
+ * cuts it into batches, a pool of threads read the document bodies,
+ * and the calling thread stores the completed batches in the
+ * destination in sequence order. The scan is allowed to run a few
+ * batches ahead of the writes.
+ *
+ * The checkpoint is stored in the destination right before every
+ * commit, so it is always consistent with the documents committed.
+ */
+#include "internal.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct cbio_repl_batch {
+    /* Link in the list of batches waiting for a thread */
+    struct cbio_repl_batch *next;
+    /* Link in the list of batches not yet stored, in seqno order */
+    struct cbio_repl_batch *inflight_next;
+    libcbio_document_t *docs;
+    size_t ndocs;
+    uint64_t last_seqno;
+    int done;
+    cbio_error_t error;
+};
+
+struct cbio_repl_ctx {
+    libcbio_t src;
+    libcbio_t dst;
+    cbio_replicate_options_t opts;
+    struct cbio_repl_batch *current;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct cbio_repl_batch *todo_head;
+    struct cbio_repl_batch *todo_tail;
+    struct cbio_repl_batch *inflight_head;
+    struct cbio_repl_batch *inflight_tail;
+    size_t ninflight;
+    int shutdown;
+
+    /* Only accessed by the calling thread */
+    uint64_t uncommitted;
+    uint64_t last_seqno;
+    cbio_error_t error;
+};
+
+LIBCBIO_API
+void cbio_replicate_options_init(cbio_replicate_options_t *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->batch_size = 1000;
+    opts->commit_interval = 100000;
+    opts->nthreads = 4;
+    opts->checkpoint_id = CBIO_REPLICATE_DOCUMENT;
+}
+
+static void cbio_repl_batch_release(struct cbio_repl_batch *batch)
+{
+    for (size_t ii = 0; ii < batch->ndocs; ++ii) {
+        cbio_document_release(batch->docs[ii]);
+    }
+    cbio_free(batch->docs, CBIO_ALLOC_BATCH);
+    cbio_free(batch, CBIO_ALLOC_BATCH);
+}
+
+static void cbio_repl_fetch(libcbio_t src, struct cbio_repl_batch *batch)
+{
+    for (size_t ii = 0; ii < batch->ndocs; ++ii) {
+        cbio_error_t err = cbio_document_fetch_value(src, batch->docs[ii]);
+        if (err != CBIO_SUCCESS && err != CBIO_ERROR_ENOENT) {
+            batch->error = err;
+            return;
+        }
+    }
+}
+
+static void *cbio_repl_worker(void *arg)
+{
+    struct cbio_repl_ctx *ctx = arg;
+
+    pthread_mutex_lock(&ctx->mutex);
+    while (1) {
+        struct cbio_repl_batch *batch;
+
+        while (ctx->todo_head == NULL && !ctx->shutdown) {
+            pthread_cond_wait(&ctx->cond, &ctx->mutex);
+        }
+        if ((batch = ctx->todo_head) == NULL) {
+            break;
+        }
+        if ((ctx->todo_head = batch->next) == NULL) {
+            ctx->todo_tail = NULL;
+        }
+        pthread_mutex_unlock(&ctx->mutex);
+
+        cbio_repl_fetch(ctx->src, batch);
+
+        pthread_mutex_lock(&ctx->mutex);
+        batch->done = 1;
+        pthread_cond_broadcast(&ctx->cond);
+    }
+    pthread_mutex_unlock(&ctx->mutex);
+
+    return NULL;
+}
+
+static cbio_error_t cbio_repl_checkpoint(struct cbio_repl_ctx *ctx)
+{
+    libcbio_document_t doc;
+    cbio_error_t err;
+    char json[64];
+    int len;
+
+    len = snprintf(json, sizeof(json), "{\"seqno\":%" PRIu64 "}",
+                   ctx->last_seqno);
+    if ((err = cbio_create_empty_document(ctx->dst, &doc)) != CBIO_SUCCESS) {
+        return err;
+    }
+
+    if ((err = cbio_document_set_id(doc, ctx->opts.checkpoint_id,
+                                    strlen(ctx->opts.checkpoint_id),
+                                    0)) == CBIO_SUCCESS &&
+        (err = cbio_document_set_value(doc, json, (size_t)len,
+                                       0)) == CBIO_SUCCESS &&
+        (err = cbio_store_document(ctx->dst, doc)) == CBIO_SUCCESS) {
+        err = cbio_commit(ctx->dst);
+    }
+    cbio_document_release(doc);
+
+    if (err == CBIO_SUCCESS) {
+        ctx->uncommitted = 0;
+    }
+
+    return err;
+}
+
+static uint64_t cbio_repl_get_checkpoint(struct cbio_repl_ctx *ctx,
+                                         int *found)
+{
+    libcbio_document_t doc;
+    const void *value;
+    size_t nvalue;
+    uint64_t ret = 0;
+    char json[64];
+    char *ptr;
+
+    *found = 0;
+    if (cbio_get_document(ctx->dst, ctx->opts.checkpoint_id,
+                          strlen(ctx->opts.checkpoint_id),
+                          &doc) != CBIO_SUCCESS) {
+        return 0;
+    }
+
+    if (cbio_document_get_value(doc, &value, &nvalue) == CBIO_SUCCESS &&
+        nvalue < sizeof(json)) {
+        memcpy(json, value, nvalue);
+        json[nvalue] = '\0';
+        if ((ptr = strstr(json, "\"seqno\":")) != NULL) {
+            ret = strtoull(ptr + strlen("\"seqno\":"), NULL, 10);
+            *found = 1;
+        }
+    }
+    cbio_document_release(doc);
+
+    return ret;
+}
+
+/*
+ * Store the oldest batch in flight in the destination (waiting for it
+ * to complete first)
+ */
+static void cbio_repl_store_oldest(struct cbio_repl_ctx *ctx)
+{
+    struct cbio_repl_batch *batch;
+
+    pthread_mutex_lock(&ctx->mutex);
+    batch = ctx->inflight_head;
+    while (!batch->done) {
+        pthread_cond_wait(&ctx->cond, &ctx->mutex);
+    }
+    if ((ctx->inflight_head = batch->inflight_next) == NULL) {
+        ctx->inflight_tail = NULL;
+    }
+    --ctx->ninflight;
+    pthread_mutex_unlock(&ctx->mutex);
+
+    if (ctx->error == CBIO_SUCCESS) {
+        ctx->error = batch->error;
+    }
+
+    if (ctx->error == CBIO_SUCCESS) {
+        ctx->error = cbio_store_documents(ctx->dst, batch->docs,
+                                          batch->ndocs);
+        if (ctx->error == CBIO_SUCCESS) {
+            ctx->last_seqno = batch->last_seqno;
+            ctx->uncommitted += batch->ndocs;
+            if (ctx->uncommitted >= ctx->opts.commit_interval) {
+                ctx->error = cbio_repl_checkpoint(ctx);
+            }
+        }
+    }
+
+    cbio_repl_batch_release(batch);
+}
+
+static void cbio_repl_submit_current(struct cbio_repl_ctx *ctx)
+{
+    struct cbio_repl_batch *batch = ctx->current;
+    ctx->current = NULL;
+
+    /* Without threads to help us we read the bodies ourself */
+    if (ctx->opts.nthreads == 0) {
+        cbio_repl_fetch(ctx->src, batch);
+        batch->done = 1;
+    }
+
+    pthread_mutex_lock(&ctx->mutex);
+    if (!batch->done) {
+        if (ctx->todo_tail == NULL) {
+            ctx->todo_head = ctx->todo_tail = batch;
+        } else {
+            ctx->todo_tail->next = batch;
+            ctx->todo_tail = batch;
+        }
+    }
+    if (ctx->inflight_tail == NULL) {
+        ctx->inflight_head = ctx->inflight_tail = batch;
+    } else {
+        ctx->inflight_tail->inflight_next = batch;
+        ctx->inflight_tail = batch;
+    }
+    ++ctx->ninflight;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->mutex);
+}
+
+static int cbio_repl_changes_callback(libcbio_t handle,
+                                      libcbio_document_t doc,
+                                      void *arg)
+{
+    struct cbio_repl_ctx *ctx = arg;
+    (void)handle;
+
+    if (ctx->error != CBIO_SUCCESS) {
+        /* No point in reading the rest of the feed */
+        return -1;
+    }
+
+    if (ctx->current == NULL) {
+        struct cbio_repl_batch *batch;
+
+        batch = cbio_calloc(1, sizeof(*batch), CBIO_ALLOC_BATCH);
+        if (batch == NULL ||
+            (batch->docs = cbio_calloc(ctx->opts.batch_size,
+                                       sizeof(libcbio_document_t),
+                                       CBIO_ALLOC_BATCH)) == NULL) {
+            cbio_free(batch, CBIO_ALLOC_BATCH);
+            ctx->error = CBIO_ERROR_ENOMEM;
+            return -1;
+        }
+        ctx->current = batch;
+    }
+
+    ctx->current->docs[ctx->current->ndocs++] = doc;
+    ctx->current->last_seqno = doc->info->db_seq;
+
+    if (ctx->current->ndocs == ctx->opts.batch_size) {
+        /* Don't let the scan run too far ahead of the writes */
+        size_t max = ctx->opts.nthreads > 0 ?
+                     (size_t)ctx->opts.nthreads * 2 : 1;
+        while (ctx->ninflight >= max) {
+            cbio_repl_store_oldest(ctx);
+        }
+        cbio_repl_submit_current(ctx);
+    }
+
+    /* Keep the document, it is released once it is stored */
+    return 1;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_replicate(libcbio_t src,
+                            libcbio_t dst,
+                            uint64_t since,
+                            const cbio_replicate_options_t *opts)
+{
+    struct cbio_repl_ctx *ctx;
+    pthread_t *threads = NULL;
+    int nthreads = 0;
+    cbio_error_t err;
+
+    if (src == dst || dst->mode == CBIO_OPEN_RDONLY ||
+        dst->mode == CBIO_OPEN_SHARED_RDONLY) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if ((ctx = cbio_calloc(1, sizeof(*ctx), CBIO_ALLOC_BATCH)) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    ctx->src = src;
+    ctx->dst = dst;
+    if (opts != NULL) {
+        ctx->opts = *opts;
+    } else {
+        cbio_replicate_options_init(&ctx->opts);
+    }
+
+    if (ctx->opts.batch_size == 0 || ctx->opts.nthreads < 0 ||
+        ctx->opts.checkpoint_id == NULL ||
+        strncmp(ctx->opts.checkpoint_id, "_local/", 7) != 0) {
+        cbio_free(ctx, CBIO_ALLOC_BATCH);
+        return CBIO_ERROR_EINVAL;
+    }
+
+    /* Only shared handles may be read from multiple threads */
+    if (src->mode != CBIO_OPEN_SHARED_RDONLY) {
+        ctx->opts.nthreads = 0;
+    }
+
+    if (ctx->opts.resume) {
+        int found;
+        uint64_t seqno = cbio_repl_get_checkpoint(ctx, &found);
+        if (found && seqno >= since) {
+            since = seqno + 1;
+        }
+    }
+
+    pthread_mutex_init(&ctx->mutex, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+
+    if (ctx->opts.nthreads > 0) {
+        threads = cbio_calloc((size_t)ctx->opts.nthreads, sizeof(pthread_t),
+                              CBIO_ALLOC_BATCH);
+        if (threads == NULL) {
+            ctx->opts.nthreads = 0;
+        }
+        for (; threads != NULL && nthreads < ctx->opts.nthreads; ++nthreads) {
+            if (pthread_create(threads + nthreads, NULL, cbio_repl_worker,
+                               ctx) != 0) {
+                break;
+            }
+        }
+        ctx->opts.nthreads = nthreads;
+    }
+
+    err = cbio_changes_since(src, since, cbio_repl_changes_callback, ctx);
+    if (ctx->current != NULL) {
+        cbio_repl_submit_current(ctx);
+    }
+    while (ctx->ninflight > 0) {
+        cbio_repl_store_oldest(ctx);
+    }
+
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->shutdown = 1;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->mutex);
+    for (int ii = 0; ii < nthreads; ++ii) {
+        pthread_join(threads[ii], NULL);
+    }
+    cbio_free(threads, CBIO_ALLOC_BATCH);
+
+    if (err == CBIO_SUCCESS) {
+        err = ctx->error;
+    }
+    /*
+     * Whatever we stored is committed when the handle is closed, so
+     * record how far we got even if we failed (the checkpoint only
+     * covers the batches that were stored)
+     */
+    if (ctx->uncommitted > 0) {
+        cbio_error_t cerr = cbio_repl_checkpoint(ctx);
+        if (err == CBIO_SUCCESS) {
+            err = cerr;
+        }
+    }
+
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->mutex);
+    cbio_free(ctx, CBIO_ALLOC_BATCH);
+
+    return err;
+}
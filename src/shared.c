@@ -0,0 +1,289 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static void cbio_ref_destroy(struct cbio_db_ref *ref)
+{
+    cbio_close_db(ref->db, &ref->file);
+    cbio_free(ref, CBIO_ALLOC_HANDLE);
+}
+
+static struct cbio_db_ref *cbio_ref_create(Db *db,
+                                           uint64_t generation,
+                                           const struct cbio_file_id *file)
+{
+    struct cbio_db_ref *ref = cbio_calloc(1, sizeof(*ref), CBIO_ALLOC_HANDLE);
+    if (ref != NULL) {
+        ref->db = db;
+        ref->generation = generation;
+        ref->file = *file;
+    }
+    return ref;
+}
+
+/*
+ * Try to put the reference back on the idle list. If there is no
+ * room for it we'll just close it
+ */
+static void cbio_shared_park(struct cbio_shared_st *shared,
+                             struct cbio_db_ref *ref)
+{
+    for (int ii = 0; ii < CBIO_SHARED_POOL_SIZE; ++ii) {
+        if (shared->idle[ii] == NULL &&
+            __sync_bool_compare_and_swap(&shared->idle[ii], NULL, ref)) {
+            /* Both this and cbio_shared_wait() use full barriers, so
+               either we see the waiter or it sees the Db */
+            if (__sync_fetch_and_add(&shared->waiters, 0) > 0) {
+                pthread_mutex_lock(&shared->mutex);
+                pthread_cond_broadcast(&shared->released);
+                pthread_mutex_unlock(&shared->mutex);
+            }
+            return;
+        }
+    }
+    cbio_ref_destroy(ref);
+}
+
+static int cbio_shared_has_idle(struct cbio_shared_st *shared)
+{
+    for (int ii = 0; ii < CBIO_SHARED_POOL_SIZE; ++ii) {
+        if (shared->idle[ii] != NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Wait (for a while) until there is something on the idle list or a
+ * new header is published
+ */
+static void cbio_shared_wait(struct cbio_shared_st *shared,
+                             uint64_t generation)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)CBIO_SHARED_WAIT_MS * 1000000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+
+    pthread_mutex_lock(&shared->mutex);
+    __sync_add_and_fetch(&shared->waiters, 1);
+    while (generation == shared->generation && !cbio_shared_has_idle(shared)) {
+        if (pthread_cond_timedwait(&shared->released, &shared->mutex,
+                                   &deadline) != 0) {
+            break;
+        }
+    }
+    __sync_sub_and_fetch(&shared->waiters, 1);
+    pthread_mutex_unlock(&shared->mutex);
+}
+
+cbio_error_t cbio_shared_create(libcbio_t handle, Db *db)
+{
+    struct cbio_shared_st *shared = cbio_calloc(1, sizeof(*shared),
+                                                CBIO_ALLOC_HANDLE);
+    struct cbio_db_ref *ref = cbio_ref_create(db, 0, &handle->exclusive.file);
+
+    if (shared == NULL || ref == NULL) {
+        cbio_free(shared, CBIO_ALLOC_HANDLE);
+        cbio_free(ref, CBIO_ALLOC_HANDLE);
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    shared->header_position = couchstore_get_header_position(db);
+    shared->file = handle->exclusive.file;
+    shared->idle[0] = ref;
+    pthread_mutex_init(&shared->mutex, NULL);
+    pthread_cond_init(&shared->released, NULL);
+    handle->shared = shared;
+
+    return CBIO_SUCCESS;
+}
+
+void cbio_shared_destroy(libcbio_t handle)
+{
+    for (int ii = 0; ii < CBIO_SHARED_POOL_SIZE; ++ii) {
+        if (handle->shared->idle[ii] != NULL) {
+            cbio_ref_destroy(handle->shared->idle[ii]);
+        }
+    }
+    pthread_cond_destroy(&handle->shared->released);
+    pthread_mutex_destroy(&handle->shared->mutex);
+    cbio_free(handle->shared, CBIO_ALLOC_HANDLE);
+    handle->shared = NULL;
+}
+
+static uint64_t cbio_shared_advance(struct cbio_shared_st *shared,
+                                    Db *db,
+                                    const struct cbio_file_id *file)
+{
+    /* Publish the header position before the generation so that a
+       reader seeing the new generation also see the new position */
+    shared->header_position = couchstore_get_header_position(db);
+    shared->file = *file;
+    return __sync_add_and_fetch(&shared->generation, 1);
+}
+
+void cbio_shared_publish(libcbio_t handle,
+                         Db *db,
+                         const struct cbio_file_id *file)
+{
+    struct cbio_shared_st *shared = handle->shared;
+    uint64_t generation = cbio_shared_advance(shared, db, file);
+
+    struct cbio_db_ref *ref = cbio_ref_create(db, generation, file);
+    if (ref == NULL) {
+        /* Readers will open the new header on demand */
+        cbio_close_db(db, file);
+    } else {
+        cbio_shared_park(shared, ref);
+    }
+}
+
+#define CBIO_ADOPT_OK 1
+#define CBIO_ADOPT_RETRY 0
+#define CBIO_ADOPT_NEWER -1
+
+/*
+ * Figure out which generation a Db we just opened belongs to. couchstore
+ * always opens the most recent header on disk (and can't be told to
+ * open an older one), which may be newer than the one published for
+ * the handle. Such a Db is refused with CBIO_ADOPT_NEWER unless
+ * advance is set, in which case the handle is moved forward to it (as
+ * a refresh would) rather than letting this reader see a newer
+ * snapshot than cbio_get_header_position() reports. Returns
+ * CBIO_ADOPT_RETRY if the Db is older than the published header
+ * (another thread moved the handle forward while we opened it).
+ */
+static int cbio_shared_adopt(libcbio_t handle,
+                             Db *db,
+                             const struct cbio_file_id *file,
+                             int advance,
+                             uint64_t *generation)
+{
+    struct cbio_shared_st *shared = handle->shared;
+    uint64_t header = couchstore_get_header_position(db);
+    struct stat st;
+    int ret = CBIO_ADOPT_OK;
+
+    pthread_mutex_lock(&shared->mutex);
+    if (file->ino == shared->file.ino && file->dev == shared->file.dev &&
+        header <= shared->header_position) {
+        /* The file is append-only, so a lower position is older */
+        if (header == shared->header_position) {
+            *generation = __sync_fetch_and_add(&shared->generation, 0);
+        } else {
+            ret = CBIO_ADOPT_RETRY;
+        }
+    } else if (file->ino != 0 && stat(handle->name, &st) == 0 &&
+               st.st_ino == file->ino && st.st_dev == file->dev) {
+        if (advance) {
+            *generation = cbio_shared_advance(shared, db, file);
+        } else {
+            ret = CBIO_ADOPT_NEWER;
+        }
+    } else {
+        /* The file was replaced after we opened it */
+        ret = CBIO_ADOPT_RETRY;
+    }
+    pthread_mutex_unlock(&shared->mutex);
+
+    return ret;
+}
+
+cbio_error_t cbio_acquire_db(libcbio_t handle, struct cbio_db_ref **ref)
+{
+    struct cbio_shared_st *shared = handle->shared;
+    uint64_t generation;
+    struct cbio_file_id file;
+    couchstore_error_t err;
+    int waited = 0;
+    Db *db;
+
+    if (shared == NULL) {
+        handle->exclusive.db = handle->couchstore_handle;
+        *ref = &handle->exclusive;
+        return CBIO_SUCCESS;
+    }
+
+    do {
+        generation = __sync_fetch_and_add(&shared->generation, 0);
+        for (int ii = 0; ii < CBIO_SHARED_POOL_SIZE; ++ii) {
+            struct cbio_db_ref *curr = shared->idle[ii];
+            if (curr != NULL &&
+                __sync_bool_compare_and_swap(&shared->idle[ii], curr, NULL)) {
+                if (curr->generation == generation) {
+                    *ref = curr;
+                    return CBIO_SUCCESS;
+                }
+                /* This one was opened on an older header */
+                cbio_ref_destroy(curr);
+            }
+        }
+
+        err = cbio_open_db(handle->name, COUCHSTORE_OPEN_FLAG_RDONLY,
+                           &db, &file);
+        if (err != COUCHSTORE_SUCCESS) {
+            return cbio_remap_error(err);
+        }
+
+        switch (cbio_shared_adopt(handle, db, &file, waited, &generation)) {
+        case CBIO_ADOPT_OK:
+            break;
+        case CBIO_ADOPT_NEWER:
+            /* Rather wait for one of the others to be released than
+               move the handle. If the caller holds the last of them
+               itself, we give up and move it after a while */
+            cbio_close_db(db, &file);
+            db = NULL;
+            cbio_shared_wait(shared, generation);
+            waited = 1;
+            break;
+        default:
+            cbio_close_db(db, &file);
+            db = NULL;
+        }
+    } while (db == NULL);
+
+    if ((*ref = cbio_ref_create(db, generation, &file)) == NULL) {
+        cbio_close_db(db, &file);
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    return CBIO_SUCCESS;
+}
+
+void cbio_release_db(libcbio_t handle, struct cbio_db_ref *ref)
+{
+    struct cbio_shared_st *shared = handle->shared;
+
+    if (shared == NULL) {
+        return;
+    }
+
+    if (ref->generation != __sync_fetch_and_add(&shared->generation, 0)) {
+        cbio_ref_destroy(ref);
+    } else {
+        cbio_shared_park(shared, ref);
+    }
+}
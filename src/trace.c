@@ -0,0 +1,71 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+#include "internal.h"
+
+/*
+ * Like the allocator, the trace callback is installed before libcbio
+ * is used, so the hot paths only test cbio_trace_callback without
+ * any locking.
+ */
+cbio_trace_callback_t cbio_trace_callback;
+static void *trace_cookie;
+
+#ifdef CBIO_PROBES
+/*
+ * The semaphores of the probes, in the section where the tools
+ * attaching to the probes expect them (like dtrace -G would generate)
+ */
+#define CBIO_PROBE_DEFINE(name) \
+    volatile unsigned short libcbio_##name##_entry_semaphore \
+        __attribute__((section(".probes"))); \
+    volatile unsigned short libcbio_##name##_return_semaphore \
+        __attribute__((section(".probes")))
+CBIO_PROBE_DEFINE(get_document);
+CBIO_PROBE_DEFINE(store_documents);
+CBIO_PROBE_DEFINE(commit);
+CBIO_PROBE_DEFINE(changes_since);
+CBIO_PROBE_DEFINE(changes_callback);
+#endif
+
+LIBCBIO_API
+void cbio_set_trace_callback(cbio_trace_callback_t callback, void *cookie)
+{
+    trace_cookie = cookie;
+    cbio_trace_callback = callback;
+}
+
+void cbio_trace(libcbio_t handle,
+                cbio_trace_op_t op,
+                int done,
+                uint64_t ndocs,
+                uint64_t nkey,
+                uint64_t nbytes,
+                int result)
+{
+    cbio_trace_event_t event;
+    cbio_trace_callback_t callback = cbio_trace_callback;
+
+    if (callback != NULL) {
+        event.op = op;
+        event.done = done;
+        event.ndocs = ndocs;
+        event.nkey = nkey;
+        event.nbytes = nbytes;
+        event.result = result;
+        callback(handle, &event, trace_cookie);
+    }
+}
@@ -0,0 +1,498 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * cbio_verify() reads every node of the by-id and by-sequence trees and
+ * every document body (couchstore validates the checksum of everything
+ * it reads). couchstore doesn't let us visit the nodes directly, so the
+ * trees are read through the iterators. Each file is split into tasks:
+ * one for the by-id tree, and one per range of sequence numbers (which
+ * also reads the bodies). The tasks are run by a pool of threads, each
+ * with its own couchstore handle.
+ *
+ * When an iteration of the by-sequence tree fails we probe for the
+ * next sequence number we're able to look up (doubling the distance
+ * every time) and report everything in between as corrupt. There is
+ * no way to skip past a broken part of the by-id tree, so we report
+ * everything after the last id read.
+ */
+#include "internal.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct cbio_verify_task {
+    struct cbio_verify_task *next;
+    size_t file;
+    /* Set for the task walking the by-id tree */
+    int by_id;
+    uint64_t first_seqno;
+    uint64_t last_seqno;
+};
+
+struct cbio_verify_ctx {
+    const char *const *paths;
+    cbio_verify_options_t opts;
+
+    pthread_mutex_t mutex;
+    struct cbio_verify_task *tasks;
+    /* The number of tasks not completed for each file */
+    size_t *remaining;
+    cbio_verify_progress_t progress;
+    cbio_error_t error;
+    uint64_t started;
+    uint64_t last_progress;
+};
+
+struct cbio_verify_scan {
+    struct cbio_verify_ctx *ctx;
+    struct cbio_verify_task *task;
+    /* The next sequence number (or the last id) we expect to read */
+    uint64_t next;
+    char *id;
+    size_t nid;
+    size_t idsize;
+    /* Documents and bytes not yet added to the progress */
+    uint64_t documents;
+    uint64_t bytes;
+};
+
+LIBCBIO_API
+void cbio_verify_options_init(cbio_verify_options_t *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->nthreads = 4;
+    opts->seqnos_per_task = 100000;
+    opts->progress_interval_ms = 1000;
+}
+
+static uint64_t cbio_verify_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void cbio_verify_report(struct cbio_verify_ctx *ctx,
+                               const cbio_verify_problem_t *problem)
+{
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->progress.problems++;
+    if (ctx->error == CBIO_SUCCESS) {
+        ctx->error = problem->error;
+    }
+    if (ctx->opts.problem != NULL) {
+        ctx->opts.problem(problem, ctx->opts.cookie);
+    }
+    pthread_mutex_unlock(&ctx->mutex);
+}
+
+static void cbio_verify_report_range(struct cbio_verify_scan *scan,
+                                     cbio_verify_area_t area,
+                                     uint64_t first,
+                                     uint64_t last,
+                                     cbio_error_t error)
+{
+    cbio_verify_problem_t problem;
+
+    memset(&problem, 0, sizeof(problem));
+    problem.path = scan->ctx->paths[scan->task->file];
+    problem.area = area;
+    problem.first_seqno = first;
+    problem.last_seqno = last;
+    problem.error = error;
+    if (area == CBIO_VERIFY_BY_ID) {
+        problem.id = scan->id;
+        problem.nid = scan->nid;
+    }
+    cbio_verify_report(scan->ctx, &problem);
+}
+
+/*
+ * Add what we've read to the progress, call the progress callback if
+ * it's time to do so and sleep if we're ahead of the throttle
+ */
+static void cbio_verify_account(struct cbio_verify_scan *scan)
+{
+    struct cbio_verify_ctx *ctx = scan->ctx;
+    uint64_t now = cbio_verify_now();
+    uint64_t delay = 0;
+
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->progress.documents += scan->documents;
+    ctx->progress.bytes += scan->bytes;
+    scan->documents = scan->bytes = 0;
+
+    if (ctx->opts.progress != NULL &&
+        now - ctx->last_progress >= ctx->opts.progress_interval_ms) {
+        ctx->last_progress = now;
+        ctx->opts.progress(&ctx->progress, ctx->opts.cookie);
+    }
+
+    if (ctx->opts.max_bytes_per_sec != 0) {
+        uint64_t due = ctx->progress.bytes * 1000 /
+                       ctx->opts.max_bytes_per_sec + ctx->started;
+        if (due > now) {
+            delay = due - now;
+        }
+    }
+    pthread_mutex_unlock(&ctx->mutex);
+
+    if (delay > 0) {
+        struct timespec ts;
+        ts.tv_sec = (time_t)(delay / 1000);
+        ts.tv_nsec = (long)(delay % 1000) * 1000000;
+        nanosleep(&ts, NULL);
+    }
+}
+
+static int cbio_verify_seqno_callback(Db *db, DocInfo *docinfo, void *arg)
+{
+    struct cbio_verify_scan *scan = arg;
+
+    if (docinfo->db_seq > scan->task->last_seqno) {
+        /* couchstore only releases the docinfo if we return 0 */
+        couchstore_free_docinfo(docinfo);
+        return COUCHSTORE_ERROR_CANCEL;
+    }
+
+    scan->next = docinfo->db_seq + 1;
+    scan->documents++;
+    scan->bytes += docinfo->id.size + docinfo->rev_meta.size;
+
+    if (docinfo->bp != 0) {
+        Doc *doc;
+        couchstore_error_t err;
+
+        err = couchstore_open_doc_with_docinfo(db, docinfo, &doc, 0);
+        if (err == COUCHSTORE_SUCCESS) {
+            couchstore_free_document(doc);
+            scan->bytes += docinfo->size;
+        } else {
+            cbio_verify_problem_t problem;
+
+            memset(&problem, 0, sizeof(problem));
+            problem.path = scan->ctx->paths[scan->task->file];
+            problem.area = CBIO_VERIFY_BODY;
+            problem.first_seqno = problem.last_seqno = docinfo->db_seq;
+            problem.id = docinfo->id.buf;
+            problem.nid = docinfo->id.size;
+            problem.error = cbio_remap_error(err);
+            cbio_verify_report(scan->ctx, &problem);
+        }
+    }
+
+    if (scan->bytes >= 64 * 1024 || scan->documents >= 1000) {
+        cbio_verify_account(scan);
+    }
+
+    return 0;
+}
+
+static int cbio_verify_probe_callback(Db *db, DocInfo *docinfo, void *arg)
+{
+    uint64_t *found = arg;
+    (void)db;
+
+    *found = docinfo->db_seq;
+    couchstore_free_docinfo(docinfo);
+    return COUCHSTORE_ERROR_CANCEL;
+}
+
+/*
+ * Locate the first sequence number after `bad` in the task we're able
+ * to read. Returns 0 if there is none.
+ */
+static uint64_t cbio_verify_probe(Db *db, uint64_t bad, uint64_t last)
+{
+    uint64_t step = 1;
+
+    while (bad + step <= last) {
+        couchstore_error_t err;
+        uint64_t found = 0;
+
+        err = couchstore_changes_since(db, bad + step, 0,
+                                       cbio_verify_probe_callback, &found);
+        if (err == COUCHSTORE_SUCCESS || err == COUCHSTORE_ERROR_CANCEL) {
+            return found <= last ? found : 0;
+        }
+        step *= 2;
+    }
+
+    return 0;
+}
+
+static void cbio_verify_seqnos(struct cbio_verify_scan *scan, Db *db)
+{
+    struct cbio_verify_task *task = scan->task;
+
+    scan->next = task->first_seqno;
+    while (scan->next <= task->last_seqno) {
+        couchstore_error_t err;
+        uint64_t bad, resume;
+
+        err = couchstore_changes_since(db, scan->next, 0,
+                                       cbio_verify_seqno_callback, scan);
+        if (err == COUCHSTORE_SUCCESS || err == COUCHSTORE_ERROR_CANCEL) {
+            break;
+        }
+
+        bad = scan->next;
+        resume = cbio_verify_probe(db, bad, task->last_seqno);
+        cbio_verify_report_range(scan, CBIO_VERIFY_BY_SEQNO, bad,
+                                 resume != 0 ? resume - 1 : task->last_seqno,
+                                 cbio_remap_error(err));
+        if (resume == 0) {
+            break;
+        }
+        scan->next = resume;
+    }
+}
+
+static int cbio_verify_id_callback(Db *db, DocInfo *docinfo, void *arg)
+{
+    struct cbio_verify_scan *scan = arg;
+    (void)db;
+
+    if (docinfo->id.size > scan->idsize) {
+        char *ptr = cbio_realloc(scan->id, docinfo->id.size, CBIO_ALLOC_BATCH);
+        if (ptr == NULL) {
+            couchstore_free_docinfo(docinfo);
+            return COUCHSTORE_ERROR_ALLOC_FAIL;
+        }
+        scan->id = ptr;
+        scan->idsize = docinfo->id.size;
+    }
+    memcpy(scan->id, docinfo->id.buf, docinfo->id.size);
+    scan->nid = docinfo->id.size;
+    scan->bytes += docinfo->id.size + docinfo->rev_meta.size;
+
+    if (scan->bytes >= 64 * 1024) {
+        cbio_verify_account(scan);
+    }
+
+    return 0;
+}
+
+static void cbio_verify_ids(struct cbio_verify_scan *scan, Db *db)
+{
+    couchstore_error_t err;
+
+    err = couchstore_all_docs(db, NULL, 0, cbio_verify_id_callback, scan);
+    if (err != COUCHSTORE_SUCCESS) {
+        cbio_verify_report_range(scan, CBIO_VERIFY_BY_ID, 0, 0,
+                                 cbio_remap_error(err));
+    }
+}
+
+static void cbio_verify_run(struct cbio_verify_ctx *ctx,
+                            struct cbio_verify_task *task)
+{
+    struct cbio_verify_scan scan;
+    couchstore_error_t err;
+    Db *db;
+
+    memset(&scan, 0, sizeof(scan));
+    scan.ctx = ctx;
+    scan.task = task;
+
+    err = couchstore_open_db(ctx->paths[task->file],
+                             COUCHSTORE_OPEN_FLAG_RDONLY, &db);
+    if (err != COUCHSTORE_SUCCESS) {
+        cbio_verify_report_range(&scan, CBIO_VERIFY_FILE, task->first_seqno,
+                                 task->last_seqno, cbio_remap_error(err));
+    } else {
+        if (task->by_id) {
+            cbio_verify_ids(&scan, db);
+        } else {
+            cbio_verify_seqnos(&scan, db);
+        }
+        couchstore_close_db(db);
+    }
+    cbio_free(scan.id, CBIO_ALLOC_BATCH);
+
+    pthread_mutex_lock(&ctx->mutex);
+    if (--ctx->remaining[task->file] == 0) {
+        ctx->progress.files_done++;
+    }
+    pthread_mutex_unlock(&ctx->mutex);
+    cbio_verify_account(&scan);
+}
+
+static void *cbio_verify_worker(void *arg)
+{
+    struct cbio_verify_ctx *ctx = arg;
+    struct cbio_verify_task *task;
+
+    while (1) {
+        pthread_mutex_lock(&ctx->mutex);
+        if ((task = ctx->tasks) != NULL) {
+            ctx->tasks = task->next;
+        }
+        pthread_mutex_unlock(&ctx->mutex);
+
+        if (task == NULL) {
+            break;
+        }
+        cbio_verify_run(ctx, task);
+        cbio_free(task, CBIO_ALLOC_BATCH);
+    }
+
+    return NULL;
+}
+
+static cbio_error_t cbio_verify_add_task(struct cbio_verify_ctx *ctx,
+                                         struct cbio_verify_task ***tail,
+                                         size_t file,
+                                         int by_id,
+                                         uint64_t first,
+                                         uint64_t last)
+{
+    struct cbio_verify_task *task = cbio_calloc(1, sizeof(*task),
+                                                CBIO_ALLOC_BATCH);
+    if (task == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    task->file = file;
+    task->by_id = by_id;
+    task->first_seqno = first;
+    task->last_seqno = last;
+    **tail = task;
+    *tail = &task->next;
+    ctx->remaining[file]++;
+
+    return CBIO_SUCCESS;
+}
+
+/*
+ * Split the files into tasks. The sequence numbers are only known
+ * once a file is opened, so a file we can't open gets a single task
+ * (which reports the problem).
+ */
+static cbio_error_t cbio_verify_plan(struct cbio_verify_ctx *ctx,
+                                     size_t npaths)
+{
+    struct cbio_verify_task **tail = &ctx->tasks;
+    cbio_error_t err = CBIO_SUCCESS;
+
+    for (size_t ii = 0; ii < npaths && err == CBIO_SUCCESS; ++ii) {
+        couchstore_error_t cerr;
+        uint64_t last = 0;
+        DbInfo info;
+        Db *db;
+
+        if (couchstore_open_db(ctx->paths[ii], COUCHSTORE_OPEN_FLAG_RDONLY,
+                               &db) == COUCHSTORE_SUCCESS) {
+            if ((cerr = couchstore_db_info(db, &info)) == COUCHSTORE_SUCCESS) {
+                last = info.last_sequence;
+            } else {
+                /* We don't know which sequence numbers to read */
+                cbio_verify_problem_t problem;
+
+                memset(&problem, 0, sizeof(problem));
+                problem.path = ctx->paths[ii];
+                problem.area = CBIO_VERIFY_FILE;
+                problem.error = cbio_remap_error(cerr);
+                cbio_verify_report(ctx, &problem);
+            }
+            couchstore_close_db(db);
+        }
+
+        err = cbio_verify_add_task(ctx, &tail, ii, 1, 0, 0);
+        for (uint64_t first = 1;
+             first <= last && err == CBIO_SUCCESS;
+             first += ctx->opts.seqnos_per_task) {
+            uint64_t end = first + ctx->opts.seqnos_per_task - 1;
+            err = cbio_verify_add_task(ctx, &tail, ii, 0, first,
+                                       end < last ? end : last);
+        }
+    }
+
+    return err;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_verify(const char *const *paths,
+                         size_t npaths,
+                         const cbio_verify_options_t *opts)
+{
+    struct cbio_verify_ctx ctx;
+    pthread_t *threads = NULL;
+    int nthreads = 0;
+    cbio_error_t err;
+
+    if (paths == NULL || npaths == 0) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.paths = paths;
+    if (opts != NULL) {
+        ctx.opts = *opts;
+    } else {
+        cbio_verify_options_init(&ctx.opts);
+    }
+    if (ctx.opts.seqnos_per_task == 0) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if ((ctx.remaining = cbio_calloc(npaths, sizeof(size_t),
+                                     CBIO_ALLOC_BATCH)) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+    ctx.progress.nfiles = npaths;
+    pthread_mutex_init(&ctx.mutex, NULL);
+
+    if ((err = cbio_verify_plan(&ctx, npaths)) == CBIO_SUCCESS) {
+        ctx.started = ctx.last_progress = cbio_verify_now();
+
+        if (ctx.opts.nthreads > 1) {
+            threads = cbio_calloc((size_t)ctx.opts.nthreads, sizeof(pthread_t),
+                                  CBIO_ALLOC_BATCH);
+        }
+        /* The calling thread is one of the workers */
+        while (threads != NULL && nthreads < ctx.opts.nthreads - 1 &&
+               pthread_create(threads + nthreads, NULL, cbio_verify_worker,
+                              &ctx) == 0) {
+            ++nthreads;
+        }
+
+        cbio_verify_worker(&ctx);
+        for (int ii = 0; ii < nthreads; ++ii) {
+            pthread_join(threads[ii], NULL);
+        }
+        cbio_free(threads, CBIO_ALLOC_BATCH);
+
+        if (ctx.opts.progress != NULL) {
+            ctx.opts.progress(&ctx.progress, ctx.opts.cookie);
+        }
+        err = ctx.error;
+    }
+
+    while (ctx.tasks != NULL) {
+        struct cbio_verify_task *next = ctx.tasks->next;
+        cbio_free(ctx.tasks, CBIO_ALLOC_BATCH);
+        ctx.tasks = next;
+    }
+    pthread_mutex_destroy(&ctx.mutex);
+    cbio_free(ctx.remaining, CBIO_ALLOC_BATCH);
+
+    return err;
+}
@@ -0,0 +1,511 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * The access log is a sample of the ids read through the handle, kept
+ * in a ring (so it follows the working set) and saved to a sidecar
+ * file. It isn't stored as a local document since the reads it records
+ * are typically done through read only handles. The file contains the
+ * sorted, unique ids (integers are stored in network byte order):
+ *
+ *   "CBIOACC1" uint32_t count
+ *
+ * followed by count entries of:
+ *
+ *   uint32_t nid, id
+ *
+ * cbio_warmup() looks up all of the ids in a single pass of the by-id
+ * tree (which reads the paths to them), sorts the documents by their
+ * offset in the file, and reads the bodies with a number of threads
+ * (with their own couchstore handles) working their way forward
+ * through the file together.
+ */
+#include "internal.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CBIO_ACCESS_LOG_MAGIC "CBIOACC1"
+
+struct cbio_access_entry {
+    char *id;
+    size_t nid;
+};
+
+struct cbio_access_log_st {
+    pthread_mutex_t mutex;
+    char *path;
+    uint32_t sample_rate;
+    uint64_t reads;
+    struct cbio_access_entry *ring;
+    size_t size;
+    size_t next;
+};
+
+static void cbio_encode_uint32(unsigned char *dest, uint32_t val)
+{
+    dest[0] = (unsigned char)(val >> 24);
+    dest[1] = (unsigned char)(val >> 16);
+    dest[2] = (unsigned char)(val >> 8);
+    dest[3] = (unsigned char)val;
+}
+
+static uint32_t cbio_decode_uint32(const unsigned char *src)
+{
+    return ((uint32_t)src[0] << 24) | ((uint32_t)src[1] << 16) |
+           ((uint32_t)src[2] << 8) | (uint32_t)src[3];
+}
+
+/* Same ordering as couchstore use for the by-id tree */
+static int cbio_access_compare(const void *a, const void *b)
+{
+    const struct cbio_access_entry *x = a;
+    const struct cbio_access_entry *y = b;
+    size_t size = x->nid < y->nid ? x->nid : y->nid;
+    int ret = memcmp(x->id, y->id, size);
+    if (ret == 0) {
+        ret = x->nid < y->nid ? -1 : (x->nid > y->nid ? 1 : 0);
+    }
+    return ret;
+}
+
+void cbio_access_log_record(libcbio_t handle, const void *id, size_t nid)
+{
+    struct cbio_access_log_st *log = handle->access_log;
+    struct cbio_access_entry *entry;
+    char *copy;
+
+    if (__sync_add_and_fetch(&log->reads, 1) % log->sample_rate != 0) {
+        return;
+    }
+
+    if ((copy = cbio_malloc(nid > 0 ? nid : 1, CBIO_ALLOC_OTHER)) == NULL) {
+        /* It's only a sample anyway */
+        return;
+    }
+    memcpy(copy, id, nid);
+
+    pthread_mutex_lock(&log->mutex);
+    entry = log->ring + log->next;
+    cbio_free(entry->id, CBIO_ALLOC_OTHER);
+    entry->id = copy;
+    entry->nid = nid;
+    log->next = (log->next + 1) % log->size;
+    pthread_mutex_unlock(&log->mutex);
+}
+
+/* Write the (sorted) entries, skipping duplicates */
+static cbio_error_t cbio_access_log_write(FILE *fp,
+                                          const struct cbio_access_entry *e,
+                                          size_t nentries)
+{
+    unsigned char header[12];
+    uint32_t count = 0;
+
+    for (size_t ii = 0; ii < nentries; ++ii) {
+        if (ii == 0 || cbio_access_compare(e + ii - 1, e + ii) != 0) {
+            ++count;
+        }
+    }
+
+    memcpy(header, CBIO_ACCESS_LOG_MAGIC, 8);
+    cbio_encode_uint32(header + 8, count);
+    if (fwrite(header, 1, 12, fp) != 12) {
+        return CBIO_ERROR_EIO;
+    }
+
+    for (size_t ii = 0; ii < nentries; ++ii) {
+        if (ii > 0 && cbio_access_compare(e + ii - 1, e + ii) == 0) {
+            continue;
+        }
+        cbio_encode_uint32(header, (uint32_t)e[ii].nid);
+        if (fwrite(header, 1, 4, fp) != 4 ||
+            fwrite(e[ii].id, 1, e[ii].nid, fp) != e[ii].nid) {
+            return CBIO_ERROR_EIO;
+        }
+    }
+
+    return CBIO_SUCCESS;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_save_access_log(libcbio_t handle)
+{
+    struct cbio_access_log_st *log = handle->access_log;
+    struct cbio_access_entry *entries;
+    size_t nentries = 0;
+    size_t nbytes = 0;
+    cbio_error_t err;
+    char *ids = NULL;
+    char *tmp;
+    FILE *fp;
+
+    if (log == NULL) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    entries = cbio_calloc(log->size, sizeof(*entries), CBIO_ALLOC_BATCH);
+    tmp = cbio_malloc(strlen(log->path) + 5, CBIO_ALLOC_BATCH);
+    if (entries == NULL || tmp == NULL) {
+        cbio_free(entries, CBIO_ALLOC_BATCH);
+        cbio_free(tmp, CBIO_ALLOC_BATCH);
+        return CBIO_ERROR_ENOMEM;
+    }
+    sprintf(tmp, "%s.tmp", log->path);
+
+    /* Copy the ids (into a single block) so we don't hold the lock
+       while writing. The ring itself is left alone so it keeps its
+       recency order. */
+    pthread_mutex_lock(&log->mutex);
+    for (size_t ii = 0; ii < log->size; ++ii) {
+        if (log->ring[ii].id != NULL) {
+            nbytes += log->ring[ii].nid;
+        }
+    }
+    if ((ids = cbio_malloc(nbytes > 0 ? nbytes : 1,
+                           CBIO_ALLOC_BATCH)) != NULL) {
+        char *ptr = ids;
+        for (size_t ii = 0; ii < log->size; ++ii) {
+            if (log->ring[ii].id != NULL) {
+                memcpy(ptr, log->ring[ii].id, log->ring[ii].nid);
+                entries[nentries].id = ptr;
+                entries[nentries++].nid = log->ring[ii].nid;
+                ptr += log->ring[ii].nid;
+            }
+        }
+    }
+    pthread_mutex_unlock(&log->mutex);
+
+    if (ids == NULL) {
+        cbio_free(entries, CBIO_ALLOC_BATCH);
+        cbio_free(tmp, CBIO_ALLOC_BATCH);
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    qsort(entries, nentries, sizeof(*entries), cbio_access_compare);
+
+    /* Replace the old file atomically so a crash never leaves a
+       partial log behind */
+    if ((fp = fopen(tmp, "wb")) == NULL) {
+        err = CBIO_ERROR_OPEN_FILE;
+    } else {
+        err = cbio_access_log_write(fp, entries, nentries);
+        if (fclose(fp) != 0 && err == CBIO_SUCCESS) {
+            err = CBIO_ERROR_EIO;
+        }
+        if (err == CBIO_SUCCESS && rename(tmp, log->path) != 0) {
+            err = CBIO_ERROR_EIO;
+        }
+        if (err != CBIO_SUCCESS) {
+            (void)remove(tmp);
+        }
+    }
+
+    cbio_free(ids, CBIO_ALLOC_BATCH);
+    cbio_free(entries, CBIO_ALLOC_BATCH);
+    cbio_free(tmp, CBIO_ALLOC_BATCH);
+
+    return err;
+}
+
+cbio_error_t cbio_access_log_destroy(libcbio_t handle)
+{
+    struct cbio_access_log_st *log = handle->access_log;
+    cbio_error_t err;
+
+    if (log == NULL) {
+        return CBIO_SUCCESS;
+    }
+
+    err = cbio_save_access_log(handle);
+    for (size_t ii = 0; ii < log->size; ++ii) {
+        cbio_free(log->ring[ii].id, CBIO_ALLOC_OTHER);
+    }
+    pthread_mutex_destroy(&log->mutex);
+    cbio_free(log->ring, CBIO_ALLOC_HANDLE);
+    cbio_free(log->path, CBIO_ALLOC_HANDLE);
+    cbio_free(log, CBIO_ALLOC_HANDLE);
+    handle->access_log = NULL;
+
+    return err;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_set_access_log(libcbio_t handle,
+                                 const char *path,
+                                 uint32_t sample_rate,
+                                 size_t max_ids)
+{
+    struct cbio_access_log_st *log;
+    cbio_error_t err;
+
+    if ((err = cbio_access_log_destroy(handle)) != CBIO_SUCCESS ||
+        path == NULL) {
+        return err;
+    }
+
+    if (sample_rate == 0 || max_ids == 0) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    if ((log = cbio_calloc(1, sizeof(*log), CBIO_ALLOC_HANDLE)) == NULL) {
+        return CBIO_ERROR_ENOMEM;
+    }
+    log->ring = cbio_calloc(max_ids, sizeof(*log->ring), CBIO_ALLOC_HANDLE);
+    log->path = cbio_malloc(strlen(path) + 1, CBIO_ALLOC_HANDLE);
+    if (log->ring == NULL || log->path == NULL) {
+        cbio_free(log->ring, CBIO_ALLOC_HANDLE);
+        cbio_free(log->path, CBIO_ALLOC_HANDLE);
+        cbio_free(log, CBIO_ALLOC_HANDLE);
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    strcpy(log->path, path);
+    log->sample_rate = sample_rate;
+    log->size = max_ids;
+    pthread_mutex_init(&log->mutex, NULL);
+    handle->access_log = log;
+
+    return CBIO_SUCCESS;
+}
+
+struct cbio_warmup_ctx {
+    const char *name;
+    DocInfo **docs;
+    size_t ndocs;
+    size_t next;
+    uint64_t nread;
+    pthread_mutex_t mutex;
+};
+
+static cbio_error_t cbio_warmup_load(const char *path,
+                                     struct cbio_access_entry **entries,
+                                     size_t *nentries,
+                                     char **ids)
+{
+    unsigned char header[12];
+    size_t count, size;
+    long total;
+    char *ptr;
+    FILE *fp;
+
+    if ((fp = fopen(path, "rb")) == NULL) {
+        return CBIO_ERROR_OPEN_FILE;
+    }
+
+    if (fseek(fp, 0, SEEK_END) != 0 || (total = ftell(fp)) < 12 ||
+        fseek(fp, 0, SEEK_SET) != 0 || fread(header, 1, 12, fp) != 12 ||
+        memcmp(header, CBIO_ACCESS_LOG_MAGIC, 8) != 0) {
+        fclose(fp);
+        return CBIO_ERROR_CORRUPT;
+    }
+
+    count = cbio_decode_uint32(header + 8);
+    size = (size_t)total - 12;
+    if (count > size / 4) {
+        fclose(fp);
+        return CBIO_ERROR_CORRUPT;
+    }
+
+    *entries = cbio_calloc(count > 0 ? count : 1, sizeof(**entries),
+                           CBIO_ALLOC_BATCH);
+    *ids = cbio_malloc(size > 0 ? size : 1, CBIO_ALLOC_BATCH);
+    if (*entries == NULL || *ids == NULL) {
+        cbio_free(*entries, CBIO_ALLOC_BATCH);
+        cbio_free(*ids, CBIO_ALLOC_BATCH);
+        fclose(fp);
+        return CBIO_ERROR_ENOMEM;
+    }
+
+    /* Read all of the ids in one go and point into the buffer */
+    if (fread(*ids, 1, size, fp) != size) {
+        cbio_free(*entries, CBIO_ALLOC_BATCH);
+        cbio_free(*ids, CBIO_ALLOC_BATCH);
+        fclose(fp);
+        return CBIO_ERROR_EIO;
+    }
+    fclose(fp);
+
+    ptr = *ids;
+    for (size_t ii = 0; ii < count; ++ii) {
+        size_t nid;
+        if ((size_t)(*ids + size - ptr) < 4 ||
+            (nid = cbio_decode_uint32((unsigned char *)ptr)) >
+            (size_t)(*ids + size - ptr) - 4) {
+            cbio_free(*entries, CBIO_ALLOC_BATCH);
+            cbio_free(*ids, CBIO_ALLOC_BATCH);
+            return CBIO_ERROR_CORRUPT;
+        }
+        (*entries)[ii].id = ptr + 4;
+        (*entries)[ii].nid = nid;
+        ptr += 4 + nid;
+    }
+    *nentries = count;
+
+    return CBIO_SUCCESS;
+}
+
+static int cbio_warmup_lookup_callback(Db *db, DocInfo *docinfo, void *arg)
+{
+    struct cbio_warmup_ctx *ctx = arg;
+    (void)db;
+
+    if (docinfo->deleted || docinfo->bp == 0) {
+        return 0;
+    }
+
+    /* Keep the docinfo, it is released once the body is read */
+    ctx->docs[ctx->ndocs++] = docinfo;
+    return 1;
+}
+
+static int cbio_warmup_compare_offset(const void *a, const void *b)
+{
+    const DocInfo *x = *(DocInfo *const *)a;
+    const DocInfo *y = *(DocInfo *const *)b;
+    return x->bp < y->bp ? -1 : (x->bp > y->bp ? 1 : 0);
+}
+
+static void *cbio_warmup_worker(void *arg)
+{
+    struct cbio_warmup_ctx *ctx = arg;
+    size_t first, last;
+    uint64_t nread = 0;
+    Db *db;
+
+    if (couchstore_open_db(ctx->name, COUCHSTORE_OPEN_FLAG_RDONLY,
+                           &db) != COUCHSTORE_SUCCESS) {
+        return NULL;
+    }
+
+    /* The threads take the documents in chunks in offset order, so
+       the reads move forward through the file */
+    while (1) {
+        pthread_mutex_lock(&ctx->mutex);
+        first = ctx->next;
+        last = first + 64 < ctx->ndocs ? first + 64 : ctx->ndocs;
+        ctx->next = last;
+        pthread_mutex_unlock(&ctx->mutex);
+
+        if (first == last) {
+            break;
+        }
+
+        for (size_t ii = first; ii < last; ++ii) {
+            Doc *doc;
+            if (couchstore_open_doc_with_docinfo(db, ctx->docs[ii], &doc,
+                                                 0) == COUCHSTORE_SUCCESS) {
+                couchstore_free_document(doc);
+                ++nread;
+            }
+        }
+    }
+    couchstore_close_db(db);
+
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->nread += nread;
+    pthread_mutex_unlock(&ctx->mutex);
+
+    return NULL;
+}
+
+LIBCBIO_API
+cbio_error_t cbio_warmup(libcbio_t handle,
+                         const char *path,
+                         int nthreads,
+                         uint64_t *nread)
+{
+    struct cbio_warmup_ctx ctx;
+    struct cbio_access_entry *entries;
+    struct cbio_db_ref *ref;
+    couchstore_error_t err;
+    cbio_error_t ret;
+    pthread_t *threads;
+    sized_buf *keys;
+    size_t nentries;
+    char *ids;
+    int nstarted = 0;
+
+    if (path == NULL || nthreads <= 0) {
+        return CBIO_ERROR_EINVAL;
+    }
+
+    ret = cbio_warmup_load(path, &entries, &nentries, &ids);
+    if (ret != CBIO_SUCCESS) {
+        return ret;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.name = handle->name;
+    ctx.docs = cbio_calloc(nentries > 0 ? nentries : 1, sizeof(DocInfo *),
+                           CBIO_ALLOC_BATCH);
+    keys = cbio_calloc(nentries > 0 ? nentries : 1, sizeof(sized_buf),
+                       CBIO_ALLOC_BATCH);
+    threads = cbio_calloc((size_t)nthreads, sizeof(pthread_t),
+                          CBIO_ALLOC_BATCH);
+    if (ctx.docs == NULL || keys == NULL || threads == NULL) {
+        ret = CBIO_ERROR_ENOMEM;
+    } else if ((ret = cbio_acquire_db(handle, &ref)) == CBIO_SUCCESS) {
+        /* The ids are sorted, so this reads every node on the paths to
+           them once */
+        for (size_t ii = 0; ii < nentries; ++ii) {
+            keys[ii].buf = entries[ii].id;
+            keys[ii].size = entries[ii].nid;
+        }
+        err = couchstore_docinfos_by_id(ref->db, keys, (unsigned)nentries,
+                                        0, cbio_warmup_lookup_callback,
+                                        &ctx);
+        cbio_release_db(handle, ref);
+        ret = cbio_remap_error(err);
+    }
+
+    if (ret == CBIO_SUCCESS) {
+        qsort(ctx.docs, ctx.ndocs, sizeof(DocInfo *),
+              cbio_warmup_compare_offset);
+        pthread_mutex_init(&ctx.mutex, NULL);
+        for (; nstarted < nthreads; ++nstarted) {
+            if (pthread_create(threads + nstarted, NULL, cbio_warmup_worker,
+                               &ctx) != 0) {
+                break;
+            }
+        }
+        if (nstarted == 0) {
+            cbio_warmup_worker(&ctx);
+        }
+        for (int ii = 0; ii < nstarted; ++ii) {
+            pthread_join(threads[ii], NULL);
+        }
+        pthread_mutex_destroy(&ctx.mutex);
+
+        if (nread != NULL) {
+            *nread = ctx.nread;
+        }
+    }
+
+    for (size_t ii = 0; ii < ctx.ndocs; ++ii) {
+        couchstore_free_docinfo(ctx.docs[ii]);
+    }
+    cbio_free(ctx.docs, CBIO_ALLOC_BATCH);
+    cbio_free(keys, CBIO_ALLOC_BATCH);
+    cbio_free(threads, CBIO_ALLOC_BATCH);
+    cbio_free(entries, CBIO_ALLOC_BATCH);
+    cbio_free(ids, CBIO_ALLOC_BATCH);
+
+    return ret;
+}
@@ -0,0 +1,362 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * recovery_bench measures how long it takes to get a database file
+ * back in service after a crash. It builds a database file of the
+ * requested size, and for each scenario makes a copy of it with a
+ * torn tail (truncated, or with garbage appended like a partially
+ * written batch) and times cbio_open_handle() (which has to locate
+ * the last valid header) and the first cbio_get_document(). The copy
+ * is evicted from the page cache before every run, so the numbers
+ * include reading from disk (as far as the OS lets us).
+ *
+ * It also measures the cost of cbio_commit() (which fsyncs the file)
+ * with different commit intervals, which is the durability knob
+ * libcbio users have.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <libcbio/cbio.h>
+
+/* Number of documents updated when measuring the commit cost */
+#define COMMIT_UPDATES 1000
+
+struct scenario {
+    const char *name;
+    /* Bytes to remove from the end of the file */
+    off_t truncate;
+    /* Bytes of garbage to append to the file */
+    off_t garbage;
+};
+
+static const struct scenario scenarios[] = {
+    { "clean shutdown", 0, 0 },
+    { "truncated 1 byte", 1, 0 },
+    { "truncated 4kB", 4096, 0 },
+    { "truncated 1MB", 1024 * 1024, 0 },
+    { "4kB garbage appended", 0, 4096 },
+    { "1MB garbage appended", 0, 1024 * 1024 },
+    { "16MB garbage appended", 0, 16 * 1024 * 1024 },
+    { NULL, 0, 0 }
+};
+
+static const char *dbfile = "recovery_bench.cbio";
+static const char *scratchfile = "recovery_bench_scratch.cbio";
+
+static uint64_t ndocs = 100000;
+static size_t valuesize = 256;
+static int repeat = 5;
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: recovery_bench [options]\n"
+            "\t-n num\tNumber of documents in the database"
+            " (default 100000)\n"
+            "\t-s num\tSize of each value in bytes (default 256)\n"
+            "\t-r num\tNumber of runs per scenario (default 5)\n"
+            "\t-f file\tDatabase file to use (default %s)\n"
+            "\t-k\tKeep the database file\n", dbfile);
+    exit(EXIT_FAILURE);
+}
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void die(const char *what, cbio_error_t err)
+{
+    fprintf(stderr, "%s: %s\n", what, cbio_strerror(err));
+    exit(EXIT_FAILURE);
+}
+
+static void make_id(char *buffer, size_t size, uint64_t id)
+{
+    snprintf(buffer, size, "doc-%010llu", (unsigned long long)id);
+}
+
+static void store(libcbio_t handle, uint64_t id, const char *value)
+{
+    libcbio_document_t doc;
+    cbio_error_t err;
+    char key[32];
+
+    make_id(key, sizeof(key), id);
+    if ((err = cbio_create_empty_document(handle, &doc)) != CBIO_SUCCESS ||
+        (err = cbio_document_set_id(doc, key, strlen(key),
+                                    0)) != CBIO_SUCCESS ||
+        (err = cbio_document_set_value(doc, value, valuesize,
+                                       0)) != CBIO_SUCCESS ||
+        (err = cbio_store_document(handle, doc)) != CBIO_SUCCESS) {
+        die("Failed to store document", err);
+    }
+    cbio_document_release(doc);
+}
+
+static void build_database(const char *value)
+{
+    cbio_write_buffer_t policy;
+    libcbio_t handle;
+    cbio_error_t err;
+    double start = now();
+
+    (void)remove(dbfile);
+    if ((err = cbio_open_handle(dbfile, CBIO_OPEN_CREATE,
+                                &handle)) != CBIO_SUCCESS) {
+        die("Failed to create database", err);
+    }
+
+    memset(&policy, 0, sizeof(policy));
+    policy.max_documents = 1000;
+    if ((err = cbio_set_write_buffer(handle, &policy)) != CBIO_SUCCESS) {
+        die("Failed to set write buffer", err);
+    }
+
+    /* Commit regularly so the file contains a realistic number of
+       headers */
+    for (uint64_t ii = 0; ii < ndocs; ++ii) {
+        store(handle, ii, value);
+        if ((ii + 1) % 10000 == 0 &&
+            (err = cbio_commit(handle)) != CBIO_SUCCESS) {
+            die("Failed to commit", err);
+        }
+    }
+    cbio_close_handle(handle);
+
+    fprintf(stdout, "Created %llu documents in %.2fs\n",
+            (unsigned long long)ndocs, now() - start);
+}
+
+static void measure_commit(const char *value)
+{
+    static const int intervals[] = { 1, 10, 100, 1000, 0 };
+    libcbio_t handle;
+    cbio_error_t err;
+
+    fprintf(stdout, "\nCommit cost (%d updates)\n", COMMIT_UPDATES);
+    fprintf(stdout, "%-10s %12s %14s %12s\n", "interval", "total (s)",
+            "commit (ms)", "docs/s");
+
+    for (int ii = 0; intervals[ii] != 0; ++ii) {
+        double start, elapsed;
+        double committing = 0;
+        int ncommits = 0;
+
+        if ((err = cbio_open_handle(dbfile, CBIO_OPEN_RW,
+                                    &handle)) != CBIO_SUCCESS) {
+            die("Failed to open database", err);
+        }
+
+        start = now();
+        for (int jj = 0; jj < COMMIT_UPDATES; ++jj) {
+            store(handle, (uint64_t)rand() % ndocs, value);
+            if ((jj + 1) % intervals[ii] == 0) {
+                double begin = now();
+                if ((err = cbio_commit(handle)) != CBIO_SUCCESS) {
+                    die("Failed to commit", err);
+                }
+                committing += now() - begin;
+                ++ncommits;
+            }
+        }
+        elapsed = now() - start;
+        cbio_close_handle(handle);
+
+        fprintf(stdout, "%-10d %12.3f %14.3f %12.0f\n", intervals[ii],
+                elapsed, committing * 1000 / ncommits,
+                COMMIT_UPDATES / elapsed);
+    }
+}
+
+static void copy_file(const struct scenario *scenario, off_t size)
+{
+    char *buffer = malloc(1024 * 1024);
+    int in = open(dbfile, O_RDONLY);
+    int out = open(scratchfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    off_t left = size - scenario->truncate;
+    ssize_t nr;
+
+    if (buffer == NULL || in == -1 || out == -1) {
+        fprintf(stderr, "Failed to create copy: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    while (left > 0 &&
+           (nr = read(in, buffer,
+                      left < 1024 * 1024 ? (size_t)left : 1024 * 1024)) > 0) {
+        if (write(out, buffer, (size_t)nr) != nr) {
+            fprintf(stderr, "Failed to write copy: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        left -= nr;
+    }
+
+    for (off_t ii = 0; ii < scenario->garbage; ii += 1024 * 1024) {
+        size_t chunk = 1024 * 1024;
+        if (scenario->garbage - ii < (off_t)chunk) {
+            chunk = (size_t)(scenario->garbage - ii);
+        }
+        for (size_t jj = 0; jj < chunk; ++jj) {
+            buffer[jj] = (char)rand();
+        }
+        if (write(out, buffer, chunk) != (ssize_t)chunk) {
+            fprintf(stderr, "Failed to write copy: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Make sure the open has to go to the disk */
+    fsync(out);
+#ifdef POSIX_FADV_DONTNEED
+    (void)posix_fadvise(out, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+
+    close(in);
+    close(out);
+    free(buffer);
+}
+
+static void measure_recovery(void)
+{
+    struct stat st;
+
+    if (stat(dbfile, &st) == -1) {
+        fprintf(stderr, "Failed to stat %s: %s\n", dbfile, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stdout, "\nRecovery of a %llu byte file (%d runs)\n",
+            (unsigned long long)st.st_size, repeat);
+    fprintf(stdout, "%-24s %12s %12s %12s %12s %8s\n", "scenario",
+            "open min", "open avg", "open max", "read avg", "found");
+
+    for (int ii = 0; scenarios[ii].name != NULL; ++ii) {
+        double open_min = 0, open_max = 0, open_total = 0, read_total = 0;
+        int found = 0;
+
+        if (scenarios[ii].truncate >= st.st_size) {
+            continue;
+        }
+
+        for (int jj = 0; jj < repeat; ++jj) {
+            libcbio_document_t doc;
+            libcbio_t handle;
+            cbio_error_t err;
+            double start, elapsed;
+            char key[32];
+
+            copy_file(scenarios + ii, st.st_size);
+
+            start = now();
+            err = cbio_open_handle(scratchfile, CBIO_OPEN_RDONLY, &handle);
+            elapsed = now() - start;
+            if (err != CBIO_SUCCESS) {
+                die("Failed to open database", err);
+            }
+
+            open_total += elapsed;
+            if (jj == 0 || elapsed < open_min) {
+                open_min = elapsed;
+            }
+            if (elapsed > open_max) {
+                open_max = elapsed;
+            }
+
+            make_id(key, sizeof(key), (uint64_t)rand() % ndocs);
+            start = now();
+            err = cbio_get_document(handle, key, strlen(key), &doc);
+            read_total += now() - start;
+            if (err == CBIO_SUCCESS) {
+                cbio_document_release(doc);
+                ++found;
+            } else if (err != CBIO_ERROR_ENOENT) {
+                die("Failed to read document", err);
+            }
+
+            cbio_close_handle(handle);
+        }
+
+        fprintf(stdout, "%-24s %10.3fms %10.3fms %10.3fms %10.3fms %5d/%d\n",
+                scenarios[ii].name, open_min * 1000,
+                open_total * 1000 / repeat, open_max * 1000,
+                read_total * 1000 / repeat, found, repeat);
+    }
+
+    (void)remove(scratchfile);
+}
+
+int main(int argc, char **argv)
+{
+    int keep = 0;
+    char *value;
+    int cmd;
+
+    while ((cmd = getopt(argc, argv, "n:s:r:f:k")) != -1) {
+        switch (cmd) {
+        case 'n':
+            ndocs = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            valuesize = (size_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        case 'f':
+            dbfile = optarg;
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (ndocs == 0 || repeat <= 0) {
+        usage();
+    }
+
+    if ((value = malloc(valuesize + 1)) == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return EXIT_FAILURE;
+    }
+    memset(value, 'x', valuesize);
+
+    build_database(value);
+    measure_recovery();
+    measure_commit(value);
+
+    if (!keep) {
+        (void)remove(dbfile);
+    }
+    free(value);
+
+    return EXIT_SUCCESS;
+}
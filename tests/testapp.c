@@ -21,11 +21,15 @@
 #include <string.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
 
 void *blob;
 size_t blobsize;
 
 const char *dbfile = "testcase.cbio";
+const char *dbfile2 = "testcase2.cbio";
 
 typedef int (*testcase)(void);
 struct test {
@@ -453,6 +457,15 @@ static int count_callback(libcbio_t handle, libcbio_document_t doc, void *ctx)
     return 0;
 }
 
+/* Counts down to zero and stops the iteration there */
+static int stop_callback(libcbio_t handle, libcbio_document_t doc, void *ctx)
+{
+    (void)handle;
+    (void)doc;
+    int *count = ctx;
+    return --(*count) == 0 ? -1 : 0;
+}
+
 
 static int test_changes_since(void)
 {
@@ -497,6 +510,13 @@ static int test_changes_since(void)
         return 1;
     }
 
+    total = 10;
+    err = cbio_changes_since(handle, offset, stop_callback, &total);
+    if (err != CBIO_SUCCESS || total != 0) {
+        report("changes since did not stop when asked to");
+        return 1;
+    }
+
     cbio_close_handle(handle);
     return 0;
 }
@@ -604,9 +624,2834 @@ static int test_local_documents(void)
     return 0;
 }
 
+static int test_refresh_handle(void)
+{
+    libcbio_t handle;
+    libcbio_document_t doc;
+    cbio_error_t err;
+
+    if (create_database() != 0) {
+        /* Error already reported */
+        return 1;
+    }
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_RDONLY, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Expected open of \"%s\" to succeed, but it \"%s\"",
+               dbfile, cbio_strerror(err));
+        return 1;
+    }
+
+    err = cbio_refresh_handle(handle);
+    if (err != CBIO_SUCCESS) {
+        report("Refresh of an unchanged file failed: \"%s\"",
+               cbio_strerror(err));
+        return 1;
+    }
+
+    if (store_document() != 0) {
+        /* Error already reported */
+        return 1;
+    }
+
+    err = cbio_get_document(handle, "hi-there", sizeof("hi-there"), &doc);
+    if (err != CBIO_ERROR_ENOENT) {
+        report("I did not expect to see \"hi-there\" before refresh"
+               ", but I got \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    err = cbio_refresh_handle(handle);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to refresh handle: \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    err = cbio_get_document(handle, "hi-there", sizeof("hi-there"), &doc);
+    if (err != CBIO_SUCCESS) {
+        report("Expected to find \"hi-there\" after refresh"
+               ", but I got \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    cbio_document_release(doc);
+    cbio_close_handle(handle);
+    return 0;
+}
+
+/* The header of the commit shared_reader() must not see unrefreshed */
+static off_t shared_newer_header;
+
+static void *shared_reader(void *arg)
+{
+    libcbio_t handle = arg;
+    libcbio_document_t doc;
+    cbio_error_t err;
+
+    for (int ii = 0; ii < 1000; ++ii) {
+        err = cbio_get_document(handle, "hi-there", sizeof("hi-there"), &doc);
+        if (err != CBIO_SUCCESS) {
+            report("Expected to find \"hi-there\", but I got \"%s\"",
+                   cbio_strerror(err));
+            return arg;
+        }
+        cbio_document_release(doc);
+
+        /* A thread may open a new couchstore handle on the newer
+           header, but then the shared handle has to report it */
+        err = cbio_get_document(handle, "hi-again", sizeof("hi-again"), &doc);
+        if (err == CBIO_SUCCESS) {
+            cbio_document_release(doc);
+            if (cbio_get_header_position(handle) != shared_newer_header) {
+                report("Found a document newer than the handle's header");
+                return arg;
+            }
+        } else if (err != CBIO_ERROR_ENOENT) {
+            report("Failed to look up \"hi-again\": \"%s\"",
+                   cbio_strerror(err));
+            return arg;
+        }
+    }
+
+    return NULL;
+}
+
+static int store_simple_doc(libcbio_t handle, const char *id,
+                            const char *value, int deleted);
+static int expect_value(libcbio_t handle, const char *id, const char *value);
+
+struct shared_holder {
+    libcbio_t handle;
+    volatile int inside;
+    volatile int committed;
+};
+
+/* Keeps the Db used by the changes feed busy until told to let go */
+static int shared_hold_callback(libcbio_t handle, libcbio_document_t doc,
+                                void *ctx)
+{
+    struct shared_holder *holder = ctx;
+    (void)handle;
+    (void)doc;
+
+    holder->inside = 1;
+    for (int ii = 0; ii < 5000 && !holder->committed; ++ii) {
+        usleep(1000);
+    }
+    /* Give the main thread time to start waiting for a Db */
+    usleep(20000);
+    return -1;
+}
+
+static void *shared_holder_main(void *arg)
+{
+    struct shared_holder *holder = arg;
+    (void)cbio_changes_since(holder->handle, 0, shared_hold_callback, holder);
+    return NULL;
+}
+
+/*
+ * Commit while another thread has the only Db of the shared handle
+ * checked out. A read must wait for it rather than open the newer
+ * header.
+ */
+static int shared_pool_exhausted(libcbio_t handle)
+{
+    struct shared_holder holder;
+    off_t header = cbio_get_header_position(handle);
+    libcbio_t writer;
+    pthread_t thread;
+    int ret = 0;
+
+    memset(&holder, 0, sizeof(holder));
+    holder.handle = handle;
+    if (pthread_create(&thread, NULL, shared_holder_main, &holder) != 0) {
+        report("Failed to create thread: %s", strerror(errno));
+        return 1;
+    }
+    for (int ii = 0; ii < 5000 && !holder.inside; ++ii) {
+        usleep(1000);
+    }
+
+    if (cbio_open_handle(dbfile, CBIO_OPEN_RW, &writer) != CBIO_SUCCESS) {
+        report("Failed to open writer");
+        ret = 1;
+    } else {
+        if (store_simple_doc(writer, "newest", "1", 0) ||
+            cbio_commit(writer) != CBIO_SUCCESS) {
+            report("Failed to commit \"newest\"");
+            ret = 1;
+        }
+        cbio_close_handle(writer);
+    }
+    holder.committed = 1;
+
+    if (ret == 0 && (expect_value(handle, "newest", NULL) ||
+                     cbio_get_header_position(handle) != header)) {
+        report("The shared handle moved past its header");
+        ret = 1;
+    }
+    pthread_join(thread, NULL);
+
+    return ret;
+}
+
+static int test_shared_handle(void)
+{
+    const int nthreads = 8;
+    pthread_t threads[nthreads];
+    libcbio_t handle, writer;
+    libcbio_document_t doc;
+    cbio_error_t err;
+    int failed = 0;
+
+    if (store_document() != 0) {
+        /* Error already reported */
+        return 1;
+    }
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_SHARED_RDONLY, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Expected open of \"%s\" to succeed, but it \"%s\"",
+               dbfile, cbio_strerror(err));
+        return 1;
+    }
+
+    err = cbio_create_empty_document(handle, &doc);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to create an empty document: \"%s\"",
+               cbio_strerror(err));
+        return 1;
+    }
+    cbio_document_set_id(doc, "foo", 3, 0);
+    cbio_document_set_value(doc, "bar", 3, 0);
+    if (cbio_store_document(handle, doc) != CBIO_ERROR_EINVAL) {
+        report("Should not be able to store through a shared handle");
+        return 1;
+    }
+    cbio_document_release(doc);
+
+    /* Commit a document the shared handle doesn't know about yet */
+    err = cbio_open_handle(dbfile, CBIO_OPEN_RW, &writer);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open writer \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+    if ((err = cbio_create_empty_document(writer, &doc)) != CBIO_SUCCESS ||
+        (err = cbio_document_set_id(doc, "hi-again", sizeof("hi-again"),
+                                    0)) != CBIO_SUCCESS ||
+        (err = cbio_document_set_value(doc, "bar", 3, 0)) != CBIO_SUCCESS ||
+        (err = cbio_store_document(writer, doc)) != CBIO_SUCCESS ||
+        (err = cbio_commit(writer)) != CBIO_SUCCESS) {
+        report("Failed to store \"hi-again\": \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+    cbio_document_release(doc);
+    cbio_close_handle(writer);
+
+    /* Closing the writer may have committed again */
+    err = cbio_open_handle(dbfile, CBIO_OPEN_RDONLY, &writer);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open reader \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+    shared_newer_header = cbio_get_header_position(writer);
+    cbio_close_handle(writer);
+
+    for (int ii = 0; ii < nthreads; ++ii) {
+        if (pthread_create(&threads[ii], NULL, shared_reader, handle) != 0) {
+            report("Failed to create thread: %s", strerror(errno));
+            return 1;
+        }
+    }
+
+    for (int ii = 0; ii < nthreads; ++ii) {
+        void *res;
+        pthread_join(threads[ii], &res);
+        if (res != NULL) {
+            ++failed;
+        }
+    }
+    cbio_close_handle(handle);
+
+    /* Start over with a single Db in the pool */
+    err = cbio_open_handle(dbfile, CBIO_OPEN_SHARED_RDONLY, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+    if (shared_pool_exhausted(handle)) {
+        ++failed;
+    }
+    cbio_close_handle(handle);
+
+    return failed ? 1 : 0;
+}
+
+struct async_result {
+    int hit;
+    int miss;
+    int error;
+};
+
+static void async_get_callback(libcbio_t handle, const void *id, size_t nid,
+                               cbio_error_t err, libcbio_document_t doc,
+                               void *ctx)
+{
+    struct async_result *res = ctx;
+    (void)handle;
+    (void)id;
+    (void)nid;
+
+    if (err == CBIO_SUCCESS) {
+        __sync_add_and_fetch(&res->hit, 1);
+        cbio_document_release(doc);
+    } else if (err == CBIO_ERROR_ENOENT) {
+        __sync_add_and_fetch(&res->miss, 1);
+    } else {
+        __sync_add_and_fetch(&res->error, 1);
+    }
+}
+
+struct async_gate {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int open;
+    int ndone;
+};
+
+/* Holds the worker thread until the gate is opened */
+static void async_gate_callback(libcbio_t handle, const void *id, size_t nid,
+                                cbio_error_t err, libcbio_document_t doc,
+                                void *ctx)
+{
+    struct async_gate *gate = ctx;
+    (void)handle;
+    (void)id;
+    (void)nid;
+    (void)err;
+
+    if (doc != NULL) {
+        cbio_document_release(doc);
+    }
+    pthread_mutex_lock(&gate->mutex);
+    while (!gate->open) {
+        pthread_cond_wait(&gate->cond, &gate->mutex);
+    }
+    ++gate->ndone;
+    pthread_mutex_unlock(&gate->mutex);
+}
+
+static int test_async_queue_limit(void)
+{
+    struct async_gate gate;
+    cbio_async_options_t opts;
+    libcbio_t handle;
+    cbio_error_t err;
+    int ret = 0;
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_SHARED_RDONLY, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    cbio_async_options_init(&opts);
+    opts.nthreads = 0;
+    if (cbio_set_async_options(handle, &opts) != CBIO_ERROR_EINVAL) {
+        report("Expected a pool without threads to be refused");
+        return 1;
+    }
+    opts.nthreads = 1;
+    opts.max_pending = 2;
+    if (cbio_set_async_options(handle, &opts) != CBIO_SUCCESS) {
+        report("Failed to set the async options");
+        return 1;
+    }
+
+    /* The first read holds the only worker, and the second waits */
+    memset(&gate, 0, sizeof(gate));
+    pthread_mutex_init(&gate.mutex, NULL);
+    pthread_cond_init(&gate.cond, NULL);
+    for (int ii = 0; ii < 3; ++ii) {
+        err = cbio_get_document_async(handle, "hi-there",
+                                      sizeof("hi-there"),
+                                      async_gate_callback, &gate);
+        if (err != (ii < 2 ? CBIO_SUCCESS : CBIO_ERROR_EBUSY)) {
+            report("Unexpected result for read %d: \"%s\"", ii,
+                   cbio_strerror(err));
+            ret = 1;
+        }
+    }
+
+    pthread_mutex_lock(&gate.mutex);
+    gate.open = 1;
+    pthread_cond_broadcast(&gate.cond);
+    pthread_mutex_unlock(&gate.mutex);
+    cbio_wait_async(handle);
+    if (ret == 0 && gate.ndone != 2) {
+        report("Expected 2 reads to complete, got %d", gate.ndone);
+        ret = 1;
+    }
+
+    cbio_close_handle(handle);
+    pthread_cond_destroy(&gate.cond);
+    pthread_mutex_destroy(&gate.mutex);
+
+    return ret;
+}
+
+static int test_get_document_async(void)
+{
+    struct async_result res = { 0, 0, 0 };
+    libcbio_t handle;
+    cbio_error_t err;
+
+    if (store_document() != 0) {
+        /* Error already reported */
+        return 1;
+    }
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_SHARED_RDONLY, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Expected open of \"%s\" to succeed, but it \"%s\"",
+               dbfile, cbio_strerror(err));
+        return 1;
+    }
+
+    for (int ii = 0; ii < 1000; ++ii) {
+        if (ii % 2) {
+            err = cbio_get_document_async(handle, "hi-there",
+                                          sizeof("hi-there"),
+                                          async_get_callback, &res);
+        } else {
+            err = cbio_get_document_async(handle, "wtf", sizeof("wtf"),
+                                          async_get_callback, &res);
+        }
+        if (err != CBIO_SUCCESS) {
+            report("Failed to schedule get: \"%s\"", cbio_strerror(err));
+            return 1;
+        }
+    }
+
+    cbio_wait_async(handle);
+    if (res.hit != 500 || res.miss != 500 || res.error != 0) {
+        report("Expected 500 hits and 500 misses, got %d/%d (%d errors)",
+               res.hit, res.miss, res.error);
+        return 1;
+    }
+
+    if (cbio_set_async_options(handle, NULL) != CBIO_ERROR_EINVAL) {
+        report("Expected the options to be fixed once the pool runs");
+        return 1;
+    }
+    cbio_close_handle(handle);
+
+    return test_async_queue_limit();
+}
+
+static int test_json_mode(void)
+{
+    struct {
+        const char *id;
+        const char *value;
+        uint8_t content_type;
+    } cases[] = {
+        { "json", "{ \"foo\" : [ 1, 2.5e3, true, null, \"b\\u00e6r\" ] }",
+          CBIO_DOC_IS_JSON },
+        { "utf8", "\"r\xc3\xb8" "dgr\xc3\xb8" "t med fl\xc3\xb8" "de, "
+          "padded to cross a sixteen byte boundary\"", CBIO_DOC_IS_JSON },
+        { "nested", "{\"a\":{\"_b\":1}}", CBIO_DOC_IS_JSON },
+        { "reserved", "{\"a\":1,\"_id\":2}", CBIO_DOC_INVALID_JSON_KEY },
+        { "truncated", "{ \"foo\" : [ 1, 2 }", CBIO_DOC_INVALID_JSON },
+        { "bad-utf8", "\"\xc3\x28\"", CBIO_DOC_INVALID_JSON },
+        { "blob", "hei", CBIO_DOC_INVALID_JSON },
+        { NULL, NULL, 0 }
+    };
+    libcbio_t handle;
+    libcbio_document_t doc;
+    cbio_error_t err;
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_CREATE, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Expected open of \"%s\" to succeed, but it \"%s\"",
+               dbfile, cbio_strerror(err));
+        return 1;
+    }
+
+    err = cbio_set_json_mode(handle, 1);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to enable json mode: \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    for (int ii = 0; cases[ii].id != NULL; ++ii) {
+        if (cbio_create_empty_document(handle, &doc) != CBIO_SUCCESS ||
+            cbio_document_set_id(doc, cases[ii].id,
+                                 strlen(cases[ii].id), 0) != CBIO_SUCCESS ||
+            cbio_document_set_value(doc, cases[ii].value,
+                                    strlen(cases[ii].value),
+                                    0) != CBIO_SUCCESS ||
+            cbio_document_set_content_type(doc,
+                                           CBIO_DOC_NON_JSON_MODE) != CBIO_SUCCESS) {
+            report("Failed to create document");
+            return 1;
+        }
+
+        err = cbio_store_document(handle, doc);
+        if (err != CBIO_SUCCESS) {
+            report("Failed to store document \"%s\"", cbio_strerror(err));
+            return 1;
+        }
+        cbio_document_release(doc);
+    }
+    cbio_commit(handle);
+
+    for (int ii = 0; cases[ii].id != NULL; ++ii) {
+        uint8_t content_type;
+        err = cbio_get_document(handle, cases[ii].id,
+                                strlen(cases[ii].id), &doc);
+        if (err != CBIO_SUCCESS) {
+            report("Failed to get \"%s\": \"%s\"", cases[ii].id,
+                   cbio_strerror(err));
+            return 1;
+        }
+        cbio_document_get_content_type(doc, &content_type);
+        cbio_document_release(doc);
+        if (content_type != cases[ii].content_type) {
+            report("Incorrect content type for \"%s\": %u", cases[ii].id,
+                   (unsigned int)content_type);
+            return 1;
+        }
+    }
+
+    cbio_close_handle(handle);
+    return 0;
+}
+
+static int test_document_classify(void)
+{
+    struct {
+        const char *value;
+        uint8_t content_type;
+    } cases[] = {
+        { "{\"foo\":[1,2,{\"bar\":null}]}", CBIO_DOC_IS_JSON },
+        { "{\"_rev\":1}", CBIO_DOC_INVALID_JSON_KEY },
+        { "not json", CBIO_DOC_INVALID_JSON },
+        { NULL, 0 }
+    };
+    libcbio_t handle;
+    libcbio_document_t doc;
+    uint8_t content_type;
+    cbio_error_t err;
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_CREATE, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Expected open of \"%s\" to succeed, but it \"%s\"",
+               dbfile, cbio_strerror(err));
+        return 1;
+    }
+
+    /* Without json mode the store keeps the content type we set */
+    for (int ii = 0; cases[ii].value != NULL; ++ii) {
+        if (cbio_create_empty_document(handle, &doc) != CBIO_SUCCESS ||
+            cbio_document_set_id(doc, "doc", 3, 0) != CBIO_SUCCESS ||
+            cbio_document_set_value(doc, cases[ii].value,
+                                    strlen(cases[ii].value),
+                                    0) != CBIO_SUCCESS ||
+            cbio_document_set_content_type(doc,
+                                           CBIO_DOC_NON_JSON_MODE) != CBIO_SUCCESS) {
+            report("Failed to create document");
+            return 1;
+        }
+
+        if ((err = cbio_document_classify(doc)) != CBIO_SUCCESS ||
+            (err = cbio_store_document(handle, doc)) != CBIO_SUCCESS) {
+            report("Failed to classify and store \"%s\": \"%s\"",
+                   cases[ii].value, cbio_strerror(err));
+            return 1;
+        }
+        cbio_document_release(doc);
+
+        err = cbio_get_document(handle, "doc", 3, &doc);
+        if (err != CBIO_SUCCESS) {
+            report("Failed to get document: \"%s\"", cbio_strerror(err));
+            return 1;
+        }
+        cbio_document_get_content_type(doc, &content_type);
+        cbio_document_release(doc);
+        if (content_type != cases[ii].content_type) {
+            report("Incorrect content type for \"%s\": %u",
+                   cases[ii].value, (unsigned int)content_type);
+            return 1;
+        }
+    }
+
+    /* Compressed values can't be inspected */
+    if (cbio_create_empty_document(handle, &doc) != CBIO_SUCCESS ||
+        cbio_document_set_value(doc, "{}", 2, 0) != CBIO_SUCCESS ||
+        cbio_document_set_content_type(doc,
+                                       CBIO_DOC_IS_COMPRESSED) != CBIO_SUCCESS) {
+        report("Failed to create document");
+        return 1;
+    }
+    if (cbio_document_classify(doc) != CBIO_ERROR_EINVAL) {
+        report("Should not be able to classify a compressed value");
+        return 1;
+    }
+    cbio_document_release(doc);
+
+    cbio_close_handle(handle);
+    return 0;
+}
+
+static int store_simple_doc(libcbio_t handle, const char *id,
+                            const char *value, int deleted)
+{
+    libcbio_document_t doc = NULL;
+    cbio_error_t err;
+
+    if ((err = cbio_create_empty_document(handle, &doc)) != CBIO_SUCCESS ||
+        (err = cbio_document_set_id(doc, id, strlen(id), 0)) != CBIO_SUCCESS ||
+        (err = cbio_document_set_value(doc, value, strlen(value),
+                                        0)) != CBIO_SUCCESS ||
+        (err = cbio_document_set_deleted(doc, deleted)) != CBIO_SUCCESS ||
+        (err = cbio_store_document(handle, doc)) != CBIO_SUCCESS) {
+        report("Failed to store \"%s\": \"%s\"", id, cbio_strerror(err));
+        if (doc != NULL) {
+            cbio_document_release(doc);
+        }
+        return 1;
+    }
+    cbio_document_release(doc);
+    return 0;
+}
+
+static int test_changes_since_filtered(void)
+{
+    cbio_changes_filter_t filter;
+    libcbio_t handle;
+    cbio_error_t err;
+    int total;
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_CREATE, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    if (store_simple_doc(handle, "user::1", "{}", 0) ||
+        store_simple_doc(handle, "user::2", "{}", 1) ||
+        store_simple_doc(handle, "user::3", "{}", 0) ||
+        store_simple_doc(handle, "item::1", "{}", 0) ||
+        store_simple_doc(handle, "item::2", "{}", 1) ||
+        store_simple_doc(handle, "use", "{\"a\":1}", 0)) {
+        return 1;
+    }
+
+    for (int ii = 0; ii < 2; ++ii) {
+        libcbio_document_t doc;
+        uint8_t content_type = ii == 0 ?
+            CBIO_DOC_IS_JSON | CBIO_DOC_IS_COMPRESSED : CBIO_DOC_NON_JSON_MODE;
+
+        if ((err = cbio_create_empty_document(handle, &doc)) != CBIO_SUCCESS ||
+            (err = cbio_document_set_id(doc, ii == 0 ? "zip" : "raw", 3,
+                                        0)) != CBIO_SUCCESS ||
+            (err = cbio_document_set_value(doc, "{}", 2,
+                                           0)) != CBIO_SUCCESS ||
+            (err = cbio_document_set_content_type(
+                       doc, content_type)) != CBIO_SUCCESS ||
+            (err = cbio_store_document(handle, doc)) != CBIO_SUCCESS) {
+            report("Failed to store document: \"%s\"", cbio_strerror(err));
+            return 1;
+        }
+        cbio_document_release(doc);
+    }
+    cbio_commit(handle);
+
+    cbio_changes_filter_init(&filter);
+    filter.content_type = CBIO_DOC_IS_JSON;
+    total = 0;
+    err = cbio_changes_since_filtered(handle, 0, &filter, count_callback,
+                                      &total);
+    if (err != CBIO_SUCCESS || total != 7) {
+        report("Expected 7 JSON documents, got %d (%s)", total,
+               cbio_strerror(err));
+        return 1;
+    }
+
+    cbio_changes_filter_init(&filter);
+    filter.id_prefix = "user::";
+    filter.nid_prefix = 6;
+    total = 0;
+    err = cbio_changes_since_filtered(handle, 0, &filter, count_callback,
+                                      &total);
+    if (err != CBIO_SUCCESS || total != 3) {
+        report("Expected 3 documents with prefix, got %d (%s)", total,
+               cbio_strerror(err));
+        return 1;
+    }
+
+    filter.deleted = CBIO_FILTER_DELETED_EXCLUDE;
+    total = 0;
+    err = cbio_changes_since_filtered(handle, 0, &filter, count_callback,
+                                      &total);
+    if (err != CBIO_SUCCESS || total != 2) {
+        report("Expected 2 live documents with prefix, got %d (%s)", total,
+               cbio_strerror(err));
+        return 1;
+    }
+
+    cbio_changes_filter_init(&filter);
+    filter.deleted = CBIO_FILTER_DELETED_ONLY;
+    total = 0;
+    err = cbio_changes_since_filtered(handle, 0, &filter, count_callback,
+                                      &total);
+    if (err != CBIO_SUCCESS || total != 2) {
+        report("Expected 2 deleted documents, got %d (%s)", total,
+               cbio_strerror(err));
+        return 1;
+    }
+
+    cbio_changes_filter_init(&filter);
+    filter.min_size = 3;
+    total = 0;
+    err = cbio_changes_since_filtered(handle, 0, &filter, count_callback,
+                                      &total);
+    if (err != CBIO_SUCCESS || total != 1) {
+        report("Expected 1 document bigger than 2 bytes, got %d (%s)", total,
+               cbio_strerror(err));
+        return 1;
+    }
+
+    cbio_close_handle(handle);
+    return 0;
+}
+
+static int test_purge_tombstones(void)
+{
+    const char *local_ids[] = { "_local/checkpoint" };
+    libcbio_t handle;
+    libcbio_t purged;
+    libcbio_document_t doc;
+    cbio_error_t err;
+    uint64_t seqno;
+    int total;
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_CREATE, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    /* a-d gets seqno 1-4 (local documents don't have a seqno), and the
+       tombstone for e gets seqno 5 which is kept */
+    if (store_simple_doc(handle, "a", "{}", 0) ||
+        store_simple_doc(handle, "b", "{}", 1) ||
+        store_simple_doc(handle, "c", "{}", 1) ||
+        store_simple_doc(handle, "_local/checkpoint", "{}", 0) ||
+        store_simple_doc(handle, "d", "{}", 0) ||
+        store_simple_doc(handle, "e", "{}", 1)) {
+        return 1;
+    }
+    cbio_commit(handle);
+
+    err = cbio_purge_tombstones(handle, dbfile2, 5, local_ids, 1);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to purge tombstones \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    err = cbio_purge_tombstones(handle, dbfile2, 5, local_ids, 1);
+    if (err != CBIO_ERROR_EINVAL) {
+        report("Should not be able to purge into an existing file");
+        return 1;
+    }
+    cbio_close_handle(handle);
+
+    err = cbio_open_handle(dbfile2, CBIO_OPEN_RDONLY, &purged);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open purged file \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    total = 0;
+    err = cbio_changes_since(purged, 0, count_callback, &total);
+    if (err != CBIO_SUCCESS || total != 3) {
+        report("Expected a, d and the tombstone for e, got %d", total);
+        return 1;
+    }
+
+    err = cbio_get_document(purged, "_local/checkpoint",
+                            strlen("_local/checkpoint"), &doc);
+    if (err != CBIO_SUCCESS) {
+        report("The local document should be copied \"%s\"",
+               cbio_strerror(err));
+        return 1;
+    }
+    cbio_document_release(doc);
+
+    /* a and d are renumbered 1 and 2, so the tombstones were dropped
+       from before 3 in the new file */
+    err = cbio_get_purge_seqno(purged, &seqno);
+    if (err != CBIO_SUCCESS || seqno != 3) {
+        report("Expected purge seqno 3, got %llu (%s)",
+               (unsigned long long)seqno, cbio_strerror(err));
+        return 1;
+    }
+
+    cbio_close_handle(purged);
+    return 0;
+}
+
+static int test_delete_documents(void)
+{
+    const void *ids[] = { "a", "c", "_local/d", "nonexistent" };
+    size_t nids[] = { 1, 1, 8, 11 };
+    libcbio_t handle;
+    libcbio_document_t doc;
+    cbio_error_t err;
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_CREATE, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    if (store_simple_doc(handle, "a", "{}", 0) ||
+        store_simple_doc(handle, "b", "{}", 0) ||
+        store_simple_doc(handle, "c", "{}", 0) ||
+        store_simple_doc(handle, "_local/d", "{}", 0)) {
+        return 1;
+    }
+
+    err = cbio_delete_documents(handle, ids, nids, 4);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to delete documents \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+    cbio_commit(handle);
+
+    for (int ii = 0; ii < 4; ++ii) {
+        err = cbio_get_document(handle, ids[ii], nids[ii], &doc);
+        if (err != CBIO_ERROR_ENOENT) {
+            report("I did not expect to find \"%.*s\", but I got \"%s\"",
+                   (int)nids[ii], (const char *)ids[ii], cbio_strerror(err));
+            return 1;
+        }
+    }
+
+    err = cbio_get_document(handle, "b", 1, &doc);
+    if (err != CBIO_SUCCESS) {
+        report("Expected to find \"b\", but I got \"%s\"",
+               cbio_strerror(err));
+        return 1;
+    }
+    cbio_document_release(doc);
+
+    cbio_close_handle(handle);
+    return 0;
+}
+
+static int test_store_documents_conditional(void)
+{
+    const char *ids[] = { "a", "b", "c", "d", "e" };
+    uint64_t expected[] = { 1, CBIO_REV_MUST_NOT_EXIST,
+                            CBIO_REV_MUST_NOT_EXIST, 5, 1
+                          };
+    cbio_error_t wanted[] = { CBIO_SUCCESS, CBIO_SUCCESS, CBIO_ERROR_EEXISTS,
+                              CBIO_ERROR_EEXISTS, CBIO_ERROR_ENOENT
+                            };
+    libcbio_document_t docs[5];
+    cbio_error_t result[5];
+    libcbio_document_t doc;
+    libcbio_t handle;
+    cbio_error_t err;
+    uint64_t revision;
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_CREATE, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    if (store_simple_doc(handle, "b", "{}", 1)) {
+        return 1;
+    }
+    for (int ii = 0; ii < 5; ++ii) {
+        const char *id = ids[ii];
+        err = cbio_create_empty_document(handle, &docs[ii]);
+        if (err != CBIO_SUCCESS ||
+            (err = cbio_document_set_id(docs[ii], id, 1, 0)) != CBIO_SUCCESS ||
+            (err = cbio_document_set_value(docs[ii], id, 1, 0)) != CBIO_SUCCESS ||
+            (err = cbio_document_set_revision(docs[ii], 1)) != CBIO_SUCCESS) {
+            report("Failed to create \"%s\": \"%s\"", id, cbio_strerror(err));
+            return 1;
+        }
+        if (ii != 1 && ii != 4 &&
+            (err = cbio_store_document(handle, docs[ii])) != CBIO_SUCCESS) {
+            report("Failed to store \"%s\": \"%s\"", id, cbio_strerror(err));
+            return 1;
+        }
+        cbio_document_set_revision(docs[ii], 2);
+    }
+
+    err = cbio_store_documents_conditional(handle, docs, expected, result, 5);
+    if (err != CBIO_SUCCESS) {
+        report("Conditional store failed \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+    cbio_commit(handle);
+
+    for (int ii = 0; ii < 5; ++ii) {
+        uint64_t wanted_revision = 1;
+        cbio_document_release(docs[ii]);
+        if (result[ii] != wanted[ii]) {
+            report("Unexpected result for \"%s\": \"%s\"", ids[ii],
+                   cbio_strerror(result[ii]));
+            return 1;
+        }
+
+        err = cbio_get_document(handle, ids[ii], 1, &doc);
+        if (ii == 4) {
+            if (err != CBIO_ERROR_ENOENT) {
+                report("Did not expect to find \"e\"");
+                return 1;
+            }
+            continue;
+        }
+        if (err != CBIO_SUCCESS) {
+            report("Failed to get \"%s\": \"%s\"", ids[ii],
+                   cbio_strerror(err));
+            return 1;
+        }
+        cbio_document_get_revision(doc, &revision);
+        cbio_document_release(doc);
+        if (result[ii] == CBIO_SUCCESS) {
+            wanted_revision = 2;
+        }
+        if (revision != wanted_revision) {
+            report("Unexpected revision for \"%s\": %lu", ids[ii],
+                   (unsigned long)revision);
+            return 1;
+        }
+    }
+
+    /* Both would pass the check against the stored revision */
+    for (int ii = 0; ii < 2; ++ii) {
+        expected[ii] = 2;
+        err = cbio_create_empty_document(handle, &docs[ii]);
+        if (err != CBIO_SUCCESS ||
+            (err = cbio_document_set_id(docs[ii], "a", 1, 0)) != CBIO_SUCCESS ||
+            (err = cbio_document_set_value(docs[ii], ii == 0 ? "x" : "y", 1,
+                                           0)) != CBIO_SUCCESS ||
+            (err = cbio_document_set_revision(docs[ii], 3)) != CBIO_SUCCESS) {
+            report("Failed to create \"a\": \"%s\"", cbio_strerror(err));
+            return 1;
+        }
+    }
+
+    err = cbio_store_documents_conditional(handle, docs, expected, result, 2);
+    cbio_document_release(docs[0]);
+    cbio_document_release(docs[1]);
+    if (err != CBIO_SUCCESS || result[0] != CBIO_SUCCESS ||
+        result[1] != CBIO_ERROR_EEXISTS) {
+        report("Expected only the first \"a\" to be stored: \"%s\" \"%s\"",
+               cbio_strerror(result[0]), cbio_strerror(result[1]));
+        return 1;
+    }
+
+    if ((err = cbio_get_document(handle, "a", 1, &doc)) == CBIO_SUCCESS) {
+        const void *value;
+        size_t nvalue;
+        cbio_document_get_value(doc, &value, &nvalue);
+        if (nvalue != 1 || memcmp(value, "x", 1) != 0) {
+            err = CBIO_ERROR_EEXISTS;
+        }
+        cbio_document_release(doc);
+    }
+    if (err != CBIO_SUCCESS) {
+        report("Expected the first \"a\" to be stored: \"%s\"",
+               cbio_strerror(err));
+        return 1;
+    }
+
+    cbio_close_handle(handle);
+    return 0;
+}
+
+static void value_extractor(libcbio_t handle, libcbio_document_t doc,
+                            cbio_index_emit_fn emit, void *emitctx,
+                            void *cookie)
+{
+    const void *value;
+    size_t nvalue;
+    (void)handle;
+    (void)cookie;
+
+    if (cbio_document_get_value(doc, &value, &nvalue) == CBIO_SUCCESS) {
+        emit(emitctx, value, nvalue);
+    }
+}
+
+static int index_callback(libcbio_t handle, const void *key, size_t nkey,
+                          const void *id, size_t nid, void *ctx)
+{
+    char *buffer = ctx;
+    (void)handle;
+    (void)key;
+    (void)nkey;
+    strncat(buffer, id, nid);
+    return 0;
+}
+
+static int query_index(libcbio_t handle, const char *start, const char *end,
+                       const char *expected)
+{
+    char buffer[64] = { 0 };
+    cbio_error_t err;
+
+    err = cbio_index_query(handle, start, strlen(start), end, strlen(end),
+                           index_callback, buffer);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to query index \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+    if (strcmp(buffer, expected) != 0) {
+        report("Expected [%s, %s] to return \"%s\", got \"%s\"",
+               start, end, expected, buffer);
+        return 1;
+    }
+    return 0;
+}
+
+static int test_secondary_index(void)
+{
+    libcbio_t handle;
+    cbio_error_t err;
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_CREATE, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    /* Stored before the index exists, picked up when it is opened */
+    if (store_simple_doc(handle, "a", "red", 0)) {
+        return 1;
+    }
+
+    err = cbio_open_index(handle, dbfile2, value_extractor, NULL);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open index \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    if (store_simple_doc(handle, "b", "blue", 0) ||
+        store_simple_doc(handle, "c", "red", 0) ||
+        store_simple_doc(handle, "d", "reddish", 0) ||
+        query_index(handle, "red", "red", "ac") ||
+        query_index(handle, "blue", "red", "bac") ||
+        query_index(handle, "re", "s", "acd")) {
+        return 1;
+    }
+
+    /* Changing and deleting documents removes the old entries */
+    if (store_simple_doc(handle, "a", "green", 0) ||
+        store_simple_doc(handle, "c", "red", 1) ||
+        query_index(handle, "red", "red", "") ||
+        query_index(handle, "a", "z", "bad")) {
+        return 1;
+    }
+    cbio_commit(handle);
+    cbio_close_handle(handle);
+
+    /* Changes made without the index are picked up when it's opened */
+    err = cbio_open_handle(dbfile, CBIO_OPEN_RW, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+    if (store_simple_doc(handle, "e", "red", 0) ||
+        store_simple_doc(handle, "b", "blue", 1)) {
+        return 1;
+    }
+    cbio_commit(handle);
+    cbio_close_handle(handle);
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_RW, &handle);
+    if (err == CBIO_SUCCESS) {
+        err = cbio_open_index(handle, dbfile2, value_extractor, NULL);
+    }
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open index \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+    if (query_index(handle, "a", "z", "aed")) {
+        return 1;
+    }
+    cbio_close_handle(handle);
+
+    return 0;
+}
+
+struct test_alloc_header {
+    cbio_alloc_class_t cls;
+    long padding;
+};
+
+/*
+ * The allocator hooks used by the tests count the blocks allocated
+ * in every class, and make the allocations bigger than fail_above
+ * fail while it is set (it may be changed at any time)
+ */
+struct test_alloc_stats {
+    long outstanding;
+    long mismatch;
+    long allocated[CBIO_ALLOC_OTHER + 1];
+    volatile size_t fail_above;
+};
+
+static int test_alloc_fails(const struct test_alloc_stats *stats,
+                            size_t size)
+{
+    return stats->fail_above != 0 && size > stats->fail_above;
+}
+
+static void *test_malloc(size_t size, cbio_alloc_class_t cls, void *cookie)
+{
+    struct test_alloc_stats *stats = cookie;
+    struct test_alloc_header *ret;
+
+    if (test_alloc_fails(stats, size) ||
+        (ret = malloc(sizeof(*ret) + size)) == NULL) {
+        return NULL;
+    }
+    ret->cls = cls;
+    __sync_fetch_and_add(&stats->outstanding, 1);
+    __sync_fetch_and_add(&stats->allocated[cls], 1);
+    return ret + 1;
+}
+
+static void *test_calloc(size_t nmemb, size_t size, cbio_alloc_class_t cls,
+                         void *cookie)
+{
+    void *ret = test_malloc(nmemb * size, cls, cookie);
+    if (ret != NULL) {
+        memset(ret, 0, nmemb * size);
+    }
+    return ret;
+}
+
+static void test_free(void *ptr, cbio_alloc_class_t cls, void *cookie)
+{
+    struct test_alloc_stats *stats = cookie;
+    struct test_alloc_header *header = ptr;
+    --header;
+    if (header->cls != cls) {
+        __sync_fetch_and_add(&stats->mismatch, 1);
+    }
+    __sync_fetch_and_sub(&stats->outstanding, 1);
+    free(header);
+}
+
+static void *test_realloc(void *ptr, size_t size, cbio_alloc_class_t cls,
+                          void *cookie)
+{
+    struct test_alloc_header *header = ptr;
+    if (ptr == NULL) {
+        return test_malloc(size, cls, cookie);
+    }
+    if (test_alloc_fails(cookie, size)) {
+        return NULL;
+    }
+    --header;
+    if ((header = realloc(header, sizeof(*header) + size)) == NULL) {
+        return NULL;
+    }
+    return header + 1;
+}
+
+static void test_allocator_init(cbio_allocator_t *allocator,
+                                struct test_alloc_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    allocator->malloc_fn = test_malloc;
+    allocator->calloc_fn = test_calloc;
+    allocator->realloc_fn = test_realloc;
+    allocator->free_fn = test_free;
+    allocator->cookie = stats;
+}
+
+static int test_secondary_index_recovery(void)
+{
+    const size_t nbig = 600 * 1024;
+    struct test_alloc_stats alloc_stats;
+    cbio_allocator_t allocator;
+    libcbio_t handle;
+    cbio_error_t err;
+    char *big;
+    int ret = 1;
+
+    if ((big = malloc(nbig + 1)) == NULL) {
+        report("Failed to allocate memory");
+        return 1;
+    }
+    memset(big, 'q', nbig);
+    big[nbig] = '\0';
+
+    test_allocator_init(&allocator, &alloc_stats);
+    cbio_set_allocator(&allocator);
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_CREATE, &handle);
+    if (err == CBIO_SUCCESS) {
+        err = cbio_open_index(handle, dbfile2, value_extractor, NULL);
+    }
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open index \"%s\"", cbio_strerror(err));
+        cbio_set_allocator(NULL);
+        free(big);
+        return 1;
+    }
+
+    /* The document is stored, but the index can't hold on to the key */
+    alloc_stats.fail_above = 1024 * 1024;
+    if (store_simple_doc(handle, "x", big, 0) == 0) {
+        report("Expected the index update to fail");
+    } else {
+        /* The next commit indexes it again, and the index keeps being
+           maintained afterwards */
+        alloc_stats.fail_above = 0;
+        if (store_simple_doc(handle, "y", "red", 0) == 0 &&
+            cbio_commit(handle) == CBIO_SUCCESS &&
+            query_index(handle, "q", "r", "x") == 0 &&
+            store_simple_doc(handle, "z", "red", 0) == 0 &&
+            query_index(handle, "red", "red", "yz") == 0) {
+            ret = 0;
+        }
+    }
+
+    cbio_close_handle(handle);
+    cbio_set_allocator(NULL);
+    free(big);
+
+    return ret;
+}
+
+static int check_range(libcbio_t handle, const char *start, const char *end,
+                       uint64_t live, uint64_t deleted, uint64_t live_bytes)
+{
+    cbio_range_stats_t stats;
+    cbio_error_t err;
+
+    err = cbio_count_range(handle, start, start ? strlen(start) : 0,
+                           end, end ? strlen(end) : 0, &stats);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to count range \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    if (stats.live != live || stats.deleted != deleted ||
+        stats.live_bytes != live_bytes) {
+        report("Unexpected stats for [%s, %s]: %lu %lu %lu",
+               start ? start : "", end ? end : "",
+               (unsigned long)stats.live, (unsigned long)stats.deleted,
+               (unsigned long)stats.live_bytes);
+        return 1;
+    }
+    return 0;
+}
+
+static int test_count_range(void)
+{
+    libcbio_t handle;
+    cbio_error_t err;
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_CREATE, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    if (store_simple_doc(handle, "item::1", "12345", 0) ||
+        store_simple_doc(handle, "item::2", "", 1) ||
+        store_simple_doc(handle, "user::1", "123", 0) ||
+        store_simple_doc(handle, "user::2", "1234567", 0) ||
+        store_simple_doc(handle, "user::3", "", 1) ||
+        store_simple_doc(handle, "_local/x", "12345", 0)) {
+        return 1;
+    }
+    cbio_commit(handle);
+
+    if (check_range(handle, NULL, NULL, 3, 2, 15) ||
+        check_range(handle, "user::", "user::\xff", 2, 1, 10) ||
+        check_range(handle, "item::1", "user::1", 2, 1, 8) ||
+        check_range(handle, "user::2", NULL, 1, 1, 7) ||
+        check_range(handle, NULL, "item::", 0, 0, 0)) {
+        return 1;
+    }
+
+    cbio_close_handle(handle);
+    return 0;
+}
+
+static int expect_value(libcbio_t handle, const char *id, const char *value)
+{
+    libcbio_document_t doc;
+    const void *data;
+    size_t ndata;
+    cbio_error_t err;
+
+    err = cbio_get_document(handle, id, strlen(id), &doc);
+    if (value == NULL) {
+        if (err != CBIO_ERROR_ENOENT) {
+            report("Did not expect to find \"%s\": \"%s\"", id,
+                   cbio_strerror(err));
+            return 1;
+        }
+        return 0;
+    }
+
+    if (err != CBIO_SUCCESS) {
+        report("Failed to get \"%s\": \"%s\"", id, cbio_strerror(err));
+        return 1;
+    }
+    cbio_document_get_value(doc, &data, &ndata);
+    if (ndata != strlen(value) || memcmp(data, value, ndata) != 0) {
+        report("Unexpected value for \"%s\"", id);
+        return 1;
+    }
+    cbio_document_release(doc);
+    return 0;
+}
+
+/*
+ * Store a batch where the second document can't be copied (the test
+ * allocator using alloc_stats must be installed)
+ */
+static int store_partial_batch(libcbio_t handle,
+                               struct test_alloc_stats *alloc_stats)
+{
+    const size_t nbig = 2 * 1024 * 1024;
+    libcbio_document_t docs[2];
+    cbio_error_t err;
+    char *big;
+
+    if ((big = calloc(1, nbig)) == NULL) {
+        report("Failed to allocate memory");
+        return 1;
+    }
+
+    if (cbio_create_empty_document(handle, &docs[0]) != CBIO_SUCCESS) {
+        free(big);
+        return 1;
+    }
+    if (cbio_create_empty_document(handle, &docs[1]) != CBIO_SUCCESS) {
+        cbio_document_release(docs[0]);
+        free(big);
+        return 1;
+    }
+
+    err = cbio_document_set_id(docs[0], "g", 1, 0);
+    if (err == CBIO_SUCCESS) {
+        err = cbio_document_set_value(docs[0], "8", 1, 0);
+    }
+    if (err == CBIO_SUCCESS) {
+        err = cbio_document_set_id(docs[1], "h", 1, 0);
+    }
+    if (err == CBIO_SUCCESS) {
+        err = cbio_document_set_value(docs[1], big, nbig, 0);
+    }
+    if (err == CBIO_SUCCESS) {
+        alloc_stats->fail_above = 1024 * 1024;
+        err = cbio_store_documents(handle, docs, 2);
+        alloc_stats->fail_above = 0;
+    }
+
+    cbio_document_release(docs[0]);
+    cbio_document_release(docs[1]);
+    free(big);
+
+    if (err != CBIO_ERROR_ENOMEM) {
+        report("Expected the batch to fail: \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+    return 0;
+}
+
+static int test_write_buffer(void)
+{
+    struct test_alloc_stats alloc_stats;
+    cbio_allocator_t allocator;
+    cbio_write_buffer_t policy;
+    cbio_range_stats_t stats;
+    libcbio_t handle;
+    libcbio_t reader;
+    cbio_error_t err;
+
+    /* Lets store_partial_batch() make the big allocations fail */
+    test_allocator_init(&allocator, &alloc_stats);
+    cbio_set_allocator(&allocator);
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_CREATE, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    memset(&policy, 0, sizeof(policy));
+    policy.max_documents = 3;
+    policy.commit_on_flush = 1;
+    if ((err = cbio_set_write_buffer(handle, &policy)) != CBIO_SUCCESS) {
+        report("Failed to set write buffer \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    /* Reads go through the buffer */
+    if (store_simple_doc(handle, "a", "1", 0) ||
+        store_simple_doc(handle, "b", "2", 0) ||
+        store_simple_doc(handle, "a", "3", 0) ||
+        store_simple_doc(handle, "b", "", 1) ||
+        expect_value(handle, "a", "3") ||
+        expect_value(handle, "b", NULL)) {
+        return 1;
+    }
+
+    /* Nothing is written (or committed) yet */
+    err = cbio_open_handle(dbfile, CBIO_OPEN_RDONLY, &reader);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open reader \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+    if (expect_value(reader, "a", NULL)) {
+        return 1;
+    }
+    cbio_close_handle(reader);
+
+    /* Hitting the limit flushes and commits */
+    if (store_simple_doc(handle, "c", "4", 0)) {
+        return 1;
+    }
+    err = cbio_open_handle(dbfile, CBIO_OPEN_RDONLY, &reader);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open reader \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+    if (expect_value(reader, "a", "3") || expect_value(reader, "b", NULL) ||
+        expect_value(reader, "c", "4")) {
+        return 1;
+    }
+    cbio_close_handle(reader);
+
+    /* Operations on the file see the buffered documents */
+    if (store_simple_doc(handle, "d", "5", 0)) {
+        return 1;
+    }
+    err = cbio_count_range(handle, NULL, 0, NULL, 0, &stats);
+    if (err != CBIO_SUCCESS || stats.live != 3 || stats.deleted != 1) {
+        report("Unexpected document count");
+        return 1;
+    }
+
+    /* A batch which doesn't fit leaves nothing behind in the buffer */
+    if (store_partial_batch(handle, &alloc_stats) ||
+        expect_value(handle, "g", NULL)) {
+        return 1;
+    }
+
+    if (store_simple_doc(handle, "e", "6", 0) ||
+        (err = cbio_set_write_buffer(handle, NULL)) != CBIO_SUCCESS ||
+        store_simple_doc(handle, "f", "7", 0)) {
+        report("Failed to disable the write buffer");
+        return 1;
+    }
+    cbio_close_handle(handle);
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_RDONLY, &reader);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open reader \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+    if (expect_value(reader, "d", "5") || expect_value(reader, "e", "6") ||
+        expect_value(reader, "f", "7") || expect_value(reader, "g", NULL)) {
+        return 1;
+    }
+    cbio_close_handle(reader);
+    cbio_set_allocator(NULL);
+
+    if (alloc_stats.outstanding != 0) {
+        report("%ld blocks leaked", alloc_stats.outstanding);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int test_backup_restore(void)
+{
+    const char *deltas[] = { "testcase.delta1", "testcase.delta2",
+                             "testcase.delta3"
+                           };
+    const char *local[] = { "_local/x" };
+    libcbio_document_t doc;
+    libcbio_t handle;
+    cbio_error_t err;
+    uint64_t last1, last2, revision;
+    FILE *fp;
+    int ret = 1;
+
+    for (int ii = 0; ii < 3; ++ii) {
+        (void)remove(deltas[ii]);
+    }
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_CREATE, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    if (store_simple_doc(handle, "a", "1", 0) ||
+        store_simple_doc(handle, "b", "2", 0) ||
+        store_simple_doc(handle, "_local/x", "3", 0)) {
+        return 1;
+    }
+    cbio_commit(handle);
+
+    err = cbio_backup_since(handle, 0, deltas[0], local, 1, &last1);
+    if (err != CBIO_SUCCESS || last1 != 2) {
+        report("Failed to create full backup \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    if (cbio_create_empty_document(handle, &doc) != CBIO_SUCCESS ||
+        cbio_document_set_id(doc, "a", 1, 0) != CBIO_SUCCESS ||
+        cbio_document_set_value(doc, "4", 1, 0) != CBIO_SUCCESS ||
+        cbio_document_set_revision(doc, 7) != CBIO_SUCCESS ||
+        cbio_store_document(handle, doc) != CBIO_SUCCESS) {
+        report("Failed to store \"a\"");
+        return 1;
+    }
+    cbio_document_release(doc);
+
+    if (store_simple_doc(handle, "b", "", 1) ||
+        store_simple_doc(handle, "c", "5", 0) ||
+        store_simple_doc(handle, "_local/x", "6", 0)) {
+        return 1;
+    }
+    cbio_commit(handle);
+
+    if ((err = cbio_backup_since(handle, last1 + 1, deltas[1], local, 1,
+                                 &last2)) != CBIO_SUCCESS ||
+        (err = cbio_backup_since(handle, last2 + 10, deltas[2], NULL, 0,
+                                 NULL)) != CBIO_SUCCESS) {
+        report("Failed to create delta \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    /* Never overwrite an existing delta */
+    if (cbio_backup_since(handle, 0, deltas[0], NULL, 0,
+                          NULL) != CBIO_ERROR_EINVAL) {
+        report("Expected backup to an existing file to fail");
+        return 1;
+    }
+    cbio_close_handle(handle);
+
+    err = cbio_open_handle(dbfile2, CBIO_OPEN_CREATE, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    /* There is a gap between the second and the third delta */
+    if (cbio_restore_delta(handle, deltas + 1, 2) != CBIO_ERROR_EINVAL) {
+        report("Unexpected result from restoring a broken chain");
+        return 1;
+    }
+
+    if ((err = cbio_restore_delta(handle, deltas, 2)) != CBIO_SUCCESS) {
+        report("Failed to restore \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    if (expect_value(handle, "a", "4") || expect_value(handle, "b", NULL) ||
+        expect_value(handle, "c", "5") || expect_value(handle, "_local/x", "6")) {
+        return 1;
+    }
+
+    if (cbio_get_document(handle, "a", 1, &doc) == CBIO_SUCCESS) {
+        cbio_document_get_revision(doc, &revision);
+        cbio_document_release(doc);
+        ret = revision == 7 ? 0 : 1;
+    }
+
+    /* Lengths reaching past the end of the file are refused before
+       anything is allocated for them */
+    if ((fp = fopen(deltas[0], "r+b")) == NULL ||
+        fseek(fp, 16 + 19, SEEK_SET) != 0 ||
+        fwrite("\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff", 1, 12,
+               fp) != 12) {
+        report("Failed to damage %s", deltas[0]);
+        ret = 1;
+    }
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    err = cbio_restore_delta(handle, deltas, 1);
+    if (err != CBIO_ERROR_CORRUPT) {
+        report("Expected a damaged record to be refused: \"%s\"",
+               cbio_strerror(err));
+        ret = 1;
+    }
+    cbio_close_handle(handle);
+
+    for (int ii = 0; ii < 3; ++ii) {
+        (void)remove(deltas[ii]);
+    }
+
+    return ret;
+}
+
+static int test_replicate(void)
+{
+    cbio_replicate_options_t opts;
+    libcbio_document_t doc;
+    libcbio_t src, dst;
+    cbio_error_t err;
+    uint64_t revision = 0;
+    char key[32];
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_CREATE, &src);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    for (int ii = 0; ii < 100; ++ii) {
+        sprintf(key, "doc-%03d", ii);
+        if (store_simple_doc(src, key, key, ii % 10 == 0)) {
+            return 1;
+        }
+    }
+
+    if (cbio_create_empty_document(src, &doc) != CBIO_SUCCESS ||
+        cbio_document_set_id(doc, "rev", 3, 0) != CBIO_SUCCESS ||
+        cbio_document_set_value(doc, "r", 1, 0) != CBIO_SUCCESS ||
+        cbio_document_set_revision(doc, 9) != CBIO_SUCCESS ||
+        cbio_store_document(src, doc) != CBIO_SUCCESS) {
+        report("Failed to store document with revision");
+        return 1;
+    }
+    cbio_document_release(doc);
+    cbio_close_handle(src);
+
+    if ((err = cbio_open_handle(dbfile, CBIO_OPEN_SHARED_RDONLY,
+                                &src)) != CBIO_SUCCESS ||
+        (err = cbio_open_handle(dbfile2, CBIO_OPEN_CREATE,
+                                &dst)) != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    cbio_replicate_options_init(&opts);
+    opts.batch_size = 7;
+    opts.commit_interval = 20;
+    opts.nthreads = 2;
+    opts.resume = 1;
+
+    if ((err = cbio_replicate(src, dst, 0, &opts)) != CBIO_SUCCESS) {
+        report("Failed to replicate \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    if (expect_value(dst, "doc-000", NULL) ||
+        expect_value(dst, "doc-001", "doc-001") ||
+        expect_value(dst, "doc-099", "doc-099") ||
+        expect_value(dst, "_local/cbio_replicate", "{\"seqno\":101}")) {
+        return 1;
+    }
+
+    if (cbio_get_document(dst, "rev", 3, &doc) == CBIO_SUCCESS) {
+        cbio_document_get_revision(doc, &revision);
+        cbio_document_release(doc);
+    }
+    if (revision != 9) {
+        report("The revision was not preserved");
+        return 1;
+    }
+    cbio_close_handle(src);
+
+    /* Only the new change should be copied when resuming */
+    err = cbio_open_handle(dbfile, CBIO_OPEN_RW, &src);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+    if (store_simple_doc(src, "new", "n", 0) ||
+        store_simple_doc(dst, "doc-001", "local", 0)) {
+        return 1;
+    }
+    cbio_commit(src);
+
+    if ((err = cbio_replicate(src, dst, 0, &opts)) != CBIO_SUCCESS) {
+        report("Failed to resume replication \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    if (expect_value(dst, "new", "n") ||
+        expect_value(dst, "doc-001", "local") ||
+        expect_value(dst, "_local/cbio_replicate", "{\"seqno\":102}")) {
+        return 1;
+    }
+
+    cbio_close_handle(src);
+    cbio_close_handle(dst);
+
+    return 0;
+}
+
+struct verify_result {
+    cbio_verify_progress_t progress;
+    int files;
+    int other;
+    /* The last body and by-sequence problems reported */
+    uint64_t body_seqno;
+    uint64_t first_seqno;
+    uint64_t last_seqno;
+};
+
+static void verify_problem(const cbio_verify_problem_t *problem, void *ctx)
+{
+    struct verify_result *result = ctx;
+    if (problem->area == CBIO_VERIFY_FILE &&
+        strcmp(problem->path, "testcase.missing") == 0) {
+        result->files++;
+    } else if (problem->area == CBIO_VERIFY_BODY) {
+        result->body_seqno = problem->first_seqno;
+    } else if (problem->area == CBIO_VERIFY_BY_SEQNO) {
+        result->first_seqno = problem->first_seqno;
+        result->last_seqno = problem->last_seqno;
+    } else {
+        result->other++;
+    }
+}
+
+/*
+ * Flip a bit in the middle of the last copy of pattern in the file.
+ * The by-sequence tree is written after the by-id tree, so for an id
+ * that is where the by-sequence entry lives
+ */
+static int corrupt_file(const char *path, const char *pattern)
+{
+    size_t npattern = strlen(pattern);
+    long offset = -1;
+    char *data = NULL;
+    long size;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r+b")) == NULL ||
+        fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0 ||
+        (data = malloc((size_t)size + 1)) == NULL ||
+        fseek(fp, 0, SEEK_SET) != 0 ||
+        fread(data, 1, (size_t)size, fp) != (size_t)size) {
+        report("Failed to read \"%s\"", path);
+        free(data);
+        if (fp != NULL) {
+            fclose(fp);
+        }
+        return 1;
+    }
+
+    for (long ii = 0; ii + (long)npattern <= size; ++ii) {
+        if (memcmp(data + ii, pattern, npattern) == 0) {
+            offset = ii + (long)npattern / 2;
+        }
+    }
+
+    if (offset == -1) {
+        report("Didn't find \"%s\" in \"%s\"", pattern, path);
+    } else {
+        data[offset] ^= 0x20;
+        if (fseek(fp, offset, SEEK_SET) != 0 ||
+            fwrite(data + offset, 1, 1, fp) != 1) {
+            report("Failed to write \"%s\"", path);
+            offset = -1;
+        }
+    }
+    free(data);
+
+    return fclose(fp) != 0 || offset == -1;
+}
+
+static void verify_progress(const cbio_verify_progress_t *progress,
+                            void *ctx)
+{
+    struct verify_result *result = ctx;
+    result->progress = *progress;
+}
+
+static int test_verify(void)
+{
+    const char *paths[] = { dbfile, dbfile2, "testcase.missing" };
+    struct verify_result result;
+    cbio_verify_options_t opts;
+    libcbio_t handle;
+    cbio_error_t err;
+    char key[32];
+
+    for (int ii = 0; ii < 2; ++ii) {
+        err = cbio_open_handle(paths[ii], CBIO_OPEN_CREATE, &handle);
+        if (err != CBIO_SUCCESS) {
+            report("Failed to open handle \"%s\"", cbio_strerror(err));
+            return 1;
+        }
+        for (int jj = 0; jj < 50; ++jj) {
+            sprintf(key, "doc-%03d", jj);
+            if (store_simple_doc(handle, key, key, jj % 10 == 0)) {
+                return 1;
+            }
+        }
+        cbio_close_handle(handle);
+    }
+
+    memset(&result, 0, sizeof(result));
+    cbio_verify_options_init(&opts);
+    opts.nthreads = 3;
+    opts.seqnos_per_task = 7;
+    opts.max_bytes_per_sec = 1024 * 1024 * 1024;
+    opts.problem = verify_problem;
+    opts.progress = verify_progress;
+    opts.cookie = &result;
+
+    if ((err = cbio_verify(paths, 2, &opts)) != CBIO_SUCCESS) {
+        report("Failed to verify \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    if (result.files != 0 || result.other != 0 ||
+        result.progress.documents != 100 ||
+        result.progress.files_done != 2 || result.progress.nfiles != 2) {
+        report("Unexpected result from verifying clean files");
+        return 1;
+    }
+
+    /* A missing file is reported, but doesn't stop the others */
+    memset(&result, 0, sizeof(result));
+    if (cbio_verify(paths, 3, &opts) == CBIO_SUCCESS ||
+        result.files != 1 || result.other != 0 ||
+        result.progress.documents != 100 ||
+        result.progress.files_done != 3) {
+        report("Unexpected result from verifying a missing file");
+        return 1;
+    }
+
+    /* Damage a body and the by-sequence entry of another document */
+    (void)remove(dbfile);
+    err = cbio_open_handle(dbfile, CBIO_OPEN_CREATE, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+    for (int ii = 0; ii < 200; ++ii) {
+        sprintf(key, "doc-%03d", ii);
+        if (store_simple_doc(handle, ii == 100 ? "Zq7-bad-node" : key,
+                             ii == 20 ? "Xw9-bad-body" : key, 0)) {
+            return 1;
+        }
+    }
+    cbio_close_handle(handle);
+    if (corrupt_file(dbfile, "Xw9-bad-body") ||
+        corrupt_file(dbfile, "Zq7-bad-node")) {
+        return 1;
+    }
+
+    /* Both are reported, and everything else is still read */
+    memset(&result, 0, sizeof(result));
+    if (cbio_verify(paths, 1, &opts) == CBIO_SUCCESS ||
+        result.other != 0 || result.body_seqno != 21 ||
+        result.first_seqno == 0 || result.first_seqno > 101 ||
+        result.last_seqno < 101 || result.last_seqno >= 200 ||
+        result.progress.documents + result.last_seqno -
+        result.first_seqno + 1 != 200) {
+        report("Unexpected result from verifying a damaged file");
+        return 1;
+    }
+
+    return 0;
+}
+
+static int test_key_batches(void)
+{
+    uint64_t seqnos[4];
+    uint8_t flags[4];
+    size_t offsets[5];
+    char ids[16];
+    cbio_key_batch_t batch;
+    libcbio_t handle;
+    cbio_error_t err;
+    char got[128];
+    uint64_t since = 1;
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_CREATE, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    /* Stored out of id order, and 'b' is deleted */
+    if (store_simple_doc(handle, "e", "1", 0) ||
+        store_simple_doc(handle, "b", "2", 1) ||
+        store_simple_doc(handle, "aaaa", "3", 0) ||
+        store_simple_doc(handle, "d", "4", 0) ||
+        store_simple_doc(handle, "c", "5", 0) ||
+        store_simple_doc(handle, "_local/x", "6", 0)) {
+        return 1;
+    }
+
+    memset(&batch, 0, sizeof(batch));
+    batch.capacity = 4;
+    batch.seqnos = seqnos;
+    batch.flags = flags;
+    batch.id_offsets = offsets;
+    batch.ids = ids;
+    batch.ids_size = sizeof(ids);
+
+    got[0] = '\0';
+    do {
+        if ((err = cbio_changes_since_keys(handle, since,
+                                           &batch)) != CBIO_SUCCESS) {
+            report("Failed to get changes \"%s\"", cbio_strerror(err));
+            return 1;
+        }
+        for (size_t ii = 0; ii < batch.nentries; ++ii) {
+            size_t len = strlen(got);
+            snprintf(got + len, sizeof(got) - len, "%.*s:%d%s,",
+                     (int)(offsets[ii + 1] - offsets[ii]), ids + offsets[ii],
+                     (int)seqnos[ii], flags[ii] & CBIO_KEY_DELETED ? "d" : "");
+            since = seqnos[ii] + 1;
+        }
+    } while (batch.nentries > 0);
+
+    if (strcmp("e:1,b:2d,aaaa:3,d:4,c:5,", got) != 0) {
+        report("Unexpected changes \"%s\"", got);
+        return 1;
+    }
+
+    got[0] = '\0';
+    do {
+        const char *after = NULL;
+        size_t nafter = 0;
+        if (batch.nentries > 0) {
+            after = ids + offsets[batch.nentries - 1];
+            nafter = offsets[batch.nentries] - offsets[batch.nentries - 1];
+        }
+        batch.capacity = 2;
+        if ((err = cbio_all_keys(handle, after, nafter,
+                                 &batch)) != CBIO_SUCCESS) {
+            report("Failed to get ids \"%s\"", cbio_strerror(err));
+            return 1;
+        }
+        for (size_t ii = 0; ii < batch.nentries; ++ii) {
+            size_t len = strlen(got);
+            snprintf(got + len, sizeof(got) - len, "%.*s,",
+                     (int)(offsets[ii + 1] - offsets[ii]), ids + offsets[ii]);
+        }
+    } while (batch.nentries > 0);
+
+    if (strcmp("aaaa,b,c,d,e,", got) != 0) {
+        report("Unexpected ids \"%s\"", got);
+        return 1;
+    }
+
+    /* An id which doesn't fit in the buffer */
+    batch.ids_size = 2;
+    if (cbio_all_keys(handle, NULL, 0, &batch) != CBIO_ERROR_ENOMEM) {
+        report("Expected the id buffer to be too small");
+        return 1;
+    }
+
+    cbio_close_handle(handle);
+
+    return 0;
+}
+
+/* Every block carries the class it was allocated with */
+static int test_allocator(void)
+{
+    struct test_alloc_stats stats;
+    cbio_allocator_t allocator;
+    cbio_write_buffer_t policy;
+    libcbio_t handle;
+    cbio_error_t err;
+    int ret = 0;
+
+    memset(&allocator, 0, sizeof(allocator));
+    if (cbio_set_allocator(&allocator) != CBIO_ERROR_EINVAL) {
+        report("Expected an incomplete allocator to be rejected");
+        return 1;
+    }
+
+    test_allocator_init(&allocator, &stats);
+    if (cbio_set_allocator(&allocator) != CBIO_SUCCESS) {
+        report("Failed to set allocator");
+        return 1;
+    }
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_CREATE, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        cbio_set_allocator(NULL);
+        return 1;
+    }
+
+    memset(&policy, 0, sizeof(policy));
+    policy.max_documents = 2;
+    if (cbio_set_write_buffer(handle, &policy) != CBIO_SUCCESS ||
+        store_simple_doc(handle, "a", "1", 0) ||
+        store_simple_doc(handle, "b", "2", 0) ||
+        store_simple_doc(handle, "c", "3", 0) ||
+        store_simple_doc(handle, "_local/d", "4", 0) ||
+        expect_value(handle, "a", "1") || expect_value(handle, "c", "3") ||
+        expect_value(handle, "_local/d", "4")) {
+        ret = 1;
+    }
+    cbio_close_handle(handle);
+    cbio_set_allocator(NULL);
+
+    if (ret == 0 && (stats.outstanding != 0 || stats.mismatch != 0)) {
+        report("%ld blocks leaked, %ld released with the wrong class",
+               stats.outstanding, stats.mismatch);
+        ret = 1;
+    }
+
+    if (ret == 0 && (stats.allocated[CBIO_ALLOC_HANDLE] == 0 ||
+                     stats.allocated[CBIO_ALLOC_DOCUMENT] == 0 ||
+                     stats.allocated[CBIO_ALLOC_DOCINFO] == 0 ||
+                     stats.allocated[CBIO_ALLOC_DATA] == 0 ||
+                     stats.allocated[CBIO_ALLOC_BATCH] == 0)) {
+        report("Expected allocations of all classes");
+        ret = 1;
+    }
+
+    return ret;
+}
+
+static long total_allocations(const struct test_alloc_stats *stats)
+{
+    long ret = 0;
+    for (int ii = 0; ii <= CBIO_ALLOC_OTHER; ++ii) {
+        ret += stats->allocated[ii];
+    }
+    return ret;
+}
+
+static int expect_document(libcbio_document_t doc, const char *value)
+{
+    const void *data;
+    size_t ndata;
+
+    if (cbio_document_get_value(doc, &data, &ndata) != CBIO_SUCCESS ||
+        ndata != strlen(value) || memcmp(data, value, ndata) != 0) {
+        report("Unexpected value (expected \"%s\")", value);
+        return 1;
+    }
+    return 0;
+}
+
+static int read_into_document(libcbio_t handle, libcbio_document_t doc,
+                              const struct test_alloc_stats *stats)
+{
+    const void *data;
+    size_t ndata;
+    long allocations;
+
+    if (cbio_get_document_into(handle, "b", 1, doc) != CBIO_SUCCESS ||
+        expect_document(doc, "a somewhat longer value") ||
+        cbio_get_document_into(handle, "_local/d", 8, doc) != CBIO_SUCCESS ||
+        expect_document(doc, "local")) {
+        return 1;
+    }
+
+    if (cbio_get_document_into(handle, "c", 1, doc) != CBIO_ERROR_ENOENT ||
+        cbio_document_get_value(doc, &data, &ndata) != CBIO_ERROR_EINVAL) {
+        report("Expected deleted document to leave an empty document");
+        return 1;
+    }
+
+    /* Once the buffer is big enough we shouldn't allocate anything */
+    allocations = total_allocations(stats);
+    for (int ii = 0; ii < 10; ++ii) {
+        if (cbio_get_document_into(handle, "a", 1, doc) != CBIO_SUCCESS ||
+            expect_document(doc, "short") ||
+            cbio_get_document_into(handle, "b", 1, doc) != CBIO_SUCCESS ||
+            expect_document(doc, "a somewhat longer value")) {
+            return 1;
+        }
+    }
+    if (total_allocations(stats) != allocations) {
+        report("Reading into a document allocated memory");
+        return 1;
+    }
+
+    /* The document may still be used for storing */
+    cbio_document_reinitialize(doc);
+    if (cbio_document_set_id(doc, "e", 1, 0) != CBIO_SUCCESS ||
+        cbio_document_set_value(doc, "new", 3, 1) != CBIO_SUCCESS ||
+        cbio_store_document(handle, doc) != CBIO_SUCCESS ||
+        expect_value(handle, "e", "new")) {
+        report("Failed to store reused document");
+        return 1;
+    }
+
+    return 0;
+}
+
+static int test_get_document_into(void)
+{
+    struct test_alloc_stats stats;
+    cbio_allocator_t allocator;
+    libcbio_document_t doc;
+    libcbio_t handle;
+    cbio_error_t err;
+    int ret = 1;
+
+    test_allocator_init(&allocator, &stats);
+    cbio_set_allocator(&allocator);
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_CREATE, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        cbio_set_allocator(NULL);
+        return 1;
+    }
+
+    if (store_simple_doc(handle, "a", "short", 0) == 0 &&
+        store_simple_doc(handle, "b", "a somewhat longer value", 0) == 0 &&
+        store_simple_doc(handle, "c", "gone", 1) == 0 &&
+        store_simple_doc(handle, "_local/d", "local", 0) == 0 &&
+        cbio_commit(handle) == CBIO_SUCCESS) {
+        /* Start out with a document read the normal way */
+        if (cbio_get_document(handle, "a", 1, &doc) == CBIO_SUCCESS) {
+            ret = read_into_document(handle, doc, &stats);
+            cbio_document_release(doc);
+        } else {
+            report("Failed to get document");
+        }
+    }
+
+    cbio_close_handle(handle);
+    cbio_set_allocator(NULL);
+    if (ret == 0 && (stats.outstanding != 0 || stats.mismatch != 0)) {
+        report("%ld blocks leaked, %ld released with the wrong class",
+               stats.outstanding, stats.mismatch);
+        ret = 1;
+    }
+
+    return ret;
+}
+
+static int test_access_log_warmup(void)
+{
+    const char *logfile = "testcase.access";
+    libcbio_document_t doc;
+    libcbio_t handle;
+    cbio_error_t err;
+    uint64_t nread = 0;
+    char key[32];
+    FILE *fp;
+
+    (void)remove(logfile);
+    err = cbio_open_handle(dbfile, CBIO_OPEN_CREATE, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    for (int ii = 0; ii < 20; ++ii) {
+        sprintf(key, "doc-%02d", ii);
+        if (store_simple_doc(handle, key, key, 0)) {
+            return 1;
+        }
+    }
+    cbio_commit(handle);
+
+    /* Every second read is sampled, and only the last 4 are kept */
+    if (cbio_set_access_log(handle, logfile, 2, 4) != CBIO_SUCCESS) {
+        report("Failed to set access log");
+        return 1;
+    }
+    for (int ii = 0; ii < 10; ++ii) {
+        sprintf(key, "doc-%02d", ii);
+        if (cbio_get_document(handle, key, strlen(key),
+                              &doc) != CBIO_SUCCESS) {
+            report("Failed to read \"%s\"", key);
+            return 1;
+        }
+        cbio_document_release(doc);
+    }
+    if (cbio_save_access_log(handle) != CBIO_SUCCESS) {
+        report("Failed to save access log");
+        return 1;
+    }
+
+    err = cbio_warmup(handle, logfile, 2, &nread);
+    if (err != CBIO_SUCCESS || nread != 4) {
+        report("Unexpected warmup result \"%s\" %d", cbio_strerror(err),
+               (int)nread);
+        return 1;
+    }
+
+    /* Saving leaves the ring alone, so the next sample replaces the
+       oldest one (doc-03) */
+    for (int ii = 10; ii < 12; ++ii) {
+        sprintf(key, "doc-%02d", ii);
+        if (cbio_get_document(handle, key, strlen(key),
+                              &doc) != CBIO_SUCCESS) {
+            report("Failed to read \"%s\"", key);
+            return 1;
+        }
+        cbio_document_release(doc);
+    }
+    if (cbio_save_access_log(handle) != CBIO_SUCCESS) {
+        report("Failed to save access log");
+        return 1;
+    }
+    if ((fp = fopen(logfile, "rb")) != NULL) {
+        char content[128];
+        size_t nr = fread(content, 1, sizeof(content) - 1, fp);
+        fclose(fp);
+        content[nr] = '\0';
+        for (size_t ii = 0; ii < nr; ++ii) {
+            if (content[ii] == '\0') {
+                content[ii] = ' ';
+            }
+        }
+        if (strstr(content, "doc-03") != NULL ||
+            strstr(content, "doc-05") == NULL ||
+            strstr(content, "doc-11") == NULL) {
+            report("Saving the access log lost the recency order");
+            return 1;
+        }
+    }
+
+    /* Documents deleted since the log was written are skipped */
+    if (store_simple_doc(handle, "doc-05", "x", 1) ||
+        cbio_set_access_log(handle, NULL, 0, 0) != CBIO_SUCCESS) {
+        return 1;
+    }
+    cbio_close_handle(handle);
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_RDONLY, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+    err = cbio_warmup(handle, logfile, 4, &nread);
+    if (err != CBIO_SUCCESS || nread != 3) {
+        report("Unexpected warmup result \"%s\" %d", cbio_strerror(err),
+               (int)nread);
+        return 1;
+    }
+
+    if ((fp = fopen(logfile, "wb")) != NULL) {
+        fputs("garbage", fp);
+        fclose(fp);
+    }
+    if (cbio_warmup(handle, logfile, 1, NULL) != CBIO_ERROR_CORRUPT) {
+        report("Expected a broken access log to be refused");
+        return 1;
+    }
+    cbio_close_handle(handle);
+    (void)remove(logfile);
+
+    return 0;
+}
+
+static int check_lookups(libcbio_t handle, const char *a, const char *c)
+{
+    libcbio_document_t doc;
+    int ret = 0;
+
+    /* Twice, so the second round is served by the cache */
+    for (int ii = 0; ii < 2 && ret == 0; ++ii) {
+        ret = expect_value(handle, "a", a) || expect_value(handle, "b", NULL) ||
+              expect_value(handle, "c", c);
+    }
+
+    if (ret == 0 &&
+        cbio_create_empty_document(handle, &doc) == CBIO_SUCCESS) {
+        if (cbio_get_document_into(handle, "a", 1, doc) != CBIO_SUCCESS) {
+            report("Failed to read \"a\" into a document");
+            ret = 1;
+        } else {
+            ret = expect_document(doc, a);
+        }
+        cbio_document_release(doc);
+    }
+
+    return ret;
+}
+
+/* Check the hits and misses of the lookup cache since *last */
+static int check_cache_stats(cbio_lookup_cache_stats_t *last,
+                             uint64_t hits, uint64_t misses)
+{
+    cbio_lookup_cache_stats_t stats;
+
+    cbio_get_lookup_cache_stats(&stats);
+    if (stats.hits - last->hits != hits ||
+        stats.misses - last->misses != misses) {
+        report("Expected %d hits and %d misses, got %d and %d",
+               (int)hits, (int)misses, (int)(stats.hits - last->hits),
+               (int)(stats.misses - last->misses));
+        return 1;
+    }
+    *last = stats;
+
+    return 0;
+}
+
+static int test_lookup_cache(void)
+{
+    libcbio_t writer, reader, shared;
+    cbio_lookup_cache_stats_t stats;
+    cbio_error_t err;
+    int ret = 1;
+
+    cbio_set_lookup_cache(1024 * 1024);
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_CREATE, &writer);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    if (store_simple_doc(writer, "a", "first", 0) ||
+        store_simple_doc(writer, "b", "gone", 1) ||
+        cbio_commit(writer) != CBIO_SUCCESS) {
+        report("Failed to store documents");
+        return 1;
+    }
+
+    if ((err = cbio_open_handle(dbfile, CBIO_OPEN_RDONLY,
+                                &reader)) != CBIO_SUCCESS ||
+        (err = cbio_open_handle(dbfile, CBIO_OPEN_SHARED_RDONLY,
+                                &shared)) != CBIO_SUCCESS) {
+        report("Failed to open reader \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    /* The reader misses the first round of three ids, and the rest
+       (including the ones by the other handle) are hits */
+    cbio_get_lookup_cache_stats(&stats);
+    if (check_lookups(reader, "first", NULL) == 0 &&
+        check_cache_stats(&stats, 4, 3) == 0 &&
+        check_lookups(shared, "first", NULL) == 0 &&
+        check_cache_stats(&stats, 7, 0) == 0) {
+        /* The cached lookups belong to the old header, and the writer
+           doesn't use the cache at all */
+        if (store_simple_doc(writer, "a", "second", 0) ||
+            store_simple_doc(writer, "c", "new", 0) ||
+            cbio_commit(writer) != CBIO_SUCCESS) {
+            report("Failed to update documents");
+        } else if (check_lookups(writer, "second", "new") == 0 &&
+                   check_lookups(reader, "first", NULL) == 0 &&
+                   check_cache_stats(&stats, 7, 0) == 0 &&
+                   cbio_refresh_handle(reader) == CBIO_SUCCESS &&
+                   cbio_refresh_handle(shared) == CBIO_SUCCESS &&
+                   check_lookups(reader, "second", "new") == 0 &&
+                   check_lookups(shared, "second", "new") == 0 &&
+                   check_cache_stats(&stats, 11, 3) == 0) {
+            ret = 0;
+        }
+    }
+
+    cbio_close_handle(shared);
+    cbio_close_handle(reader);
+
+    /* Once the file isn't open the inode may be reused by another
+       file, so a new handle can't use what is cached */
+    if (ret == 0) {
+        ret = 1;
+        err = cbio_open_handle(dbfile, CBIO_OPEN_RDONLY, &reader);
+        if (err != CBIO_SUCCESS) {
+            report("Failed to open reader \"%s\"", cbio_strerror(err));
+        } else {
+            if (check_lookups(reader, "second", "new") == 0 &&
+                check_cache_stats(&stats, 4, 3) == 0) {
+                ret = 0;
+            }
+            cbio_close_handle(reader);
+        }
+    }
+
+    cbio_close_handle(writer);
+    cbio_set_lookup_cache(0);
+
+    return ret;
+}
+
+struct test_trace_stats {
+    int started[CBIO_TRACE_CHANGES_CALLBACK + 1];
+    int done[CBIO_TRACE_CHANGES_CALLBACK + 1];
+    uint64_t nkey;
+    uint64_t nbytes;
+    int errors;
+};
+
+static void trace_callback(libcbio_t handle,
+                           const cbio_trace_event_t *event,
+                           void *cookie)
+{
+    struct test_trace_stats *stats = cookie;
+    (void)handle;
+
+    if (event->done) {
+        ++stats->done[event->op];
+        if (event->op == CBIO_TRACE_GET_DOCUMENT) {
+            stats->nkey += event->nkey;
+            stats->nbytes += event->nbytes;
+            if (event->result != CBIO_SUCCESS) {
+                ++stats->errors;
+            }
+        }
+    } else {
+        ++stats->started[event->op];
+    }
+}
+
+static int test_trace_callback(void)
+{
+    struct test_trace_stats stats;
+    libcbio_document_t doc;
+    libcbio_t handle;
+    cbio_error_t err;
+    int ndocs = 0;
+    int ret = 0;
+
+    memset(&stats, 0, sizeof(stats));
+    cbio_set_trace_callback(trace_callback, &stats);
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_CREATE, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        cbio_set_trace_callback(NULL, NULL);
+        return 1;
+    }
+
+    if (store_simple_doc(handle, "a", "value", 0) ||
+        store_simple_doc(handle, "bb", "other", 0) ||
+        cbio_commit(handle) != CBIO_SUCCESS ||
+        cbio_get_document(handle, "a", 1, &doc) != CBIO_SUCCESS) {
+        report("Failed to store and read documents");
+        ret = 1;
+    } else {
+        cbio_document_release(doc);
+        /* A miss is reported with its error */
+        (void)cbio_get_document(handle, "missing", 7, &doc);
+        (void)cbio_changes_since(handle, 0, count_callback, &ndocs);
+    }
+    cbio_close_handle(handle);
+    cbio_set_trace_callback(NULL, NULL);
+
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (int ii = 0; ii <= CBIO_TRACE_CHANGES_CALLBACK; ++ii) {
+        if (stats.started[ii] != stats.done[ii]) {
+            report("Operation %d started %d times, but finished %d", ii,
+                   stats.started[ii], stats.done[ii]);
+            return 1;
+        }
+    }
+
+    if (stats.done[CBIO_TRACE_STORE_DOCUMENTS] != 2 ||
+        stats.done[CBIO_TRACE_COMMIT] < 1 ||
+        stats.done[CBIO_TRACE_GET_DOCUMENT] != 2 ||
+        stats.done[CBIO_TRACE_CHANGES_SINCE] != 1 ||
+        stats.done[CBIO_TRACE_CHANGES_CALLBACK] != ndocs ||
+        ndocs != 2) {
+        report("Unexpected number of events");
+        return 1;
+    }
+
+    if (stats.nkey != 1 + 7 || stats.nbytes != 5 || stats.errors != 1) {
+        report("Unexpected get events (%llu key bytes, %llu value bytes"
+               ", %d errors)", (unsigned long long)stats.nkey,
+               (unsigned long long)stats.nbytes, stats.errors);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int expect_projection(libcbio_t handle, const char *id,
+                             const char *const *paths, size_t npaths,
+                             const char *expected)
+{
+    libcbio_document_t doc;
+    cbio_error_t err;
+    int ret;
+
+    err = cbio_get_document_projected(handle, id, strlen(id), paths, npaths,
+                                      &doc);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to project \"%s\": \"%s\"", id, cbio_strerror(err));
+        return 1;
+    }
+    ret = expect_document(doc, expected);
+    cbio_document_release(doc);
+
+    return ret;
+}
+
+static int projection_callback(libcbio_t handle, libcbio_document_t doc,
+                               void *ctx)
+{
+    static const char *const paths[] = { "age" };
+    int *nprojected = ctx;
+    const void *id;
+    size_t nid;
+
+    cbio_document_get_id(doc, &id, &nid);
+    if (nid == 1 && memcmp(id, "p", 1) == 0 &&
+        cbio_document_fetch_value(handle, doc) == CBIO_SUCCESS &&
+        cbio_document_project(doc, paths, 1) == CBIO_SUCCESS &&
+        expect_document(doc, "{\"age\":3}") == 0) {
+        ++*nprojected;
+    }
+
+    return 0;
+}
+
+static int test_json_projection(void)
+{
+    static const char *const paths[] = {
+        "age", "address.city", "tags[1].b[1]", "missing", "address",
+        "tags[5]", "name.first"
+    };
+    static const char *const duplicate[] = { "a.y", "a.x" };
+    static const char *const malformed[] = { "a..b" };
+    libcbio_document_t doc;
+    libcbio_t handle;
+    cbio_error_t err;
+    int nprojected = 0;
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_CREATE, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    if (store_simple_doc(handle, "p",
+                         "{\"name\": \"x\", \"age\": 3, \"address\": "
+                         "{\"city\": \"Oslo\", \"zip\": \"0150\"}, "
+                         "\"tags\": [\"a\", {\"b\": [1, 2]}]}", 0) ||
+        store_simple_doc(handle, "d", "{\"a\":{\"x\":1},\"a\":{\"y\":2}}",
+                         0) ||
+        store_simple_doc(handle, "n", "not json", 0) ||
+        cbio_commit(handle) != CBIO_SUCCESS) {
+        report("Failed to store documents");
+        return 1;
+    }
+
+    if (expect_projection(handle, "p", paths, 7,
+                          "{\"age\":3,\"address.city\":\"Oslo\","
+                          "\"tags[1].b[1]\":2,\"address\":"
+                          "{\"city\": \"Oslo\", \"zip\": \"0150\"}}") ||
+        expect_projection(handle, "d", duplicate, 2,
+                          "{\"a.y\":2,\"a.x\":1}") ||
+        expect_projection(handle, "p", NULL, 0, "{}")) {
+        return 1;
+    }
+
+    err = cbio_get_document_projected(handle, "p", 1, malformed, 1, &doc);
+    if (err != CBIO_ERROR_EINVAL) {
+        report("Expected a malformed path to be rejected");
+        return 1;
+    }
+    err = cbio_get_document_projected(handle, "n", 1, paths, 1, &doc);
+    if (err != CBIO_ERROR_EINVAL) {
+        report("Expected a value which isn't JSON to be rejected");
+        return 1;
+    }
+
+    err = cbio_changes_since(handle, 0, projection_callback, &nprojected);
+    if (err != CBIO_SUCCESS || nprojected != 1) {
+        report("Failed to project documents in the changes feed");
+        return 1;
+    }
+
+    cbio_close_handle(handle);
+    return 0;
+}
+
+struct test_follow_ctx {
+    libcbio_t handle;
+    volatile int ndocs;
+    cbio_error_t error;
+};
+
+static int follow_callback(libcbio_t handle, libcbio_document_t doc,
+                           void *ctx)
+{
+    struct test_follow_ctx *follow = ctx;
+    (void)doc;
+
+    if (__sync_add_and_fetch(&follow->ndocs, 1) == 4) {
+        cbio_stop_following(handle);
+    }
+    return 0;
+}
+
+static void *follower(void *arg)
+{
+    struct test_follow_ctx *follow = arg;
+    cbio_follow_options_t opts;
+
+    /* Only a notification of the commit will get us going again */
+    cbio_follow_options_init(&opts);
+    opts.poll_interval_ms = 0;
+    opts.timeout_ms = 10000;
+    follow->error = cbio_follow_changes(follow->handle, 0, &opts,
+                                        follow_callback, follow);
+    return NULL;
+}
+
+static int test_follow_changes(void)
+{
+    struct test_follow_ctx follow;
+    cbio_follow_options_t opts;
+    libcbio_t writer;
+    cbio_error_t err;
+    pthread_t thread;
+    time_t start;
+    int ncancel;
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_CREATE, &writer);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+
+    memset(&follow, 0, sizeof(follow));
+    if (store_simple_doc(writer, "a", "1", 0) ||
+        store_simple_doc(writer, "b", "2", 0) ||
+        cbio_commit(writer) != CBIO_SUCCESS ||
+        cbio_open_handle(dbfile, CBIO_OPEN_RDONLY,
+                         &follow.handle) != CBIO_SUCCESS) {
+        report("Failed to set up the database");
+        return 1;
+    }
+
+    if (cbio_follow_changes(writer, 0, NULL, follow_callback,
+                            &follow) != CBIO_ERROR_EINVAL) {
+        report("Expected following a writer to be rejected");
+        return 1;
+    }
+
+    /* Nothing new arrives, so this returns after the timeout */
+    cbio_follow_options_init(&opts);
+    opts.timeout_ms = 50;
+    err = cbio_follow_changes(follow.handle, 0, &opts, follow_callback,
+                              &follow);
+    if (err != CBIO_SUCCESS || follow.ndocs != 2) {
+        report("Expected to see 2 documents before the timeout");
+        return 1;
+    }
+
+    /* The callback stops following by returning -1 */
+    start = time(NULL);
+    ncancel = 1;
+    opts.timeout_ms = 5000;
+    err = cbio_follow_changes(follow.handle, 0, &opts, stop_callback,
+                              &ncancel);
+    if (err != CBIO_SUCCESS || ncancel != 0 || time(NULL) - start > 2) {
+        report("Expected the callback to stop following");
+        return 1;
+    }
+
+    follow.ndocs = 0;
+    if (pthread_create(&thread, NULL, follower, &follow) != 0) {
+        report("Failed to start the follower");
+        return 1;
+    }
+    for (int ii = 0; ii < 5000 && follow.ndocs < 2; ++ii) {
+        usleep(1000);
+    }
+    if (follow.ndocs < 2) {
+        report("The follower didn't see the first 2 documents");
+        cbio_stop_following(follow.handle);
+        pthread_join(thread, NULL);
+        return 1;
+    }
+
+    if (store_simple_doc(writer, "c", "3", 0) ||
+        store_simple_doc(writer, "d", "4", 0) ||
+        cbio_commit(writer) != CBIO_SUCCESS) {
+        report("Failed to store more documents");
+        return 1;
+    }
+    pthread_join(thread, NULL);
+
+    if (follow.error != CBIO_SUCCESS || follow.ndocs != 4) {
+        report("Expected the follower to see 4 documents, got %d (%s)",
+               follow.ndocs, cbio_strerror(follow.error));
+        return 1;
+    }
+
+    cbio_close_handle(follow.handle);
+    cbio_close_handle(writer);
+    return 0;
+}
+
+static int max_seqno_callback(libcbio_t handle, libcbio_document_t doc,
+                              void *ctx)
+{
+    uint64_t *max = ctx;
+    uint64_t seqno;
+
+    (void)handle;
+    if (cbio_document_get_seqno(doc, &seqno) == CBIO_SUCCESS &&
+        seqno > *max) {
+        *max = seqno;
+    }
+    return 0;
+}
+
+static int test_load_repeated_keys(void)
+{
+    uint64_t max_seqno = 0;
+    const char *input = "testcase.load";
+    char cmd[256];
+    libcbio_t handle;
+    cbio_error_t err;
+    FILE *fp;
+    int ret;
+
+    /* Three lines per chunk: "a" and "b" repeat both within a chunk
+       and across chunks */
+    if ((fp = fopen(input, "w")) == NULL) {
+        report("Failed to create %s: %s", input, strerror(errno));
+        return 1;
+    }
+    fputs("a\t1\nb\t1\na\t2\n"
+          "c\t1\na\t3\nc\t2\n"
+          "b\t2\nd\t1\nb\t3\n"
+          "a\t4\n", fp);
+    fclose(fp);
+
+    snprintf(cmd, sizeof(cmd), "tools/cbio_load -n -b 3 -t 2 -i %s %s",
+             input, dbfile);
+    ret = system(cmd);
+    (void)remove(input);
+    if (ret != 0) {
+        report("\"%s\" failed: %d", cmd, ret);
+        return 1;
+    }
+
+    err = cbio_open_handle(dbfile, CBIO_OPEN_RDONLY, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+    ret = expect_value(handle, "a", "4") || expect_value(handle, "b", "3") ||
+          expect_value(handle, "c", "2") || expect_value(handle, "d", "1");
+
+    /* Only the last of the repeated keys within a chunk is stored, so
+       the loader used 7 sequence numbers rather than 10 */
+    err = cbio_changes_since(handle, 0, max_seqno_callback, &max_seqno);
+    if (ret == 0 && (err != CBIO_SUCCESS || max_seqno != 7)) {
+        report("Expected the last seqno to be 7, got %llu (%s)",
+               (unsigned long long)max_seqno, cbio_strerror(err));
+        ret = 1;
+    }
+    cbio_close_handle(handle);
+
+    return ret;
+}
+
+static int run_dump(const char *output, const char *checkpoint)
+{
+    char cmd[256];
+    int ret;
+
+    snprintf(cmd, sizeof(cmd), "tools/cbio_dump -b 1 -C %s -o %s %s",
+             checkpoint, output, dbfile);
+    if ((ret = system(cmd)) != 0) {
+        report("\"%s\" failed: %d", cmd, ret);
+        return 1;
+    }
+    return 0;
+}
+
+static int test_dump_resume(void)
+{
+    const char *output = "testcase.dump";
+    const char *checkpoint = "testcase.checkpoint";
+    char line[256];
+    libcbio_t handle;
+    cbio_error_t err;
+    FILE *fp;
+    int nlines = 0;
+    int ret = 0;
+
+    (void)remove(checkpoint);
+    err = cbio_open_handle(dbfile, CBIO_OPEN_CREATE, &handle);
+    if (err != CBIO_SUCCESS) {
+        report("Failed to open handle \"%s\"", cbio_strerror(err));
+        return 1;
+    }
+    if (store_simple_doc(handle, "a", "1", 0) ||
+        store_simple_doc(handle, "b", "2", 0) ||
+        cbio_commit(handle) != CBIO_SUCCESS ||
+        run_dump(output, checkpoint)) {
+        cbio_close_handle(handle);
+        return 1;
+    }
+
+    /* Pretend that the dump crashed after writing a batch but before
+       the checkpoint, and resume it after more documents are stored */
+    if ((fp = fopen(output, "a")) != NULL) {
+        fputs("{\"file\":\"partial\n", fp);
+        fclose(fp);
+    }
+    if (store_simple_doc(handle, "c", "3", 0) ||
+        cbio_commit(handle) != CBIO_SUCCESS ||
+        run_dump(output, checkpoint)) {
+        cbio_close_handle(handle);
+        return 1;
+    }
+    cbio_close_handle(handle);
+
+    if ((fp = fopen(output, "r")) == NULL) {
+        report("Failed to open %s: %s", output, strerror(errno));
+        return 1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strstr(line, "partial") != NULL ||
+            strstr(line, "\"seq\"") == NULL) {
+            report("Unexpected line in the dump: %s", line);
+            ret = 1;
+        }
+        ++nlines;
+    }
+    fclose(fp);
+    (void)remove(output);
+    (void)remove(checkpoint);
+
+    if (ret == 0 && nlines != 3) {
+        report("Expected 3 documents in the dump, got %d", nlines);
+        ret = 1;
+    }
+
+    return ret;
+}
+
 static void remove_dbfiles(void)
 {
-    if (remove(dbfile) == -1 && errno != ENOENT) {
+    if ((remove(dbfile) == -1 && errno != ENOENT) ||
+        (remove(dbfile2) == -1 && errno != ENOENT)) {
         report("Failed to remove test case files: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
@@ -633,6 +3478,32 @@ static struct test tests[] = {
     { .name = "test_bulk_store_documents", .func = bulk_store_documents },
     { .name = "test_changes_since", .func = test_changes_since },
     { .name = "test_local_documents", .func = test_local_documents },
+    { .name = "test_refresh_handle", .func = test_refresh_handle },
+    { .name = "test_shared_handle", .func = test_shared_handle },
+    { .name = "test_get_document_async", .func = test_get_document_async },
+    { .name = "test_json_mode", .func = test_json_mode },
+    { .name = "test_document_classify", .func = test_document_classify },
+    { .name = "test_changes_since_filtered", .func = test_changes_since_filtered },
+    { .name = "test_purge_tombstones", .func = test_purge_tombstones },
+    { .name = "test_delete_documents", .func = test_delete_documents },
+    { .name = "test_store_documents_conditional", .func = test_store_documents_conditional },
+    { .name = "test_secondary_index", .func = test_secondary_index },
+    { .name = "test_secondary_index_recovery", .func = test_secondary_index_recovery },
+    { .name = "test_count_range", .func = test_count_range },
+    { .name = "test_write_buffer", .func = test_write_buffer },
+    { .name = "test_backup_restore", .func = test_backup_restore },
+    { .name = "test_replicate", .func = test_replicate },
+    { .name = "test_verify", .func = test_verify },
+    { .name = "test_key_batches", .func = test_key_batches },
+    { .name = "test_allocator", .func = test_allocator },
+    { .name = "test_get_document_into", .func = test_get_document_into },
+    { .name = "test_access_log_warmup", .func = test_access_log_warmup },
+    { .name = "test_lookup_cache", .func = test_lookup_cache },
+    { .name = "test_trace_callback", .func = test_trace_callback },
+    { .name = "test_json_projection", .func = test_json_projection },
+    { .name = "test_follow_changes", .func = test_follow_changes },
+    { .name = "test_load_repeated_keys", .func = test_load_repeated_keys },
+    { .name = "test_dump_resume", .func = test_dump_resume },
     { .name = NULL, .func = NULL }
 };
 
@@ -0,0 +1,865 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * cbio_dump writes all of the documents in one or more database files
+ * to a stream ordered by sequence number. The main thread walks the
+ * changes feed and cuts it into batches, a pool of worker threads read
+ * the document bodies and encode the batches, and the main thread
+ * writes the encoded batches in order.
+ *
+ * The JSON-lines format contains one object per document:
+ *
+ *   {"file":"<db>","seq":N,"id":"<id>","rev":N,"deleted":bool,
+ *    "content_type":N,"meta":"<hex>","value":<json>}
+ *
+ * value is included verbatim if the document is valid JSON, and as a
+ * base64 encoded string otherwise (and omitted for deleted documents).
+ * Compressed values are decompressed.
+ *
+ * The binary format starts every database file with a file record,
+ * followed by one record per document, with all integers in network
+ * byte order:
+ *
+ *   uint8_t 'F', uint32_t nname, name
+ *   uint8_t 'D', uint64_t seq, uint64_t rev, uint8_t deleted,
+ *   uint8_t content_type, uint32_t nid, uint32_t nmeta, uint32_t nvalue,
+ *   id, meta, value
+ *
+ * A document belongs to the file named by the last file record before
+ * it (a resumed dump repeats the file record).
+ *
+ * With -C the size of the output and the last sequence number written
+ * for each database file are stored in the checkpoint file, and a
+ * restarted dump truncates the output to that size and continues from
+ * where it stopped. The output is synced to disk before the checkpoint
+ * is replaced.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <libcbio/cbio.h>
+
+enum output_format {
+    FORMAT_JSON,
+    FORMAT_BINARY
+};
+
+struct buffer {
+    char *data;
+    size_t size;
+    size_t allocated;
+};
+
+struct batch {
+    /* Link in the list of batches waiting for a worker */
+    struct batch *next;
+    /* Link in the list of batches not yet written, in seqno order */
+    struct batch *inflight_next;
+    libcbio_document_t *docs;
+    size_t ndocs;
+    uint64_t last_seqno;
+    struct buffer output;
+    int done;
+    int error;
+};
+
+struct checkpoint {
+    char *fname;
+    uint64_t seqno;
+};
+
+static struct {
+    enum output_format format;
+    size_t batchsize;
+    int nworkers;
+    FILE *output;
+    const char *checkpoint_file;
+    struct checkpoint *checkpoints;
+    int ncheckpoints;
+    /* The size of the output when the checkpoint was written */
+    uint64_t checkpoint_offset;
+    /* The size of the output so far */
+    uint64_t offset;
+
+    /* The file being dumped */
+    libcbio_t handle;
+    const char *fname;
+    struct batch *current;
+
+    /* Batches waiting for a worker */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct batch *todo_head;
+    struct batch *todo_tail;
+    /* Batches submitted, in sequence order */
+    struct batch *inflight_head;
+    struct batch *inflight_tail;
+    size_t ninflight;
+    int shutdown;
+
+    uint64_t ndocs;
+    uint64_t nbytes;
+    int failed;
+} dump;
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: cbio_dump [options] dbfile [dbfile...]\n"
+            "\t-o file\tWrite output to file (default stdout)\n"
+            "\t-f fmt\tOutput format: json or binary (default json)\n"
+            "\t-s seq\tOnly dump changes since seq (default 0)\n"
+            "\t-C file\tResume from and record progress in checkpoint file\n"
+            "\t-b num\tNumber of documents per batch (default 1000)\n"
+            "\t-t num\tNumber of worker threads (default 4)\n");
+    exit(EXIT_FAILURE);
+}
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int buffer_reserve(struct buffer *buf, size_t size)
+{
+    if (buf->size + size > buf->allocated) {
+        size_t sz = buf->allocated ? buf->allocated : 64 * 1024;
+        char *ptr;
+        while (sz < buf->size + size) {
+            sz *= 2;
+        }
+        if ((ptr = realloc(buf->data, sz)) == NULL) {
+            return -1;
+        }
+        buf->data = ptr;
+        buf->allocated = sz;
+    }
+    return 0;
+}
+
+static int buffer_append(struct buffer *buf, const void *data, size_t size)
+{
+    if (buffer_reserve(buf, size) == -1) {
+        return -1;
+    }
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+    return 0;
+}
+
+static int buffer_printf(struct buffer *buf, const char *fmt, ...)
+{
+    char tmp[256];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+
+    if (len < 0 || (size_t)len >= sizeof(tmp)) {
+        return -1;
+    }
+    return buffer_append(buf, tmp, (size_t)len);
+}
+
+static int buffer_json_string(struct buffer *buf, const char *data,
+                              size_t size)
+{
+    if (buffer_reserve(buf, size * 6 + 2) == -1) {
+        return -1;
+    }
+
+    buf->data[buf->size++] = '"';
+    for (size_t ii = 0; ii < size; ++ii) {
+        unsigned char c = (unsigned char)data[ii];
+        if (c == '"' || c == '\\') {
+            buf->data[buf->size++] = '\\';
+            buf->data[buf->size++] = (char)c;
+        } else if (c < 0x20) {
+            buf->size += (size_t)sprintf(buf->data + buf->size,
+                                         "\\u%04x", c);
+        } else {
+            buf->data[buf->size++] = (char)c;
+        }
+    }
+    buf->data[buf->size++] = '"';
+
+    return 0;
+}
+
+static int buffer_hex(struct buffer *buf, const unsigned char *data,
+                      size_t size)
+{
+    static const char digits[] = "0123456789abcdef";
+    if (buffer_reserve(buf, size * 2 + 2) == -1) {
+        return -1;
+    }
+    buf->data[buf->size++] = '"';
+    for (size_t ii = 0; ii < size; ++ii) {
+        buf->data[buf->size++] = digits[data[ii] >> 4];
+        buf->data[buf->size++] = digits[data[ii] & 0x0f];
+    }
+    buf->data[buf->size++] = '"';
+    return 0;
+}
+
+static int buffer_base64(struct buffer *buf, const unsigned char *data,
+                         size_t size)
+{
+    static const char table[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t ii;
+
+    if (buffer_reserve(buf, (size + 2) / 3 * 4 + 2) == -1) {
+        return -1;
+    }
+
+    buf->data[buf->size++] = '"';
+    for (ii = 0; ii + 2 < size; ii += 3) {
+        uint32_t v = ((uint32_t)data[ii] << 16) |
+                     ((uint32_t)data[ii + 1] << 8) | data[ii + 2];
+        buf->data[buf->size++] = table[(v >> 18) & 0x3f];
+        buf->data[buf->size++] = table[(v >> 12) & 0x3f];
+        buf->data[buf->size++] = table[(v >> 6) & 0x3f];
+        buf->data[buf->size++] = table[v & 0x3f];
+    }
+    if (ii < size) {
+        uint32_t v = (uint32_t)data[ii] << 16;
+        if (ii + 1 < size) {
+            v |= (uint32_t)data[ii + 1] << 8;
+        }
+        buf->data[buf->size++] = table[(v >> 18) & 0x3f];
+        buf->data[buf->size++] = table[(v >> 12) & 0x3f];
+        if (ii + 1 < size) {
+            buf->data[buf->size++] = table[(v >> 6) & 0x3f];
+        } else {
+            buf->data[buf->size++] = '=';
+        }
+        buf->data[buf->size++] = '=';
+    }
+    buf->data[buf->size++] = '"';
+
+    return 0;
+}
+
+static int buffer_uint(struct buffer *buf, uint64_t val, int nbytes)
+{
+    unsigned char tmp[8];
+    for (int ii = nbytes - 1; ii >= 0; --ii) {
+        tmp[ii] = (unsigned char)(val & 0xff);
+        val >>= 8;
+    }
+    return buffer_append(buf, tmp, (size_t)nbytes);
+}
+
+/*
+ * CBIO_DOC_IS_JSON is also the content type of every document stored
+ * without json mode, so check the value before pasting it into the
+ * output as is
+ */
+static int value_is_json(libcbio_document_t doc, uint8_t content_type)
+{
+    if (content_type != CBIO_DOC_IS_JSON ||
+        cbio_document_classify(doc) != CBIO_SUCCESS ||
+        cbio_document_get_content_type(doc, &content_type) != CBIO_SUCCESS) {
+        return 0;
+    }
+
+    /* Reserved keys don't make it invalid JSON */
+    return content_type == CBIO_DOC_IS_JSON ||
+           content_type == CBIO_DOC_INVALID_JSON_KEY;
+}
+
+static int encode_json(struct buffer *buf, libcbio_document_t doc)
+{
+    const void *id, *meta, *value = NULL;
+    size_t nid, nmeta, nvalue = 0;
+    uint64_t seqno, rev;
+    uint8_t content_type;
+    int deleted;
+
+    cbio_document_get_id(doc, &id, &nid);
+    cbio_document_get_meta(doc, &meta, &nmeta);
+    cbio_document_get_seqno(doc, &seqno);
+    cbio_document_get_revision(doc, &rev);
+    cbio_document_get_deleted(doc, &deleted);
+    cbio_document_get_content_type(doc, &content_type);
+
+    if (buffer_append(buf, "{\"file\":", 8) == -1 ||
+        buffer_json_string(buf, dump.fname, strlen(dump.fname)) == -1 ||
+        buffer_printf(buf, ",\"seq\":%llu,\"id\":",
+                      (unsigned long long)seqno) == -1 ||
+        buffer_json_string(buf, id, nid) == -1 ||
+        buffer_printf(buf, ",\"rev\":%llu,\"deleted\":%s,"
+                      "\"content_type\":%u,\"meta\":",
+                      (unsigned long long)rev, deleted ? "true" : "false",
+                      (unsigned int)content_type) == -1 ||
+        buffer_hex(buf, meta, nmeta) == -1) {
+        return -1;
+    }
+
+    if (!deleted) {
+        cbio_document_get_value(doc, &value, &nvalue);
+        if (buffer_append(buf, ",\"value\":", 9) == -1) {
+            return -1;
+        }
+        if (value_is_json(doc, content_type)) {
+            if (buffer_append(buf, value, nvalue) == -1) {
+                return -1;
+            }
+        } else if (buffer_base64(buf, value, nvalue) == -1) {
+            return -1;
+        }
+    }
+
+    return buffer_append(buf, "}\n", 2);
+}
+
+static int encode_binary(struct buffer *buf, libcbio_document_t doc)
+{
+    const void *id, *meta, *value = NULL;
+    size_t nid, nmeta, nvalue = 0;
+    uint64_t seqno, rev;
+    uint8_t content_type;
+    int deleted;
+
+    cbio_document_get_id(doc, &id, &nid);
+    cbio_document_get_meta(doc, &meta, &nmeta);
+    cbio_document_get_seqno(doc, &seqno);
+    cbio_document_get_revision(doc, &rev);
+    cbio_document_get_deleted(doc, &deleted);
+    cbio_document_get_content_type(doc, &content_type);
+    if (!deleted) {
+        cbio_document_get_value(doc, &value, &nvalue);
+    }
+
+    if (buffer_uint(buf, 'D', 1) == -1 ||
+        buffer_uint(buf, seqno, 8) == -1 ||
+        buffer_uint(buf, rev, 8) == -1 ||
+        buffer_uint(buf, deleted ? 1 : 0, 1) == -1 ||
+        buffer_uint(buf, content_type, 1) == -1 ||
+        buffer_uint(buf, nid, 4) == -1 ||
+        buffer_uint(buf, nmeta, 4) == -1 ||
+        buffer_uint(buf, nvalue, 4) == -1 ||
+        buffer_append(buf, id, nid) == -1 ||
+        buffer_append(buf, meta, nmeta) == -1 ||
+        buffer_append(buf, value, nvalue) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void encode_batch(struct batch *batch)
+{
+    for (size_t ii = 0; ii < batch->ndocs && !batch->error; ++ii) {
+        libcbio_document_t doc = batch->docs[ii];
+        int deleted;
+        cbio_error_t err;
+
+        cbio_document_get_deleted(doc, &deleted);
+        if (!deleted) {
+            err = cbio_document_fetch_decompressed_value(dump.handle, doc);
+            if (err != CBIO_SUCCESS) {
+                fprintf(stderr, "Failed to read document from %s: %s\n",
+                        dump.fname, cbio_strerror(err));
+                batch->error = 1;
+                break;
+            }
+        }
+
+        if (dump.format == FORMAT_JSON) {
+            batch->error = encode_json(&batch->output, doc) == -1;
+        } else {
+            batch->error = encode_binary(&batch->output, doc) == -1;
+        }
+    }
+
+    for (size_t ii = 0; ii < batch->ndocs; ++ii) {
+        cbio_document_release(batch->docs[ii]);
+    }
+    batch->ndocs = 0;
+}
+
+static void *worker_main(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&dump.mutex);
+    while (1) {
+        struct batch *batch;
+        while (dump.todo_head == NULL && !dump.shutdown) {
+            pthread_cond_wait(&dump.cond, &dump.mutex);
+        }
+        if ((batch = dump.todo_head) == NULL) {
+            break;
+        }
+        if ((dump.todo_head = batch->next) == NULL) {
+            dump.todo_tail = NULL;
+        }
+        pthread_mutex_unlock(&dump.mutex);
+
+        encode_batch(batch);
+
+        pthread_mutex_lock(&dump.mutex);
+        batch->done = 1;
+        pthread_cond_broadcast(&dump.cond);
+    }
+    pthread_mutex_unlock(&dump.mutex);
+
+    return NULL;
+}
+
+static int write_output(const void *data, size_t size)
+{
+    if (fwrite(data, 1, size, dump.output) != size) {
+        return -1;
+    }
+    dump.offset += size;
+    dump.nbytes += size;
+    return 0;
+}
+
+static int save_checkpoint(uint64_t seqno)
+{
+    char tmp[1024];
+    FILE *fp;
+    int found = 0;
+
+    for (int ii = 0; ii < dump.ncheckpoints; ++ii) {
+        if (strcmp(dump.checkpoints[ii].fname, dump.fname) == 0) {
+            dump.checkpoints[ii].seqno = seqno;
+            found = 1;
+        }
+    }
+
+    if (!found) {
+        struct checkpoint *ptr = realloc(dump.checkpoints,
+                                         (dump.ncheckpoints + 1) *
+                                         sizeof(struct checkpoint));
+        if (ptr == NULL) {
+            return -1;
+        }
+        dump.checkpoints = ptr;
+        ptr[dump.ncheckpoints].fname = strdup(dump.fname);
+        ptr[dump.ncheckpoints].seqno = seqno;
+        if (ptr[dump.ncheckpoints].fname == NULL) {
+            return -1;
+        }
+        ++dump.ncheckpoints;
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", dump.checkpoint_file);
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        return -1;
+    }
+    /* The first line is the size of the output */
+    fprintf(fp, "%llu\n", (unsigned long long)dump.offset);
+    for (int ii = 0; ii < dump.ncheckpoints; ++ii) {
+        fprintf(fp, "%llu\t%s\n",
+                (unsigned long long)dump.checkpoints[ii].seqno,
+                dump.checkpoints[ii].fname);
+    }
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        fclose(fp);
+        return -1;
+    }
+    if (fclose(fp) != 0 || rename(tmp, dump.checkpoint_file) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int load_checkpoints(void)
+{
+    char line[1024];
+    FILE *fp = fopen(dump.checkpoint_file, "r");
+
+    if (fp == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    if (fgets(line, sizeof(line), fp) == NULL) {
+        /* An empty checkpoint file means nothing was written */
+        fclose(fp);
+        return 0;
+    }
+    dump.checkpoint_offset = strtoull(line, NULL, 10);
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        struct checkpoint *ptr;
+        char *fname;
+        size_t len = strlen(line);
+
+        if (len > 0 && line[len - 1] == '\n') {
+            line[len - 1] = '\0';
+        }
+        if ((fname = strchr(line, '\t')) == NULL) {
+            continue;
+        }
+        ptr = realloc(dump.checkpoints, (dump.ncheckpoints + 1) *
+                      sizeof(struct checkpoint));
+        if (ptr == NULL) {
+            fclose(fp);
+            return -1;
+        }
+        dump.checkpoints = ptr;
+        ptr[dump.ncheckpoints].seqno = strtoull(line, NULL, 10);
+        if ((ptr[dump.ncheckpoints].fname = strdup(fname + 1)) == NULL) {
+            fclose(fp);
+            return -1;
+        }
+        ++dump.ncheckpoints;
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+/*
+ * Cut the output back to the size it had when the checkpoint was
+ * written, and position it at the end
+ */
+static int resume_output(const char *outfile)
+{
+    struct stat st;
+    off_t offset = (off_t)dump.checkpoint_offset;
+
+    if (fstat(fileno(dump.output), &st) == -1) {
+        fprintf(stderr, "Failed to stat %s: %s\n", outfile,
+                strerror(errno));
+        return -1;
+    }
+    if (st.st_size < offset) {
+        fprintf(stderr, "%s is shorter than the checkpoint (%llu bytes)\n",
+                outfile, (unsigned long long)dump.checkpoint_offset);
+        return -1;
+    }
+    if (ftruncate(fileno(dump.output), offset) == -1 ||
+        fseeko(dump.output, offset, SEEK_SET) == -1) {
+        fprintf(stderr, "Failed to truncate %s: %s\n", outfile,
+                strerror(errno));
+        return -1;
+    }
+    dump.offset = dump.checkpoint_offset;
+
+    return 0;
+}
+
+/*
+ * Write out the oldest batch in flight (waiting for it to complete
+ * first)
+ */
+static int flush_oldest(void)
+{
+    struct batch *batch;
+
+    pthread_mutex_lock(&dump.mutex);
+    batch = dump.inflight_head;
+    while (!batch->done) {
+        pthread_cond_wait(&dump.cond, &dump.mutex);
+    }
+    if ((dump.inflight_head = batch->inflight_next) == NULL) {
+        dump.inflight_tail = NULL;
+    }
+    --dump.ninflight;
+    pthread_mutex_unlock(&dump.mutex);
+
+    if (batch->error) {
+        dump.failed = 1;
+    } else if (!dump.failed) {
+        if (write_output(batch->output.data, batch->output.size) == -1) {
+            fprintf(stderr, "Failed to write output: %s\n", strerror(errno));
+            dump.failed = 1;
+        } else if (dump.checkpoint_file != NULL) {
+            /* The checkpoint must never be ahead of the output */
+            if (fflush(dump.output) != 0 ||
+                fsync(fileno(dump.output)) != 0 ||
+                save_checkpoint(batch->last_seqno) == -1) {
+                fprintf(stderr, "Failed to write checkpoint: %s\n",
+                        strerror(errno));
+                dump.failed = 1;
+            }
+        }
+    }
+
+    free(batch->output.data);
+    free(batch->docs);
+    free(batch);
+
+    return dump.failed ? -1 : 0;
+}
+
+static void submit_current(void)
+{
+    struct batch *batch = dump.current;
+    dump.current = NULL;
+
+    pthread_mutex_lock(&dump.mutex);
+    if (dump.todo_tail == NULL) {
+        dump.todo_head = dump.todo_tail = batch;
+    } else {
+        dump.todo_tail->next = batch;
+        dump.todo_tail = batch;
+    }
+    if (dump.inflight_tail == NULL) {
+        dump.inflight_head = dump.inflight_tail = batch;
+    } else {
+        dump.inflight_tail->inflight_next = batch;
+        dump.inflight_tail = batch;
+    }
+    ++dump.ninflight;
+    pthread_cond_broadcast(&dump.cond);
+    pthread_mutex_unlock(&dump.mutex);
+}
+
+static int changes_callback(libcbio_t handle, libcbio_document_t doc,
+                            void *ctx)
+{
+    (void)handle;
+    (void)ctx;
+
+    if (dump.failed) {
+        return 0;
+    }
+
+    if (dump.current == NULL) {
+        struct batch *batch = calloc(1, sizeof(*batch));
+        if (batch == NULL ||
+            (batch->docs = calloc(dump.batchsize,
+                                  sizeof(libcbio_document_t))) == NULL) {
+            free(batch);
+            dump.failed = 1;
+            return 0;
+        }
+        dump.current = batch;
+    }
+
+    dump.current->docs[dump.current->ndocs++] = doc;
+    cbio_document_get_seqno(doc, &dump.current->last_seqno);
+    ++dump.ndocs;
+
+    if (dump.current->ndocs == dump.batchsize) {
+        /* Don't let the scan run too far ahead of the output */
+        if (dump.ninflight >= (size_t)dump.nworkers * 2) {
+            flush_oldest();
+        }
+        submit_current();
+    }
+
+    /* Keep the document, the worker will release it */
+    return 1;
+}
+
+static int dump_file(const char *fname, uint64_t since)
+{
+    cbio_error_t err;
+
+    dump.fname = fname;
+    for (int ii = 0; ii < dump.ncheckpoints; ++ii) {
+        if (strcmp(dump.checkpoints[ii].fname, fname) == 0 &&
+            dump.checkpoints[ii].seqno >= since) {
+            since = dump.checkpoints[ii].seqno + 1;
+        }
+    }
+
+    err = cbio_open_handle(fname, CBIO_OPEN_SHARED_RDONLY, &dump.handle);
+    if (err != CBIO_SUCCESS) {
+        fprintf(stderr, "Failed to open %s: %s\n", fname,
+                cbio_strerror(err));
+        return -1;
+    }
+
+    if (dump.format == FORMAT_BINARY) {
+        struct buffer header = { NULL, 0, 0 };
+        size_t nname = strlen(fname);
+
+        if (buffer_uint(&header, 'F', 1) == -1 ||
+            buffer_uint(&header, nname, 4) == -1 ||
+            buffer_append(&header, fname, nname) == -1 ||
+            write_output(header.data, header.size) == -1) {
+            fprintf(stderr, "Failed to write output: %s\n", strerror(errno));
+            dump.failed = 1;
+        }
+        free(header.data);
+        if (dump.failed) {
+            cbio_close_handle(dump.handle);
+            return -1;
+        }
+    }
+
+    err = cbio_changes_since(dump.handle, since, changes_callback, NULL);
+    if (dump.current != NULL) {
+        submit_current();
+    }
+    while (dump.ninflight > 0) {
+        flush_oldest();
+    }
+
+    if (err != CBIO_SUCCESS) {
+        fprintf(stderr, "Failed to iterate changes in %s: %s\n", fname,
+                cbio_strerror(err));
+        dump.failed = 1;
+    }
+
+    cbio_close_handle(dump.handle);
+    return dump.failed ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *outfile = NULL;
+    uint64_t since = 0;
+    pthread_t *workers;
+    int nworkers = 0;
+    double start;
+    int cmd;
+
+    dump.format = FORMAT_JSON;
+    dump.batchsize = 1000;
+    dump.nworkers = 4;
+    dump.output = stdout;
+
+    while ((cmd = getopt(argc, argv, "o:f:s:C:b:t:")) != -1) {
+        switch (cmd) {
+        case 'o':
+            outfile = optarg;
+            break;
+        case 'f':
+            if (strcmp(optarg, "json") == 0) {
+                dump.format = FORMAT_JSON;
+            } else if (strcmp(optarg, "binary") == 0) {
+                dump.format = FORMAT_BINARY;
+            } else {
+                usage();
+            }
+            break;
+        case 's':
+            since = strtoull(optarg, NULL, 10);
+            break;
+        case 'C':
+            dump.checkpoint_file = optarg;
+            break;
+        case 'b':
+            dump.batchsize = (size_t)strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            dump.nworkers = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (optind == argc || dump.batchsize == 0 || dump.nworkers < 1) {
+        usage();
+    }
+
+    if (dump.checkpoint_file != NULL) {
+        if (outfile == NULL) {
+            fprintf(stderr, "A checkpoint file requires an output file\n");
+            return EXIT_FAILURE;
+        }
+        if (load_checkpoints() == -1) {
+            fprintf(stderr, "Failed to read checkpoint file %s: %s\n",
+                    dump.checkpoint_file, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (outfile != NULL) {
+        /* Continue after the last checkpoint if we're resuming a
+           previous dump, dropping whatever was written after it */
+        const char *mode = dump.ncheckpoints > 0 ? "r+b" : "wb";
+        if ((dump.output = fopen(outfile, mode)) == NULL) {
+            fprintf(stderr, "Failed to open %s: %s\n", outfile,
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+        if (dump.ncheckpoints > 0 && resume_output(outfile) == -1) {
+            fclose(dump.output);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if ((workers = calloc(dump.nworkers, sizeof(pthread_t))) == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return EXIT_FAILURE;
+    }
+
+    pthread_mutex_init(&dump.mutex, NULL);
+    pthread_cond_init(&dump.cond, NULL);
+    while (nworkers < dump.nworkers &&
+           pthread_create(&workers[nworkers], NULL, worker_main,
+                          NULL) == 0) {
+        ++nworkers;
+    }
+    if (nworkers == 0) {
+        fprintf(stderr, "Failed to start worker threads\n");
+        dump.failed = 1;
+    }
+    /* Run with the workers we got */
+    dump.nworkers = nworkers;
+
+    start = now();
+    for (int ii = optind; ii < argc && !dump.failed; ++ii) {
+        dump_file(argv[ii], since);
+    }
+
+    pthread_mutex_lock(&dump.mutex);
+    dump.shutdown = 1;
+    pthread_cond_broadcast(&dump.cond);
+    pthread_mutex_unlock(&dump.mutex);
+    for (int ii = 0; ii < dump.nworkers; ++ii) {
+        pthread_join(workers[ii], NULL);
+    }
+
+    if (fflush(dump.output) != 0) {
+        fprintf(stderr, "Failed to write output: %s\n", strerror(errno));
+        dump.failed = 1;
+    }
+    if (dump.output != stdout) {
+        fclose(dump.output);
+    }
+
+    double elapsed = now() - start;
+    fprintf(stderr, "Dumped %llu documents (%llu bytes) in %.2f seconds "
+            "(%.0f docs/sec)\n", (unsigned long long)dump.ndocs,
+            (unsigned long long)dump.nbytes, elapsed,
+            elapsed > 0 ? dump.ndocs / elapsed : 0.0);
+
+    for (int ii = 0; ii < dump.ncheckpoints; ++ii) {
+        free(dump.checkpoints[ii].fname);
+    }
+    free(dump.checkpoints);
+    free(workers);
+
+    return dump.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,832 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *     Copyright 2012 Couchbase, Inc.
+ *
+ *   Licensed under the Apache License, Version 2.0 (the "License");
+ *   you may not use this file except in compliance with the License.
+ *   You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *   See the License for the specific language governing permissions and
+ *   limitations under the License.
+ */
+
+/*
+ * cbio_load reads documents from a file (or stdin) and stores them in
+ * one or more database files. The work is split in a pipeline:
+ *
+ *   reader thread -> N worker threads -> one writer thread per file
+ *
+ * The reader cuts the input into chunks of lines, the workers parse
+ * the lines into documents (and validate the JSON), and the writers
+ * store the documents in batches and commit periodically. The writers
+ * apply the chunks in input order, and a batch only keeps the last of
+ * the lines within a chunk with the same key, so if a key appears
+ * multiple times the last one wins. Every stage blocks the one before
+ * it when it falls behind, so memory use is bounded no matter how
+ * large the input is.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <libcbio/cbio.h>
+
+enum input_format {
+    FORMAT_KV,
+    FORMAT_JSON
+};
+
+struct chunk {
+    struct chunk *next;
+    uint64_t seqno;
+    size_t nlines;
+    size_t *offset;
+    size_t *length;
+    char *data;
+    size_t ndata;
+};
+
+struct batch {
+    struct batch *next;
+    uint64_t seqno;
+    size_t ndocs;
+    libcbio_document_t docs[1];
+};
+
+struct writer {
+    pthread_t thread;
+    const char *fname;
+    libcbio_t handle;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    /* Signalled when the writer moves on to the next chunk */
+    pthread_cond_t space;
+    /* Sorted by seqno */
+    struct batch *pending;
+    uint64_t next;
+    uint64_t nchunks;
+    uint64_t ndocs;
+};
+
+static struct {
+    enum input_format format;
+    const char *keyfield;
+    size_t batchsize;
+    uint64_t commit_interval;
+    int nworkers;
+    int validate;
+    int verbose;
+    FILE *input;
+
+    int nwriters;
+    struct writer *writers;
+
+    /* The queue between the reader and the workers */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct chunk *head;
+    struct chunk *tail;
+    size_t queued;
+    int eof;
+
+    volatile uint64_t stored;
+    volatile uint64_t skipped;
+    volatile int failed;
+} loader;
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "Usage: cbio_load [options] dbfile [dbfile...]\n"
+            "\t-i file\tRead input from file (default stdin)\n"
+            "\t-f fmt\tInput format: kv (key<TAB>value) or json (default kv)\n"
+            "\t-k name\tTop-level field holding the key for json input"
+            " (default \"id\")\n"
+            "\t-b num\tNumber of documents per batch (default 1000)\n"
+            "\t-c num\tNumber of documents between commits"
+            " (default 100000)\n"
+            "\t-t num\tNumber of parse threads (default 4)\n"
+            "\t-n\tDon't validate JSON values\n"
+            "\t-v\tReport progress every second\n"
+            "Documents are spread over the database files by key.\n");
+    exit(EXIT_FAILURE);
+}
+
+static double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static uint32_t hash_key(const char *key, size_t nkey)
+{
+    /* FNV-1a */
+    uint32_t h = 2166136261U;
+    for (size_t ii = 0; ii < nkey; ++ii) {
+        h ^= (unsigned char)key[ii];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static void chunk_release(struct chunk *chunk)
+{
+    if (chunk != NULL) {
+        free(chunk->offset);
+        free(chunk->length);
+        free(chunk->data);
+        free(chunk);
+    }
+}
+
+static struct chunk *chunk_create(uint64_t seqno)
+{
+    struct chunk *ret = calloc(1, sizeof(*ret));
+    if (ret != NULL) {
+        ret->seqno = seqno;
+        ret->offset = calloc(loader.batchsize, sizeof(size_t));
+        ret->length = calloc(loader.batchsize, sizeof(size_t));
+        if (ret->offset == NULL || ret->length == NULL) {
+            chunk_release(ret);
+            ret = NULL;
+        }
+    }
+    return ret;
+}
+
+static int chunk_append(struct chunk *chunk, const char *line, size_t nline,
+                        size_t *allocated)
+{
+    if (chunk->ndata + nline > *allocated) {
+        size_t sz = (*allocated == 0) ? 64 * 1024 : *allocated;
+        char *ptr;
+        while (sz < chunk->ndata + nline) {
+            sz *= 2;
+        }
+        if ((ptr = realloc(chunk->data, sz)) == NULL) {
+            return -1;
+        }
+        chunk->data = ptr;
+        *allocated = sz;
+    }
+
+    memcpy(chunk->data + chunk->ndata, line, nline);
+    chunk->offset[chunk->nlines] = chunk->ndata;
+    chunk->length[chunk->nlines] = nline;
+    chunk->ndata += nline;
+    chunk->nlines++;
+
+    return 0;
+}
+
+static void queue_chunk(struct chunk *chunk)
+{
+    pthread_mutex_lock(&loader.mutex);
+    /* Don't let the reader run too far ahead of the workers */
+    while (loader.queued >= (size_t)loader.nworkers * 4 && !loader.failed) {
+        pthread_cond_wait(&loader.cond, &loader.mutex);
+    }
+    if (loader.tail == NULL) {
+        loader.head = loader.tail = chunk;
+    } else {
+        loader.tail->next = chunk;
+        loader.tail = chunk;
+    }
+    ++loader.queued;
+    pthread_cond_broadcast(&loader.cond);
+    pthread_mutex_unlock(&loader.mutex);
+}
+
+static struct chunk *next_chunk(void)
+{
+    struct chunk *ret;
+
+    pthread_mutex_lock(&loader.mutex);
+    while (loader.head == NULL && !loader.eof) {
+        pthread_cond_wait(&loader.cond, &loader.mutex);
+    }
+    if ((ret = loader.head) != NULL) {
+        if ((loader.head = ret->next) == NULL) {
+            loader.tail = NULL;
+        }
+        --loader.queued;
+        pthread_cond_broadcast(&loader.cond);
+    }
+    pthread_mutex_unlock(&loader.mutex);
+
+    return ret;
+}
+
+static void *reader_main(void *arg)
+{
+    char *line = NULL;
+    size_t nline = 0;
+    size_t allocated = 0;
+    ssize_t nr;
+    uint64_t seqno = 0;
+    struct chunk *chunk = NULL;
+    (void)arg;
+
+    while (!loader.failed && (nr = getline(&line, &nline, loader.input)) != -1) {
+        while (nr > 0 && (line[nr - 1] == '\n' || line[nr - 1] == '\r')) {
+            --nr;
+        }
+        if (nr == 0) {
+            continue;
+        }
+
+        if (chunk == NULL) {
+            allocated = 0;
+            if ((chunk = chunk_create(seqno++)) == NULL) {
+                fprintf(stderr, "Failed to allocate memory\n");
+                loader.failed = 1;
+                break;
+            }
+        }
+
+        if (chunk_append(chunk, line, (size_t)nr, &allocated) == -1) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            loader.failed = 1;
+            break;
+        }
+
+        if (chunk->nlines == loader.batchsize) {
+            queue_chunk(chunk);
+            chunk = NULL;
+        }
+    }
+
+    if (chunk != NULL) {
+        if (loader.failed) {
+            chunk_release(chunk);
+        } else {
+            queue_chunk(chunk);
+        }
+    }
+    free(line);
+
+    if (ferror(loader.input)) {
+        fprintf(stderr, "Failed to read input: %s\n", strerror(errno));
+        loader.failed = 1;
+    }
+
+    pthread_mutex_lock(&loader.mutex);
+    loader.eof = 1;
+    pthread_cond_broadcast(&loader.cond);
+    pthread_mutex_unlock(&loader.mutex);
+
+    for (int ii = 0; ii < loader.nwriters; ++ii) {
+        struct writer *w = &loader.writers[ii];
+        pthread_mutex_lock(&w->mutex);
+        w->nchunks = seqno;
+        pthread_cond_signal(&w->cond);
+        pthread_mutex_unlock(&w->mutex);
+    }
+
+    return NULL;
+}
+
+/*
+ * Locate the string value of the top-level field named
+ * loader.keyfield. Keys containing escape sequences are not
+ * supported.
+ */
+static int json_find_key(const char *data, size_t ndata,
+                         const char **key, size_t *nkey)
+{
+    size_t nfield = strlen(loader.keyfield);
+    int depth = 0;
+    int expect_key = 0;
+
+    for (size_t ii = 0; ii < ndata; ++ii) {
+        char c = data[ii];
+        if (c == '{' || c == '[') {
+            ++depth;
+            expect_key = (c == '{' && depth == 1);
+        } else if (c == '}' || c == ']') {
+            --depth;
+        } else if (c == ',') {
+            expect_key = (depth == 1);
+        } else if (c == '"') {
+            size_t start = ++ii;
+            while (ii < ndata && data[ii] != '"') {
+                if (data[ii] == '\\') {
+                    ++ii;
+                }
+                ++ii;
+            }
+            if (ii >= ndata) {
+                return -1;
+            }
+            if (expect_key && ii - start == nfield &&
+                memcmp(data + start, loader.keyfield, nfield) == 0) {
+                /* Skip the colon and locate the value */
+                ++ii;
+                while (ii < ndata && (data[ii] == ' ' || data[ii] == ':' ||
+                                      data[ii] == '\t')) {
+                    ++ii;
+                }
+                if (ii >= ndata || data[ii] != '"') {
+                    return -1;
+                }
+                start = ++ii;
+                while (ii < ndata && data[ii] != '"') {
+                    if (data[ii] == '\\') {
+                        return -1;
+                    }
+                    ++ii;
+                }
+                if (ii >= ndata || ii == start) {
+                    return -1;
+                }
+                *key = data + start;
+                *nkey = ii - start;
+                return 0;
+            }
+            expect_key = 0;
+        }
+    }
+
+    return -1;
+}
+
+static int parse_line(const char *line, size_t nline,
+                      const char **key, size_t *nkey,
+                      const char **value, size_t *nvalue)
+{
+    if (loader.format == FORMAT_KV) {
+        const char *tab = memchr(line, '\t', nline);
+        if (tab == NULL || tab == line) {
+            return -1;
+        }
+        *key = line;
+        *nkey = (size_t)(tab - line);
+        *value = tab + 1;
+        *nvalue = nline - *nkey - 1;
+        return 0;
+    }
+
+    *value = line;
+    *nvalue = nline;
+    return json_find_key(line, nline, key, nkey);
+}
+
+static struct batch *batch_create(uint64_t seqno, size_t ndocs)
+{
+    struct batch *ret = calloc(1, sizeof(*ret) +
+                               ndocs * sizeof(libcbio_document_t));
+    if (ret != NULL) {
+        ret->seqno = seqno;
+    }
+    return ret;
+}
+
+static void batch_release(struct batch *batch)
+{
+    for (size_t ii = 0; ii < batch->ndocs; ++ii) {
+        cbio_document_release(batch->docs[ii]);
+    }
+    free(batch);
+}
+
+struct batch_entry {
+    const void *id;
+    size_t nid;
+    size_t index;
+};
+
+static int compare_entries(const void *a, const void *b)
+{
+    const struct batch_entry *ea = a;
+    const struct batch_entry *eb = b;
+    size_t n = ea->nid < eb->nid ? ea->nid : eb->nid;
+    int ret = memcmp(ea->id, eb->id, n);
+
+    if (ret == 0 && ea->nid != eb->nid) {
+        ret = ea->nid < eb->nid ? -1 : 1;
+    }
+    if (ret == 0) {
+        ret = ea->index < eb->index ? -1 : 1;
+    }
+    return ret;
+}
+
+/*
+ * A batch must not contain the same document twice, so drop all but
+ * the last line with every key (the others keep their order)
+ */
+static int batch_dedupe(struct batch *batch)
+{
+    struct batch_entry *entries;
+    size_t nkept = 0;
+
+    if (batch->ndocs < 2) {
+        return 0;
+    }
+    if ((entries = calloc(batch->ndocs, sizeof(*entries))) == NULL) {
+        return -1;
+    }
+
+    for (size_t ii = 0; ii < batch->ndocs; ++ii) {
+        (void)cbio_document_get_id(batch->docs[ii], &entries[ii].id,
+                                   &entries[ii].nid);
+        entries[ii].index = ii;
+    }
+    qsort(entries, batch->ndocs, sizeof(*entries), compare_entries);
+
+    for (size_t ii = 0; ii + 1 < batch->ndocs; ++ii) {
+        if (entries[ii].nid == entries[ii + 1].nid &&
+            memcmp(entries[ii].id, entries[ii + 1].id,
+                   entries[ii].nid) == 0) {
+            cbio_document_release(batch->docs[entries[ii].index]);
+            batch->docs[entries[ii].index] = NULL;
+        }
+    }
+    free(entries);
+
+    for (size_t ii = 0; ii < batch->ndocs; ++ii) {
+        if (batch->docs[ii] != NULL) {
+            batch->docs[nkept++] = batch->docs[ii];
+        }
+    }
+    batch->ndocs = nkept;
+
+    return 0;
+}
+
+/* Wake up every thread so they notice that loader.failed is set */
+static void wake_all(void)
+{
+    pthread_mutex_lock(&loader.mutex);
+    pthread_cond_broadcast(&loader.cond);
+    pthread_mutex_unlock(&loader.mutex);
+
+    for (int ii = 0; ii < loader.nwriters; ++ii) {
+        struct writer *w = &loader.writers[ii];
+        pthread_mutex_lock(&w->mutex);
+        pthread_cond_broadcast(&w->cond);
+        pthread_cond_broadcast(&w->space);
+        pthread_mutex_unlock(&w->mutex);
+    }
+}
+
+static void writer_push(struct writer *w, struct batch *batch)
+{
+    struct batch **pp;
+
+    pthread_mutex_lock(&w->mutex);
+    /* Don't let the workers run too far ahead of the writer. The batch
+       the writer waits for is always let through, so this can't
+       deadlock */
+    while (batch->seqno >= w->next + (uint64_t)loader.nworkers * 4 &&
+           !loader.failed) {
+        pthread_cond_wait(&w->space, &w->mutex);
+    }
+    pp = &w->pending;
+    while (*pp != NULL && (*pp)->seqno < batch->seqno) {
+        pp = &(*pp)->next;
+    }
+    batch->next = *pp;
+    *pp = batch;
+    if (batch->seqno == w->next) {
+        pthread_cond_signal(&w->cond);
+    }
+    pthread_mutex_unlock(&w->mutex);
+}
+
+static int process_chunk(struct chunk *chunk)
+{
+    struct batch **batches = calloc(loader.nwriters, sizeof(*batches));
+    int ret = 0;
+
+    if (batches == NULL) {
+        return -1;
+    }
+
+    for (int ii = 0; ii < loader.nwriters; ++ii) {
+        if ((batches[ii] = batch_create(chunk->seqno, chunk->nlines)) == NULL) {
+            while (ii > 0) {
+                free(batches[--ii]);
+            }
+            free(batches);
+            return -1;
+        }
+    }
+
+    for (size_t ii = 0; ii < chunk->nlines; ++ii) {
+        const char *line = chunk->data + chunk->offset[ii];
+        const char *key, *value;
+        size_t nkey, nvalue;
+        libcbio_document_t doc = NULL;
+        struct batch *batch;
+        uint32_t idx;
+
+        if (parse_line(line, chunk->length[ii], &key, &nkey,
+                       &value, &nvalue) == -1) {
+            __sync_add_and_fetch(&loader.skipped, 1);
+            continue;
+        }
+
+        idx = hash_key(key, nkey) % (uint32_t)loader.nwriters;
+        batch = batches[idx];
+        if (cbio_create_empty_document(loader.writers[idx].handle,
+                                       &doc) != CBIO_SUCCESS ||
+            cbio_document_set_id(doc, key, nkey, 1) != CBIO_SUCCESS ||
+            cbio_document_set_value(doc, value, nvalue, 1) != CBIO_SUCCESS ||
+            cbio_document_set_content_type(doc,
+                                           CBIO_DOC_NON_JSON_MODE) != CBIO_SUCCESS ||
+            (loader.validate && cbio_document_classify(doc) != CBIO_SUCCESS)) {
+            fprintf(stderr, "Failed to create document\n");
+            if (doc != NULL) {
+                cbio_document_release(doc);
+            }
+            loader.failed = 1;
+            wake_all();
+            break;
+        }
+        batch->docs[batch->ndocs++] = doc;
+    }
+
+    /* Every writer gets a batch (possibly empty) for every chunk so
+       that they know when it's safe to proceed to the next one */
+    for (int ii = 0; ii < loader.nwriters; ++ii) {
+        if (batch_dedupe(batches[ii]) == -1) {
+            ret = -1;
+        }
+        writer_push(&loader.writers[ii], batches[ii]);
+    }
+    free(batches);
+
+    return ret;
+}
+
+static void *worker_main(void *arg)
+{
+    struct chunk *chunk;
+    (void)arg;
+
+    while ((chunk = next_chunk()) != NULL) {
+        if (process_chunk(chunk) == -1) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            loader.failed = 1;
+            wake_all();
+        }
+        chunk_release(chunk);
+    }
+
+    return NULL;
+}
+
+static void *writer_main(void *arg)
+{
+    struct writer *w = arg;
+    uint64_t uncommitted = 0;
+    cbio_error_t err;
+
+    while (1) {
+        struct batch *batch;
+
+        pthread_mutex_lock(&w->mutex);
+        while (w->next != w->nchunks && !loader.failed &&
+               (w->pending == NULL || w->pending->seqno != w->next)) {
+            pthread_cond_wait(&w->cond, &w->mutex);
+        }
+        if (w->next == w->nchunks || loader.failed) {
+            pthread_mutex_unlock(&w->mutex);
+            break;
+        }
+        batch = w->pending;
+        w->pending = batch->next;
+        ++w->next;
+        pthread_cond_broadcast(&w->space);
+        pthread_mutex_unlock(&w->mutex);
+
+        if (batch->ndocs > 0) {
+            err = cbio_store_documents(w->handle, batch->docs, batch->ndocs);
+            if (err != CBIO_SUCCESS) {
+                fprintf(stderr, "Failed to store documents in %s: %s\n",
+                        w->fname, cbio_strerror(err));
+                loader.failed = 1;
+                batch_release(batch);
+                break;
+            }
+            uncommitted += batch->ndocs;
+            w->ndocs += batch->ndocs;
+            __sync_add_and_fetch(&loader.stored, batch->ndocs);
+        }
+        batch_release(batch);
+
+        if (uncommitted >= loader.commit_interval) {
+            if ((err = cbio_commit(w->handle)) != CBIO_SUCCESS) {
+                fprintf(stderr, "Failed to commit %s: %s\n",
+                        w->fname, cbio_strerror(err));
+                loader.failed = 1;
+                break;
+            }
+            uncommitted = 0;
+        }
+    }
+
+    if (!loader.failed && (err = cbio_commit(w->handle)) != CBIO_SUCCESS) {
+        fprintf(stderr, "Failed to commit %s: %s\n", w->fname,
+                cbio_strerror(err));
+        loader.failed = 1;
+    }
+
+    if (loader.failed) {
+        wake_all();
+    }
+
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t reader;
+    pthread_t *workers;
+    int nworkers = 0, nwriters = 0;
+    int have_reader = 0;
+    double start;
+    int cmd;
+
+    loader.format = FORMAT_KV;
+    loader.keyfield = "id";
+    loader.batchsize = 1000;
+    loader.commit_interval = 100000;
+    loader.nworkers = 4;
+    loader.validate = 1;
+    loader.input = stdin;
+
+    while ((cmd = getopt(argc, argv, "i:f:k:b:c:t:nv")) != -1) {
+        switch (cmd) {
+        case 'i':
+            if ((loader.input = fopen(optarg, "r")) == NULL) {
+                fprintf(stderr, "Failed to open %s: %s\n", optarg,
+                        strerror(errno));
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'f':
+            if (strcmp(optarg, "kv") == 0) {
+                loader.format = FORMAT_KV;
+            } else if (strcmp(optarg, "json") == 0) {
+                loader.format = FORMAT_JSON;
+            } else {
+                usage();
+            }
+            break;
+        case 'k':
+            loader.keyfield = optarg;
+            break;
+        case 'b':
+            loader.batchsize = (size_t)strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            loader.commit_interval = strtoull(optarg, NULL, 10);
+            break;
+        case 't':
+            loader.nworkers = atoi(optarg);
+            break;
+        case 'n':
+            loader.validate = 0;
+            break;
+        case 'v':
+            loader.verbose = 1;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (optind == argc || loader.batchsize == 0 || loader.nworkers < 1) {
+        usage();
+    }
+
+    loader.nwriters = argc - optind;
+    loader.writers = calloc(loader.nwriters, sizeof(struct writer));
+    workers = calloc(loader.nworkers, sizeof(pthread_t));
+    if (loader.writers == NULL || workers == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        return EXIT_FAILURE;
+    }
+
+    pthread_mutex_init(&loader.mutex, NULL);
+    pthread_cond_init(&loader.cond, NULL);
+
+    for (int ii = 0; ii < loader.nwriters; ++ii) {
+        struct writer *w = &loader.writers[ii];
+        cbio_error_t err;
+
+        w->fname = argv[optind + ii];
+        w->nchunks = UINT64_MAX;
+        pthread_mutex_init(&w->mutex, NULL);
+        pthread_cond_init(&w->cond, NULL);
+        pthread_cond_init(&w->space, NULL);
+        err = cbio_open_handle(w->fname, CBIO_OPEN_CREATE, &w->handle);
+        if (err != CBIO_SUCCESS) {
+            fprintf(stderr, "Failed to open %s: %s\n", w->fname,
+                    cbio_strerror(err));
+            return EXIT_FAILURE;
+        }
+    }
+
+    start = now();
+    /* Every file needs its writer */
+    for (; nwriters < loader.nwriters; ++nwriters) {
+        if (pthread_create(&loader.writers[nwriters].thread, NULL,
+                           writer_main, &loader.writers[nwriters]) != 0) {
+            fprintf(stderr, "Failed to start writer thread\n");
+            loader.failed = 1;
+            break;
+        }
+    }
+    /* ...but we can do with fewer workers than asked for */
+    while (!loader.failed && nworkers < loader.nworkers &&
+           pthread_create(&workers[nworkers], NULL, worker_main,
+                          NULL) == 0) {
+        ++nworkers;
+    }
+    if (nworkers == 0) {
+        fprintf(stderr, "Failed to start worker threads\n");
+        loader.failed = 1;
+    }
+    loader.nworkers = nworkers;
+    if (!loader.failed &&
+        pthread_create(&reader, NULL, reader_main, NULL) == 0) {
+        have_reader = 1;
+    } else {
+        if (!loader.failed) {
+            fprintf(stderr, "Failed to start reader thread\n");
+            loader.failed = 1;
+        }
+        pthread_mutex_lock(&loader.mutex);
+        loader.eof = 1;
+        pthread_mutex_unlock(&loader.mutex);
+        wake_all();
+    }
+
+    if (loader.verbose && have_reader) {
+        int done = 0;
+        while (!done) {
+            sleep(1);
+            pthread_mutex_lock(&loader.mutex);
+            done = loader.eof && loader.head == NULL;
+            pthread_mutex_unlock(&loader.mutex);
+            fprintf(stderr, "\r%llu documents stored (%.0f docs/sec)    ",
+                    (unsigned long long)loader.stored,
+                    loader.stored / (now() - start));
+        }
+        fprintf(stderr, "\n");
+    }
+
+    if (have_reader) {
+        pthread_join(reader, NULL);
+    }
+    for (int ii = 0; ii < nworkers; ++ii) {
+        pthread_join(workers[ii], NULL);
+    }
+    for (int ii = 0; ii < loader.nwriters; ++ii) {
+        struct writer *w = &loader.writers[ii];
+        pthread_mutex_lock(&w->mutex);
+        pthread_cond_signal(&w->cond);
+        pthread_mutex_unlock(&w->mutex);
+        if (ii < nwriters) {
+            pthread_join(w->thread, NULL);
+        }
+        while (w->pending != NULL) {
+            struct batch *next = w->pending->next;
+            batch_release(w->pending);
+            w->pending = next;
+        }
+        cbio_close_handle(w->handle);
+    }
+
+    double elapsed = now() - start;
+    fprintf(stderr, "Stored %llu documents in %.2f seconds (%.0f docs/sec)",
+            (unsigned long long)loader.stored, elapsed,
+            elapsed > 0 ? loader.stored / elapsed : 0.0);
+    if (loader.skipped > 0) {
+        fprintf(stderr, ", skipped %llu malformed lines",
+                (unsigned long long)loader.skipped);
+    }
+    fprintf(stderr, "\n");
+
+    if (loader.input != stdin) {
+        fclose(loader.input);
+    }
+    free(workers);
+    free(loader.writers);
+
+    return loader.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}